@@ -0,0 +1,360 @@
+/* batch.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * bmpedit --batch DIR runs one filter chain over every
+ * input file, writing DIR/<input's name>. The work is a
+ * pipeline, so the disk and the CPUs are busy at once
+ * instead of taking turns:
+ *
+ *     reader -> decoded queue -> filter threads -> filtered queue -> writer
+ *
+ * The reader thread decodes the inputs in order, and asks
+ * the kernel to start reading the next few files into the
+ * page cache (posix_fadvise) so their reads overlap the
+ * work on this one. --threads filter threads run the chain,
+ * and the writer, on the calling thread, encodes and writes
+ * the results. The queues hold BATCH_QUEUE_DEPTH images
+ * each and a full one makes the stage before it wait, so at
+ * most threads + 2*BATCH_QUEUE_DEPTH + 2 images are in
+ * memory however many files there are. The files are the
+ * parallelism, so the codec and the filters each run on the
+ * thread they are called on
+ *
+ */
+
+#define _GNU_SOURCE
+#include "batch.h"
+#include "libbmpedit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define BATCH_QUEUE_DEPTH 2
+
+// Files ahead of the one being decoded that the kernel is asked to read
+#define BATCH_READ_AHEAD 4
+
+#define BATCH_MESSAGE_SIZE 512
+
+struct batch_job {
+    int index;
+    struct image img;
+};
+
+// Fixed size ring of jobs between two stages. pop returns NULL once
+// every producer has finished and the ring is empty
+struct batch_queue {
+    struct batch_job *jobs[BATCH_QUEUE_DEPTH];
+    int head;
+    int count;
+    int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct batch {
+    struct filter_chain *chain;
+    struct batch_queue decoded;
+    struct batch_queue filtered;
+    FILE *log;
+    // Taken to report a failed file or count it
+    pthread_mutex_t report_lock;
+    int n_of_failures;
+};
+
+void init_batch_queue(struct batch_queue *queue, int producers);
+void destroy_batch_queue(struct batch_queue *queue);
+void push_batch_job(struct batch_queue *queue, struct batch_job *job);
+struct batch_job *pop_batch_job(struct batch_queue *queue);
+void finish_batch_producer(struct batch_queue *queue);
+void free_batch_job(struct batch_job *job);
+void report_batch_failure(struct batch *batch, int index, int status, const char *what);
+const char *batch_base_name(const char *file_name);
+int compare_batch_base_names(const void *a, const void *b);
+int batch_output_path(struct filter_chain *chain, int index, char *path, size_t path_size);
+void read_ahead_file(const char *file_name);
+void *batch_reader_main(void *arg);
+void *batch_filter_main(void *arg);
+void run_batch_writer(struct batch *batch);
+
+void init_batch_queue(struct batch_queue *queue, int producers) {
+    queue->head = 0;
+    queue->count = 0;
+    queue->producers = producers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+void destroy_batch_queue(struct batch_queue *queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
+
+// Waits for room, this is what keeps a fast stage from running ahead
+void push_batch_job(struct batch_queue *queue, struct batch_job *job) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == BATCH_QUEUE_DEPTH) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    queue->jobs[(queue->head + queue->count) % BATCH_QUEUE_DEPTH] = job;
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+struct batch_job *pop_batch_job(struct batch_queue *queue) {
+    struct batch_job *job = NULL;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && queue->producers > 0) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->count > 0) {
+        job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % BATCH_QUEUE_DEPTH;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+void finish_batch_producer(struct batch_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->producers--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void free_batch_job(struct batch_job *job) {
+    free_struct_image(&job->img);
+    free(job);
+}
+
+// Files are reported as they fail and the rest carry on
+void report_batch_failure(struct batch *batch, int index, int status, const char *what) {
+    char message[BATCH_MESSAGE_SIZE];
+    chain_error(message, sizeof(message), status, "%s %s", what, batch->chain->batch_input_file_names[index]);
+    pthread_mutex_lock(&batch->report_lock);
+    fprintf(stderr, "bmpedit: %s\n", message);
+    batch->n_of_failures++;
+    pthread_mutex_unlock(&batch->report_lock);
+}
+
+// The file's name without its directories
+const char *batch_base_name(const char *file_name) {
+    const char *base_name = strrchr(file_name, '/');
+    return base_name == NULL ? file_name : base_name + 1;
+}
+
+int compare_batch_base_names(const void *a, const void *b) {
+    return strcmp(batch_base_name(*(char * const *)a), batch_base_name(*(char * const *)b));
+}
+
+// Inputs with the same name in different directories would be written
+// to the same output, one over the other. Sorting by name puts them next
+// to each other. Returns IMAGE_ERR_ARGUMENT with a message if there are any
+int check_batch_output_names(struct filter_chain *chain, char *message, size_t message_size) {
+    int n = chain->n_of_batch_inputs;
+    char **names = malloc(n*sizeof(char *));
+    if (names == NULL) return chain_error(message, message_size, IMAGE_ERR_NO_MEMORY, "Error checking the --batch inputs");
+    memcpy(names, chain->batch_input_file_names, n*sizeof(char *));
+    qsort(names, n, sizeof(char *), compare_batch_base_names);
+
+    int status = IMAGE_OK;
+    int i;
+    for (i = 1; i < n && status == IMAGE_OK; i++) {
+        if (compare_batch_base_names(&names[i - 1], &names[i]) == 0) {
+            status = chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "%s and %s would both be written to %s/%s",
+                                 names[i - 1], names[i], chain->batch_dir, batch_base_name(names[i]));
+        }
+    }
+    free(names);
+    return status;
+}
+
+// DIR/ and the input's name without its directories
+int batch_output_path(struct filter_chain *chain, int index, char *path, size_t path_size) {
+    const char *base_name = batch_base_name(chain->batch_input_file_names[index]);
+    int length = snprintf(path, path_size, "%s/%s", chain->batch_dir, base_name);
+    return length >= 0 && (size_t)length < path_size ? IMAGE_OK : IMAGE_ERR_ARGUMENT;
+}
+
+// Starts the kernel reading a file into the page cache without
+// waiting for it. The pages stay after the file is closed
+void read_ahead_file(const char *file_name) {
+    int fildes = open(file_name, O_RDONLY);
+    if (fildes == -1) return;
+    posix_fadvise(fildes, 0, 0, POSIX_FADV_WILLNEED);
+    close(fildes);
+}
+
+void *batch_reader_main(void *arg) {
+    struct batch *batch = arg;
+    struct filter_chain *chain = batch->chain;
+    int i;
+    for (i = 0; i < chain->n_of_batch_inputs && i < BATCH_READ_AHEAD; i++) {
+        read_ahead_file(chain->batch_input_file_names[i]);
+    }
+
+    for (i = 0; i < chain->n_of_batch_inputs; i++) {
+        if (i + BATCH_READ_AHEAD < chain->n_of_batch_inputs) {
+            read_ahead_file(chain->batch_input_file_names[i + BATCH_READ_AHEAD]);
+        }
+
+        // Writing over an input would lose it if the chain fails part way
+        char output_path[4096];
+        struct stat input_stat, output_stat;
+        int status = batch_output_path(chain, i, output_path, sizeof(output_path));
+        if (status == IMAGE_OK && stat(chain->batch_input_file_names[i], &input_stat) == 0
+                && stat(output_path, &output_stat) == 0
+                && input_stat.st_dev == output_stat.st_dev && input_stat.st_ino == output_stat.st_ino) {
+            status = IMAGE_ERR_ARGUMENT;
+        }
+        if (status != IMAGE_OK) {
+            report_batch_failure(batch, i, status, "The output would replace");
+            continue;
+        }
+
+        int fildes = open(chain->batch_input_file_names[i], O_RDONLY);
+        if (fildes == -1) {
+            report_batch_failure(batch, i, IMAGE_ERR_IO, "Error opening");
+            continue;
+        }
+        struct batch_job *job = malloc(sizeof(*job));
+        if (job == NULL) {
+            close(fildes);
+            report_batch_failure(batch, i, IMAGE_ERR_NO_MEMORY, "Error reading");
+            continue;
+        }
+        job->index = i;
+        status = bmp_to_struct_image_threads(fildes, &job->img, NULL, 1);
+        close(fildes);
+        if (status != IMAGE_OK) {
+            free(job);
+            report_batch_failure(batch, i, status, "Error reading");
+            continue;
+        }
+        push_batch_job(&batch->decoded, job);
+    }
+
+    finish_batch_producer(&batch->decoded);
+    return NULL;
+}
+
+void *batch_filter_main(void *arg) {
+    struct batch *batch = arg;
+    struct batch_job *job;
+    while ((job = pop_batch_job(&batch->decoded)) != NULL) {
+        char message[BATCH_MESSAGE_SIZE];
+        struct image no_image_2;
+        no_image_2.pixel_array = NULL;
+        no_image_2.grey_array = NULL;
+        int status = apply_filter_chain(batch->chain, &job->img, &no_image_2, NULL, message, sizeof(message));
+        if (status != IMAGE_OK) {
+            pthread_mutex_lock(&batch->report_lock);
+            fprintf(stderr, "bmpedit: %s: %s\n", batch->chain->batch_input_file_names[job->index], message);
+            batch->n_of_failures++;
+            pthread_mutex_unlock(&batch->report_lock);
+            free_batch_job(job);
+            continue;
+        }
+        push_batch_job(&batch->filtered, job);
+    }
+
+    finish_batch_producer(&batch->filtered);
+    return NULL;
+}
+
+void run_batch_writer(struct batch *batch) {
+    struct batch_job *job;
+    while ((job = pop_batch_job(&batch->filtered)) != NULL) {
+        char output_path[4096];
+        int status = batch_output_path(batch->chain, job->index, output_path, sizeof(output_path));
+        if (status == IMAGE_OK) {
+            int fildes = open(output_path, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+            if (fildes == -1) {
+                status = IMAGE_ERR_IO;
+            } else {
+                status = struct_image_to_bmp_depth_threads(fildes, &job->img, batch->chain->output_depth, 1);
+                if (close(fildes) == -1 && status == IMAGE_OK) status = IMAGE_ERR_IO;
+            }
+        }
+        if (status != IMAGE_OK) {
+            report_batch_failure(batch, job->index, status, "Error writing the output for");
+        } else if (batch->log) {
+            fprintf(batch->log, "%s -> %s\n", batch->chain->batch_input_file_names[job->index], output_path);
+        }
+        free_batch_job(job);
+    }
+}
+
+// Runs chain over chain->batch_input_file_names with n_of_threads filter
+// threads, 0 for one per CPU. Files that fail are reported on stderr and
+// the rest carry on, the return is IMAGE_ERR_IO if any failed
+int run_filter_chain_batch(struct filter_chain *chain, int n_of_threads, FILE *log, char *message, size_t message_size) {
+    if (n_of_threads < 1) {
+        long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_of_threads = n_of_cpus > 0 ? n_of_cpus : 1;
+    }
+    if (mkdir(chain->batch_dir, 0775) == -1 && errno != EEXIST) {
+        return chain_error(message, message_size, IMAGE_ERR_IO, "Error making %s", chain->batch_dir);
+    }
+
+    // The filter threads share one copy of the chain
+    struct filter_chain batch_chain = *chain;
+    batch_chain.n_of_filter_threads = 1;
+
+    struct batch batch;
+    batch.chain = &batch_chain;
+    batch.log = log;
+    batch.n_of_failures = 0;
+    pthread_mutex_init(&batch.report_lock, NULL);
+    init_batch_queue(&batch.decoded, 1);
+    init_batch_queue(&batch.filtered, n_of_threads);
+
+    pthread_t *threads = malloc((n_of_threads + 1)*sizeof(pthread_t));
+    if (threads == NULL) return chain_error(message, message_size, IMAGE_ERR_NO_MEMORY, "Error starting the batch");
+
+    // A thread that can't be started just isn't waited for
+    int n_started = 0;
+    int i;
+    if (pthread_create(&threads[n_started], NULL, batch_reader_main, &batch) == 0) {
+        n_started++;
+    } else {
+        finish_batch_producer(&batch.decoded);
+    }
+    for (i = 0; i < n_of_threads; i++) {
+        if (pthread_create(&threads[n_started], NULL, batch_filter_main, &batch) == 0) {
+            n_started++;
+        } else {
+            finish_batch_producer(&batch.filtered);
+        }
+    }
+
+    run_batch_writer(&batch);
+
+    // With no filter threads at all, the reader may be stuck on a full queue
+    struct batch_job *job;
+    while ((job = pop_batch_job(&batch.decoded)) != NULL) {
+        report_batch_failure(&batch, job->index, IMAGE_ERR_NO_MEMORY, "No thread to filter");
+        free_batch_job(job);
+    }
+    for (i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    destroy_batch_queue(&batch.decoded);
+    destroy_batch_queue(&batch.filtered);
+    pthread_mutex_destroy(&batch.report_lock);
+
+    if (batch.n_of_failures > 0) {
+        snprintf(message, message_size, "%d of %d files failed", batch.n_of_failures, chain->n_of_batch_inputs);
+        return IMAGE_ERR_IO;
+    }
+    return IMAGE_OK;
+}
@@ -0,0 +1,19 @@
+/* batch.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of bmpedit --batch, one filter chain
+ * run over many input files
+ *
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "filter_chain.h"
+#include <stdio.h>
+
+int check_batch_output_names(struct filter_chain *chain, char *message, size_t message_size);
+int run_filter_chain_batch(struct filter_chain *chain, int n_of_threads, FILE *log, char *message, size_t message_size);
+
+#endif
@@ -0,0 +1,375 @@
+/* bench.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Benchmark driver for bmpedit. Generates synthetic
+ * 24bpp bitmaps at a range of sizes, then times
+ * decode, encode and every filter in filters.c
+ * and prints the results as CSV
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <math.h>
+#include <inttypes.h>
+#include "libbmpedit.h"
+
+// Default sizes, 1MP to 100MP. The odd widths
+// need row padding in the bitmap file
+static const char *default_sizes = "1000x1000,1001x999,2311x1731,4621x3463,10001x9999";
+
+struct bench_size {
+    int width;
+    int height;
+};
+
+void print_bench_usage();
+double now_seconds();
+uint32_t xorshift32(uint32_t *state);
+void make_synthetic_image(int width, int height, uint32_t seed, struct image *img);
+int parse_bench_sizes(char *sizes_arg, struct bench_size **sizes);
+void print_csv_row(char *label, struct image *img, char *operation, double seconds);
+void bench_size(char *label, char *tmp_dir, int repeats, int width, int height);
+
+void print_bench_usage() {
+    printf("Usage: bench [OPTIONS...]\n\
+\n\
+OPTIONS:\n\
+  -s WxH,WxH,... Image sizes to benchmark (default \"%s\")\n\
+  -r N           Number of runs per operation, the fastest is reported (default 3)\n\
+  -l LABEL       Build label written in the first CSV column (default \"default\")\n\
+  -d DIR         Directory for the temporary bitmap files (default \"/tmp\")\n\
+  -h             Displays this usage message.\n", default_sizes);
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Fills a new image with a noisy gradient so filters
+// don't get to run on flat (and branch predictable) data
+void make_synthetic_image(int width, int height, uint32_t seed, struct image *img) {
+    if (init_struct_image(img, width, height, NULL) != IMAGE_OK) {
+        error(1, 0, "Couldn't allocate memory for synthetic image");
+    }
+
+    uint32_t state = seed;
+    int x,y;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t noise = xorshift32(&state);
+            struct pixel *pix = &img->pixel_array[y*width + x];
+            pix->Red = (x*255/width + (noise & 0x3F)) & 0xFF;
+            pix->Green = (y*255/height + ((noise >> 8) & 0x3F)) & 0xFF;
+            pix->Blue = (noise >> 16) & 0xFF;
+        }
+    }
+}
+
+// Parses "WxH,WxH,..." into a malloced array, returns the count
+int parse_bench_sizes(char *sizes_arg, struct bench_size **sizes) {
+    int count = 0;
+    int capacity = 8;
+    *sizes = malloc(capacity*sizeof(struct bench_size));
+
+    char *token = strtok(sizes_arg, ",");
+    while (token != NULL) {
+        struct bench_size size;
+        if (sscanf(token, "%dx%d", &size.width, &size.height) != 2 || size.width <= 0 || size.height <= 0) {
+            error(1, 0, "Sizes must look like WIDTHxHEIGHT, got \"%s\"", token);
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *sizes = realloc(*sizes, capacity*sizeof(struct bench_size));
+        }
+        (*sizes)[count++] = size;
+        token = strtok(NULL, ",");
+    }
+    return count;
+}
+
+void print_csv_row(char *label, struct image *img, char *operation, double seconds) {
+    double megapixels = (double)img->width*img->height/1e6;
+    printf("%s,%d,%d,%.3f,%s,%.6f,%.2f\n", label, img->width, img->height,
+           megapixels, operation, seconds, megapixels/seconds);
+    fflush(stdout);
+}
+
+// Times call on a fresh copy of source, repeats times, keeping the fastest run
+#define BENCH_FILTER_ON(name, source, call) do {            \
+    double best = INFINITY;                                 \
+    int run;                                                \
+    for (run = 0; run < repeats; run++) {                   \
+        struct image img;                                   \
+        if (copy_struct_image(&img, &(source)) != IMAGE_OK) \
+            error(1, 0, "Couldn't allocate memory for copy");\
+        double start = now_seconds();                       \
+        call;                                               \
+        double elapsed = now_seconds() - start;             \
+        if (elapsed < best) best = elapsed;                 \
+        free_struct_image(&img);                            \
+    }                                                       \
+    print_csv_row(label, &src, name, best);                 \
+} while (0)
+
+#define BENCH_FILTER(name, call) BENCH_FILTER_ON(name, src, call)
+
+void bench_size(char *label, char *tmp_dir, int repeats, int width, int height) {
+    struct image src;
+    struct image src_2;
+    make_synthetic_image(width, height, 0x2545F491, &src);
+    make_synthetic_image(width, height, 0x9E3779B9, &src_2);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bmpedit-bench-%d-%dx%d.bmp", tmp_dir, (int)getpid(), width, height);
+
+    // Encode
+    double best = INFINITY;
+    int run;
+    for (run = 0; run < repeats; run++) {
+        int fildes = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+        if (fildes == -1) {
+            int errsv = errno;
+            error(1, errsv, "Error opening %s", path);
+        }
+        double start = now_seconds();
+        int status = struct_image_to_bmp(fildes, &src);
+        double elapsed = now_seconds() - start;
+        if (status != IMAGE_OK) {
+            error(1, errno, "Error writing %s", path);
+        }
+        if (elapsed < best) best = elapsed;
+        close(fildes);
+    }
+    print_csv_row(label, &src, "encode", best);
+
+    // Decode, the file written above is used as input
+    best = INFINITY;
+    for (run = 0; run < repeats; run++) {
+        int fildes = open(path, O_RDONLY);
+        if (fildes == -1) {
+            int errsv = errno;
+            error(1, errsv, "Error opening %s", path);
+        }
+        struct image img;
+        double start = now_seconds();
+        int status = bmp_to_struct_image(fildes, &img, NULL);
+        double elapsed = now_seconds() - start;
+        if (status != IMAGE_OK) {
+            error(1, 0, "Error reading %s: %s", path, image_status_string(status));
+        }
+        if (elapsed < best) best = elapsed;
+        free_struct_image(&img);
+        close(fildes);
+    }
+    print_csv_row(label, &src, "decode", best);
+
+    // Decode to an eighth of the width, reducing as the rows are read
+    best = INFINITY;
+    for (run = 0; run < repeats; run++) {
+        int fildes = open(path, O_RDONLY);
+        if (fildes == -1) {
+            int errsv = errno;
+            error(1, errsv, "Error opening %s", path);
+        }
+        struct image img;
+        int new_width = width/8 > 0 ? width/8 : 1;
+        int new_height = 0;
+        double start = now_seconds();
+        int status = bmp_to_struct_image_for_resize(fildes, &img, NULL, &new_width, &new_height, RESIZE_AUTO);
+        if (status == IMAGE_OK) {
+            status = resize_reduced_image(new_width, new_height, RESIZE_AUTO, &img);
+        }
+        double elapsed = now_seconds() - start;
+        if (status != IMAGE_OK) {
+            error(1, 0, "Error reading %s: %s", path, image_status_string(status));
+        }
+        if (elapsed < best) best = elapsed;
+        free_struct_image(&img);
+        close(fildes);
+    }
+    print_csv_row(label, &src, "decode resize 1/8", best);
+    unlink(path);
+
+    // Flat kernels for -k, big enough that the FFT path is picked
+    double box_values[15*15];
+    double motion_values[31];
+    int i;
+    for (i = 0; i < 15*15; i++) box_values[i] = 1.0/(15*15);
+    for (i = 0; i < 31; i++) motion_values[i] = 1.0/31;
+    struct convolution_kernel box_kernel = {15, 15, box_values};
+    struct convolution_kernel motion_kernel = {31, 1, motion_values};
+    struct colour_matrix sepia;
+    colour_matrix_sepia(&sepia);
+
+    // Filters, with the arguments bmpedit would pass for typical options
+    BENCH_FILTER("threshold", threshold_image(0.5, &img));
+    BENCH_FILTER("invert", invert_image(&img));
+    BENCH_FILTER("blend", blend_two_images(0.5, &img, &src_2));
+    BENCH_FILTER("crop", crop_image(width/4, height/4, width - width/4, height - height/4, &img));
+    BENCH_FILTER("rotate 90", orient_image(ORIENTATION_ROTATE_90, &img));
+    BENCH_FILTER("rotate 90 scalar", transpose_image_scalar(ORIENTATION_ROTATE_90, &img));
+    BENCH_FILTER("rotate 180", orient_image(ORIENTATION_ROTATE_180, &img));
+    BENCH_FILTER("flip h", orient_image(ORIENTATION_FLIP_HORIZONTAL, &img));
+    BENCH_FILTER("flip v", orient_image(ORIENTATION_FLIP_VERTICAL, &img));
+    BENCH_FILTER("brightness", brightness_image(0.2, &img));
+    BENCH_FILTER("greyscale", greyscale_image(&img));
+    BENCH_FILTER("sepia", colour_matrix_image(&sepia, &img));
+    BENCH_FILTER("sepia scalar", colour_matrix_image_scalar(&sepia, &img));
+    BENCH_FILTER("emboss", emboss_image(&img));
+    BENCH_FILTER("sharpen", sharpen_image(8.01 + (20-16.0), &img));
+    BENCH_FILTER("sobel", sobel_edge_detect_image(&img));
+    BENCH_FILTER("gaussian", gaussian_blur(1, 1.0, &img));
+    BENCH_FILTER("kernel 15x15", convolve_struct_image(&box_kernel, &img));
+    BENCH_FILTER("kernel 31x1", convolve_struct_image(&motion_kernel, &img));
+    BENCH_FILTER("histogram", {
+        struct image_histogram histogram;
+        compute_image_histogram(&img, &histogram);
+    });
+    BENCH_FILTER("threshold auto", {
+        struct image_histogram histogram;
+        compute_image_histogram(&img, &histogram);
+        threshold_image(otsu_threshold_value(&histogram), &img);
+    });
+    BENCH_FILTER("box mean 2", box_mean_image(2, &img));
+    BENCH_FILTER("box mean 25", box_mean_image(25, &img));
+    BENCH_FILTER("median 1", median_image(1, &img));
+    BENCH_FILTER("median 10", median_image(10, &img));
+    BENCH_FILTER("bilateral exact 0.8 25", bilateral_image_exact(0.8, 25.0, &img));
+    BENCH_FILTER("bilateral grid 4 20", bilateral_image_grid(4.0, 20.0, &img));
+    BENCH_FILTER("bilateral grid 4 1", bilateral_image_grid(4.0, 1.0, &img));
+    BENCH_FILTER("erode 3x3", morphology_image(MORPHOLOGY_ERODE, 3, 3, &img));
+    BENCH_FILTER("open 15x15", morphology_image(MORPHOLOGY_OPEN, 15, 15, &img));
+    BENCH_FILTER("binary open 15x15", {
+        threshold_image(0.5, &img);
+        morphology_image(MORPHOLOGY_OPEN, 15, 15, &img);
+    });
+    BENCH_FILTER("adaptive bradley 15", adaptive_threshold_image(ADAPTIVE_BRADLEY, 15, 0, &img));
+    BENCH_FILTER("adaptive sauvola 15", adaptive_threshold_image(ADAPTIVE_SAUVOLA, 15, 0, &img));
+    BENCH_FILTER("resize 1/8", resize_image(width/8 > 0 ? width/8 : 1, 0, RESIZE_AUTO, &img));
+    BENCH_FILTER("resize area 1/3", resize_image(width/3 > 0 ? width/3 : 1, 0, RESIZE_AREA, &img));
+    BENCH_FILTER("resize lanczos 1/3", resize_image(width/3 > 0 ? width/3 : 1, 0, RESIZE_LANCZOS, &img));
+    BENCH_FILTER("pyramid", {
+        int n_of_levels = pyramid_depth(width, height);
+        struct image levels[32];
+        if (build_image_pyramid(&img, n_of_levels, levels) == IMAGE_OK) {
+            int level;
+            for (level = 0; level < n_of_levels; level++) free_struct_image(&levels[level]);
+        }
+    });
+    BENCH_FILTER("resize bilinear 3/2", resize_image(width*3/2, 0, RESIZE_BILINEAR, &img));
+
+    // The same filters after -g, on a single channel image
+    struct image src_grey;
+    if (copy_struct_image(&src_grey, &src) != IMAGE_OK || greyscale_image(&src_grey) != IMAGE_OK) {
+        error(1, 0, "Couldn't make greyscale image");
+    }
+    BENCH_FILTER_ON("grey threshold", src_grey, threshold_image(0.5, &img));
+    BENCH_FILTER_ON("grey invert", src_grey, invert_image(&img));
+    BENCH_FILTER_ON("grey brightness", src_grey, brightness_image(0.2, &img));
+    BENCH_FILTER_ON("grey rotate 90", src_grey, orient_image(ORIENTATION_ROTATE_90, &img));
+    BENCH_FILTER_ON("grey rotate 90 scalar", src_grey, transpose_image_scalar(ORIENTATION_ROTATE_90, &img));
+    BENCH_FILTER_ON("grey rotate 180", src_grey, orient_image(ORIENTATION_ROTATE_180, &img));
+    BENCH_FILTER_ON("grey flip h", src_grey, orient_image(ORIENTATION_FLIP_HORIZONTAL, &img));
+    BENCH_FILTER_ON("grey emboss", src_grey, emboss_image(&img));
+    BENCH_FILTER_ON("grey sharpen", src_grey, sharpen_image(8.01 + (20-16.0), &img));
+    BENCH_FILTER_ON("grey sobel", src_grey, sobel_edge_detect_image(&img));
+    BENCH_FILTER_ON("grey gaussian", src_grey, gaussian_blur(1, 1.0, &img));
+    BENCH_FILTER_ON("grey kernel 15x15", src_grey, convolve_struct_image(&box_kernel, &img));
+    BENCH_FILTER_ON("grey box mean 25", src_grey, box_mean_image(25, &img));
+    BENCH_FILTER_ON("grey open 15x15", src_grey, morphology_image(MORPHOLOGY_OPEN, 15, 15, &img));
+    BENCH_FILTER_ON("grey median 10", src_grey, median_image(10, &img));
+    BENCH_FILTER_ON("grey bilateral exact 0.8 25", src_grey, bilateral_image_exact(0.8, 25.0, &img));
+    BENCH_FILTER_ON("grey bilateral grid 4 20", src_grey, bilateral_image_grid(4.0, 20.0, &img));
+    BENCH_FILTER_ON("grey histogram", src_grey, {
+        struct image_histogram histogram;
+        compute_image_histogram(&img, &histogram);
+    });
+    BENCH_FILTER_ON("grey encode", src_grey, {
+        int fildes = open("/dev/null", O_WRONLY);
+        struct_image_to_bmp(fildes, &img);
+        close(fildes);
+    });
+    BENCH_FILTER_ON("grey encode 8bpp", src_grey, {
+        int fildes = open("/dev/null", O_WRONLY);
+        struct_image_to_bmp_depth(fildes, &img, BMP_DEPTH_8);
+        close(fildes);
+    });
+    BENCH_FILTER_ON("grey encode 1bpp", src_grey, {
+        int fildes = open("/dev/null", O_WRONLY);
+        struct_image_to_bmp_depth(fildes, &img, BMP_DEPTH_1);
+        close(fildes);
+    });
+    free_struct_image(&src_grey);
+
+    free_struct_image(&src);
+    free_struct_image(&src_2);
+}
+
+int main(int argc, char *argv[]) {
+    char sizes_buf[1024];
+    char *label = "default";
+    char *tmp_dir = "/tmp";
+    int repeats = 3;
+
+    strncpy(sizes_buf, default_sizes, sizeof(sizes_buf) - 1);
+    sizes_buf[sizeof(sizes_buf) - 1] = '\0';
+
+    int option;
+    while ((option = getopt(argc, argv, "s:r:l:d:h")) != -1) {
+        switch (option) {
+            case 's':
+                strncpy(sizes_buf, optarg, sizeof(sizes_buf) - 1);
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                if (repeats < 1) {
+                    error(1, 0, "Need at least one run per operation");
+                }
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'd':
+                tmp_dir = optarg;
+                break;
+            case 'h':
+                print_bench_usage();
+                return 0;
+            default:
+                print_bench_usage();
+                return 1;
+        }
+    }
+
+    struct bench_size *sizes;
+    int n_of_sizes = parse_bench_sizes(sizes_buf, &sizes);
+
+    printf("build,width,height,megapixels,operation,seconds,mp_per_s\n");
+
+    int i;
+    for (i = 0; i < n_of_sizes; i++) {
+        bench_size(label, tmp_dir, repeats, sizes[i].width, sizes[i].height);
+    }
+
+    free(sizes);
+    return 0;
+}
@@ -0,0 +1,470 @@
+/* bilateral.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Bilateral filter, smoothing that stops at edges. Each
+ * pixel becomes an average of the pixels around it,
+ * weighted by how near they are and by how close their
+ * brightness is to its own, so pixels across an edge
+ * count for little. Brightness is the mean of the
+ * channels, like the luminance histogram, and weights
+ * all channels the same so colours don't fringe.
+ *
+ * Small spatial sds are summed exactly over the 5x5
+ * window of generate_gaussian_kernel(), looking the
+ * brightness weights up in a table. Bigger ones use a
+ * bilateral grid, after Chen, Paris and Durand,
+ * "Real-time Edge-Aware Image Processing with the
+ * Bilateral Grid": the pixels are added into a coarse
+ * grid over x, y and brightness, one cell per sd each
+ * way but at least a brightness level deep, the grid is
+ * blurred one dimension at a time and each pixel reads
+ * its value back out by trilinear interpolation. The
+ * grid is built a band of rows at a time, each thread
+ * holding a few MiB of it
+ *
+ */
+
+#include "bilateral.h"
+#include "image_data_helper_functions.h"
+#include "convolution_kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Cells the grid's blur reaches each way
+#define GRID_BLUR_REACH 2
+
+// Fewest grid rows in a band, however big the rows, so the rows each
+// side the blur needs aren't most of the work
+#define GRID_MIN_BAND_ROWS 16
+
+// Finest brightness step of the grid. Smaller range sds keep cells a
+// level deep and blur them less instead, as a grid 255/sd deep takes
+// far longer and far more memory for the same result
+#define GRID_MIN_RANGE_STEP 1.0
+
+// Layout of the grid, the same for every band. Cells are x across,
+// brightness deep, with channels + 1 floats each, the last being the
+// weight. Padding round the data leaves room for the blur to spread
+struct bilateral_grid {
+    double spatial_step;
+    double range_step;
+    int width;
+    int depth;
+    int rows;           // grid rows pixels are read back out of
+    int values;
+    int band_rows;      // of those, how many each band reads out
+    float taps[2*GRID_BLUR_REACH + 1];
+    float range_taps[2*GRID_BLUR_REACH + 1];
+};
+
+// The rows [start, end) of the exact filter, or the bands of the
+// grid [start, end), for one thread. cells and saved are the
+// thread's own grid and blur scratch, unused for the exact filter
+struct bilateral_job {
+    const struct image *img;
+    const uint8_t *brightness;
+    struct image *filtered;
+    const float *spatial;
+    const float *range;
+    const struct bilateral_grid *grid;
+    float *cells;
+    float *saved;
+    int start;
+    int end;
+};
+
+void plan_bilateral_grid(struct bilateral_grid *grid, int width, int height, int channels,
+                         double spatial_sd, double range_sd);
+void gaussian_grid_taps(float taps[2*GRID_BLUR_REACH + 1], double sd);
+int init_brightness(const struct image *img, uint8_t **brightness);
+void *bilateral_exact_main(void *arg);
+void blur_grid_axis(float *cells, int n, size_t step, size_t length, const float *taps, float *saved);
+void bilateral_grid_band(struct bilateral_job *job, int first_row, int end_row);
+void *bilateral_grid_main(void *arg);
+
+// The image's brightness, the grey array itself for a 1 channel image
+int init_brightness(const struct image *img, uint8_t **brightness) {
+    if (img->channels == 1) {
+        *brightness = img->grey_array;
+        return IMAGE_OK;
+    }
+    *brightness = image_alloc(img->allocator, img->n_of_pixels);
+    if (*brightness == NULL) return IMAGE_ERR_NO_MEMORY;
+    size_t i;
+    for (i = 0; i < img->n_of_pixels; i++) {
+        const struct pixel *pix = &img->pixel_array[i];
+        (*brightness)[i] = (pix->Red + pix->Green + pix->Blue)/3;
+    }
+    return IMAGE_OK;
+}
+
+// Sums the 5x5 window round each pixel, edges replicated like
+// get_nearest_pixel()
+void *bilateral_exact_main(void *arg) {
+    struct bilateral_job *job = arg;
+    const struct image *img = job->img;
+    int channels = img->channels;
+    const uint8_t *in = channels == 1 ? img->grey_array : (const uint8_t *)img->pixel_array;
+    uint8_t *out = channels == 1 ? job->filtered->grey_array : (uint8_t *)job->filtered->pixel_array;
+
+    int x, y, dx, dy, c;
+    size_t rows[5];
+    int columns[5];
+    for (y = job->start; y < job->end; y++) {
+        for (dy = -2; dy <= 2; dy++) {
+            int window_y = y + dy < 0 ? 0 : y + dy >= img->height ? img->height - 1 : y + dy;
+            rows[dy + 2] = (size_t)window_y*img->width;
+        }
+        for (x = 0; x < img->width; x++) {
+            size_t centre = (size_t)y*img->width + x;
+            int centre_brightness = job->brightness[centre];
+            float sums[3] = {0.0f, 0.0f, 0.0f};
+            float weight = 0.0f;
+            for (dx = -2; dx <= 2; dx++) {
+                columns[dx + 2] = x + dx < 0 ? 0 : x + dx >= img->width ? img->width - 1 : x + dx;
+            }
+            for (dy = -2; dy <= 2; dy++) {
+                for (dx = -2; dx <= 2; dx++) {
+                    size_t other = rows[dy + 2] + columns[dx + 2];
+                    float w = job->spatial[(dy + 2)*5 + dx + 2]*job->range[abs(job->brightness[other] - centre_brightness)];
+                    weight += w;
+                    if (channels == 3) {
+                        sums[0] += w*in[3*other];
+                        sums[1] += w*in[3*other + 1];
+                        sums[2] += w*in[3*other + 2];
+                    } else {
+                        sums[0] += w*in[other];
+                    }
+                }
+            }
+            for (c = 0; c < channels; c++) {
+                out[centre*channels + c] = (uint8_t)(sums[c]/weight + 0.5f);
+            }
+        }
+    }
+    return NULL;
+}
+
+int bilateral_image(double spatial_sd, double range_sd, struct image *img) {
+    return bilateral_image_threads(spatial_sd, range_sd, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+int bilateral_image_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads) {
+    if (spatial_sd <= BILATERAL_EXACT_MAX_SD) {
+        return bilateral_image_exact_threads(spatial_sd, range_sd, img, n_of_threads);
+    }
+    return bilateral_image_grid_threads(spatial_sd, range_sd, img, n_of_threads);
+}
+
+int bilateral_image_exact(double spatial_sd, double range_sd, struct image *img) {
+    return bilateral_image_exact_threads(spatial_sd, range_sd, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// The spatial weights are generate_gaussian_kernel()'s, the brightness
+// weights exp(-d^2/2sd^2) for every difference d, looked up
+int bilateral_image_exact_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads) {
+    if (spatial_sd <= 0.0 || range_sd <= 0.0) return IMAGE_ERR_ARGUMENT;
+    if (n_of_threads < 1) n_of_threads = 1;
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+    if (n_of_threads > img->height) n_of_threads = img->height;
+
+    double kernel[5][5];
+    generate_gaussian_kernel(kernel, spatial_sd);
+    float spatial[25];
+    float range[256];
+    int d;
+    for (d = 0; d < 25; d++) {
+        spatial[d] = kernel[d/5][d%5];
+    }
+    for (d = 0; d < 256; d++) {
+        range[d] = exp(-(double)d*d/(2.0*range_sd*range_sd));
+    }
+
+    struct image filtered;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, img->allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+    uint8_t *brightness;
+    status = init_brightness(img, &brightness);
+    if (status != IMAGE_OK) {
+        free_struct_image(&filtered);
+        return status;
+    }
+
+    struct bilateral_job jobs[WORKER_MAX_THREADS];
+    int t;
+    for (t = 0; t < n_of_threads; t++) {
+        memset(&jobs[t], 0, sizeof(jobs[t]));
+        jobs[t].img = img;
+        jobs[t].brightness = brightness;
+        jobs[t].filtered = &filtered;
+        jobs[t].spatial = spatial;
+        jobs[t].range = range;
+        jobs[t].start = (int)((int64_t)img->height*t/n_of_threads);
+        jobs[t].end = (int)((int64_t)img->height*(t + 1)/n_of_threads);
+    }
+    run_worker_jobs(jobs, sizeof(jobs[0]), n_of_threads, bilateral_exact_main);
+
+    if (brightness != img->grey_array) image_dealloc(img->allocator, brightness);
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
+}
+
+// Blurs n blocks of length floats, step floats apart, block by block,
+// blocks past the ends counting as empty. Whole blocks are worked on
+// at once so the loops run along contiguous floats. Each block is
+// saved before it's overwritten, saved holding the last 3
+void blur_grid_axis(float *cells, int n, size_t step, size_t length, const float *taps, float *saved) {
+    int i;
+    size_t v;
+    for (i = 0; i < n; i++) {
+        float *block = cells + i*step;
+        float *current = saved + (size_t)(i % 3)*length;
+        memcpy(current, block, length*sizeof(float));
+        // Taps past the ends read any block and count for nothing
+        const float *back_2 = i >= 2 ? saved + (size_t)((i - 2) % 3)*length : current;
+        const float *back_1 = i >= 1 ? saved + (size_t)((i - 1) % 3)*length : current;
+        const float *ahead_1 = i + 1 < n ? block + step : current;
+        const float *ahead_2 = i + 2 < n ? block + 2*step : current;
+        float w0 = i >= 2 ? taps[0] : 0.0f;
+        float w1 = i >= 1 ? taps[1] : 0.0f;
+        float w3 = i + 1 < n ? taps[3] : 0.0f;
+        float w4 = i + 2 < n ? taps[4] : 0.0f;
+        for (v = 0; v < length; v++) {
+            block[v] = w0*back_2[v] + w1*back_1[v] + taps[2]*current[v] + w3*ahead_1[v] + w4*ahead_2[v];
+        }
+    }
+}
+
+// Fills the grid for the grid rows [first_row, end_row), and the
+// GRID_BLUR_REACH rows each side the blur needs, then reads out the
+// pixels that interpolate between those rows
+void bilateral_grid_band(struct bilateral_job *job, int first_row, int end_row) {
+    const struct image *img = job->img;
+    const struct bilateral_grid *grid = job->grid;
+    int channels = img->channels;
+    int values = grid->values;
+    const uint8_t *in = channels == 1 ? img->grey_array : (const uint8_t *)img->pixel_array;
+    uint8_t *out = channels == 1 ? job->filtered->grey_array : (uint8_t *)job->filtered->pixel_array;
+
+    // Band row 0 is grid row first_row - GRID_BLUR_REACH. Reading out
+    // also needs the row after end_row - 1, hence the one extra
+    int band_start = first_row - GRID_BLUR_REACH;
+    int n_of_rows = end_row - first_row + 2*GRID_BLUR_REACH + 1;
+    size_t row_step = (size_t)grid->width*grid->depth*values;
+    size_t x_step = (size_t)grid->depth*values;
+    memset(job->cells, 0, n_of_rows*row_step*sizeof(float));
+
+    // Each pixel goes in its nearest cell
+    int x, y, row, c;
+    int y_first = max(0, (int)floor((band_start - 0.5)*grid->spatial_step));
+    int y_end = min(img->height, (int)ceil((band_start + n_of_rows + 0.5)*grid->spatial_step) + 1);
+    for (y = y_first; y < y_end; y++) {
+        row = (int)(y/grid->spatial_step + 0.5) - band_start;
+        if (row < 0 || row >= n_of_rows) continue;
+        float *cells_row = job->cells + row*row_step;
+        for (x = 0; x < img->width; x++) {
+            size_t pixel = (size_t)y*img->width + x;
+            int cell_x = (int)(x/grid->spatial_step + 0.5) + GRID_BLUR_REACH;
+            int cell_z = (int)(job->brightness[pixel]/grid->range_step + 0.5) + GRID_BLUR_REACH;
+            float *cell = cells_row + cell_x*x_step + (size_t)cell_z*values;
+            for (c = 0; c < channels; c++) {
+                cell[c] += in[pixel*channels + c];
+            }
+            cell[channels] += 1.0f;
+        }
+    }
+
+    // Blur down, across, then through the brightnesses
+    int i;
+    blur_grid_axis(job->cells, n_of_rows, row_step, row_step, grid->taps, job->saved);
+    for (row = 0; row < n_of_rows; row++) {
+        blur_grid_axis(job->cells + row*row_step, grid->width, x_step, x_step, grid->taps, job->saved);
+        for (i = 0; i < grid->width; i++) {
+            blur_grid_axis(job->cells + row*row_step + i*x_step, grid->depth, values, values, grid->range_taps, job->saved);
+        }
+    }
+
+    // Trilinear interpolation of the sums and the weight, their ratio
+    // being the average. Neighbouring brightnesses are next to each
+    // other, so each x and y corner is a pair of cells
+    y_first = max(0, (int)floor(first_row*grid->spatial_step) - 1);
+    y_end = min(img->height, (int)ceil(end_row*grid->spatial_step) + 1);
+    for (y = y_first; y < y_end; y++) {
+        double fy = y/grid->spatial_step;
+        int grid_y = (int)fy;
+        if (grid_y < first_row || grid_y >= end_row) continue;
+        float ty = fy - grid_y;
+        const float *row_0 = job->cells + (grid_y - band_start)*row_step;
+        for (x = 0; x < img->width; x++) {
+            size_t pixel = (size_t)y*img->width + x;
+            double fx = x/grid->spatial_step + GRID_BLUR_REACH;
+            double fz = job->brightness[pixel]/grid->range_step + GRID_BLUR_REACH;
+            int grid_x = (int)fx;
+            int grid_z = (int)fz;
+            float tx = fx - grid_x;
+            float tz = fz - grid_z;
+            const float *c00 = row_0 + grid_x*x_step + (size_t)grid_z*values;
+            const float *c01 = c00 + x_step;
+            const float *c10 = c00 + row_step;
+            const float *c11 = c10 + x_step;
+            float sums[4];
+            for (c = 0; c < values; c++) {
+                float v00 = c00[c] + tz*(c00[values + c] - c00[c]);
+                float v01 = c01[c] + tz*(c01[values + c] - c01[c]);
+                float v10 = c10[c] + tz*(c10[values + c] - c10[c]);
+                float v11 = c11[c] + tz*(c11[values + c] - c11[c]);
+                float v0 = v00 + tx*(v01 - v00);
+                float v1 = v10 + tx*(v11 - v10);
+                sums[c] = v0 + ty*(v1 - v0);
+            }
+            for (c = 0; c < channels; c++) {
+                if (sums[channels] > 0.0f) {
+                    int value = (int)(sums[c]/sums[channels] + 0.5f);
+                    out[pixel*channels + c] = value < 0 ? 0 : value > 255 ? 255 : value;
+                } else {
+                    out[pixel*channels + c] = in[pixel*channels + c];
+                }
+            }
+        }
+    }
+}
+
+void *bilateral_grid_main(void *arg) {
+    struct bilateral_job *job = arg;
+    int band;
+    for (band = job->start; band < job->end; band++) {
+        int first_row = band*job->grid->band_rows;
+        bilateral_grid_band(job, first_row, min(first_row + job->grid->band_rows, job->grid->rows));
+    }
+    return NULL;
+}
+
+// A cell is spatial_sd pixels across and range_sd brightness levels
+// deep, at least GRID_MIN_RANGE_STEP, and the grid is blurred with an
+// sd of one cell, or range_sd over the step deep. The bands only
+// depend on the sizes, so the result doesn't depend on the number of
+// threads
+void plan_bilateral_grid(struct bilateral_grid *grid, int width, int height, int channels,
+                         double spatial_sd, double range_sd) {
+    grid->spatial_step = spatial_sd;
+    grid->range_step = range_sd > GRID_MIN_RANGE_STEP ? range_sd : GRID_MIN_RANGE_STEP;
+    grid->width = (int)((width - 1)/spatial_sd + 0.5) + 2*GRID_BLUR_REACH + 2;
+    grid->depth = (int)(255/grid->range_step + 0.5) + 2*GRID_BLUR_REACH + 2;
+    grid->rows = (int)((height - 1)/spatial_sd) + 1;
+    grid->values = channels + 1;
+    size_t row_bytes = (size_t)grid->width*grid->depth*grid->values*sizeof(float);
+    // A band's rows, the blur's reach each side and one more, and
+    // the 3 rows the blur keeps
+    grid->band_rows = (int)(BILATERAL_GRID_BAND_BYTES/row_bytes) - 2*GRID_BLUR_REACH - 1 - 3;
+    if (grid->band_rows < GRID_MIN_BAND_ROWS) grid->band_rows = GRID_MIN_BAND_ROWS;
+    if (grid->band_rows > grid->rows) grid->band_rows = grid->rows;
+
+    gaussian_grid_taps(grid->taps, 1.0);
+    gaussian_grid_taps(grid->range_taps, range_sd/grid->range_step);
+}
+
+// The sums of the columns of generate_gaussian_kernel(sd), a
+// normalised 1D gaussian
+void gaussian_grid_taps(float taps[2*GRID_BLUR_REACH + 1], double sd) {
+    double kernel[5][5];
+    generate_gaussian_kernel(kernel, sd);
+    int i, j;
+    for (i = 0; i < 5; i++) {
+        taps[i] = 0.0f;
+        for (j = 0; j < 5; j++) {
+            taps[i] += (float)kernel[j][i];
+        }
+    }
+}
+
+// What each thread of the grid allocates, for --max-memory
+size_t bilateral_grid_thread_bytes(int width, int height, int channels, double spatial_sd, double range_sd) {
+    struct bilateral_grid grid;
+    plan_bilateral_grid(&grid, width, height, channels, spatial_sd, range_sd);
+    size_t row_bytes = (size_t)grid.width*grid.depth*grid.values*sizeof(float);
+    return (grid.band_rows + 2*GRID_BLUR_REACH + 1 + 3)*row_bytes;
+}
+
+int bilateral_image_grid(double spatial_sd, double range_sd, struct image *img) {
+    return bilateral_image_grid_threads(spatial_sd, range_sd, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+int bilateral_image_grid_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads) {
+    if (spatial_sd <= 0.0 || range_sd <= 0.0) return IMAGE_ERR_ARGUMENT;
+    if (n_of_threads < 1) n_of_threads = 1;
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+
+    struct bilateral_grid grid;
+    plan_bilateral_grid(&grid, img->width, img->height, img->channels, spatial_sd, range_sd);
+    size_t row_bytes = (size_t)grid.width*grid.depth*grid.values*sizeof(float);
+
+    int n_of_bands = (grid.rows + grid.band_rows - 1)/grid.band_rows;
+    if (n_of_threads > n_of_bands) n_of_threads = n_of_bands;
+
+    struct image filtered;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, img->allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+    uint8_t *brightness = NULL;
+    status = init_brightness(img, &brightness);
+
+    // Every thread has its own band of the grid
+    struct bilateral_job jobs[WORKER_MAX_THREADS];
+    size_t cells_size = (grid.band_rows + 2*GRID_BLUR_REACH + 1)*row_bytes;
+    int t;
+    for (t = 0; t < n_of_threads; t++) {
+        memset(&jobs[t], 0, sizeof(jobs[t]));
+    }
+    for (t = 0; t < n_of_threads && status == IMAGE_OK; t++) {
+        jobs[t].img = img;
+        jobs[t].brightness = brightness;
+        jobs[t].filtered = &filtered;
+        jobs[t].grid = &grid;
+        jobs[t].start = (int)((int64_t)n_of_bands*t/n_of_threads);
+        jobs[t].end = (int)((int64_t)n_of_bands*(t + 1)/n_of_threads);
+        jobs[t].cells = image_alloc(img->allocator, cells_size);
+        jobs[t].saved = image_alloc(img->allocator, 3*row_bytes);
+        if (jobs[t].cells == NULL || jobs[t].saved == NULL) status = IMAGE_ERR_NO_MEMORY;
+    }
+    if (status == IMAGE_OK) {
+        run_worker_jobs(jobs, sizeof(jobs[0]), n_of_threads, bilateral_grid_main);
+    }
+
+    for (t = 0; t < n_of_threads; t++) {
+        image_dealloc(img->allocator, jobs[t].cells);
+        image_dealloc(img->allocator, jobs[t].saved);
+    }
+    if (brightness != NULL && brightness != img->grey_array) image_dealloc(img->allocator, brightness);
+    if (status != IMAGE_OK) {
+        free_struct_image(&filtered);
+        return status;
+    }
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
+}
+
+// Parses "spatial_sd,range_sd", both over 0
+int parse_bilateral_arg(double *spatial_sd, double *range_sd, char *bilateral_arg) {
+    char extra;
+    if (sscanf(bilateral_arg, "%lf,%lf%c", spatial_sd, range_sd, &extra) != 2) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    if (!(*spatial_sd > 0.0) || !(*range_sd > 0.0)) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
@@ -0,0 +1,33 @@
+/* bilateral.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the bilateral filter, edge
+ * preserving smoothing
+ *
+ */
+
+#ifndef BILATERAL_H
+#define BILATERAL_H
+
+#include "image_data_types.h"
+#include <stddef.h>
+
+// Spatial sds up to this are summed exactly over the 5x5 window of
+// generate_gaussian_kernel(), bigger ones use the bilateral grid
+#define BILATERAL_EXACT_MAX_SD 1.0
+
+// About how much of the grid each thread holds at once, more when a
+// few rows of the grid are bigger than this
+#define BILATERAL_GRID_BAND_BYTES (8 << 20)
+
+int bilateral_image(double spatial_sd, double range_sd, struct image *img);
+int bilateral_image_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads);
+int bilateral_image_exact(double spatial_sd, double range_sd, struct image *img);
+int bilateral_image_exact_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads);
+int bilateral_image_grid(double spatial_sd, double range_sd, struct image *img);
+int bilateral_image_grid_threads(double spatial_sd, double range_sd, struct image *img, int n_of_threads);
+size_t bilateral_grid_thread_bytes(int width, int height, int channels, double spatial_sd, double range_sd);
+int parse_bilateral_arg(double *spatial_sd, double *range_sd, char *bilateral_arg);
+
+#endif
@@ -3,256 +3,1150 @@
  * u5350448
  *
  * Functions for dealing
- * with 24bpp bitmap files and structures
- * defined in image_data_types.h
+ * with bitmap files and structures
+ * defined in image_data_types.h. Reads 1, 8, 24
+ * and 32bpp, bottom up or top down, and writes
+ * 1, 8 and 24bpp. Big files are decoded and encoded
+ * on several threads, each reading or writing its own
+ * rows with pread and pwrite
  */
 
 #include "bmp_struct_image.h"
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdlib.h>
-#include <error.h>
 #include <errno.h>
 #include <math.h>
 #include <string.h>
+#include <fcntl.h>
+#include "image_data_helper_functions.h"
+#include "resize.h"
 
-void bmp_to_struct_image(int input_fildes, struct image *img) {
-    // Check the first two characters are "BM"
-    char buf[3];
-    if (pread(input_fildes, buf, 2, 0x00) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
-    } 
-    buf[2] = '\0';
+// Rows are read and written in blocks of about this many bytes
+#define IO_BLOCK_SIZE (1 << 20)
 
-    if (strcmp(buf, "BM") != 0) {
-        error(1, 0, "Input file is not a supported bitmap");
+// File header plus BITMAPINFOHEADER
+#define BMP_HEADER_SIZE 0x36
+#define BMP_FILE_HEADER_SIZE 14
+
+// Compression methods
+#define BMP_BI_RGB 0
+#define BMP_BI_BITFIELDS 3
+
+// What the decoder needs from the headers and palette
+struct bmp_info {
+    uint32_t pixel_array_offset;
+    uint32_t info_header_size;
+    int32_t width;
+    // Always positive, top_down is set if the file's height was negative
+    int32_t height;
+    int top_down;
+    int bpp;
+    uint32_t compression;
+    uint32_t n_of_colours;
+    // Blue, green, red, reserved for each palette entry
+    uint8_t palette[256*4];
+    int palette_is_grey;
+    // Entry i is grey level i, rows can be copied as they are
+    int palette_is_identity;
+};
+
+// Size a decode is headed for, see bmp_to_struct_image_for_resize(),
+// or a preview_factor over 1 for bmp_to_struct_image_preview()
+struct bmp_resize_target {
+    int *width;
+    int *height;
+    int method;
+    int preview_factor;
+};
+
+// Where decoded rows go, straight into the image, through a
+// row_reducer when shrinking as it reads, or averaged into
+// a preview when preview_factor is over 1
+struct bmp_row_sink {
+    struct image *img;
+    int reducing;
+    int preview_factor;
+    struct image row_image;
+    struct row_reducer reducer;
+    const struct image_allocator *allocator;
+};
+
+// A band of rows, in file order, for one thread to read
+// into the sink or write out of img at offset. An offset
+// of -1 writes to the file's position instead
+struct bmp_rows_job {
+    int fildes;
+    off_t offset;
+    size_t row_width;
+    int start;
+    int end;
+    uint8_t *buf;
+    int rows_per_block;
+    struct bmp_info *info;
+    struct bmp_row_sink *sink;
+    struct image *img;
+    int bpp;
+    int status;
+    int errsv;
+};
+
+int read_fully_at(int fildes, void *buf, size_t count, off_t offset);
+int read_fully(int fildes, void *buf, size_t count);
+int write_fully(int fildes, const void *buf, size_t count);
+int write_fully_at(int fildes, const void *buf, size_t count, off_t offset);
+size_t bmp_row_width(int width, int bpp);
+int parse_bmp_header(const uint8_t *header, struct bmp_info *info);
+int check_bmp_masks(const uint8_t *masks, struct bmp_info *info);
+uint64_t bmp_palette_offset(struct bmp_info *info);
+void check_bmp_palette(struct bmp_info *info);
+int bmp_row_to_y(struct bmp_info *info, int row_index);
+int init_struct_image_for_bmp(struct image *img, struct bmp_info *info, const struct image_allocator *allocator);
+void bmp_row_to_pixels(const uint8_t *row, struct bmp_info *info, struct image *img, int y);
+uint8_t grey_value_at(struct image *img, size_t pixel_index);
+void pixels_to_bmp_row(struct image *img, int y, int bpp, uint8_t *row);
+int init_bmp_row_sink(struct bmp_row_sink *sink, struct image *img, struct bmp_info *info,
+                      const struct bmp_resize_target *target, const struct image_allocator *allocator);
+void store_bmp_row(struct bmp_row_sink *sink, const uint8_t *row, struct bmp_info *info, int row_index);
+void finish_bmp_row_sink(struct bmp_row_sink *sink, int status);
+int preview_source_row(int preview_y, int factor, int height);
+void average_preview_row(const struct image *row_image, struct image *img, int y, int factor);
+int read_bmp_preview_rows(int input_fildes, struct bmp_info *info, struct bmp_row_sink *sink,
+                          const struct image_allocator *allocator);
+int read_bmp_info_at(int input_fildes, struct bmp_info *info);
+int read_bmp_seekable(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                      const struct bmp_resize_target *target, int flip_vertical, int n_of_threads);
+void shift_bits_left(uint8_t *bytes, size_t size, int shift);
+uint32_t written_pixel_array_offset(int bpp);
+int bmp_io_threads(size_t n_of_pixels, int height, int n_of_threads);
+int split_bmp_rows(struct bmp_rows_job *jobs, int n_of_jobs, const struct bmp_rows_job *whole,
+                   const struct image_allocator *allocator);
+int run_bmp_rows_jobs(struct bmp_rows_job *jobs, int n_of_jobs, void *(*job_main)(void *),
+                      const struct image_allocator *allocator);
+void *read_bmp_rows_main(void *arg);
+void *write_bmp_rows_main(void *arg);
+int read_bmp_stream(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                    const struct bmp_resize_target *target, int flip_vertical);
+
+// pread that treats a short read as a truncated file
+int read_fully_at(int fildes, void *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fildes, (char *)buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return IMAGE_ERR_IO;
+        }
+        if (n == 0) return IMAGE_ERR_FORMAT;
+        done += n;
+    }
+    return IMAGE_OK;
+}
+
+// read for pipes, carries on through short reads
+int read_fully(int fildes, void *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = read(fildes, (char *)buf + done, count - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return IMAGE_ERR_IO;
+        }
+        if (n == 0) return IMAGE_ERR_FORMAT;
+        done += n;
+    }
+    return IMAGE_OK;
+}
+
+// write that retries until everything is written
+int write_fully(int fildes, const void *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = write(fildes, (const char *)buf + done, count - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return IMAGE_ERR_IO;
+        }
+        done += n;
+    }
+    return IMAGE_OK;
+}
+
+// pwrite that retries until everything is written, or
+// write_fully() for an offset of -1
+int write_fully_at(int fildes, const void *buf, size_t count, off_t offset) {
+    if (offset == -1) return write_fully(fildes, buf, count);
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pwrite(fildes, (const char *)buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return IMAGE_ERR_IO;
+        }
+        done += n;
+    }
+    return IMAGE_OK;
+}
+
+// Calculate row width
+// http://en.wikipedia.org/wiki/BMP_file_format
+size_t bmp_row_width(int width, int bpp) {
+    return ((size_t)bpp*width + 31)/32*4;
+}
+
+// Reads the fields we use out of the file header and
+// BITMAPINFOHEADER, rejecting anything we can't decode
+int parse_bmp_header(const uint8_t *header, struct bmp_info *info) {
+    if (header[0] != 'B' || header[1] != 'M') {
+        return IMAGE_ERR_FORMAT;
+    }
+
+    uint16_t bpp;
+    uint32_t colours_used;
+    memcpy(&info->pixel_array_offset, header + 0xA, 4);
+    memcpy(&info->info_header_size, header + 0xE, 4);
+    memcpy(&info->width, header + 0x12, 4);
+    memcpy(&info->height, header + 0x16, 4);
+    memcpy(&bpp, header + 0x1C, 2);
+    memcpy(&info->compression, header + 0x1E, 4);
+    memcpy(&colours_used, header + 0x2E, 4);
+    info->bpp = bpp;
+
+    // A negative height means the rows are stored top down
+    info->top_down = 0;
+    if (info->height < 0 && info->height != INT32_MIN) {
+        info->height = -info->height;
+        info->top_down = 1;
+    }
+
+    if (info->width <= 0 || info->height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+    if (info->info_header_size < 40) {
+        return IMAGE_ERR_FORMAT;
+    }
+    if (info->bpp != 1 && info->bpp != 8 && info->bpp != 24 && info->bpp != 32) {
+        return IMAGE_ERR_FORMAT;
+    }
+    // Bitfields are only understood for 32bpp, see check_bmp_masks()
+    if (info->compression != BMP_BI_RGB && !(info->compression == BMP_BI_BITFIELDS && info->bpp == 32)) {
+        return IMAGE_ERR_FORMAT;
+    }
+
+    // Palettes default to every possible colour
+    info->n_of_colours = 0;
+    if (info->bpp <= 8) {
+        info->n_of_colours = colours_used == 0 ? 1u << info->bpp : colours_used;
+        if (info->n_of_colours > 1u << info->bpp) {
+            return IMAGE_ERR_FORMAT;
+        }
+    }
+    // Summed in 64 bits, a huge info header size would wrap round and
+    // let the palette start before the headers end
+    if (bmp_palette_offset(info) + 4*info->n_of_colours > info->pixel_array_offset) {
+        return IMAGE_ERR_FORMAT;
+    }
+
+    // Indexes past the end of a short palette read as black
+    memset(info->palette, 0, sizeof(info->palette));
+    info->palette_is_grey = 0;
+    info->palette_is_identity = 0;
+    return IMAGE_OK;
+}
+
+// For BI_BITFIELDS, the red, green and blue masks at 0x36, either just after
+// a BITMAPINFOHEADER or inside a V4/V5 header. Only the usual BGRx
+// layout is accepted, anything else would need per pixel shifting
+int check_bmp_masks(const uint8_t *masks, struct bmp_info *info) {
+    if (info->compression != BMP_BI_BITFIELDS) return IMAGE_OK;
+
+    uint32_t red_mask, green_mask, blue_mask;
+    memcpy(&red_mask, masks, 4);
+    memcpy(&green_mask, masks + 4, 4);
+    memcpy(&blue_mask, masks + 8, 4);
+    if (red_mask != 0x00FF0000 || green_mask != 0x0000FF00 || blue_mask != 0x000000FF) {
+        return IMAGE_ERR_FORMAT;
+    }
+    return IMAGE_OK;
+}
+
+uint64_t bmp_palette_offset(struct bmp_info *info) {
+    uint64_t offset = (uint64_t)BMP_FILE_HEADER_SIZE + info->info_header_size;
+    // A BITMAPINFOHEADER is followed by the masks, V2 (52 bytes) and
+    // later headers hold them
+    if (info->compression == BMP_BI_BITFIELDS && info->info_header_size < 52) {
+        offset += 12;
+    }
+    return offset;
+}
+
+// Once the palette is read, works out if it only has greys,
+// which lets 8bpp and 1bpp files decode to a single channel
+void check_bmp_palette(struct bmp_info *info) {
+    uint32_t i;
+    info->palette_is_grey = info->bpp <= 8;
+    info->palette_is_identity = info->bpp == 8 && info->n_of_colours == 256;
+    for (i = 0; i < info->n_of_colours; i++) {
+        uint8_t *entry = &info->palette[4*i];
+        if (entry[0] != entry[1] || entry[1] != entry[2]) {
+            info->palette_is_grey = 0;
+        }
+        if (entry[0] != i) {
+            info->palette_is_identity = 0;
+        }
+    }
+    info->palette_is_identity = info->palette_is_identity && info->palette_is_grey;
+}
+
+// Image row, counting from the top, of the row_index'th row in the file
+int bmp_row_to_y(struct bmp_info *info, int row_index) {
+    return info->top_down ? row_index : info->height - 1 - row_index;
+}
+
+int init_struct_image_for_bmp(struct image *img, struct bmp_info *info, const struct image_allocator *allocator) {
+    if (info->palette_is_grey) {
+        return init_grey_struct_image(img, info->width, info->height, allocator);
+    }
+    return init_struct_image(img, info->width, info->height, allocator);
+}
+
+// Converts one row of bitmap data into row y of img,
+// counting rows from the top
+void bmp_row_to_pixels(const uint8_t *row, struct bmp_info *info, struct image *img, int y) {
+    int x;
+    if (info->bpp == 24) {
+        // Same layout as pixel_array
+        memcpy(&img->pixel_array[(size_t)y*img->width], row, (size_t)img->width*3);
+        return;
+    }
+    if (info->bpp == 32) {
+        // Blue, green, red, then alpha or unused, which is dropped
+        struct pixel *pix = &img->pixel_array[(size_t)y*img->width];
+        for (x = 0; x < img->width; x++, row += 4) {
+            pix[x].Blue = row[0];
+            pix[x].Green = row[1];
+            pix[x].Red = row[2];
+        }
+        return;
+    }
+    if (info->palette_is_identity) {
+        memcpy(&img->grey_array[(size_t)y*img->width], row, img->width);
+        return;
+    }
+
+    for (x = 0; x < img->width; x++) {
+        int colour_index;
+        if (info->bpp == 8) {
+            colour_index = row[x];
+        } else {
+            // 1bpp, the leftmost pixel is the most significant bit
+            colour_index = (row[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        uint8_t *entry = &info->palette[4*colour_index];
+        size_t pixel_index = (size_t)y*img->width + x;
+        if (img->channels == 1) {
+            img->grey_array[pixel_index] = entry[0];
+        } else {
+            struct pixel *pix = &img->pixel_array[pixel_index];
+            pix->Blue = entry[0];
+            pix->Green = entry[1];
+            pix->Red = entry[2];
+        }
+    }
+}
+
+// Grey value of a pixel for 8bpp and 1bpp output, colour
+// pixels are averaged the same way greyscale_image() does
+uint8_t grey_value_at(struct image *img, size_t pixel_index) {
+    if (img->channels == 1) {
+        return img->grey_array[pixel_index];
+    }
+    struct pixel *pix = &img->pixel_array[pixel_index];
+    return (int) ((pix->Red + pix->Green + pix->Blue)/3.0);
+}
+
+// Converts row y of img into a row of bitmap data, padding included.
+// Single channel images are expanded back out to three for 24bpp
+void pixels_to_bmp_row(struct image *img, int y, int bpp, uint8_t *row) {
+    size_t row_width = bmp_row_width(img->width, bpp);
+    int x;
+    if (bpp == 1) {
+        // Anything from mid grey up is white, packed eight pixels to a byte
+        memset(row, 0, row_width);
+        for (x = 0; x < img->width; x += 8) {
+            uint8_t bits = 0;
+            int bit;
+            for (bit = 0; bit < 8 && x + bit < img->width; bit++) {
+                bits |= (grey_value_at(img, (size_t)y*img->width + x + bit) >> 7) << (7 - bit);
+            }
+            row[x >> 3] = bits;
+        }
+        return;
+    }
+
+    if (bpp == 8 && img->channels == 1) {
+        memcpy(row, &img->grey_array[(size_t)y*img->width], img->width);
+    } else if (bpp == 8) {
+        for (x = 0; x < img->width; x++) {
+            row[x] = grey_value_at(img, (size_t)y*img->width + x);
+        }
+    } else if (img->channels == 1) {
+        uint8_t *grey = &img->grey_array[(size_t)y*img->width];
+        for (x = 0; x < img->width; x++) {
+            row[3*x] = grey[x];
+            row[3*x + 1] = grey[x];
+            row[3*x + 2] = grey[x];
+        }
+    } else {
+        memcpy(row, &img->pixel_array[(size_t)y*img->width], (size_t)img->width*3);
+    }
+    size_t pad_index;
+    for (pad_index = (size_t)img->width*bpp/8; pad_index < row_width; pad_index++) {
+        row[pad_index] = 0;
+    }
+}
+
+// Picks the smallest depth that holds the image exactly: 1bpp if
+// every pixel is black or white, 8bpp if every pixel is grey
+int bmp_depth_for_image(struct image *img) {
+    size_t pixel_index;
+    if (img->channels == 1) {
+        for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+            uint8_t grey = img->grey_array[pixel_index];
+            if (grey != 0 && grey != 255) return BMP_DEPTH_8;
+        }
+        return BMP_DEPTH_1;
+    }
+
+    int is_binary = 1;
+    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+        struct pixel *pix = &img->pixel_array[pixel_index];
+        if (pix->Red != pix->Green || pix->Green != pix->Blue) return BMP_DEPTH_24;
+        if (pix->Red != 0 && pix->Red != 255) is_binary = 0;
+    }
+    return is_binary ? BMP_DEPTH_1 : BMP_DEPTH_8;
+}
+
+// Sets up img for the decoded rows. With a target, works out the
+// whole number reduction resize_image() would start with and sets
+// up a row_reducer so img only ever holds the reduced image
+int init_bmp_row_sink(struct bmp_row_sink *sink, struct image *img, struct bmp_info *info,
+                      const struct bmp_resize_target *target, const struct image_allocator *allocator) {
+    sink->img = img;
+    sink->reducing = 0;
+    sink->preview_factor = 1;
+    sink->allocator = allocator;
+
+    // A preview is the size of the blocks, rounded up, and each row is
+    // decoded into a one row image before being averaged
+    int status;
+    if (target != NULL && target->preview_factor > 1) {
+        int factor = target->preview_factor;
+        struct bmp_info preview_info = *info;
+        preview_info.width = (info->width - 1)/factor + 1;
+        preview_info.height = (info->height - 1)/factor + 1;
+        status = init_struct_image_for_bmp(img, &preview_info, allocator);
+        if (status != IMAGE_OK) return status;
+        if (info->palette_is_grey) {
+            status = init_grey_struct_image(&sink->row_image, info->width, 1, allocator);
+        } else {
+            status = init_struct_image(&sink->row_image, info->width, 1, allocator);
+        }
+        if (status != IMAGE_OK) {
+            free_struct_image(img);
+            return status;
+        }
+        sink->preview_factor = factor;
+        return IMAGE_OK;
+    }
+
+    int factor_x = 1;
+    int factor_y = 1;
+    if (target != NULL) {
+        resolve_resize_dimensions(info->width, info->height, target->width, target->height);
+        factor_x = reduce_factor_for_resize(info->width, *target->width, target->method);
+        factor_y = reduce_factor_for_resize(info->height, *target->height, target->method);
     }
+    if (factor_x == 1 && factor_y == 1) {
+        return init_struct_image_for_bmp(img, info, allocator);
+    }
+
+    // Each row is decoded into a one row image, then added to the sums
+    if (info->palette_is_grey) {
+        status = init_grey_struct_image(&sink->row_image, info->width, 1, allocator);
+    } else {
+        status = init_struct_image(&sink->row_image, info->width, 1, allocator);
+    }
+    if (status != IMAGE_OK) return status;
 
-    get_dimensions_from_bmp(&img->width, &img->height, input_fildes);
-    get_pixel_array_from_bmp_malloc(img, input_fildes);
+    status = row_reducer_init(&sink->reducer, info->width, info->height, sink->row_image.channels,
+                              factor_x, factor_y, img, allocator);
+    if (status != IMAGE_OK) {
+        free_struct_image(&sink->row_image);
+        return status;
+    }
+    sink->reducing = 1;
+    return IMAGE_OK;
 }
 
-void struct_image_to_bmp(int output_fildes, struct image *img) {
-    write_bmp_header_to_file(output_fildes, img);
-    write_pixel_array_to_bmp(output_fildes, img);
+void store_bmp_row(struct bmp_row_sink *sink, const uint8_t *row, struct bmp_info *info, int row_index) {
+    if (sink->preview_factor > 1) {
+        int y = bmp_row_to_y(info, row_index);
+        int preview_y = y/sink->preview_factor;
+        if (y != preview_source_row(preview_y, sink->preview_factor, info->height)) return;
+        bmp_row_to_pixels(row, info, &sink->row_image, 0);
+        average_preview_row(&sink->row_image, sink->img, preview_y, sink->preview_factor);
+        return;
+    }
+    if (!sink->reducing) {
+        bmp_row_to_pixels(row, info, sink->img, bmp_row_to_y(info, row_index));
+        return;
+    }
+    struct image *row_image = &sink->row_image;
+    bmp_row_to_pixels(row, info, row_image, 0);
+    const uint8_t *decoded = row_image->channels == 1 ? row_image->grey_array : (uint8_t *)row_image->pixel_array;
+    row_reducer_add_row(&sink->reducer, decoded, bmp_row_to_y(info, row_index));
 }
 
-void get_dimensions_from_bmp(int *width, int *height, int input_fildes) {
-    if (pread(input_fildes, width, 4, 0x12) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
+// Frees the sink's buffers, and the image too if status is an error
+void finish_bmp_row_sink(struct bmp_row_sink *sink, int status) {
+    if (sink->reducing) {
+        row_reducer_free(&sink->reducer, sink->allocator);
+        free_struct_image(&sink->row_image);
+    }
+    if (sink->preview_factor > 1) {
+        free_struct_image(&sink->row_image);
     }
-    if (pread(input_fildes, height, 4, 0x16) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
+    if (status != IMAGE_OK) {
+        free_struct_image(sink->img);
     }
 }
 
-void get_pixel_array_from_bmp_malloc(struct image *raw_image, int input_fildes) {
-    // Get pixel array offset in bmp
-    int pixel_array_offset;
-    if (pread(input_fildes, &pixel_array_offset, 4, 0xA) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
+// The row of the bitmap, counting from the top, that row preview_y
+// of a preview is taken from: the middle of its block of rows
+int preview_source_row(int preview_y, int factor, int height) {
+    int start = preview_y*factor;
+    int rows = height - start < factor ? height - start : factor;
+    return start + rows/2;
+}
+
+// Averages each factor pixels of row_image into row y of img,
+// the last block being narrower if the width doesn't divide
+void average_preview_row(const struct image *row_image, struct image *img, int y, int factor) {
+    int channels = img->channels;
+    const uint8_t *src = channels == 1 ? row_image->grey_array : (const uint8_t *)row_image->pixel_array;
+    uint8_t *dst = channels == 1 ? &img->grey_array[(size_t)y*img->width]
+        : (uint8_t *)&img->pixel_array[(size_t)y*img->width];
+    int x, c;
+    for (x = 0; x < img->width; x++) {
+        int start = x*factor;
+        int n = row_image->width - start < factor ? row_image->width - start : factor;
+        for (c = 0; c < channels; c++) {
+            const uint8_t *block = src + (size_t)start*channels + c;
+            unsigned sum = 0;
+            int i;
+            for (i = 0; i < n; i++) {
+                sum += block[i*channels];
+            }
+            dst[(size_t)x*channels + c] = (sum + n/2)/n;
+        }
     }
+}
 
-    // Get pixel data size
-    uint32_t pixel_array_size;
-    if (pread(input_fildes, &pixel_array_size, 4, 0x22) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
+// Reads just the rows a preview sink keeps, one pread each
+int read_bmp_preview_rows(int input_fildes, struct bmp_info *info, struct bmp_row_sink *sink,
+                          const struct image_allocator *allocator) {
+    size_t row_width = bmp_row_width(info->width, info->bpp);
+    uint8_t *row = image_alloc(allocator, row_width);
+    if (row == NULL) return IMAGE_ERR_NO_MEMORY;
+
+    int status = IMAGE_OK;
+    int preview_y;
+    for (preview_y = 0; preview_y < sink->img->height && status == IMAGE_OK; preview_y++) {
+        // Rows are their own index counted from the other end
+        int row_index = bmp_row_to_y(info, preview_source_row(preview_y, sink->preview_factor, info->height));
+        status = read_fully_at(input_fildes, row, row_width, info->pixel_array_offset + (off_t)row_index*row_width);
+        if (status == IMAGE_OK) {
+            store_bmp_row(sink, row, info, row_index);
+        }
     }
+    image_dealloc(allocator, row);
+    return status;
+}
 
-    int n_of_pixels = raw_image->width*raw_image->height;
+// Reads a bitmap from a file with pread, or from a pipe
+// with bmp_stream_to_struct_image() if it can't seek
+int bmp_to_struct_image(int input_fildes, struct image *img, const struct image_allocator *allocator) {
+    if (lseek(input_fildes, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return read_bmp_stream(input_fildes, img, allocator, NULL, 0);
+    }
+    return read_bmp_seekable(input_fildes, img, allocator, NULL, 0, 0);
+}
 
-    struct pixel *pixel_array = malloc(n_of_pixels * sizeof(struct pixel));
-    if (pixel_array == NULL) {
-        int errsv = errno;
-        error(1, errsv, "Couldn't allocate memory for pixel array\n");
+// Reads a bitmap upside down, the same as bmp_to_struct_image() then
+// flip_image_vertical(). Rows are stored from the other end as they
+// are decoded, so the flip costs nothing
+int bmp_to_struct_image_flipped(int input_fildes, struct image *img, const struct image_allocator *allocator) {
+    if (lseek(input_fildes, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return read_bmp_stream(input_fildes, img, allocator, NULL, 1);
     }
+    return read_bmp_seekable(input_fildes, img, allocator, NULL, 1, 0);
+}
 
-    // Read in bitmap data
-    uint8_t *img_buf = malloc(pixel_array_size);
-    if (img_buf == NULL) {
-        int errsv = errno;
-        error(1, errsv, "Couldn't allocate memory for image buffer\n");
+// bmp_to_struct_image() on n_of_threads threads, at most WORKER_MAX_THREADS.
+// Pipes are always read on one
+int bmp_to_struct_image_threads(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                int n_of_threads) {
+    if (lseek(input_fildes, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return read_bmp_stream(input_fildes, img, allocator, NULL, 0);
     }
+    if (n_of_threads < 1) n_of_threads = 1;
+    return read_bmp_seekable(input_fildes, img, allocator, NULL, 0, n_of_threads);
+}
 
-    if (pread(input_fildes, img_buf, pixel_array_size, pixel_array_offset) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed read");
+// Reads a bitmap that is going to be resized. The whole number reduction
+// resize_image() would start with is done as the rows are read, so memory
+// use follows the new size, not the bitmap's. new_width and new_height
+// are resolved against the bitmap's size, finish the resize with
+// resize_reduced_image()
+int bmp_to_struct_image_for_resize(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                   int *new_width, int *new_height, int method) {
+    struct bmp_resize_target target = {new_width, new_height, method, 0};
+    if (lseek(input_fildes, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return read_bmp_stream(input_fildes, img, allocator, &target, 0);
+    }
+    return read_bmp_seekable(input_fildes, img, allocator, &target, 0, 0);
+}
+
+// Reads a 1/factor size preview of a bitmap, the sizes rounded up. Each
+// pixel is the average of factor pixels along the middle row of its
+// factor x factor block, so from a file only one row in factor is read
+// and decoded. From a pipe every row is read but only those decoded
+int bmp_to_struct_image_preview(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                int factor) {
+    if (factor < 1) return IMAGE_ERR_ARGUMENT;
+    struct bmp_resize_target target = {NULL, NULL, 0, factor};
+    if (lseek(input_fildes, 0, SEEK_CUR) == -1 && errno == ESPIPE) {
+        return read_bmp_stream(input_fildes, img, allocator, &target, 0);
+    }
+    return read_bmp_seekable(input_fildes, img, allocator, &target, 0, 0);
+}
+
+int bmp_stream_to_struct_image(int input_fildes, struct image *img, const struct image_allocator *allocator) {
+    return read_bmp_stream(input_fildes, img, allocator, NULL, 0);
+}
+
+// Forward only reader for pipes: reads the header, skips to the
+// pixel data and converts it a row at a time as it arrives.
+// flip_vertical stores the rows in the opposite order
+int read_bmp_stream(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                    const struct bmp_resize_target *target, int flip_vertical) {
+    uint8_t header[BMP_HEADER_SIZE];
+    struct bmp_info info;
+    int status = read_fully(input_fildes, header, sizeof(header));
+    if (status != IMAGE_OK) return status;
+    status = parse_bmp_header(header, &info);
+    if (status != IMAGE_OK) return status;
+    info.top_down ^= flip_vertical;
+
+    uint32_t position = sizeof(header);
+    if (info.compression == BMP_BI_BITFIELDS) {
+        uint8_t masks[12];
+        status = read_fully(input_fildes, masks, sizeof(masks));
+        if (status != IMAGE_OK) return status;
+        status = check_bmp_masks(masks, &info);
+        if (status != IMAGE_OK) return status;
+        position += sizeof(masks);
+    }
+
+    size_t row_width = bmp_row_width(info.width, info.bpp);
+    uint32_t skip_buf_size = row_width < sizeof(info.palette) ? sizeof(info.palette) : row_width;
+    uint8_t *row = image_alloc(allocator, skip_buf_size);
+    if (row == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    // Skip the rest of a larger info header, then read the palette
+    uint32_t to_skip = bmp_palette_offset(&info) - position;
+    while (to_skip > 0 && status == IMAGE_OK) {
+        uint32_t chunk = to_skip < skip_buf_size ? to_skip : skip_buf_size;
+        status = read_fully(input_fildes, row, chunk);
+        to_skip -= chunk;
+    }
+    if (status == IMAGE_OK && info.n_of_colours > 0) {
+        status = read_fully(input_fildes, info.palette, 4*info.n_of_colours);
+    }
+    check_bmp_palette(&info);
+
+    // Skip anything between the palette and the pixel data
+    position = bmp_palette_offset(&info) + 4*info.n_of_colours;
+    to_skip = info.pixel_array_offset - position;
+    while (to_skip > 0 && status == IMAGE_OK) {
+        uint32_t chunk = to_skip < skip_buf_size ? to_skip : skip_buf_size;
+        status = read_fully(input_fildes, row, chunk);
+        to_skip -= chunk;
+    }
+
+    struct bmp_row_sink sink;
+    if (status == IMAGE_OK) {
+        status = init_bmp_row_sink(&sink, img, &info, target, allocator);
+    }
+    if (status != IMAGE_OK) {
+        image_dealloc(allocator, row);
+        return status;
     }
 
-    // Calculate row width
-    // http://en.wikipedia.org/wiki/BMP_file_format
-    
-    int row_width = (int)(floor((24.0*((double)raw_image->width) + 31.0)/32.0)*4.0);
-    int bytes_to_skip = row_width - raw_image->width*3;
     int row_index;
-    int col_index;
-
-    // Get row by row backwards
-    
-    uint8_t *img_buf_backwards_pointer = img_buf + pixel_array_size - 1;
-    for (row_index = 0; row_index < raw_image->height; row_index++) {
-        img_buf_backwards_pointer -= bytes_to_skip;
-        for (col_index = 0; col_index < raw_image->width; ++col_index, img_buf_backwards_pointer-=3) {
-            pixel_array[row_index*raw_image->width + col_index].Red = *img_buf_backwards_pointer;
-            pixel_array[row_index*raw_image->width + col_index].Green = *(img_buf_backwards_pointer-1);
-            pixel_array[row_index*raw_image->width + col_index].Blue = *(img_buf_backwards_pointer-2);
+    for (row_index = 0; row_index < info.height && status == IMAGE_OK; row_index++) {
+        status = read_fully(input_fildes, row, row_width);
+        if (status == IMAGE_OK) {
+            store_bmp_row(&sink, row, &info, row_index);
         }
     }
 
-    // Set the image
-    raw_image->pixel_array = pixel_array;
-    raw_image->pixel_array_byte_size = pixel_array_size;
-    raw_image->n_of_pixels = n_of_pixels;
+    image_dealloc(allocator, row);
+    finish_bmp_row_sink(&sink, status);
+    return status;
+}
 
-    // Free the buffer
-    free(img_buf);
+int struct_image_to_bmp(int output_fildes, struct image *img) {
+    return struct_image_to_bmp_depth(output_fildes, img, BMP_DEPTH_24);
 }
 
-void write_bmp_header_to_file(int fildes, struct image *img) {
-    // Write BM
-    if (write(fildes, "BM", 2) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+// Writes img at 1, 8 or 24bpp, or BMP_DEPTH_AUTO for the
+// smallest of those that loses nothing
+int struct_image_to_bmp_depth(int output_fildes, struct image *img, int bpp) {
+    return struct_image_to_bmp_depth_threads(output_fildes, img, bpp, 0);
+}
+
+// struct_image_to_bmp_depth() writing the pixel data on n_of_threads
+// threads, 0 for one per CPU for big images
+int struct_image_to_bmp_depth_threads(int output_fildes, struct image *img, int bpp, int n_of_threads) {
+    if (bpp == BMP_DEPTH_AUTO) {
+        bpp = bmp_depth_for_image(img);
+    }
+    if (bpp != BMP_DEPTH_1 && bpp != BMP_DEPTH_8 && bpp != BMP_DEPTH_24) {
+        return IMAGE_ERR_ARGUMENT;
     }
 
-    // Write file size (unsigned)
-    uint32_t file_size = 0x36 + img->pixel_array_byte_size;
-    if (write(fildes, (char*)&file_size, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    int status = write_bmp_header_to_file(output_fildes, img, bpp);
+    if (status != IMAGE_OK) return status;
+    return write_pixel_array_to_bmp_threads(output_fildes, img, bpp, n_of_threads);
+}
+
+int get_dimensions_from_bmp(int *width, int *height, int input_fildes) {
+    int status = read_fully_at(input_fildes, width, 4, 0x12);
+    if (status != IMAGE_OK) return status;
+    status = read_fully_at(input_fildes, height, 4, 0x16);
+    if (status != IMAGE_OK) return status;
+
+    // Negative for top down bitmaps
+    if (*height < 0 && *height != INT32_MIN) {
+        *height = -*height;
     }
 
-    // Write signature
-    if (write(fildes, "NICD", 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    if (*width <= 0 || *height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
     }
+    return IMAGE_OK;
+}
 
-    // Write pixel array offset
-    uint32_t pixel_array_offset = 0x36;
-    if (write(fildes, (char*)&pixel_array_offset, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+int get_pixel_array_from_bmp_malloc(struct image *raw_image, int input_fildes) {
+    return read_bmp_seekable(input_fildes, raw_image, raw_image->allocator, NULL, 0, 0);
+}
+
+// Size of a file's image, and the channels bmp_to_struct_image()
+// would give it: 1 for a grey palette, otherwise 3
+int get_layout_from_bmp(int *width, int *height, int *channels, int input_fildes) {
+    struct bmp_info info;
+    int status = read_bmp_info_at(input_fildes, &info);
+    if (status != IMAGE_OK) return status;
+    *width = info.width;
+    *height = info.height;
+    *channels = info.palette_is_grey ? 1 : 3;
+    return IMAGE_OK;
+}
+
+// Moves every bit shift places towards the start of bytes,
+// the most significant bit of a byte being its first
+void shift_bits_left(uint8_t *bytes, size_t size, int shift) {
+    size_t i;
+    for (i = 0; i + 1 < size; i++) {
+        bytes[i] = (bytes[i] << shift) | (bytes[i + 1] >> (8 - shift));
     }
+    bytes[size - 1] <<= shift;
+}
 
-    // Write header size
-    uint32_t header_size = 40;
-    if (write(fildes, (char*)&header_size, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+// Reads the pixels from (x1,y1) inclusive to (x2,y2) exclusive of a
+// file, counting rows from the top, into img. Only that part of each
+// row is read, so an image too big to hold can be worked on in pieces
+int bmp_region_to_struct_image(int input_fildes, int x1, int y1, int x2, int y2, struct image *img,
+                               const struct image_allocator *allocator) {
+    struct bmp_info info;
+    int status = read_bmp_info_at(input_fildes, &info);
+    if (status != IMAGE_OK) return status;
+    if (x1 < 0 || y1 < 0 || x2 <= x1 || y2 <= y1 || x2 > info.width || y2 > info.height) {
+        return IMAGE_ERR_DIMENSIONS;
     }
 
-    // Write dimensions
-    if (write(fildes, (char*)&img->width, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    // Decoded as if the region were the whole row
+    struct bmp_info region_info = info;
+    region_info.width = x2 - x1;
+    region_info.height = y2 - y1;
+    status = init_struct_image_for_bmp(img, &region_info, allocator);
+    if (status != IMAGE_OK) return status;
+
+    // 1bpp regions can start part way into a byte
+    size_t row_width = bmp_row_width(info.width, info.bpp);
+    size_t first_bit = (size_t)x1*info.bpp;
+    size_t span = (first_bit % 8 + (size_t)(x2 - x1)*info.bpp + 7)/8;
+    uint8_t *row = image_alloc(allocator, span);
+    if (row == NULL) {
+        free_struct_image(img);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    int y;
+    for (y = y1; y < y2 && status == IMAGE_OK; y++) {
+        int row_index = info.top_down ? y : info.height - 1 - y;
+        off_t offset = info.pixel_array_offset + (off_t)row_index*row_width + first_bit/8;
+        status = read_fully_at(input_fildes, row, span, offset);
+        if (status != IMAGE_OK) break;
+        if (first_bit % 8) shift_bits_left(row, span, first_bit % 8);
+        bmp_row_to_pixels(row, &region_info, img, y - y1);
+    }
+
+    image_dealloc(allocator, row);
+    if (status != IMAGE_OK) free_struct_image(img);
+    return status;
+}
+
+// Reads the headers, masks and palette of a file with pread
+int read_bmp_info_at(int input_fildes, struct bmp_info *info) {
+    uint8_t header[BMP_HEADER_SIZE];
+    int status = read_fully_at(input_fildes, header, sizeof(header), 0);
+    if (status != IMAGE_OK) return status;
+    status = parse_bmp_header(header, info);
+    if (status != IMAGE_OK) return status;
+
+    if (info->compression == BMP_BI_BITFIELDS) {
+        uint8_t masks[12];
+        status = read_fully_at(input_fildes, masks, sizeof(masks), BMP_HEADER_SIZE);
+        if (status != IMAGE_OK) return status;
+        status = check_bmp_masks(masks, info);
+        if (status != IMAGE_OK) return status;
+    }
+
+    if (info->n_of_colours > 0) {
+        status = read_fully_at(input_fildes, info->palette, 4*info->n_of_colours, bmp_palette_offset(info));
+        if (status != IMAGE_OK) return status;
     }
-    if (write(fildes, (char*)&img->height, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    check_bmp_palette(info);
+    return IMAGE_OK;
+}
+
+// Threads for reading or writing a bitmap, n_of_threads or one
+// per CPU for big images if that is 0, but no more than there are rows
+int bmp_io_threads(size_t n_of_pixels, int height, int n_of_threads) {
+    if (n_of_threads < 1) n_of_threads = worker_threads_for_pixels(n_of_pixels);
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+    if (n_of_threads > height) n_of_threads = height;
+    return n_of_threads;
+}
+
+// Cuts whole's rows into n_of_jobs bands, each with its own buffer of up
+// to IO_BLOCK_SIZE. The buffers are allocated here, not on the threads,
+// as allocators don't have to be thread safe
+int split_bmp_rows(struct bmp_rows_job *jobs, int n_of_jobs, const struct bmp_rows_job *whole,
+                   const struct image_allocator *allocator) {
+    int t;
+    for (t = 0; t < n_of_jobs; t++) {
+        jobs[t] = *whole;
+        jobs[t].start = whole->start + (int)((int64_t)(whole->end - whole->start)*t/n_of_jobs);
+        jobs[t].end = whole->start + (int)((int64_t)(whole->end - whole->start)*(t + 1)/n_of_jobs);
+        jobs[t].rows_per_block = IO_BLOCK_SIZE/whole->row_width;
+        if (jobs[t].rows_per_block < 1) jobs[t].rows_per_block = 1;
+        if (jobs[t].rows_per_block > jobs[t].end - jobs[t].start) jobs[t].rows_per_block = jobs[t].end - jobs[t].start;
+        jobs[t].status = IMAGE_OK;
+        jobs[t].errsv = 0;
+        jobs[t].buf = image_alloc(allocator, (size_t)jobs[t].rows_per_block*whole->row_width);
+        if (jobs[t].buf == NULL) {
+            while (t-- > 0) image_dealloc(allocator, jobs[t].buf);
+            return IMAGE_ERR_NO_MEMORY;
+        }
     }
+    return IMAGE_OK;
+}
+
+// Runs the jobs with run_worker_jobs(), then frees the buffers. Returns
+// the first job's error, with errno set as it was on that job's thread
+int run_bmp_rows_jobs(struct bmp_rows_job *jobs, int n_of_jobs, void *(*job_main)(void *),
+                      const struct image_allocator *allocator) {
+    run_worker_jobs(jobs, sizeof(jobs[0]), n_of_jobs, job_main);
+
+    int status = IMAGE_OK;
+    int t;
+    for (t = 0; t < n_of_jobs; t++) {
+        if (status == IMAGE_OK && jobs[t].status != IMAGE_OK) {
+            status = jobs[t].status;
+            errno = jobs[t].errsv;
+        }
+        image_dealloc(allocator, jobs[t].buf);
+    }
+    return status;
+}
+
+// Reads a band of rows a block at a time, so the whole
+// file never has to sit in memory next to the image
+void *read_bmp_rows_main(void *arg) {
+    struct bmp_rows_job *job = arg;
+    int row_index = job->start;
+    while (row_index < job->end && job->status == IMAGE_OK) {
+        int rows_in_block = job->end - row_index < job->rows_per_block ? job->end - row_index : job->rows_per_block;
+        off_t offset = job->offset + (off_t)row_index*job->row_width;
+        job->status = read_fully_at(job->fildes, job->buf, (size_t)rows_in_block*job->row_width, offset);
+        job->errsv = errno;
+
+        int block_row;
+        for (block_row = 0; block_row < rows_in_block && job->status == IMAGE_OK; block_row++, row_index++) {
+            store_bmp_row(job->sink, job->buf + (size_t)block_row*job->row_width, job->info, row_index);
+        }
+    }
+    return NULL;
+}
+
+// Converts and writes a band of rows a block at a time, the
+// file's bottom row first
+void *write_bmp_rows_main(void *arg) {
+    struct bmp_rows_job *job = arg;
+    int row_index = job->start;
+    while (row_index < job->end && job->status == IMAGE_OK) {
+        off_t offset = job->offset == -1 ? -1 : job->offset + (off_t)row_index*job->row_width;
+        int rows_in_block = 0;
+        for (; rows_in_block < job->rows_per_block && row_index < job->end; rows_in_block++, row_index++) {
+            pixels_to_bmp_row(job->img, job->img->height - 1 - row_index, job->bpp,
+                              job->buf + (size_t)rows_in_block*job->row_width);
+        }
+        job->status = write_fully_at(job->fildes, job->buf, (size_t)rows_in_block*job->row_width, offset);
+        job->errsv = errno;
+    }
+    return NULL;
+}
+
+// Reader for files, reads blocks of rows with pread.
+// flip_vertical stores the rows in the opposite order.
+// Rows go straight into the image unless it is being
+// reduced, so then they can be split between threads
+int read_bmp_seekable(int input_fildes, struct image *raw_image, const struct image_allocator *allocator,
+                      const struct bmp_resize_target *target, int flip_vertical, int n_of_threads) {
+    struct bmp_info info;
+    int status = read_bmp_info_at(input_fildes, &info);
+    if (status != IMAGE_OK) return status;
+    info.top_down ^= flip_vertical;
+
+    // The size field at 0x22 is allowed to be 0 for uncompressed
+    // bitmaps, so the layout is worked out from the dimensions
+    struct bmp_row_sink sink;
+    status = init_bmp_row_sink(&sink, raw_image, &info, target, allocator);
+    if (status != IMAGE_OK) return status;
+    if (sink.preview_factor > 1) {
+        status = read_bmp_preview_rows(input_fildes, &info, &sink, allocator);
+        finish_bmp_row_sink(&sink, status);
+        return status;
+    }
+
+    struct bmp_rows_job whole;
+    memset(&whole, 0, sizeof(whole));
+    whole.fildes = input_fildes;
+    whole.offset = info.pixel_array_offset;
+    whole.row_width = bmp_row_width(info.width, info.bpp);
+    whole.start = 0;
+    whole.end = info.height;
+    whole.info = &info;
+    whole.sink = &sink;
+
+    int n_of_jobs = sink.reducing ? 1 : bmp_io_threads((size_t)info.width*info.height, info.height, n_of_threads);
+    struct bmp_rows_job jobs[WORKER_MAX_THREADS];
+    status = split_bmp_rows(jobs, n_of_jobs, &whole, allocator);
+    if (status == IMAGE_OK) {
+        status = run_bmp_rows_jobs(jobs, n_of_jobs, read_bmp_rows_main, allocator);
+    }
+
+    finish_bmp_row_sink(&sink, status);
+    return status;
+}
+
+// Where the pixel data starts in the files written here, after the
+// headers and, for 1bpp and 8bpp, a palette of greys
+uint32_t written_pixel_array_offset(int bpp) {
+    uint32_t n_of_colours = bpp <= 8 ? 1u << bpp : 0;
+    return BMP_HEADER_SIZE + 4*n_of_colours;
+}
+
+int write_bmp_header_to_file(int fildes, struct image *img, int bpp) {
+    // 1bpp and 8bpp have a palette of greys, black to white
+    uint32_t n_of_colours = bpp <= 8 ? 1u << bpp : 0;
+    uint64_t pixel_array_byte_size = (uint64_t)bmp_row_width(img->width, bpp)*img->height;
+
+    // Write BM
+    if (write_fully(fildes, "BM", 2) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // Write file size (unsigned)
+    uint32_t pixel_array_offset = written_pixel_array_offset(bpp);
+    // Files over 4GiB can't hold their size, readers work it out instead
+    uint64_t file_size = pixel_array_offset + pixel_array_byte_size;
+    uint32_t file_size_field = file_size > UINT32_MAX ? 0 : file_size;
+    if (write_fully(fildes, (char*)&file_size_field, 4) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // Write signature
+    if (write_fully(fildes, "NICD", 4) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // Write pixel array offset
+    if (write_fully(fildes, (char*)&pixel_array_offset, 4) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // Write header size
+    uint32_t header_size = 40;
+    if (write_fully(fildes, (char*)&header_size, 4) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // Write dimensions
+    if (write_fully(fildes, (char*)&img->width, 4) != IMAGE_OK) return IMAGE_ERR_IO;
+    if (write_fully(fildes, (char*)&img->height, 4) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // Number of colour planes
     uint16_t n_of_colour_planes = 1;
-    if (write(fildes, (char*)&n_of_colour_planes, 2) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    if (write_fully(fildes, (char*)&n_of_colour_planes, 2) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // bpp
-    uint16_t bpp = 24;
-    if (write(fildes, (char*)&bpp, 2) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    uint16_t bits_per_pixel = bpp;
+    if (write_fully(fildes, (char*)&bits_per_pixel, 2) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // compression method
-    if (write(fildes, "\0\0\0\0", 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    if (write_fully(fildes, "\0\0\0\0", 4) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // raw bitmap data size
-    if (write(fildes, (char*)&img->pixel_array_byte_size, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    // 0 is allowed for uncompressed bitmaps, used when it won't fit
+    uint32_t pixel_array_byte_size_field = pixel_array_byte_size > UINT32_MAX ? 0 : pixel_array_byte_size;
+    if (write_fully(fildes, (char*)&pixel_array_byte_size_field, 4) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // image resolution (signed)
     int32_t img_res = 2880;
-    if (write(fildes, (char*)&img_res, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
-    if (write(fildes, (char*)&img_res, 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    if (write_fully(fildes, (char*)&img_res, 4) != IMAGE_OK) return IMAGE_ERR_IO;
+    if (write_fully(fildes, (char*)&img_res, 4) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // colours in palette
-    if (write(fildes, "\0\0\0\0", 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
-    }
+    if (write_fully(fildes, (char*)&n_of_colours, 4) != IMAGE_OK) return IMAGE_ERR_IO;
 
     // import colours in palette
-    if (write(fildes, "\0\0\0\0", 4) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    if (write_fully(fildes, "\0\0\0\0", 4) != IMAGE_OK) return IMAGE_ERR_IO;
+
+    // palette, blue, green, red, reserved
+    if (n_of_colours > 0) {
+        uint8_t palette[256*4];
+        uint32_t i;
+        for (i = 0; i < n_of_colours; i++) {
+            uint8_t grey = i*255/(n_of_colours - 1);
+            palette[4*i] = grey;
+            palette[4*i + 1] = grey;
+            palette[4*i + 2] = grey;
+            palette[4*i + 3] = 0;
+        }
+        if (write_fully(fildes, palette, 4*n_of_colours) != IMAGE_OK) return IMAGE_ERR_IO;
     }
+    return IMAGE_OK;
 }
 
-void write_pixel_array_to_bmp(int fildes, struct image *img)  {
+int write_pixel_array_to_bmp(int fildes, struct image *img, int bpp)  {
+    return write_pixel_array_to_bmp_threads(fildes, img, bpp, 0);
+}
 
-    // Write row by row
-    int row_width = (int)(floor((24.0*((double)img->width) + 31.0)/32.0)*4.0);
-    int bytes_to_pad = row_width - img->width*3;
-    int row_index;
-    int col_index;
-    int offset = 0x0;
-    int pad_index;
-    int byte_index;
-    int pixel_index;
+// Writes the pixel data a block of rows at a time, bottom row first,
+// so only the blocks are buffered and pipes get data as soon as possible.
+// Files are written from the current position on n_of_threads threads,
+// 0 for one per CPU for big images, each with pwrite at its rows' offset.
+// Pipes, and files opened to append, are written in order on this one
+int write_pixel_array_to_bmp_threads(int fildes, struct image *img, int bpp, int n_of_threads) {
+    struct bmp_rows_job whole;
+    memset(&whole, 0, sizeof(whole));
+    whole.fildes = fildes;
+    whole.offset = -1;
+    whole.row_width = bmp_row_width(img->width, bpp);
+    whole.start = 0;
+    whole.end = img->height;
+    whole.img = img;
+    whole.bpp = bpp;
 
-    uint8_t *img_buf = malloc(img->pixel_array_byte_size + img->height*bytes_to_pad);
+    int n_of_jobs = bmp_io_threads(img->n_of_pixels, img->height, n_of_threads);
+    int flags = fcntl(fildes, F_GETFL);
+    if (n_of_jobs > 1 && flags != -1 && !(flags & O_APPEND)) {
+        whole.offset = lseek(fildes, 0, SEEK_CUR);
+    }
+    if (whole.offset == -1) n_of_jobs = 1;
 
-    if (img_buf == NULL) {
-        int errsv = errno;
-        error(1, errsv, "Failed to allocate memory for the image");
+    struct bmp_rows_job jobs[WORKER_MAX_THREADS];
+    int status = split_bmp_rows(jobs, n_of_jobs, &whole, img->allocator);
+    if (status != IMAGE_OK) return status;
+    status = run_bmp_rows_jobs(jobs, n_of_jobs, write_bmp_rows_main, img->allocator);
+
+    // pwrite leaves the position alone, move it past the pixel data
+    // so anything written after lands in the right place
+    if (status == IMAGE_OK && whole.offset != -1
+            && lseek(fildes, whole.offset + (off_t)whole.row_width*img->height, SEEK_SET) == -1) {
+        return IMAGE_ERR_IO;
     }
+    return status;
+}
 
-    // Write each row starting at the back of the pixel array but the front of img_buf
-    for (row_index = 0; row_index < img->height; row_index++) {
-        for (col_index = 0; col_index < img->width; col_index++) {
-            // Write blue then green then red
-            byte_index = row_index*img->width*3 + col_index*3 + offset;
-            pixel_index = img->n_of_pixels - (row_index*img->width + col_index) - 1;
+// Writes the headers of a width x height bitmap and makes the file its
+// full size, padding zeroed, so the pixels can be filled in a region
+// at a time in any order with struct_image_region_to_bmp()
+int write_bmp_header_for_regions(int fildes, int width, int height, int bpp) {
+    if (bpp != BMP_DEPTH_1 && bpp != BMP_DEPTH_8 && bpp != BMP_DEPTH_24) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    struct image size_only;
+    memset(&size_only, 0, sizeof(size_only));
+    size_only.width = width;
+    size_only.height = height;
 
-            img_buf[byte_index] = img->pixel_array[pixel_index].Blue;
-            img_buf[byte_index + 1] = img->pixel_array[pixel_index].Green;
-            img_buf[byte_index + 2] = img->pixel_array[pixel_index].Red;
-        }
+    // The rows are written at offsets from the start of the file
+    if (lseek(fildes, 0, SEEK_SET) == -1) return IMAGE_ERR_IO;
+    int status = write_bmp_header_to_file(fildes, &size_only, bpp);
+    if (status != IMAGE_OK) return status;
 
-        // Add padding
-        for (pad_index = 0; pad_index < bytes_to_pad; pad_index++) {
-            img_buf[row_index*img->width*3 + col_index*3 + offset + pad_index] = 0;
-        }
+    off_t file_size = written_pixel_array_offset(bpp) + (off_t)bmp_row_width(width, bpp)*height;
+    if (ftruncate(fildes, file_size) == -1) return IMAGE_ERR_IO;
+    return IMAGE_OK;
+}
 
-        // Add offset
-        offset += bytes_to_pad;
+// Writes img into a width x height file from write_bmp_header_for_regions()
+// with its top left pixel at (x, y). At 1bpp x has to be a multiple of 8,
+// and so does img's width unless it reaches the right edge
+int struct_image_region_to_bmp(int fildes, struct image *img, int x, int y, int width, int height, int bpp) {
+    if (bpp != BMP_DEPTH_1 && bpp != BMP_DEPTH_8 && bpp != BMP_DEPTH_24) {
+        return IMAGE_ERR_ARGUMENT;
     }
+    if (x < 0 || y < 0 || x + img->width > width || y + img->height > height) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+    if ((size_t)x*bpp % 8 != 0 || (x + img->width < width && (size_t)img->width*bpp % 8 != 0)) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    size_t row_width = bmp_row_width(width, bpp);
+    size_t region_row_bytes = ((size_t)img->width*bpp + 7)/8;
+    uint8_t *row = image_alloc(img->allocator, bmp_row_width(img->width, bpp));
+    if (row == NULL) return IMAGE_ERR_NO_MEMORY;
 
-    // Write the buffer to the file
-    if (write(fildes, img_buf, img->pixel_array_byte_size) == -1) {
-        int errsv = errno;
-        error(1, errsv, "Failed write");
+    int status = IMAGE_OK;
+    int region_y;
+    for (region_y = 0; region_y < img->height && status == IMAGE_OK; region_y++) {
+        // Rows are stored bottom up
+        int row_index = height - 1 - (y + region_y);
+        off_t offset = written_pixel_array_offset(bpp) + (off_t)row_index*row_width + (size_t)x*bpp/8;
+        pixels_to_bmp_row(img, region_y, bpp, row);
+        status = write_fully_at(fildes, row, region_row_bytes, offset);
     }
 
-    // Free the memory
-    if (img_buf) free(img_buf);
+    image_dealloc(img->allocator, row);
+    return status;
 }
@@ -3,7 +3,7 @@
  * u5350448
  *
  * Declarations of functions for dealing
- * with 24bpp bitmap files and structures
+ * with bitmap files and structures
  * defined in image_data_types.h
  */
 
@@ -12,13 +12,39 @@
 
 #include "image_data_types.h"
 
-void bmp_to_struct_image(int input_fildes, struct image *img);
-void struct_image_to_bmp(int output_fildes, struct image *img);
+// Output bits per pixel, BMP_DEPTH_AUTO picks the smallest
+// that holds the image exactly
+enum bmp_depth {
+    BMP_DEPTH_AUTO = 0,
+    BMP_DEPTH_1 = 1,
+    BMP_DEPTH_8 = 8,
+    BMP_DEPTH_24 = 24
+};
 
-void get_dimensions_from_bmp(int *width, int *height, int input_fildes);
-void get_pixel_array_from_bmp_malloc(struct image *raw_image, int input_fildes);
+int bmp_to_struct_image(int input_fildes, struct image *img, const struct image_allocator *allocator);
+int bmp_to_struct_image_flipped(int input_fildes, struct image *img, const struct image_allocator *allocator);
+int bmp_to_struct_image_threads(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                int n_of_threads);
+int bmp_to_struct_image_preview(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                int factor);
+int bmp_stream_to_struct_image(int input_fildes, struct image *img, const struct image_allocator *allocator);
+int bmp_to_struct_image_for_resize(int input_fildes, struct image *img, const struct image_allocator *allocator,
+                                   int *new_width, int *new_height, int method);
+int struct_image_to_bmp(int output_fildes, struct image *img);
+int struct_image_to_bmp_depth(int output_fildes, struct image *img, int bpp);
+int struct_image_to_bmp_depth_threads(int output_fildes, struct image *img, int bpp, int n_of_threads);
+int bmp_depth_for_image(struct image *img);
 
-void write_bmp_header_to_file(int fildes, struct image *img);
-void write_pixel_array_to_bmp(int fildes, struct image *img);
+int get_dimensions_from_bmp(int *width, int *height, int input_fildes);
+int get_pixel_array_from_bmp_malloc(struct image *raw_image, int input_fildes);
+int get_layout_from_bmp(int *width, int *height, int *channels, int input_fildes);
+int bmp_region_to_struct_image(int input_fildes, int x1, int y1, int x2, int y2, struct image *img,
+                               const struct image_allocator *allocator);
+
+int write_bmp_header_to_file(int fildes, struct image *img, int bpp);
+int write_pixel_array_to_bmp(int fildes, struct image *img, int bpp);
+int write_pixel_array_to_bmp_threads(int fildes, struct image *img, int bpp, int n_of_threads);
+int write_bmp_header_for_regions(int fildes, int width, int height, int bpp);
+int struct_image_region_to_bmp(int fildes, struct image *img, int x, int y, int width, int height, int bpp);
 
 #endif
@@ -14,23 +14,34 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <error.h>
-#include "bmp_struct_image.h"
-#include "filters.h"
+#include <time.h>
+#include <sys/resource.h>
+#include "libbmpedit.h"
+#include "filter_chain.h"
+#include "server.h"
+#include "batch.h"
 
 // Misc helpful functions
 
 void print_usage();
-int str_is_digit_and_radix_point(char *str);
-
-int str_is_digit_and_radix_point(char *str) {
-    int str_len = strlen(str);
-    int i;
-    for (i = 0; i < str_len; i++) {
-        if (isdigit(str[i]) || str[i] == '.') continue;
-        else return 0;
+void exit_on_error(int status, char *message);
+double seconds_since(const struct timespec *start);
+
+// Library functions return a status instead of exiting,
+// this turns a failure into an error message and exit
+void exit_on_error(int status, char *message) {
+    if (status == IMAGE_OK) return;
+    if (status == IMAGE_ERR_IO) {
+        int errsv = errno;
+        error(1, errsv, "%s", message);
     }
+    error(1, 0, "%s: %s", message, image_status_string(status));
+}
 
-    return 1;
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
 }
 
 void print_usage() {
@@ -44,301 +55,180 @@ DESCRIPTION:\n\
 \n\
 OPTIONS:\n\
   -o FILE        Sets the output file for modified images (default output file is \"out.bmp\").\n\
+                 \"-\" writes the image to stdout, and an input file of \"-\" reads stdin,\n\
+                 so bmpedit can sit in a pipeline.\n\
+  -d DEPTH       Bits per pixel of the output file, 24 (default), 8 for 256 greys or 1 for\n\
+                 black and white. \"auto\" picks the smallest that loses nothing, so greyscale\n\
+                 images are written at 8bpp and thresholded ones at 1bpp.\n\
   -t 0.0-1.0     Apply a threshold filter to the image with a threshold the threshold value given.\n\
+                 \"-t auto\" picks the threshold from the image's histogram with Otsu's method.\n\
+  -a METHOD,RADIUS[,K]\n\
+                 Adaptive threshold: each pixel is compared with the (2*RADIUS+1) square\n\
+                 around it, for unevenly lit scans. METHOD is bradley (black below (1-K)\n\
+                 times the local mean, K defaults to 0.15) or sauvola (uses the local\n\
+                 standard deviation too, K defaults to 0.34).\n\
+  -x OPERATION,WxH\n\
+                 Morphology with a W by H rectangle, or N by N for OPERATION,N. OPERATION\n\
+                 is erode (darkest under the rectangle), dilate (lightest), open (erode\n\
+                 then dilate, removes small white specks) or close (dilate then erode,\n\
+                 fills small black holes). Runs after -t and -a to clean up the result,\n\
+                 and takes the same time whatever the size\n\
   -i             Invert the image colours\n\
   -b 0.0-1.0     Blends two images together according to the blend coefficient, requires input2.bmp\n\
                  0.0 gives image 1 and 1.0 gives image 2\n\
                  Usage: bmpedit -b 0.0-1.0 [OPTIONS...] input1.bmp input2.bmp\n\
   -c x1,y1,x2,y2 Crop: Crops the image from (x1,y1) inclusive to (x2,y2) exclusive, x1 < x2, y1 < y2\n\
+  -r WxH[,METHOD] Resize: Scales the image to W by H pixels after every other filter. A W or H\n\
+                 of 0 keeps the aspect ratio. METHOD is area, bilinear, lanczos or auto (default),\n\
+                 which averages whole blocks of pixels then finishes with lanczos. Run on its\n\
+                 own, the averaging is done while the input is read so big images fit in memory\n\
   -B 0.0-2.0     Brightness: Changes overall brightness of each pixel by 100*(argument-1)%% while keeping\n\
                  colours in the same proportion\n\
                  1.0 is no change, 0.0 is -100%%, 2.0 is +100%%\n\
   -e             Emboss: Applies an emboss effect, consider using with -g\n\
   -s 0.0-20.0    Sharpen: Makes the image appear sharper by various degrees\n\
                  16.0 is a reasonable value\n\
-  -g             Greyscale: Converts the image to greyscale (still RGB though)\n\
+  -g             Greyscale: Converts the image to greyscale, filters after it work on a single\n\
+                 channel. Use with -d 8 or -d auto for an 8bpp output file\n\
   -G repeat,sd   Gaussian blur: A slow gaussian blur, repeat is the number of times it will run,\n\
                  sd is the standard deviation used to generate the values for the blur.\n\
                  In general, the higher the sd, the blurrier, but more repeats are\n\
                  needed for a substantial effect\n\
+  -k FILE        Kernel: Convolves the image with the kernel in FILE, rows of numbers one\n\
+                 row per line, both sizes odd. It is scaled to add up to 1 unless it adds\n\
+                 up to 0. Big kernels are done with FFTs so cost little more than small ones\n\
+  -m RADIUS      Box mean: Replaces each pixel with the mean of the (2*RADIUS+1) square\n\
+                 around it. Takes the same time whatever the radius\n\
+  --bilateral SPATIAL,RANGE\n\
+                 Bilateral filter: smooths like -G with sd SPATIAL, but pixels whose\n\
+                 brightness is many RANGE sds (0-255 scale) away count for less, so edges\n\
+                 stay sharp. Runs after -m. A SPATIAL over 1 uses a coarse bilateral grid,\n\
+                 whose time and memory grow as SPATIAL and RANGE shrink, RANGE no further\n\
+                 than 1\n\
+  -M RADIUS      Median: Replaces each pixel with the median of the (2*RADIUS+1) square\n\
+                 around it, which removes salt and pepper noise. Runs after -g and\n\
+                 before -S, and takes the same time whatever the radius\n\
   -S             Sobel edge detection: A form of edge detection, try with -g\n\
-  -h             Displays this usage message.\n");
+  -h             Displays this usage message.\n\
+  --white-balance auto|R,G,B\n\
+                 Multiplies red, green and blue by the gains given (0.0-8.0), or with auto\n\
+                 by the gains that make the average of each channel the same\n\
+  --saturation 0.0-8.0\n\
+                 Moves colours away from grey by this much, 0.0 is grey and 1.0 is no change\n\
+  --sepia        Sepia tone, brown like an old photograph\n\
+  --swap ORDER   Takes the new red, green and blue from the channels in ORDER, three of\n\
+                 r, g and b, so bgr swaps red and blue\n\
+                 These, -B, -g and -i run in that order and are folded into one pass when\n\
+                 nothing comes between them, values are only rounded and clipped at the end\n\
+  --rotate 90|180|270\n\
+                 Turns the image clockwise by that many degrees\n\
+  --flip h|v     Mirrors the image left to right (h) or top to bottom (v)\n\
+  --transpose    Swaps rows and columns, mirroring the image in its top left to bottom\n\
+                 right diagonal\n\
+                 These add up in the order given and run straight after -b, so the\n\
+                 other filters see the page the right way up\n\
+  --histogram FILE\n\
+                 Writes the input's luminance, red, green and blue histograms to FILE\n\
+                 as CSV, \"-\" for stdout.\n\
+\n\
+CACHE:\n\
+  --cache DIR    Keep results in DIR, named after a hash of the input file and the options.\n\
+                 Running the same options on the same file again copies the saved output\n\
+                 without decoding anything, and options that start the same way (the same\n\
+                 -G, different -t) pick up the image after the last expensive filter they\n\
+                 share. Needs an input file, not stdin, and is skipped with --histogram.\n\
+                 Nothing is ever removed from DIR\n\
+\n\
+BATCHES:\n\
+  --batch DIR    Runs the options over every input file, writing each to DIR with its own\n\
+                 name, instead of one input to -o. Files are read, filtered and written at\n\
+                 the same time, --threads images are filtered at once (default one per CPU).\n\
+                 A file that fails is reported and the rest carry on. Two inputs can't have\n\
+                 the same name. Can't be used with -b, --pyramid, --histogram, --cache,\n\
+                 --max-memory or --stats\n\
+\n\
+MEMORY:\n\
+  --max-memory SIZE\n\
+                 Keep the memory used under about SIZE bytes (K, M or G on the end for\n\
+                 KiB, MiB or GiB). If the whole image won't fit it is filtered in strips,\n\
+                 or tiles if even a strip won't fit, with the same output. Not possible\n\
+                 with -r, -t auto, --white-balance auto, --rotate 90 or 270, --transpose,\n\
+                 --bilateral with a SPATIAL over 1, --histogram, --pyramid or --cache,\n\
+                 which need the whole image at once. -r on its own shrinks the image as\n\
+                 it is read, so only needs room for that.\n\
+  --stats        Prints the plan for the image, the estimated and the peak memory used\n\
+                 and the time taken.\n\
+\n\
+PREVIEWS:\n\
+  --preview N    Runs the options on a 1/N size copy of the input for trying out values.\n\
+                 Only every Nth row is read, averaged N pixels at a time, and the blur,\n\
+                 window, crop and resize sizes are divided by N to match. Kernel files\n\
+                 aren't scaled. Can't be used with --cache or --max-memory\n\
+\n\
+PYRAMIDS:\n\
+  --pyramid[=N]  Also writes the output at 1/2, 1/4, 1/8, ... size, down to 1x1 or N levels,\n\
+                 as OUT-1.bmp, OUT-2.bmp, ... for an output file of OUT.bmp.\n\
+  --tile-size N  Cut every level, the full size one too, into N by N tiles\n\
+                 named OUT-level-column-row.bmp.\n\
+\n\
+SERVER MODE:\n\
+  --serve SOCKET Keep running and take requests on the UNIX domain socket SOCKET.\n\
+                 Each request is one line holding a bmpedit command line without\n\
+                 \"bmpedit\", e.g. \"-g -S -o out.bmp in.bmp\", and gets an \"OK\" or\n\
+                 \"ERR message\" line back. An input of \"-\" reads the file descriptor\n\
+                 sent with the request.\n\
+  --threads N    Number of requests to handle at once (default one per CPU), also used\n\
+                 by --batch. Each request's filters run on one Nth of the CPUs, or one\n\
+                 thread.\n");
 }
 
 
 int main (int argc, char* argv[]) {
 
-    // Initialise stuff
-
-    char *output_file_name;
-    output_file_name = "out.bmp";
-
-    char *input_file_name;
-    char *input_2_file_name;
-
-    // Will be the file descriptor for the BMP file
-    int input_file;
-    int input_2_file;
-    int output_file;
-
-    // Options
-    int threshold_is_set = 0;
-    double threshold_value = 0.0;
-
-    int blend_is_set = 0;
-    double blend_value = 0.0;
-
-    int invert_is_set = 0;
-
-    int crop_is_set = 0;
-    char *crop_arg = '\0';
-
-    int brightness_is_set = 0;
-    double brightness_value = 0.0;
-
-    int emboss_is_set = 0;
-
-    int greyscale_is_set = 0;
-
-    int sharpen_is_set = 0;
-    double sharpen_value = 0.0;
-
-    int sobel_is_set = 0;
-
-    int gaussian_is_set = 0;
-    char *gaussian_arg = '\0';
-
     // Handle command line arguments
-    // Based off of http://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html#Example-of-Getopt
-
-    int option;
-    while ((option = getopt (argc, argv, "G:Sgs:eH:B:c:b:iht:o:")) != -1) {
-        switch(option) {
-            case 'h':
-                print_usage();
-                break;
-            case 'o':
-                output_file_name = optarg;
-                break;
-            case 't':
-                threshold_is_set = 1;
-                if (!str_is_digit_and_radix_point(optarg)) {
-                    error(1, 0, "A number is required for the threshold");
-                }
-                threshold_value = atof(optarg);
-                break;
-            case 'b':
-                blend_is_set = 1;
-                if (!str_is_digit_and_radix_point(optarg)) {
-                    error(1, 0, "A number is required for the blend coefficient");
-                }
-                blend_value = atof(optarg);
-                break;
-            case 'e':
-                emboss_is_set = 1;
-                break;
-            case 'g':
-                greyscale_is_set = 1;
-                break;
-            case 'S':
-                sobel_is_set = 1;
-                break;
-            case 's':
-                sharpen_is_set = 1;
-                if (!str_is_digit_and_radix_point(optarg)) {
-                    error(1, 0, "A number is required for sharpen");
-                }
-                sharpen_value = atof(optarg);
-                break;
-            case 'B':
-                brightness_is_set = 1;
-                if (!str_is_digit_and_radix_point(optarg)) {
-                    error(1, 0, "A number is required for the brightness");
-                }
-                brightness_value = atof(optarg);
-                break;
-            case 'i':
-                invert_is_set = 1;
-                break;
-            case 'c':
-                crop_is_set = 1;
-                crop_arg = optarg;
-                break;
-            case 'G':
-                gaussian_is_set = 1;
-                gaussian_arg = optarg;
-                break;
-            case '?':
-                if (optopt == 'o' || optopt == 't') {
-                    fprintf (stderr, "-%c requires an argument", optopt);
-                } else if (isprint(optopt)) {
-                    fprintf(stderr, "Unknown option -%c.\n", optopt);
-                } else {
-                    fprintf(stderr, "Unknown option character \\x%x\n", optopt);
-                }
-
-                return 1;
-                break;
-            default:;
-        }
-    }
-
-    // Grab the input file name
-
-    // Check optind arg exists
-    if (optind >= argc) {
-        error(1, 0, "An input file is required, or you are missing an argument.\nTry bmpedit -h for help");
-    }
-
-    input_file_name = argv[optind];
-
-    // Open the file
-    input_file = open(input_file_name, O_RDONLY);
-
-    if (input_file == -1) {
-        int errsv = errno;
-        error(1, errsv, "Error opening input file");
-    }
-
-    // Grab bitmap data and put into struct image
-    struct image raw_image;
-    bmp_to_struct_image(input_file, &raw_image);
-
-    // Print width and height
-    printf("Image width: %dpx\n", raw_image.width);
-    printf("Image height: %dpx\n", raw_image.height);
-
-
-    // Apply the filters
-
-    // Blend
-    if (blend_is_set) {
-
-        if (blend_value > 1.0 || blend_value < 0.0) {
-            error(1, 0, "Blend value must be between 0.0 and 1.0");
-        }
-
-        printf("Blending images...\n");
-
-        // Check the right number of arguments exist
-        if (optind+1 >= argc) {
-            error(1, 0, "Two input files and a blend coefficient are required for\
- blend.\nTry bmpedit -h for help.");
-        }
-            
-        input_2_file_name = argv[optind+1];
-        input_2_file = open(input_2_file_name, O_RDONLY);
-
-        if (input_2_file == -1) {
-            int errsv = errno;
-            error(1, errsv, "Error opening second input file");
-        }
-
-        struct image image_2;
-        bmp_to_struct_image(input_2_file, &image_2);
-
-        // Will it blend?
-        if (blend_two_images(blend_value, &raw_image, &image_2) == -1) {
-            error(1, 0, "Two input images need same dimensions");
-        }
+    struct filter_chain chain;
+    char message[512];
+    if (parse_filter_chain(argc, argv, &chain, message, sizeof(message)) != IMAGE_OK) {
+        error(1, 0, "%s", message);
     }
 
-    // Gaussian blur
-    if (gaussian_is_set) {
-        int repeat;
-        double standard_deviation;
-        parse_gaussian_arg(&repeat, &standard_deviation, gaussian_arg);
-        if (repeat < 0) {
-            error(1, 0, "Must repeat gaussian blur 1 or more times");
-        }
-        printf("Applying gaussian blur...\n");
-        gaussian_blur(repeat, standard_deviation, &raw_image);
+    if (chain.help_is_set) {
+        print_usage();
     }
 
-    // Brightness
-    if (brightness_is_set) {
-        if (brightness_value < 0.0 || brightness_value > 2.0) {
-            error(1, 0, "Brightness value must be between 0.0 and 2.0");
-        }
-        printf("Changing brightness of image...\n");
-        brightness_image(brightness_value-1.0, &raw_image);
+    // Server mode, requests come in over the socket instead
+    if (chain.serve_socket_path != NULL) {
+        exit_on_error(serve_filter_chains(chain.serve_socket_path, chain.n_of_threads), "Server failed");
+        return 0;
     }
 
-    // Greyscale
-    if (greyscale_is_set) {
-        printf("Converting the image to greyscale (RGB)\n");
-        greyscale_image(&raw_image);
-    }
-
-    // Sobel
-    if (sobel_is_set) {
-        printf("Applying sobel edge detection...\n");
-        sobel_edge_detect_image(&raw_image);
-    }
-
-    // Invert
-    if (invert_is_set) {
-        printf("Inverting image...\n");
-        invert_image(&raw_image);
-    }
-
-    // Threshold
-    if (threshold_is_set) {
-        if (threshold_value > 1.0 || threshold_value < 0.0) {
-            error(1, 0, "Threshold must be between 0.0 and 1.0");
+    // Batch mode, every input is filtered into the batch directory
+    if (chain.batch_dir != NULL) {
+        if (run_filter_chain_batch(&chain, chain.n_of_threads, stdout, message, sizeof(message)) != IMAGE_OK) {
+            error(1, 0, "%s", message);
         }
-        printf("Running threshold filter...\n");
-        threshold_image(threshold_value, &raw_image);
+        return 0;
     }
 
-    // Emboss
-    if (emboss_is_set) {
-        printf("Embossing image...\n");
-        emboss_image(&raw_image);
+    // Read the input, apply the filters and write the output.
+    // Progress goes to stderr when the image or the histogram is
+    // going to stdout
+    int stdout_is_data = strcmp(chain.output_file_name, "-") == 0
+        || (chain.histogram_file_name != NULL && strcmp(chain.histogram_file_name, "-") == 0);
+    FILE *log = stdout_is_data ? stderr : stdout;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (run_filter_chain(&chain, -1, NULL, log, message, sizeof(message)) != IMAGE_OK) {
+        error(1, 0, "%s", message);
     }
 
-    // Sharpen
-    if (sharpen_is_set) {
-        if (sharpen_value < 0.0 || sharpen_value > 20.0) {
-            error(1, 0, "Sharpen value must be between 0.0 and 20.0");
-        }
-        printf("Sharpening image...\n");
-        // Magic numbers that make sharpen work
-        sharpen_image(8.01 + (20-sharpen_value), &raw_image);
+    // ru_maxrss is in KiB on Linux
+    if (chain.stats_is_set) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(log, "Peak memory: %.1f MiB\n", usage.ru_maxrss/1024.0);
+        fprintf(log, "Time: %.3f s\n", seconds_since(&start));
     }
 
-    // Crop
-    if (crop_is_set) {
-        // parse the argument
-        int x1,y1,x2,y2;
-        parse_crop_arg(&x1,&y1,&x2,&y2,crop_arg);
-        
-        if (x1 >= x2 || y1 >= y2) {
-            error(1, 0, "Crop needs sensible values\nTry bmpedit -h for help");
-        }
-
-        printf("Cropping image...\n");
-        crop_image(x1, y1, x2, y2, &raw_image);
-        printf("New image width %dpx\n", raw_image.width);
-        printf("New image height: %dpx\n", raw_image.height);
-    }
-
-    // Write modified image to output file
-    output_file = open(output_file_name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
-    if (output_file == -1) {
-        int errsv = errno;
-        error(1, errsv, "Error opening output file");
-    }
-
-    struct_image_to_bmp(output_file, &raw_image);
-
-    // Free stuff
-    free(raw_image.pixel_array);
-
-    // Close stuff
-
-    close(input_file);
-    close(output_file);
-
     return 0;
 }
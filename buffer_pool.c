@@ -0,0 +1,83 @@
+/* buffer_pool.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * The buffer pool, an image_allocator
+ * that keeps freed buffers for reuse
+ *
+ */
+
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+// Each block starts with its capacity, padded so the
+// memory handed out stays 64 byte (cache line) aligned
+#define BLOCK_HEADER_SIZE 64
+#define BLOCK_GRANULARITY 4096
+
+void *buffer_pool_alloc(size_t size, void *context);
+void buffer_pool_free(void *ptr, void *context);
+
+static size_t block_capacity(void *block) {
+    return *(size_t *)block;
+}
+
+void *buffer_pool_alloc(size_t size, void *context) {
+    struct buffer_pool *pool = context;
+
+    // Best fit from the cache, but don't give a huge buffer to a small request
+    int best = -1;
+    int i;
+    for (i = 0; i < pool->n_of_blocks; i++) {
+        size_t capacity = block_capacity(pool->blocks[i]);
+        if (capacity >= size && capacity/2 <= size + BLOCK_GRANULARITY) {
+            if (best == -1 || capacity < block_capacity(pool->blocks[best])) best = i;
+        }
+    }
+
+    if (best != -1) {
+        void *block = pool->blocks[best];
+        pool->blocks[best] = pool->blocks[--pool->n_of_blocks];
+        pool->cached_bytes -= block_capacity(block);
+        return (char *)block + BLOCK_HEADER_SIZE;
+    }
+
+    size_t capacity = (size + BLOCK_GRANULARITY - 1)/BLOCK_GRANULARITY*BLOCK_GRANULARITY;
+    void *block;
+    if (posix_memalign(&block, BLOCK_HEADER_SIZE, capacity + BLOCK_HEADER_SIZE) != 0) {
+        return NULL;
+    }
+    *(size_t *)block = capacity;
+    return (char *)block + BLOCK_HEADER_SIZE;
+}
+
+void buffer_pool_free(void *ptr, void *context) {
+    struct buffer_pool *pool = context;
+    void *block = (char *)ptr - BLOCK_HEADER_SIZE;
+    size_t capacity = block_capacity(block);
+
+    if (pool->n_of_blocks < BUFFER_POOL_MAX_BLOCKS && pool->cached_bytes + capacity <= pool->max_cached_bytes) {
+        pool->blocks[pool->n_of_blocks++] = block;
+        pool->cached_bytes += capacity;
+    } else {
+        free(block);
+    }
+}
+
+void buffer_pool_init(struct buffer_pool *pool, size_t max_cached_bytes) {
+    pool->n_of_blocks = 0;
+    pool->cached_bytes = 0;
+    pool->max_cached_bytes = max_cached_bytes;
+    pool->allocator.alloc = buffer_pool_alloc;
+    pool->allocator.free = buffer_pool_free;
+    pool->allocator.context = pool;
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool) {
+    int i;
+    for (i = 0; i < pool->n_of_blocks; i++) {
+        free(pool->blocks[i]);
+    }
+    pool->n_of_blocks = 0;
+    pool->cached_bytes = 0;
+}
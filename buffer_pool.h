@@ -0,0 +1,32 @@
+/* buffer_pool.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the buffer pool, an image_allocator
+ * that keeps freed buffers for reuse
+ *
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "image_data_types.h"
+
+#define BUFFER_POOL_MAX_BLOCKS 32
+
+// Freed buffers are kept (up to max_cached_bytes) and handed back out
+// to later allocations that fit, so a long running process doesn't
+// return memory to the kernel only to page fault it back in.
+// A pool isn't thread safe, give each thread its own
+struct buffer_pool {
+    void *blocks[BUFFER_POOL_MAX_BLOCKS];
+    int n_of_blocks;
+    size_t cached_bytes;
+    size_t max_cached_bytes;
+    struct image_allocator allocator;
+};
+
+void buffer_pool_init(struct buffer_pool *pool, size_t max_cached_bytes);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+#endif
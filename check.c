@@ -0,0 +1,2808 @@
+/* check.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Golden-output correctness harness. Every filter in
+ * filters.c and the bitmap codec are run on randomised
+ * images through a frozen scalar reference implementation
+ * and through every variant registered in the tables below,
+ * and the results are compared bit-exactly or within the
+ * variant's stated tolerance
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include "libbmpedit.h"
+#include "filter_chain.h"
+#include "result_cache.h"
+#include "batch.h"
+#include "memory_plan.h"
+
+// Odd sizes, 1 pixel edges and every row padding case
+static const int fixed_sizes[][2] = {
+    {1, 1}, {1, 9}, {9, 1}, {2, 2}, {3, 5}, {5, 3}, {4, 4},
+    {5, 5}, {6, 2}, {7, 11}, {13, 7}, {16, 9}, {33, 17}
+};
+#define N_OF_FIXED_SIZES (int)(sizeof(fixed_sizes)/sizeof(fixed_sizes[0]))
+#define N_OF_RANDOM_SIZES 12
+#define MAX_RANDOM_SIDE 70
+
+struct check_result {
+    int cases;
+    int max_diff;
+    double min_psnr;
+};
+
+static uint32_t rng_state = 0x12345678;
+static int failures = 0;
+
+uint32_t check_random();
+void make_random_image(int width, int height, int kind, struct image *img);
+void copy_image(struct image *dst, const struct image *src);
+struct pixel *ref_pixel(int x, int y, const struct image *img);
+struct pixel sample_pixel(int x, int y, const struct image *img);
+void compare_images(const struct image *expected, const struct image *actual, struct check_result *result);
+void report(const char *filter_name, const char *variant_name, int tolerance, struct check_result *result);
+
+uint32_t check_random() {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+// kind 0 is uniform noise, 1 is grey noise, 2 is black and white,
+// 3 is a smooth gradient (long runs of near-equal values)
+void make_random_image(int width, int height, int kind, struct image *img) {
+    if (init_struct_image(img, width, height, NULL) != IMAGE_OK) {
+        error(1, 0, "Couldn't allocate memory for test image");
+    }
+
+    size_t i;
+    for (i = 0; i < img->n_of_pixels; i++) {
+        uint32_t r = check_random();
+        struct pixel *pix = &img->pixel_array[i];
+        switch (kind) {
+            case 1:
+                pix->Red = pix->Green = pix->Blue = r & 0xFF;
+                break;
+            case 2:
+                pix->Red = pix->Green = pix->Blue = (r & 1) ? 0xFF : 0x0;
+                break;
+            case 3:
+                pix->Red = (i*7/(img->n_of_pixels)) + (r & 3);
+                pix->Green = (i*255/(img->n_of_pixels));
+                pix->Blue = 128 + (r & 7);
+                break;
+            default:
+                pix->Red = r & 0xFF;
+                pix->Green = (r >> 8) & 0xFF;
+                pix->Blue = (r >> 16) & 0xFF;
+        }
+    }
+}
+
+void copy_image(struct image *dst, const struct image *src) {
+    if (copy_struct_image(dst, src) != IMAGE_OK) {
+        error(1, 0, "Couldn't allocate memory for image copy");
+    }
+}
+
+// Coordinates are clamped to the image, like get_nearest_pixel()
+struct pixel *ref_pixel(int x, int y, const struct image *img) {
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x > img->width - 1) x = img->width - 1;
+    if (y > img->height - 1) y = img->height - 1;
+    return get_pixel_pointer_from_struct_image_x_y(x, y, (struct image *)img);
+}
+
+// Reads a pixel from either a 3 or 1 channel image
+struct pixel sample_pixel(int x, int y, const struct image *img) {
+    struct pixel pix;
+    if (img->channels == 1) {
+        pix.Red = pix.Green = pix.Blue = *get_grey_pointer_from_struct_image_x_y(x, y, (struct image *)img);
+    } else {
+        pix = *get_pixel_pointer_from_struct_image_x_y(x, y, (struct image *)img);
+    }
+    return pix;
+}
+
+void compare_images(const struct image *expected, const struct image *actual, struct check_result *result) {
+    result->cases++;
+    if (expected->width != actual->width || expected->height != actual->height) {
+        result->max_diff = 256;
+        result->min_psnr = 0.0;
+        return;
+    }
+
+    double squared_error = 0.0;
+    int x,y;
+    for (y = 0; y < expected->height; y++) {
+        for (x = 0; x < expected->width; x++) {
+            struct pixel e = sample_pixel(x, y, expected);
+            struct pixel a = sample_pixel(x, y, actual);
+            int diffs[3] = {abs(e.Red - a.Red), abs(e.Green - a.Green), abs(e.Blue - a.Blue)};
+            int c;
+            for (c = 0; c < 3; c++) {
+                if (diffs[c] > result->max_diff) result->max_diff = diffs[c];
+                squared_error += diffs[c]*diffs[c];
+            }
+        }
+    }
+
+    double mse = squared_error/(3.0*expected->width*expected->height);
+    double psnr = mse == 0.0 ? INFINITY : 10.0*log10(255.0*255.0/mse);
+    if (psnr < result->min_psnr) result->min_psnr = psnr;
+}
+
+void report(const char *filter_name, const char *variant_name, int tolerance, struct check_result *result) {
+    int passed = result->max_diff <= tolerance;
+    if (!passed) failures++;
+    printf("%-4s %-22s %-26s cases %4d  max diff %3d (tolerance %d)  min PSNR ",
+           passed ? "ok" : "FAIL", filter_name, variant_name, result->cases, result->max_diff, tolerance);
+    if (isinf(result->min_psnr)) printf("inf\n");
+    else printf("%.2f dB\n", result->min_psnr);
+}
+
+
+// Reference implementations
+// These are frozen copies of the original scalar code, written against
+// the pixel accessors only so they don't depend on the pixel layout.
+// Don't optimise these, they define the expected output
+
+void ref_threshold(double threshold_value, struct image *img) {
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            double pixel_average = (double)(pix->Blue + pix->Green + pix->Red) / 3.0;
+            uint8_t value = (pixel_average / 255.0 > threshold_value) ? 0xFF : 0x0;
+            pix->Red = pix->Green = pix->Blue = value;
+        }
+    }
+}
+
+void ref_invert(struct image *img) {
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            pix->Red = 255 - pix->Red;
+            pix->Green = 255 - pix->Green;
+            pix->Blue = 255 - pix->Blue;
+        }
+    }
+}
+
+void ref_blend(double blend_coefficient, struct image *img_1, const struct image *img_2) {
+    int x,y;
+    for (y = 0; y < img_1->height; y++) {
+        for (x = 0; x < img_1->width; x++) {
+            struct pixel *p1 = ref_pixel(x, y, img_1);
+            struct pixel *p2 = ref_pixel(x, y, img_2);
+            p1->Red   = (int)((1.0-blend_coefficient)*p1->Red + blend_coefficient*p2->Red);
+            p1->Green = (int)((1.0-blend_coefficient)*p1->Green + blend_coefficient*p2->Green);
+            p1->Blue  = (int)((1.0-blend_coefficient)*p1->Blue + blend_coefficient*p2->Blue);
+        }
+    }
+}
+
+uint8_t ref_clamp(int value) {
+    return value > 255 ? 255 : (value < 0 ? 0 : value);
+}
+
+void ref_brightness(double change, struct image *img) {
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            int r = pix->Red, g = pix->Green, b = pix->Blue;
+            double brightness = (r + g + b)/3.0;
+            double new_brightness = change*brightness + brightness;
+            pix->Red = ref_clamp((int)(3*new_brightness - g - b));
+            pix->Green = ref_clamp((int)(3*new_brightness - r - b));
+            pix->Blue = ref_clamp((int)(3*new_brightness - r - g));
+        }
+    }
+}
+
+void ref_greyscale(struct image *img) {
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            uint8_t grey_value = (int)((pix->Red + pix->Green + pix->Blue)/3.0);
+            pix->Red = pix->Green = pix->Blue = grey_value;
+        }
+    }
+}
+
+// matrix[c] = {red, green, blue, offset} for new channel c, rounded down
+void ref_colour_matrix(const double matrix[3][4], struct image *img) {
+    int x,y,c;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            int old[3] = {pix->Red, pix->Green, pix->Blue};
+            uint8_t new[3];
+            for (c = 0; c < 3; c++) {
+                double sum = matrix[c][0]*old[0] + matrix[c][1]*old[1] + matrix[c][2]*old[2] + matrix[c][3];
+                new[c] = ref_clamp((int)fmax(-1.0, fmin(256.0, floor(sum))));
+            }
+            pix->Red = new[0];
+            pix->Green = new[1];
+            pix->Blue = new[2];
+        }
+    }
+}
+
+void ref_saturation(double saturation, struct image *img) {
+    double matrix[3][4];
+    int c,k;
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) matrix[c][k] = (1.0 - saturation)/3.0 + (c == k ? saturation : 0.0);
+        matrix[c][3] = 0.0;
+    }
+    ref_colour_matrix(matrix, img);
+}
+
+void ref_crop(int x1, int y1, int x2, int y2, struct image *img) {
+    struct image cropped;
+    make_random_image(x2 - x1, y2 - y1, 0, &cropped);
+    int x,y;
+    for (y = y1; y < y2; y++) {
+        for (x = x1; x < x2; x++) {
+            *ref_pixel(x - x1, y - y1, &cropped) = *ref_pixel(x, y, img);
+        }
+    }
+    free(img->pixel_array);
+    *img = cropped;
+}
+
+// quarter_turns clockwise, then mirrored left to right if mirror is set
+void ref_rotate(int quarter_turns, int mirror, struct image *img) {
+    int turned_width = quarter_turns % 2 ? img->height : img->width;
+    int turned_height = quarter_turns % 2 ? img->width : img->height;
+    struct image turned;
+    make_random_image(turned_width, turned_height, 0, &turned);
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            int to_x = x;
+            int to_y = y;
+            switch (quarter_turns) {
+                case 1:
+                    to_x = img->height - 1 - y;
+                    to_y = x;
+                    break;
+                case 2:
+                    to_x = img->width - 1 - x;
+                    to_y = img->height - 1 - y;
+                    break;
+                case 3:
+                    to_x = y;
+                    to_y = img->width - 1 - x;
+                    break;
+            }
+            if (mirror) to_x = turned_width - 1 - to_x;
+            *ref_pixel(to_x, to_y, &turned) = *ref_pixel(x, y, img);
+        }
+    }
+    free(img->pixel_array);
+    *img = turned;
+}
+
+void ref_normalise(double kernel[5][5]) {
+    double kernel_sum = 0.0;
+    int x,y;
+    for (y = 0; y < 5; y++)
+        for (x = 0; x < 5; x++)
+            kernel_sum += kernel[y][x];
+    if (kernel_sum == 0.0) kernel_sum = 1.0;
+    for (y = 0; y < 5; y++)
+        for (x = 0; x < 5; x++)
+            kernel[y][x] = kernel[y][x]/kernel_sum;
+}
+
+void ref_convolve(double kernel[5][5], struct image *img) {
+    struct image out;
+    copy_image(&out, img);
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            double red_sum = 0.0, green_sum = 0.0, blue_sum = 0.0;
+            int x_dif, y_dif;
+            for (y_dif = -2; y_dif < 3; y_dif++) {
+                for (x_dif = -2; x_dif < 3; x_dif++) {
+                    struct pixel *pix = ref_pixel(x + x_dif, y + y_dif, img);
+                    red_sum += pix->Red*kernel[y_dif+2][x_dif+2];
+                    green_sum += pix->Green*kernel[y_dif+2][x_dif+2];
+                    blue_sum += pix->Blue*kernel[y_dif+2][x_dif+2];
+                }
+            }
+            struct pixel *dst = ref_pixel(x, y, &out);
+            dst->Red = (int)fmin(255.0, fmax(red_sum, 0.0));
+            dst->Green = (int)fmin(255.0, fmax(green_sum, 0.0));
+            dst->Blue = (int)fmin(255.0, fmax(blue_sum, 0.0));
+        }
+    }
+    free(img->pixel_array);
+    img->pixel_array = out.pixel_array;
+}
+
+// ref_convolve() for any odd size of kernel
+void ref_convolve_kernel(const struct convolution_kernel *kernel, struct image *img) {
+    struct image out;
+    copy_image(&out, img);
+    int rx = kernel->width/2, ry = kernel->height/2;
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            double red_sum = 0.0, green_sum = 0.0, blue_sum = 0.0;
+            int x_dif, y_dif;
+            for (y_dif = -ry; y_dif <= ry; y_dif++) {
+                for (x_dif = -rx; x_dif <= rx; x_dif++) {
+                    struct pixel *pix = ref_pixel(x + x_dif, y + y_dif, img);
+                    double value = kernel->values[(y_dif + ry)*kernel->width + x_dif + rx];
+                    red_sum += pix->Red*value;
+                    green_sum += pix->Green*value;
+                    blue_sum += pix->Blue*value;
+                }
+            }
+            struct pixel *dst = ref_pixel(x, y, &out);
+            dst->Red = (int)fmin(255.0, fmax(red_sum, 0.0));
+            dst->Green = (int)fmin(255.0, fmax(green_sum, 0.0));
+            dst->Blue = (int)fmin(255.0, fmax(blue_sum, 0.0));
+        }
+    }
+    free(img->pixel_array);
+    img->pixel_array = out.pixel_array;
+}
+
+// Kernels for the convolution checks, made the same way for both sides.
+// Kind 0 has mixed signs so sums clamp, 1 is a diagonal motion blur and
+// 2 a flat one
+void make_check_kernel(int width, int height, int kind, struct convolution_kernel *kernel) {
+    kernel->width = width;
+    kernel->height = height;
+    kernel->values = malloc((size_t)width*height*sizeof(double));
+    double sum = 0.0;
+    int x,y;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            double value;
+            if (kind == 0) value = (x*7 + y*13) % 11 - 3.0;
+            else if (kind == 1) value = x == y;
+            else value = 1.0;
+            kernel->values[y*width + x] = value;
+            sum += value;
+        }
+    }
+    for (x = 0; x < width*height; x++) kernel->values[x] /= sum;
+}
+
+void ref_emboss(struct image *img) {
+    double kernel[5][5] = {{0, 0, 0, 0, 0}, {0, -2, -1, 0, 0}, {0, -1, 1, 1, 0}, {0, 0, 1, 2, 0}, {0, 0, 0, 0, 0}};
+    ref_normalise(kernel);
+    ref_convolve(kernel, img);
+}
+
+void ref_sharpen(double sharpen_value, struct image *img) {
+    double kernel[5][5] = {{0, 0, 0, 0, 0}, {0, -1, -1, -1, 0}, {0, -1, 0, -1, 0}, {0, -1, -1, -1, 0}, {0, 0, 0, 0, 0}};
+    kernel[2][2] = sharpen_value;
+    ref_normalise(kernel);
+    ref_convolve(kernel, img);
+}
+
+void ref_sobel(struct image *img) {
+    struct image dup;
+    copy_image(&dup, img);
+    double kernel_1[5][5] = {{0, 0, 0, 0, 0}, {0, 1, 0, -1, 0}, {0, 2, 0, -2, 0}, {0, 1, 0, -1, 0}, {0, 0, 0, 0, 0}};
+    double kernel_2[5][5] = {{0, 0, 0, 0, 0}, {0, 1, 2, 1, 0}, {0, 0, 0, 0, 0}, {0, -1, -2, -1, 0}, {0, 0, 0, 0, 0}};
+    ref_normalise(kernel_1);
+    ref_normalise(kernel_2);
+    ref_convolve(kernel_1, img);
+    ref_convolve(kernel_2, &dup);
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *p1 = ref_pixel(x, y, img);
+            struct pixel *p2 = ref_pixel(x, y, &dup);
+            p1->Red = ref_clamp(p1->Red + p2->Red);
+            p1->Green = ref_clamp(p1->Green + p2->Green);
+            p1->Blue = ref_clamp(p1->Blue + p2->Blue);
+        }
+    }
+    free(dup.pixel_array);
+}
+
+void ref_gaussian(int repeat, double standard_deviation, struct image *img) {
+    double kernel[5][5];
+    int x,y;
+    for (y = -2; y < 3; y++) {
+        for (x = -2; x < 3; x++) {
+            double distance = sqrt(pow(0.0-y, 2.0) + pow(0.0-x, 2.0));
+            kernel[y+2][x+2] = (1/(sqrt(2.0*M_PI)*standard_deviation))*(pow(M_E,(-(pow(distance,2.0))/(2.0*(pow(standard_deviation,2.0))))));
+        }
+    }
+    ref_normalise(kernel);
+    int i;
+    for (i = 0; i < repeat; i++) {
+        ref_convolve(kernel, img);
+    }
+}
+
+
+// Filter table
+// Each filter has a reference and a list of variants. A variant
+// gets a copy of the input image and the second (same size) image.
+// Optimised code paths register themselves here with the tolerance
+// they are allowed against the reference
+
+// Resize references. The resampler is a dense matrix of weights in
+// double, each pass rounded to 8 bits like the library's. The library's
+// fixed point weights can round differently in each pass, so resampled
+// variants are allowed a difference of 2
+void ref_reduce(int factor_x, int factor_y, struct image *img) {
+    struct image reduced;
+    make_random_image((img->width + factor_x - 1)/factor_x, (img->height + factor_y - 1)/factor_y, 0, &reduced);
+    int x,y;
+    for (y = 0; y < reduced.height; y++) {
+        for (x = 0; x < reduced.width; x++) {
+            int sums[3] = {0, 0, 0};
+            int n = 0;
+            int bx, by;
+            for (by = y*factor_y; by < (y + 1)*factor_y && by < img->height; by++) {
+                for (bx = x*factor_x; bx < (x + 1)*factor_x && bx < img->width; bx++) {
+                    struct pixel *pix = ref_pixel(bx, by, img);
+                    sums[0] += pix->Red;
+                    sums[1] += pix->Green;
+                    sums[2] += pix->Blue;
+                    n++;
+                }
+            }
+            struct pixel *out = ref_pixel(x, y, &reduced);
+            out->Red = (sums[0] + n/2)/n;
+            out->Green = (sums[1] + n/2)/n;
+            out->Blue = (sums[2] + n/2)/n;
+        }
+    }
+    free(img->pixel_array);
+    *img = reduced;
+}
+
+// bmp_to_struct_image_preview() keeps the middle row of each block
+// of factor rows, then averages factor pixels along it
+void ref_preview(int factor, struct image *img) {
+    struct image rows;
+    make_random_image(img->width, (img->height + factor - 1)/factor, 0, &rows);
+    int y;
+    for (y = 0; y < rows.height; y++) {
+        int start = y*factor;
+        int n = img->height - start < factor ? img->height - start : factor;
+        memcpy(ref_pixel(0, y, &rows), ref_pixel(0, start + n/2, img), (size_t)img->width*sizeof(struct pixel));
+    }
+    free(img->pixel_array);
+    *img = rows;
+    ref_reduce(factor, 1, img);
+}
+
+double ref_resample_weight(int method, double scale, int i, int j) {
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double distance = fabs((j + 0.5 - (i + 0.5)*scale)/filter_scale);
+    if (method == RESIZE_AREA) {
+        double overlap = fmin((i + 1)*scale, j + 1) - fmax(i*scale, j);
+        return overlap > 0.0 ? overlap : 0.0;
+    } else if (method == RESIZE_BILINEAR) {
+        return distance < 1.0 ? 1.0 - distance : 0.0;
+    }
+    if (distance == 0.0) return 1.0;
+    if (distance >= 3.0) return 0.0;
+    return 3.0*sin(M_PI*distance)*sin(M_PI*distance/3.0)/(M_PI*M_PI*distance*distance);
+}
+
+uint8_t ref_round_clamp(double value) {
+    value = floor(value + 0.5);
+    if (value < 0.0) return 0;
+    if (value > 255.0) return 255;
+    return value;
+}
+
+// One pass, horizontal or vertical, to new_size pixels
+void ref_resample_pass(int new_size, int method, int horizontal, struct image *img) {
+    int in_size = horizontal ? img->width : img->height;
+    double scale = (double)in_size/new_size;
+    struct image resampled;
+    make_random_image(horizontal ? new_size : img->width, horizontal ? img->height : new_size, 0, &resampled);
+
+    int x,y,j;
+    for (y = 0; y < resampled.height; y++) {
+        for (x = 0; x < resampled.width; x++) {
+            int i = horizontal ? x : y;
+            double sums[3] = {0.0, 0.0, 0.0};
+            double total = 0.0;
+            for (j = 0; j < in_size; j++) {
+                double weight = ref_resample_weight(method, scale, i, j);
+                struct pixel *pix = horizontal ? ref_pixel(j, y, img) : ref_pixel(x, j, img);
+                sums[0] += weight*pix->Red;
+                sums[1] += weight*pix->Green;
+                sums[2] += weight*pix->Blue;
+                total += weight;
+            }
+            struct pixel *out = ref_pixel(x, y, &resampled);
+            out->Red = ref_round_clamp(sums[0]/total);
+            out->Green = ref_round_clamp(sums[1]/total);
+            out->Blue = ref_round_clamp(sums[2]/total);
+        }
+    }
+    free(img->pixel_array);
+    *img = resampled;
+}
+
+void ref_resample(int new_width, int new_height, int method, struct image *img) {
+    if (new_width != img->width) ref_resample_pass(new_width, method, 1, img);
+    if (new_height != img->height) ref_resample_pass(new_height, method, 0, img);
+}
+
+// Exact multiples are averaged, auto averages down to 2-4x then lanczos
+int ref_reduce_factor(int size, int new_size, int method) {
+    if (new_size >= size) return 1;
+    if (size % new_size == 0 && (method == RESIZE_AUTO || method == RESIZE_AREA)) return size/new_size;
+    if (method == RESIZE_AUTO && size/new_size >= 4) return size/new_size/2;
+    return 1;
+}
+
+void ref_resize(int new_width, int new_height, int method, struct image *img) {
+    if (new_width == 0) new_width = fmax(1.0, floor((double)img->width*new_height/img->height + 0.5));
+    if (new_height == 0) new_height = fmax(1.0, floor((double)img->height*new_width/img->width + 0.5));
+    ref_reduce(ref_reduce_factor(img->width, new_width, method), ref_reduce_factor(img->height, new_height, method), img);
+    ref_resample(new_width, new_height, method == RESIZE_AUTO ? RESIZE_LANCZOS : method, img);
+}
+
+// Otsu reference, the level with the largest between class
+// variance worked out from scratch for every split
+int ref_otsu_level(const uint64_t *counts) {
+    int best_level = -1;
+    double best_variance = -1.0;
+    int k, level;
+    for (k = 0; k < 255; k++) {
+        double n_0 = 0.0, n_1 = 0.0, sum_0 = 0.0, sum_1 = 0.0;
+        for (level = 0; level < 256; level++) {
+            if (level <= k) {
+                n_0 += counts[level];
+                sum_0 += (double)level*counts[level];
+            } else {
+                n_1 += counts[level];
+                sum_1 += (double)level*counts[level];
+            }
+        }
+        if (n_0 == 0.0 || n_1 == 0.0) continue;
+        double variance = n_0*n_1*(sum_0/n_0 - sum_1/n_1)*(sum_0/n_0 - sum_1/n_1);
+        if (variance > best_variance) {
+            best_variance = variance;
+            best_level = k;
+        }
+    }
+    if (best_level >= 0) return best_level;
+    for (level = 0; level < 256 && counts[level] == 0; level++);
+    return level < 256 ? level : 0;
+}
+
+// -t auto: luminance levels up to the Otsu level go black
+void ref_threshold_auto(struct image *img) {
+    uint64_t counts[256] = {0};
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            counts[(int)((pix->Red + pix->Green + pix->Blue)/3.0)]++;
+        }
+    }
+    int k = ref_otsu_level(counts);
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            uint8_t value = (int)((pix->Red + pix->Green + pix->Blue)/3.0) <= k ? 0x0 : 0xFF;
+            pix->Red = pix->Green = pix->Blue = value;
+        }
+    }
+}
+
+// Box mean and adaptive threshold references, every window summed directly
+void ref_box_mean(int radius, struct image *img) {
+    struct image source;
+    copy_image(&source, img);
+    int x,y,wx,wy;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            uint64_t sums[3] = {0, 0, 0};
+            uint64_t n = 0;
+            for (wy = y - radius; wy <= y + radius; wy++) {
+                for (wx = x - radius; wx <= x + radius; wx++) {
+                    if (wx < 0 || wy < 0 || wx >= img->width || wy >= img->height) continue;
+                    struct pixel *pix = ref_pixel(wx, wy, &source);
+                    sums[0] += pix->Red;
+                    sums[1] += pix->Green;
+                    sums[2] += pix->Blue;
+                    n++;
+                }
+            }
+            struct pixel *out = ref_pixel(x, y, img);
+            out->Red = (sums[0] + n/2)/n;
+            out->Green = (sums[1] + n/2)/n;
+            out->Blue = (sums[2] + n/2)/n;
+        }
+    }
+    free_struct_image(&source);
+}
+
+void ref_adaptive_threshold(int method, int radius, double k, struct image *img) {
+    struct image source;
+    copy_image(&source, img);
+    int x,y,wx,wy;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            uint64_t sum = 0, squares = 0;
+            double n = 0.0;
+            for (wy = y - radius; wy <= y + radius; wy++) {
+                for (wx = x - radius; wx <= x + radius; wx++) {
+                    if (wx < 0 || wy < 0 || wx >= img->width || wy >= img->height) continue;
+                    struct pixel *pix = ref_pixel(wx, wy, &source);
+                    uint64_t lum = (int)((pix->Red + pix->Green + pix->Blue)/3.0);
+                    sum += lum;
+                    squares += lum*lum;
+                    n++;
+                }
+            }
+            double mean = sum/n;
+            double threshold = mean*(1.0 - k);
+            if (method == ADAPTIVE_SAUVOLA) {
+                double variance = squares/n - mean*mean;
+                threshold = mean*(1.0 + k*((variance > 0.0 ? sqrt(variance) : 0.0)/128.0 - 1.0));
+            }
+            struct pixel *pix = ref_pixel(x, y, img);
+            int lum = (int)((pix->Red + pix->Green + pix->Blue)/3.0);
+            pix->Red = pix->Green = pix->Blue = lum <= threshold ? 0x0 : 0xFF;
+        }
+    }
+    free_struct_image(&source);
+}
+
+// Median reference, sorts every window. Edges are replicated
+int ref_compare_bytes(const void *a, const void *b) {
+    return *(const uint8_t *)a - *(const uint8_t *)b;
+}
+
+void ref_median(int radius, struct image *img) {
+    struct image source;
+    copy_image(&source, img);
+    int side = 2*radius + 1;
+    uint8_t *window = malloc((size_t)3*side*side);
+    int x,y,wx,wy,c;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            int n = 0;
+            for (wy = y - radius; wy <= y + radius; wy++) {
+                for (wx = x - radius; wx <= x + radius; wx++) {
+                    struct pixel *pix = ref_pixel(wx, wy, &source);
+                    window[n] = pix->Red;
+                    window[side*side + n] = pix->Green;
+                    window[2*side*side + n] = pix->Blue;
+                    n++;
+                }
+            }
+            uint8_t medians[3];
+            for (c = 0; c < 3; c++) {
+                qsort(window + c*n, n, 1, ref_compare_bytes);
+                medians[c] = window[c*n + n/2];
+            }
+            struct pixel *out = ref_pixel(x, y, img);
+            out->Red = medians[0];
+            out->Green = medians[1];
+            out->Blue = medians[2];
+        }
+    }
+    free(window);
+    free_struct_image(&source);
+}
+
+// Bilateral references. The exact one sums the 5x5 window with
+// gaussian and brightness weights worked out for every pixel. The grid
+// one builds the whole grid at once in doubles, with a cell of padding
+// more than the blur needs
+int ref_brightness_of(const struct pixel *pix) {
+    return (pix->Red + pix->Green + pix->Blue)/3;
+}
+
+void ref_bilateral_exact(double spatial_sd, double range_sd, struct image *img) {
+    struct image source;
+    copy_image(&source, img);
+    int x,y,wx,wy;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            int centre = ref_brightness_of(ref_pixel(x, y, &source));
+            double sums[3] = {0.0, 0.0, 0.0};
+            double n = 0.0;
+            for (wy = -2; wy <= 2; wy++) {
+                for (wx = -2; wx <= 2; wx++) {
+                    struct pixel *pix = ref_pixel(x + wx, y + wy, &source);
+                    int d = ref_brightness_of(pix) - centre;
+                    double w = exp(-(wx*wx + wy*wy)/(2.0*spatial_sd*spatial_sd))*exp(-d*d/(2.0*range_sd*range_sd));
+                    sums[0] += w*pix->Red;
+                    sums[1] += w*pix->Green;
+                    sums[2] += w*pix->Blue;
+                    n += w;
+                }
+            }
+            struct pixel *out = ref_pixel(x, y, img);
+            out->Red = (int)(sums[0]/n + 0.5);
+            out->Green = (int)(sums[1]/n + 0.5);
+            out->Blue = (int)(sums[2]/n + 0.5);
+        }
+    }
+    free_struct_image(&source);
+}
+
+void ref_bilateral_grid(double spatial_sd, double range_sd, struct image *img) {
+    const int pad = 3;
+    // Cells at least a level deep, blurred less deep to make up
+    double range_step = range_sd > 1.0 ? range_sd : 1.0;
+    int gw = (int)((img->width - 1)/spatial_sd + 0.5) + 2*pad + 1;
+    int gh = (int)((img->height - 1)/spatial_sd + 0.5) + 2*pad + 1;
+    int gd = (int)(255/range_step + 0.5) + 2*pad + 1;
+    size_t n_of_cells = (size_t)gw*gh*gd;
+    double *grid = calloc(n_of_cells*4, sizeof(double));
+    double *blurred = malloc(n_of_cells*4*sizeof(double));
+    double taps[5], taps_sum = 0.0, range_taps[5], range_taps_sum = 0.0;
+    int x,y,z,k,v;
+    for (k = 0; k < 5; k++) {
+        taps[k] = exp(-(k - 2)*(k - 2)/2.0);
+        taps_sum += taps[k];
+    }
+    for (k = 0; k < 5; k++) taps[k] /= taps_sum;
+    double range_cells = range_sd/range_step;
+    for (k = 0; k < 5; k++) {
+        range_taps[k] = exp(-(k - 2)*(k - 2)/(2.0*range_cells*range_cells));
+        range_taps_sum += range_taps[k];
+    }
+    for (k = 0; k < 5; k++) range_taps[k] /= range_taps_sum;
+    #define REF_CELL(x, y, z) (((size_t)(y)*gw + (x))*gd + (z))*4
+
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            double *cell = &grid[REF_CELL((int)(x/spatial_sd + 0.5) + pad, (int)(y/spatial_sd + 0.5) + pad,
+                                          (int)(ref_brightness_of(pix)/range_step + 0.5) + pad)];
+            cell[0] += pix->Red;
+            cell[1] += pix->Green;
+            cell[2] += pix->Blue;
+            cell[3] += 1.0;
+        }
+    }
+    // Across, down, then through the brightnesses, nothing past the ends
+    int pass;
+    for (pass = 0; pass < 3; pass++) {
+        int size = pass == 0 ? gw : pass == 1 ? gh : gd;
+        for (y = 0; y < gh; y++) {
+            for (x = 0; x < gw; x++) {
+                for (z = 0; z < gd; z++) {
+                    int at = pass == 0 ? x : pass == 1 ? y : z;
+                    for (v = 0; v < 4; v++) {
+                        double sum = 0.0;
+                        for (k = -2; k <= 2; k++) {
+                            if (at + k < 0 || at + k >= size) continue;
+                            size_t other = pass == 0 ? REF_CELL(x + k, y, z) : pass == 1 ? REF_CELL(x, y + k, z)
+                                : REF_CELL(x, y, z + k);
+                            sum += (pass == 2 ? range_taps : taps)[k + 2]*grid[other + v];
+                        }
+                        blurred[REF_CELL(x, y, z) + v] = sum;
+                    }
+                }
+            }
+        }
+        memcpy(grid, blurred, n_of_cells*4*sizeof(double));
+    }
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            double f[3] = {x/spatial_sd + pad, y/spatial_sd + pad, ref_brightness_of(pix)/range_step + pad};
+            int g[3];
+            double t[3];
+            for (k = 0; k < 3; k++) {
+                g[k] = (int)f[k];
+                t[k] = f[k] - g[k];
+            }
+            double sums[4] = {0.0, 0.0, 0.0, 0.0};
+            int corner;
+            for (corner = 0; corner < 8; corner++) {
+                int c0 = corner & 1, c1 = (corner >> 1) & 1, c2 = corner >> 2;
+                double w = (c0 ? t[0] : 1.0 - t[0])*(c1 ? t[1] : 1.0 - t[1])*(c2 ? t[2] : 1.0 - t[2]);
+                for (v = 0; v < 4; v++) {
+                    sums[v] += w*grid[REF_CELL(g[0] + c0, g[1] + c1, g[2] + c2) + v];
+                }
+            }
+            if (sums[3] > 0.0) {
+                pix->Red = (int)(sums[0]/sums[3] + 0.5);
+                pix->Green = (int)(sums[1]/sums[3] + 0.5);
+                pix->Blue = (int)(sums[2]/sums[3] + 0.5);
+            }
+        }
+    }
+    #undef REF_CELL
+    free(grid);
+    free(blurred);
+}
+
+// Morphology reference, looks at every pixel under the rectangle. Erode
+// takes the darkest, dilate the lightest with the rectangle turned round
+void ref_erode_dilate(int dilate, int width, int height, struct image *img) {
+    struct image source;
+    copy_image(&source, img);
+    int anchor_x = dilate ? width - 1 - width/2 : width/2;
+    int anchor_y = dilate ? height - 1 - height/2 : height/2;
+    int x,y,wx,wy;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            int red = dilate ? 0 : 255, green = red, blue = red;
+            for (wy = y - anchor_y; wy < y - anchor_y + height; wy++) {
+                for (wx = x - anchor_x; wx < x - anchor_x + width; wx++) {
+                    struct pixel *pix = ref_pixel(wx, wy, &source);
+                    if (dilate) {
+                        red = fmax(red, pix->Red);
+                        green = fmax(green, pix->Green);
+                        blue = fmax(blue, pix->Blue);
+                    } else {
+                        red = fmin(red, pix->Red);
+                        green = fmin(green, pix->Green);
+                        blue = fmin(blue, pix->Blue);
+                    }
+                }
+            }
+            struct pixel *out = ref_pixel(x, y, img);
+            out->Red = red;
+            out->Green = green;
+            out->Blue = blue;
+        }
+    }
+    free_struct_image(&source);
+}
+
+void ref_morphology(int operation, int width, int height, struct image *img) {
+    if (operation == MORPHOLOGY_OPEN || operation == MORPHOLOGY_ERODE) ref_erode_dilate(0, width, height, img);
+    if (operation == MORPHOLOGY_OPEN || operation == MORPHOLOGY_CLOSE || operation == MORPHOLOGY_DILATE) {
+        ref_erode_dilate(1, width, height, img);
+    }
+    if (operation == MORPHOLOGY_CLOSE) ref_erode_dilate(0, width, height, img);
+}
+
+typedef void (*filter_fn)(struct image *img, const struct image *img_2);
+
+struct filter_variant {
+    const char *name;
+    filter_fn apply;
+    int tolerance;
+};
+
+#define MAX_VARIANTS 8
+
+struct filter_check {
+    const char *name;
+    filter_fn reference;
+    struct filter_variant variants[MAX_VARIANTS];
+};
+
+void ref_threshold_low(struct image *img, const struct image *img_2) { ref_threshold(0.25, img); }
+void ref_threshold_high(struct image *img, const struct image *img_2) { ref_threshold(0.5, img); }
+void ref_invert_fn(struct image *img, const struct image *img_2) { ref_invert(img); }
+void ref_blend_fn(struct image *img, const struct image *img_2) { ref_blend(0.3, img, img_2); }
+void ref_crop_fn(struct image *img, const struct image *img_2) {
+    ref_crop(img->width/3, img->height/4, img->width, img->height - img->height/4, img);
+}
+void ref_rotate_90(struct image *img, const struct image *img_2) { ref_rotate(1, 0, img); }
+void ref_rotate_180(struct image *img, const struct image *img_2) { ref_rotate(2, 0, img); }
+void ref_rotate_270(struct image *img, const struct image *img_2) { ref_rotate(3, 0, img); }
+void ref_flip_h(struct image *img, const struct image *img_2) { ref_rotate(0, 1, img); }
+void ref_flip_v(struct image *img, const struct image *img_2) { ref_rotate(2, 1, img); }
+void ref_transpose(struct image *img, const struct image *img_2) { ref_rotate(1, 1, img); }
+void ref_transverse(struct image *img, const struct image *img_2) { ref_rotate(3, 1, img); }
+void ref_brightness_down(struct image *img, const struct image *img_2) { ref_brightness(-0.4, img); }
+void ref_brightness_up(struct image *img, const struct image *img_2) { ref_brightness(0.7, img); }
+void ref_greyscale_fn(struct image *img, const struct image *img_2) { ref_greyscale(img); }
+void ref_sepia(struct image *img, const struct image *img_2) {
+    const double matrix[3][4] = {{0.393, 0.769, 0.189, 0}, {0.349, 0.686, 0.168, 0}, {0.272, 0.534, 0.131, 0}};
+    ref_colour_matrix(matrix, img);
+}
+void ref_saturation_up(struct image *img, const struct image *img_2) { ref_saturation(1.6, img); }
+void ref_swap_bgr(struct image *img, const struct image *img_2) {
+    const double matrix[3][4] = {{0, 0, 1, 0}, {0, 1, 0, 0}, {1, 0, 0, 0}};
+    ref_colour_matrix(matrix, img);
+}
+void ref_white_balance(struct image *img, const struct image *img_2) {
+    const double matrix[3][4] = {{1.2, 0, 0, 0}, {0, 0.9, 0, 0}, {0, 0, 0.7, 0}};
+    ref_colour_matrix(matrix, img);
+}
+// Saturation then invert as one matrix, nothing rounded in between
+void ref_saturation_invert(struct image *img, const struct image *img_2) {
+    const double matrix[3][4] = {{-1.4, 0.2, 0.2, 255}, {0.2, -1.4, 0.2, 255}, {0.2, 0.2, -1.4, 255}};
+    ref_colour_matrix(matrix, img);
+}
+void ref_emboss_fn(struct image *img, const struct image *img_2) { ref_emboss(img); }
+void ref_sharpen_fn(struct image *img, const struct image *img_2) { ref_sharpen(8.01 + (20-16.0), img); }
+void ref_sharpen_1_fn(struct image *img, const struct image *img_2) { ref_sharpen(8.01 + (20-1.0), img); }
+void ref_sobel_fn(struct image *img, const struct image *img_2) { ref_sobel(img); }
+void ref_gaussian_fn(struct image *img, const struct image *img_2) { ref_gaussian(2, 1.5, img); }
+
+void ref_threshold_auto_fn(struct image *img, const struct image *img_2) { ref_threshold_auto(img); }
+void ref_box_mean_small(struct image *img, const struct image *img_2) { ref_box_mean(1, img); }
+void ref_box_mean_large(struct image *img, const struct image *img_2) { ref_box_mean(9, img); }
+void ref_bradley(struct image *img, const struct image *img_2) { ref_adaptive_threshold(ADAPTIVE_BRADLEY, 3, 0.15, img); }
+void ref_sauvola(struct image *img, const struct image *img_2) { ref_adaptive_threshold(ADAPTIVE_SAUVOLA, 5, 0.34, img); }
+void ref_median_small(struct image *img, const struct image *img_2) { ref_median(1, img); }
+void ref_median_large(struct image *img, const struct image *img_2) { ref_median(6, img); }
+void ref_bilateral_exact_fn(struct image *img, const struct image *img_2) { ref_bilateral_exact(0.8, 25.0, img); }
+void ref_bilateral_grid_fn(struct image *img, const struct image *img_2) { ref_bilateral_grid(3.0, 20.0, img); }
+void ref_bilateral_bands(struct image *img, const struct image *img_2) { ref_bilateral_grid(1.5, 0.5, img); }
+#define KERNEL_WRAPPERS(suffix, width, height, kind, lib_call)                                \
+    void ref_kernel_##suffix(struct image *img, const struct image *img_2) {                  \
+        struct convolution_kernel kernel;                                                      \
+        make_check_kernel(width, height, kind, &kernel);                                       \
+        ref_convolve_kernel(&kernel, img);                                                     \
+        free(kernel.values);                                                                   \
+    }                                                                                          \
+    void lib_kernel_##suffix(struct image *img, const struct image *img_2) {                  \
+        struct convolution_kernel kernel;                                                      \
+        make_check_kernel(width, height, kind, &kernel);                                       \
+        lib_call;                                                                              \
+        free(kernel.values);                                                                   \
+    }
+KERNEL_WRAPPERS(mixed_direct, 11, 7, 0, convolve_struct_image_direct(&kernel, img))
+KERNEL_WRAPPERS(mixed_fft, 11, 7, 0, convolve_struct_image_fft(&kernel, img))
+KERNEL_WRAPPERS(mixed_fft_threads, 11, 7, 0, convolve_struct_image_fft_threads(&kernel, img, 3))
+KERNEL_WRAPPERS(diagonal_auto, 15, 15, 1, convolve_struct_image(&kernel, img))
+KERNEL_WRAPPERS(diagonal_fft, 15, 15, 1, convolve_struct_image_fft(&kernel, img))
+KERNEL_WRAPPERS(flat_direct, 31, 1, 2, convolve_struct_image_direct(&kernel, img))
+KERNEL_WRAPPERS(flat_fft, 31, 1, 2, convolve_struct_image_fft(&kernel, img))
+void ref_erode_fn(struct image *img, const struct image *img_2) { ref_morphology(MORPHOLOGY_ERODE, 3, 3, img); }
+void ref_dilate_fn(struct image *img, const struct image *img_2) { ref_morphology(MORPHOLOGY_DILATE, 5, 2, img); }
+void ref_open_fn(struct image *img, const struct image *img_2) { ref_morphology(MORPHOLOGY_OPEN, 4, 7, img); }
+void ref_close_fn(struct image *img, const struct image *img_2) { ref_morphology(MORPHOLOGY_CLOSE, 9, 1, img); }
+void ref_binary_open(struct image *img, const struct image *img_2) {
+    ref_threshold(0.5, img);
+    ref_morphology(MORPHOLOGY_OPEN, 5, 3, img);
+}
+void ref_binary_close(struct image *img, const struct image *img_2) {
+    ref_threshold(0.5, img);
+    ref_morphology(MORPHOLOGY_CLOSE, 70, 4, img);
+}
+// Resize sizes are relative, so every test image gets a sensible target
+int scaled_size(int size, int numerator, int denominator) {
+    int scaled = size*numerator/denominator;
+    return scaled < 1 ? 1 : scaled;
+}
+void ref_reduce_fn(struct image *img, const struct image *img_2) { ref_reduce(2, 3, img); }
+void ref_resize_area(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 2, 3), scaled_size(img->height, 2, 3), RESIZE_AREA, img);
+}
+void ref_resize_bilinear_down(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 3, 5), scaled_size(img->height, 3, 5), RESIZE_BILINEAR, img);
+}
+void ref_resize_bilinear_up(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 7, 4), scaled_size(img->height, 7, 4), RESIZE_BILINEAR, img);
+}
+void ref_resize_lanczos_down(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 3, 5), scaled_size(img->height, 3, 5), RESIZE_LANCZOS, img);
+}
+void ref_resize_lanczos_up(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 7, 4), scaled_size(img->height, 7, 4), RESIZE_LANCZOS, img);
+}
+void ref_resize_auto(struct image *img, const struct image *img_2) {
+    ref_resize(scaled_size(img->width, 1, 5), 0, RESIZE_AUTO, img);
+}
+
+void lib_threshold_low(struct image *img, const struct image *img_2) { threshold_image(0.25, img); }
+void lib_threshold_high(struct image *img, const struct image *img_2) { threshold_image(0.5, img); }
+void lib_invert(struct image *img, const struct image *img_2) { invert_image(img); }
+void lib_blend(struct image *img, const struct image *img_2) { blend_two_images(0.3, img, (struct image *)img_2); }
+void lib_crop(struct image *img, const struct image *img_2) {
+    crop_image(img->width/3, img->height/4, img->width, img->height - img->height/4, img);
+}
+void lib_rotate_90(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_ROTATE_90, img); }
+void lib_rotate_90_scalar(struct image *img, const struct image *img_2) { transpose_image_scalar(ORIENTATION_ROTATE_90, img); }
+void lib_rotate_180(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_ROTATE_180, img); }
+void lib_rotate_270(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_ROTATE_270, img); }
+void lib_rotate_270_scalar(struct image *img, const struct image *img_2) { transpose_image_scalar(ORIENTATION_ROTATE_270, img); }
+void lib_flip_h(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_FLIP_HORIZONTAL, img); }
+void lib_flip_v(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_FLIP_VERTICAL, img); }
+void lib_transpose(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_TRANSPOSE, img); }
+void lib_transverse(struct image *img, const struct image *img_2) { orient_image(ORIENTATION_MIRROR_ANTIDIAGONAL, img); }
+// Three turns and a flip, put together by orientation_then()
+void lib_transverse_composed(struct image *img, const struct image *img_2) {
+    int orientation = orientation_then(ORIENTATION_ROTATE_90, ORIENTATION_ROTATE_180);
+    orient_image(orientation_then(orientation, ORIENTATION_FLIP_HORIZONTAL), img);
+}
+void lib_brightness_down(struct image *img, const struct image *img_2) { brightness_image(-0.4, img); }
+void lib_brightness_up(struct image *img, const struct image *img_2) { brightness_image(0.7, img); }
+void lib_brightness_down_scalar(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_brightness(-0.4, &matrix);
+    colour_matrix_image_scalar(&matrix, img);
+}
+void lib_brightness_up_scalar(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_brightness(0.7, &matrix);
+    colour_matrix_image_scalar(&matrix, img);
+}
+void lib_greyscale(struct image *img, const struct image *img_2) { greyscale_image(img); }
+void lib_sepia(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_sepia(&matrix);
+    colour_matrix_image(&matrix, img);
+}
+void lib_sepia_scalar(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_sepia(&matrix);
+    colour_matrix_image_scalar(&matrix, img);
+}
+void lib_saturation_up(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_saturation(1.6, &matrix);
+    colour_matrix_image(&matrix, img);
+}
+void lib_saturation_up_scalar(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_saturation(1.6, &matrix);
+    colour_matrix_image_scalar(&matrix, img);
+}
+void lib_swap_bgr(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_swap("bgr", &matrix);
+    colour_matrix_image(&matrix, img);
+}
+void lib_white_balance(struct image *img, const struct image *img_2) {
+    struct colour_matrix matrix;
+    colour_matrix_white_balance(1.2, 0.9, 0.7, &matrix);
+    colour_matrix_image(&matrix, img);
+}
+void lib_saturation_invert(struct image *img, const struct image *img_2) {
+    struct colour_matrix saturation, invert;
+    colour_matrix_saturation(1.6, &saturation);
+    colour_matrix_invert(&invert);
+    colour_matrix_multiply(&invert, &saturation, &saturation);
+    colour_matrix_image(&saturation, img);
+}
+void lib_emboss(struct image *img, const struct image *img_2) { emboss_image(img); }
+void lib_sharpen(struct image *img, const struct image *img_2) { sharpen_image(8.01 + (20-16.0), img); }
+void lib_sharpen_1(struct image *img, const struct image *img_2) { sharpen_image(8.01 + (20-1.0), img); }
+void lib_sobel(struct image *img, const struct image *img_2) { sobel_edge_detect_image(img); }
+void lib_gaussian(struct image *img, const struct image *img_2) { gaussian_blur(2, 1.5, img); }
+
+void lib_threshold_auto(struct image *img, const struct image *img_2) {
+    struct image_histogram histogram;
+    compute_image_histogram(img, &histogram);
+    threshold_image(otsu_threshold_value(&histogram), img);
+}
+void lib_box_mean_small(struct image *img, const struct image *img_2) { box_mean_image(1, img); }
+void lib_box_mean_large(struct image *img, const struct image *img_2) { box_mean_image(9, img); }
+void lib_bradley(struct image *img, const struct image *img_2) { adaptive_threshold_image(ADAPTIVE_BRADLEY, 3, 0, img); }
+void lib_sauvola(struct image *img, const struct image *img_2) { adaptive_threshold_image(ADAPTIVE_SAUVOLA, 5, 0, img); }
+void lib_median_small(struct image *img, const struct image *img_2) { median_image(1, img); }
+void lib_median_large(struct image *img, const struct image *img_2) { median_image(6, img); }
+void lib_bilateral_exact(struct image *img, const struct image *img_2) { bilateral_image(0.8, 25.0, img); }
+void lib_bilateral_exact_threads(struct image *img, const struct image *img_2) {
+    bilateral_image_exact_threads(0.8, 25.0, img, 3);
+}
+void lib_bilateral_grid(struct image *img, const struct image *img_2) { bilateral_image(3.0, 20.0, img); }
+void lib_bilateral_grid_threads(struct image *img, const struct image *img_2) {
+    bilateral_image_grid_threads(3.0, 20.0, img, 3);
+}
+// A range sd this small makes the grid deep enough to be built in bands
+void lib_bilateral_bands(struct image *img, const struct image *img_2) { bilateral_image_grid(1.5, 0.5, img); }
+void lib_bilateral_bands_threads(struct image *img, const struct image *img_2) {
+    bilateral_image_grid_threads(1.5, 0.5, img, 3);
+}
+void lib_erode(struct image *img, const struct image *img_2) { morphology_image(MORPHOLOGY_ERODE, 3, 3, img); }
+void lib_dilate(struct image *img, const struct image *img_2) { morphology_image(MORPHOLOGY_DILATE, 5, 2, img); }
+void lib_open(struct image *img, const struct image *img_2) { morphology_image(MORPHOLOGY_OPEN, 4, 7, img); }
+void lib_close(struct image *img, const struct image *img_2) { morphology_image(MORPHOLOGY_CLOSE, 9, 1, img); }
+void lib_binary_open(struct image *img, const struct image *img_2) {
+    threshold_image(0.5, img);
+    morphology_image(MORPHOLOGY_OPEN, 5, 3, img);
+}
+void lib_binary_close(struct image *img, const struct image *img_2) {
+    threshold_image(0.5, img);
+    morphology_image(MORPHOLOGY_CLOSE, 70, 4, img);
+}
+void lib_reduce(struct image *img, const struct image *img_2) { reduce_image(2, 3, img); }
+void lib_resize_area(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 2, 3), scaled_size(img->height, 2, 3), RESIZE_AREA, img);
+}
+void lib_resize_bilinear_down(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 3, 5), scaled_size(img->height, 3, 5), RESIZE_BILINEAR, img);
+}
+void lib_resize_bilinear_up(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 7, 4), scaled_size(img->height, 7, 4), RESIZE_BILINEAR, img);
+}
+void lib_resize_lanczos_down(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 3, 5), scaled_size(img->height, 3, 5), RESIZE_LANCZOS, img);
+}
+void lib_resize_lanczos_up(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 7, 4), scaled_size(img->height, 7, 4), RESIZE_LANCZOS, img);
+}
+void lib_resize_auto(struct image *img, const struct image *img_2) {
+    resize_image(scaled_size(img->width, 1, 5), 0, RESIZE_AUTO, img);
+}
+
+// After -g the image is single channel, these run the
+// 1 channel paths against the reference on RGB grey
+#define GREY_WRAPPERS(ref_fn, lib_fn)                                                         \
+    void ref_fn##_grey(struct image *img, const struct image *img_2) {                        \
+        ref_greyscale(img);                                                                   \
+        ref_fn(img, img_2);                                                                   \
+    }                                                                                         \
+    void lib_fn##_grey(struct image *img, const struct image *img_2) {                        \
+        greyscale_image(img);                                                                 \
+        lib_fn(img, img_2);                                                                   \
+    }
+
+GREY_WRAPPERS(ref_threshold_high, lib_threshold_high)
+GREY_WRAPPERS(ref_invert_fn, lib_invert)
+GREY_WRAPPERS(ref_crop_fn, lib_crop)
+GREY_WRAPPERS(ref_rotate_90, lib_rotate_90)
+GREY_WRAPPERS(ref_rotate_180, lib_rotate_180)
+GREY_WRAPPERS(ref_rotate_270, lib_rotate_270)
+GREY_WRAPPERS(ref_flip_h, lib_flip_h)
+GREY_WRAPPERS(ref_flip_v, lib_flip_v)
+GREY_WRAPPERS(ref_transverse, lib_transverse)
+GREY_WRAPPERS(ref_brightness_down, lib_brightness_down)
+GREY_WRAPPERS(ref_brightness_up, lib_brightness_up)
+GREY_WRAPPERS(ref_sepia, lib_sepia)
+GREY_WRAPPERS(ref_saturation_up, lib_saturation_up)
+GREY_WRAPPERS(ref_emboss_fn, lib_emboss)
+GREY_WRAPPERS(ref_sharpen_fn, lib_sharpen)
+GREY_WRAPPERS(ref_sharpen_1_fn, lib_sharpen_1)
+GREY_WRAPPERS(ref_sobel_fn, lib_sobel)
+GREY_WRAPPERS(ref_gaussian_fn, lib_gaussian)
+GREY_WRAPPERS(ref_threshold_auto_fn, lib_threshold_auto)
+GREY_WRAPPERS(ref_box_mean_large, lib_box_mean_large)
+GREY_WRAPPERS(ref_sauvola, lib_sauvola)
+GREY_WRAPPERS(ref_median_small, lib_median_small)
+GREY_WRAPPERS(ref_median_large, lib_median_large)
+GREY_WRAPPERS(ref_bilateral_exact_fn, lib_bilateral_exact)
+GREY_WRAPPERS(ref_bilateral_grid_fn, lib_bilateral_grid_threads)
+GREY_WRAPPERS(ref_bilateral_bands, lib_bilateral_bands_threads)
+GREY_WRAPPERS(ref_kernel_mixed_direct, lib_kernel_mixed_direct)
+GREY_WRAPPERS(ref_kernel_mixed_fft, lib_kernel_mixed_fft)
+GREY_WRAPPERS(ref_kernel_mixed_fft_threads, lib_kernel_mixed_fft_threads)
+GREY_WRAPPERS(ref_open_fn, lib_open)
+GREY_WRAPPERS(ref_binary_close, lib_binary_close)
+GREY_WRAPPERS(ref_reduce_fn, lib_reduce)
+GREY_WRAPPERS(ref_resize_lanczos_down, lib_resize_lanczos_down)
+GREY_WRAPPERS(ref_resize_auto, lib_resize_auto)
+
+// Both images greyscale, so the single channel blend is used
+void ref_blend_grey(struct image *img, const struct image *img_2) {
+    struct image grey_2;
+    copy_image(&grey_2, img_2);
+    ref_greyscale(img);
+    ref_greyscale(&grey_2);
+    ref_blend(0.3, img, &grey_2);
+    free_struct_image(&grey_2);
+}
+void lib_blend_grey(struct image *img, const struct image *img_2) {
+    struct image grey_2;
+    copy_image(&grey_2, img_2);
+    greyscale_image(img);
+    greyscale_image(&grey_2);
+    blend_two_images(0.3, img, &grey_2);
+    free_struct_image(&grey_2);
+}
+
+static const struct filter_check filter_checks[] = {
+    {"threshold 0.25", ref_threshold_low, {{"filters.c", lib_threshold_low, 0}}},
+    {"threshold 0.5", ref_threshold_high, {{"filters.c", lib_threshold_high, 0}}},
+    {"threshold auto", ref_threshold_auto_fn, {{"otsu", lib_threshold_auto, 0}}},
+    {"invert", ref_invert_fn, {{"filters.c", lib_invert, 0}}},
+    {"blend 0.3", ref_blend_fn, {{"filters.c", lib_blend, 0}}},
+    {"crop", ref_crop_fn, {{"filters.c", lib_crop, 0}}},
+    {"rotate 90", ref_rotate_90, {{"tiles", lib_rotate_90, 0}, {"scalar", lib_rotate_90_scalar, 0}}},
+    {"rotate 180", ref_rotate_180, {{"in place", lib_rotate_180, 0}}},
+    {"rotate 270", ref_rotate_270, {{"tiles", lib_rotate_270, 0}, {"scalar", lib_rotate_270_scalar, 0}}},
+    {"flip h", ref_flip_h, {{"in place", lib_flip_h, 0}}},
+    {"flip v", ref_flip_v, {{"in place", lib_flip_v, 0}}},
+    {"transpose", ref_transpose, {{"tiles", lib_transpose, 0}}},
+    {"transverse", ref_transverse, {{"tiles", lib_transverse, 0}, {"composed", lib_transverse_composed, 0}}},
+    {"brightness -40%", ref_brightness_down, {{"SSE2", lib_brightness_down, 1}, {"scalar", lib_brightness_down_scalar, 1}}},
+    {"brightness +70%", ref_brightness_up, {{"SSE2", lib_brightness_up, 1}, {"scalar", lib_brightness_up_scalar, 1}}},
+    {"greyscale", ref_greyscale_fn, {{"filters.c", lib_greyscale, 0}}},
+    {"sepia", ref_sepia, {{"SSE2", lib_sepia, 1}, {"scalar", lib_sepia_scalar, 1}}},
+    {"saturation 1.6", ref_saturation_up, {{"SSE2", lib_saturation_up, 1}, {"scalar", lib_saturation_up_scalar, 1}}},
+    {"swap bgr", ref_swap_bgr, {{"colour_matrix.c", lib_swap_bgr, 0}}},
+    {"white balance", ref_white_balance, {{"colour_matrix.c", lib_white_balance, 1}}},
+    {"saturation x invert", ref_saturation_invert, {{"colour_matrix.c", lib_saturation_invert, 1}}},
+    {"emboss", ref_emboss_fn, {{"filters.c", lib_emboss, 0}}},
+    {"sharpen", ref_sharpen_fn, {{"filters.c", lib_sharpen, 0}}},
+    {"sharpen 1", ref_sharpen_1_fn, {{"filters.c", lib_sharpen_1, 0}}},
+    {"sobel", ref_sobel_fn, {{"filters.c", lib_sobel, 0}}},
+    {"gaussian 2,1.5", ref_gaussian_fn, {{"filters.c", lib_gaussian, 0}}},
+    {"box mean 1", ref_box_mean_small, {{"integral.c", lib_box_mean_small, 0}}},
+    {"box mean 9", ref_box_mean_large, {{"integral.c", lib_box_mean_large, 0}}},
+    {"adaptive bradley 3", ref_bradley, {{"integral.c", lib_bradley, 0}}},
+    {"adaptive sauvola 5", ref_sauvola, {{"integral.c", lib_sauvola, 0}}},
+    {"median 1", ref_median_small, {{"median.c", lib_median_small, 0}}},
+    {"median 6", ref_median_large, {{"median.c", lib_median_large, 0}}},
+    {"bilateral 0.8,25", ref_bilateral_exact_fn, {{"exact", lib_bilateral_exact, 1},
+                                                  {"exact 3 threads", lib_bilateral_exact_threads, 1}}},
+    {"bilateral 3,20", ref_bilateral_grid_fn, {{"grid", lib_bilateral_grid, 1},
+                                               {"grid 3 threads", lib_bilateral_grid_threads, 1}}},
+    {"bilateral 1.5,0.5", ref_bilateral_bands, {{"grid bands", lib_bilateral_bands, 1},
+                                                {"grid bands 3 threads", lib_bilateral_bands_threads, 1}}},
+    {"kernel 11x7", ref_kernel_mixed_direct, {{"direct", lib_kernel_mixed_direct, 0},
+                                              {"fft", lib_kernel_mixed_fft, 1},
+                                              {"fft 3 threads", lib_kernel_mixed_fft_threads, 1}}},
+    {"kernel 15x15 diagonal", ref_kernel_diagonal_auto, {{"auto", lib_kernel_diagonal_auto, 1},
+                                                         {"fft", lib_kernel_diagonal_fft, 1}}},
+    {"kernel 31x1 flat", ref_kernel_flat_direct, {{"direct", lib_kernel_flat_direct, 0},
+                                                  {"fft", lib_kernel_flat_fft, 1}}},
+    {"erode 3x3", ref_erode_fn, {{"morphology.c", lib_erode, 0}}},
+    {"dilate 5x2", ref_dilate_fn, {{"morphology.c", lib_dilate, 0}}},
+    {"open 4x7", ref_open_fn, {{"morphology.c", lib_open, 0}}},
+    {"close 9x1", ref_close_fn, {{"morphology.c", lib_close, 0}}},
+    {"binary open 5x3", ref_binary_open, {{"bits", lib_binary_open, 0}}},
+    {"binary close 70x4", ref_binary_close, {{"bits", lib_binary_close, 0}}},
+    {"reduce 2x3", ref_reduce_fn, {{"resize.c", lib_reduce, 0}}},
+    {"resize area 2/3", ref_resize_area, {{"resize.c", lib_resize_area, 2}}},
+    {"resize bilinear 3/5", ref_resize_bilinear_down, {{"resize.c", lib_resize_bilinear_down, 2}}},
+    {"resize bilinear 7/4", ref_resize_bilinear_up, {{"resize.c", lib_resize_bilinear_up, 2}}},
+    {"resize lanczos 3/5", ref_resize_lanczos_down, {{"resize.c", lib_resize_lanczos_down, 2}}},
+    {"resize lanczos 7/4", ref_resize_lanczos_up, {{"resize.c", lib_resize_lanczos_up, 2}}},
+    {"resize auto 1/5", ref_resize_auto, {{"resize.c", lib_resize_auto, 2}}},
+    {"grey threshold 0.5", ref_threshold_high_grey, {{"1 channel", lib_threshold_high_grey, 0}}},
+    {"grey threshold auto", ref_threshold_auto_fn_grey, {{"1 channel", lib_threshold_auto_grey, 0}}},
+    {"grey invert", ref_invert_fn_grey, {{"1 channel", lib_invert_grey, 0}}},
+    {"grey blend 0.3", ref_blend_grey, {{"1 channel", lib_blend_grey, 0}}},
+    {"grey crop", ref_crop_fn_grey, {{"1 channel", lib_crop_grey, 0}}},
+    {"grey rotate 90", ref_rotate_90_grey, {{"SSE2 tiles", lib_rotate_90_grey, 0}}},
+    {"grey rotate 180", ref_rotate_180_grey, {{"in place", lib_rotate_180_grey, 0}}},
+    {"grey rotate 270", ref_rotate_270_grey, {{"SSE2 tiles", lib_rotate_270_grey, 0}}},
+    {"grey flip h", ref_flip_h_grey, {{"in place", lib_flip_h_grey, 0}}},
+    {"grey flip v", ref_flip_v_grey, {{"in place", lib_flip_v_grey, 0}}},
+    {"grey transverse", ref_transverse_grey, {{"SSE2 tiles", lib_transverse_grey, 0}}},
+    {"grey brightness -40%", ref_brightness_down_grey, {{"1 channel", lib_brightness_down_grey, 1}}},
+    {"grey brightness +70%", ref_brightness_up_grey, {{"1 channel", lib_brightness_up_grey, 1}}},
+    {"grey sepia", ref_sepia_grey, {{"1 channel", lib_sepia_grey, 1}}},
+    {"grey saturation 1.6", ref_saturation_up_grey, {{"1 channel", lib_saturation_up_grey, 1}}},
+    {"grey emboss", ref_emboss_fn_grey, {{"1 channel", lib_emboss_grey, 0}}},
+    {"grey sharpen", ref_sharpen_fn_grey, {{"1 channel", lib_sharpen_grey, 0}}},
+    {"grey sharpen 1", ref_sharpen_1_fn_grey, {{"1 channel", lib_sharpen_1_grey, 0}}},
+    {"grey sobel", ref_sobel_fn_grey, {{"1 channel", lib_sobel_grey, 0}}},
+    {"grey gaussian 2,1.5", ref_gaussian_fn_grey, {{"1 channel", lib_gaussian_grey, 0}}},
+    {"grey box mean 9", ref_box_mean_large_grey, {{"1 channel", lib_box_mean_large_grey, 0}}},
+    {"grey sauvola 5", ref_sauvola_grey, {{"1 channel", lib_sauvola_grey, 0}}},
+    {"grey median 1", ref_median_small_grey, {{"1 channel", lib_median_small_grey, 0}}},
+    {"grey median 6", ref_median_large_grey, {{"1 channel", lib_median_large_grey, 0}}},
+    {"grey bilateral 0.8,25", ref_bilateral_exact_fn_grey, {{"1 channel", lib_bilateral_exact_grey, 1}}},
+    {"grey bilateral 3,20", ref_bilateral_grid_fn_grey, {{"1 channel", lib_bilateral_grid_threads_grey, 1}}},
+    {"grey bilateral 1.5,0.5", ref_bilateral_bands_grey, {{"1 channel", lib_bilateral_bands_threads_grey, 1}}},
+    {"grey kernel 11x7", ref_kernel_mixed_direct_grey, {{"direct", lib_kernel_mixed_direct_grey, 0},
+                                                        {"fft", lib_kernel_mixed_fft_grey, 1},
+                                                        {"fft 3 threads", lib_kernel_mixed_fft_threads_grey, 1}}},
+    {"grey open 4x7", ref_open_fn_grey, {{"1 channel", lib_open_grey, 0}}},
+    {"grey binary close 70x4", ref_binary_close_grey, {{"bits", lib_binary_close_grey, 0}}},
+    {"grey reduce 2x3", ref_reduce_fn_grey, {{"1 channel", lib_reduce_grey, 0}}},
+    {"grey lanczos 3/5", ref_resize_lanczos_down_grey, {{"1 channel", lib_resize_lanczos_down_grey, 2}}},
+    {"grey resize auto 1/5", ref_resize_auto_grey, {{"1 channel", lib_resize_auto_grey, 2}}},
+};
+#define N_OF_FILTER_CHECKS (int)(sizeof(filter_checks)/sizeof(filter_checks[0]))
+
+// Runs fn on every test image, comparing against the reference
+void run_filter_check(const struct filter_check *check, const struct filter_variant *variant,
+                      struct image *inputs, struct image *inputs_2, int n_of_inputs) {
+    struct check_result result = {0, 0, INFINITY};
+    int i;
+    for (i = 0; i < n_of_inputs; i++) {
+        struct image expected;
+        struct image actual;
+        copy_image(&expected, &inputs[i]);
+        copy_image(&actual, &inputs[i]);
+        check->reference(&expected, &inputs_2[i]);
+        variant->apply(&actual, &inputs_2[i]);
+        compare_images(&expected, &actual, &result);
+        free_struct_image(&expected);
+        free_struct_image(&actual);
+    }
+    report(check->name, variant->name, variant->tolerance, &result);
+}
+
+
+// Brightness sweep
+// The colour matrix rounds the change to 1/65536, so brightness is only
+// within 1 of the reference. Every whole percent from -100% to +100%
+// and some random thousandths are tried, not just the two in the table
+
+void run_brightness_sweep_check() {
+    struct check_result sse2 = {0, 0, INFINITY};
+    struct check_result scalar = {0, 0, INFINITY};
+    struct check_result grey = {0, 0, INFINITY};
+
+    struct image input;
+    struct image grey_input;
+    make_random_image(128, 128, 0, &input);
+    copy_image(&grey_input, &input);
+    greyscale_image(&grey_input);
+
+    int n_of_changes = 201 + 200;
+    int i;
+    for (i = 0; i < n_of_changes; i++) {
+        double change = i < 201 ? (i - 100)/100.0 : ((int)(check_random() % 2001) - 1000)/1000.0;
+        struct image expected;
+        struct image actual;
+        struct colour_matrix matrix;
+
+        copy_image(&expected, &input);
+        ref_brightness(change, &expected);
+        copy_image(&actual, &input);
+        brightness_image(change, &actual);
+        compare_images(&expected, &actual, &sse2);
+        free_struct_image(&actual);
+        copy_image(&actual, &input);
+        colour_matrix_brightness(change, &matrix);
+        colour_matrix_image_scalar(&matrix, &actual);
+        compare_images(&expected, &actual, &scalar);
+        free_struct_image(&actual);
+        free_struct_image(&expected);
+
+        copy_image(&expected, &input);
+        ref_greyscale(&expected);
+        ref_brightness(change, &expected);
+        copy_image(&actual, &grey_input);
+        brightness_image(change, &actual);
+        compare_images(&expected, &actual, &grey);
+        free_struct_image(&actual);
+        free_struct_image(&expected);
+    }
+    free_struct_image(&input);
+    free_struct_image(&grey_input);
+
+    report("brightness sweep", "SSE2", 1, &sse2);
+    report("brightness sweep", "scalar", 1, &scalar);
+    report("brightness sweep", "1 channel", 1, &grey);
+}
+
+
+// Codec checks
+
+// Decodes the bytes of a 24bpp bottom-up bitmap directly,
+// independently of bmp_struct_image.c
+void ref_decode(const uint8_t *file_bytes, struct image *img) {
+    int32_t width, height;
+    uint32_t offset;
+    memcpy(&offset, file_bytes + 0xA, 4);
+    memcpy(&width, file_bytes + 0x12, 4);
+    memcpy(&height, file_bytes + 0x16, 4);
+    make_random_image(width, height, 0, img);
+
+    int row_width = (int)(floor((24.0*((double)width) + 31.0)/32.0)*4.0);
+    int x,y;
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = file_bytes + offset + (size_t)(height - 1 - y)*row_width;
+        for (x = 0; x < width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            pix->Blue = row[x*3];
+            pix->Green = row[x*3 + 1];
+            pix->Red = row[x*3 + 2];
+        }
+    }
+}
+
+uint8_t *read_whole_file(int fildes, size_t *size) {
+    off_t end = lseek(fildes, 0, SEEK_END);
+    uint8_t *bytes = malloc(end);
+    if (bytes == NULL || pread(fildes, bytes, end, 0) != end) {
+        error(1, errno, "Couldn't read back encoded file");
+    }
+    *size = end;
+    return bytes;
+}
+
+void run_codec_check(struct image *inputs, int n_of_inputs) {
+    struct check_result round_trip = {0, 0, INFINITY};
+    struct check_result ref_decoded = {0, 0, INFINITY};
+    struct check_result file_size = {0, 0, INFINITY};
+    struct check_result streamed = {0, 0, INFINITY};
+    struct check_result flipped = {0, 0, INFINITY};
+
+    char path[] = "/tmp/bmpedit-check-XXXXXX";
+    int fildes = mkstemp(path);
+    if (fildes == -1) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary file");
+    }
+    unlink(path);
+
+    int i;
+    for (i = 0; i < n_of_inputs; i++) {
+        if (ftruncate(fildes, 0) == -1 || lseek(fildes, 0, SEEK_SET) == -1) {
+            int errsv = errno;
+            error(1, errsv, "Couldn't reset temporary file");
+        }
+        if (struct_image_to_bmp(fildes, &inputs[i]) != IMAGE_OK) {
+            error(1, errno, "Couldn't encode test image");
+        }
+
+        size_t size;
+        uint8_t *bytes = read_whole_file(fildes, &size);
+
+        // The file must be exactly header plus padded rows
+        int row_width = (int)(floor((24.0*((double)inputs[i].width) + 31.0)/32.0)*4.0);
+        file_size.cases++;
+        if (size != 0x36 + (size_t)row_width*inputs[i].height) {
+            file_size.max_diff = 256;
+        }
+
+        struct image decoded;
+        if (bmp_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+            error(1, 0, "Couldn't decode test image");
+        }
+        compare_images(&inputs[i], &decoded, &round_trip);
+        free_struct_image(&decoded);
+
+        // The forward only reader, as used for pipes
+        if (lseek(fildes, 0, SEEK_SET) == -1 || bmp_stream_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+            error(1, 0, "Couldn't stream decode test image");
+        }
+        compare_images(&inputs[i], &decoded, &streamed);
+        free_struct_image(&decoded);
+
+        // Upside down, with rows stored from the bottom as they are read
+        struct image expected;
+        copy_image(&expected, &inputs[i]);
+        ref_flip_v(&expected, NULL);
+        if (bmp_to_struct_image_flipped(fildes, &decoded, NULL) != IMAGE_OK) {
+            error(1, 0, "Couldn't decode test image upside down");
+        }
+        compare_images(&expected, &decoded, &flipped);
+        free_struct_image(&decoded);
+        free_struct_image(&expected);
+
+        ref_decode(bytes, &decoded);
+        compare_images(&inputs[i], &decoded, &ref_decoded);
+        free_struct_image(&decoded);
+        free(bytes);
+    }
+    close(fildes);
+
+    report("codec", "encode file size", 0, &file_size);
+    report("codec", "encode+ref decode", 0, &ref_decoded);
+    report("codec", "round trip", 0, &round_trip);
+    report("codec", "round trip streamed", 0, &streamed);
+    report("codec", "decode flipped", 0, &flipped);
+}
+
+
+// Smallest depth that holds img exactly, the choice
+// BMP_DEPTH_AUTO must make
+int ref_depth_for_image(const struct image *img) {
+    int depth = 1;
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel pix = sample_pixel(x, y, img);
+            if (pix.Red != pix.Green || pix.Green != pix.Blue) return 24;
+            if (pix.Red != 0 && pix.Red != 255) depth = 8;
+        }
+    }
+    return depth;
+}
+
+// What an image should decode as after being written at bpp
+void ref_reduce_depth(int bpp, struct image *img) {
+    if (bpp == 24) return;
+    ref_greyscale(img);
+    if (bpp == 8) return;
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel *pix = ref_pixel(x, y, img);
+            pix->Red = pix->Green = pix->Blue = pix->Red >= 128 ? 255 : 0;
+        }
+    }
+}
+
+// Encodes at 8bpp, 1bpp and BMP_DEPTH_AUTO and decodes the
+// result with both readers. Encoding and decoding on threads
+// must give the same bytes and pixels as on one, and regions
+// and previews the same as cutting or shrinking the image
+void run_depth_check(struct image *inputs, int n_of_inputs) {
+    static const int depths[] = {BMP_DEPTH_8, BMP_DEPTH_1, BMP_DEPTH_AUTO};
+    static const char *names[] = {"8bpp", "1bpp", "auto depth"};
+    struct check_result round_trip[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result streamed[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result file_size[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result threaded_encode[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result threaded_decode[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result region_decode[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result region_encode[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result preview[3] = {{0, 0, INFINITY}, {0, 0, INFINITY}, {0, 0, INFINITY}};
+    struct check_result chosen = {0, 0, INFINITY};
+
+    char path[] = "/tmp/bmpedit-check-XXXXXX";
+    int fildes = mkstemp(path);
+    if (fildes == -1) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary file");
+    }
+    unlink(path);
+
+    int d, i;
+    for (d = 0; d < 3; d++) {
+        for (i = 0; i < n_of_inputs; i++) {
+            if (ftruncate(fildes, 0) == -1 || lseek(fildes, 0, SEEK_SET) == -1) {
+                int errsv = errno;
+                error(1, errsv, "Couldn't reset temporary file");
+            }
+            if (struct_image_to_bmp_depth(fildes, &inputs[i], depths[d]) != IMAGE_OK) {
+                error(1, errno, "Couldn't encode test image");
+            }
+
+            size_t size;
+            uint8_t *bytes = read_whole_file(fildes, &size);
+            uint16_t bpp;
+            memcpy(&bpp, bytes + 0x1C, 2);
+
+            int expected_bpp = depths[d];
+            if (expected_bpp == BMP_DEPTH_AUTO) {
+                expected_bpp = ref_depth_for_image(&inputs[i]);
+                chosen.cases++;
+                if (bpp != expected_bpp) chosen.max_diff = 256;
+            }
+
+            // Header, a palette for 1bpp and 8bpp, then padded rows
+            int row_width = (int)(floor((bpp*((double)inputs[i].width) + 31.0)/32.0)*4.0);
+            size_t palette_size = bpp <= 8 ? 4u << bpp : 0;
+            file_size[d].cases++;
+            if (size != 0x36 + palette_size + (size_t)row_width*inputs[i].height) {
+                file_size[d].max_diff = 256;
+            }
+
+            struct image expected;
+            if (copy_struct_image(&expected, &inputs[i]) != IMAGE_OK) {
+                error(1, 0, "Couldn't allocate memory for test image");
+            }
+            ref_reduce_depth(expected_bpp, &expected);
+
+            struct image decoded;
+            if (bmp_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+                error(1, 0, "Couldn't decode test image");
+            }
+            compare_images(&expected, &decoded, &round_trip[d]);
+            free_struct_image(&decoded);
+
+            if (lseek(fildes, 0, SEEK_SET) == -1 || bmp_stream_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+                error(1, 0, "Couldn't stream decode test image");
+            }
+            compare_images(&expected, &decoded, &streamed[d]);
+            free_struct_image(&decoded);
+
+            if (bmp_to_struct_image_threads(fildes, &decoded, NULL, 3) != IMAGE_OK) {
+                error(1, 0, "Couldn't decode test image on threads");
+            }
+            compare_images(&expected, &decoded, &threaded_decode[d]);
+            free_struct_image(&decoded);
+
+            // A region at an odd offset, which isn't on a byte of a 1bpp row
+            int x1 = inputs[i].width > 2 ? inputs[i].width/3 | 1 : 0;
+            int x2 = inputs[i].width > 2 ? inputs[i].width - 1 : inputs[i].width;
+            int y1 = inputs[i].height/4, y2 = inputs[i].height*3/4 + 1;
+            struct image expected_region;
+            if (copy_struct_image_region(&expected_region, &expected, x1, y1, x2, y2) != IMAGE_OK
+                    || bmp_region_to_struct_image(fildes, x1, y1, x2, y2, &decoded, NULL) != IMAGE_OK) {
+                error(1, 0, "Couldn't decode test image region");
+            }
+            compare_images(&expected_region, &decoded, &region_decode[d]);
+            free_struct_image(&expected_region);
+            free_struct_image(&decoded);
+
+            struct image expected_preview;
+            copy_image(&expected_preview, &expected);
+            ref_preview(3, &expected_preview);
+            if (bmp_to_struct_image_preview(fildes, &decoded, NULL, 3) != IMAGE_OK) {
+                error(1, 0, "Couldn't decode test image preview");
+            }
+            compare_images(&expected_preview, &decoded, &preview[d]);
+            free_struct_image(&expected_preview);
+            free_struct_image(&decoded);
+
+            // Written after some junk, the rows have to land after the header wherever it is
+            if (ftruncate(fildes, 0) == -1 || lseek(fildes, 0, SEEK_SET) == -1 || write(fildes, "junk", 4) != 4) {
+                int errsv = errno;
+                error(1, errsv, "Couldn't reset temporary file");
+            }
+            if (struct_image_to_bmp_depth_threads(fildes, &inputs[i], depths[d], 3) != IMAGE_OK
+                    || write(fildes, "end", 3) != 3) {
+                error(1, errno, "Couldn't encode test image on threads");
+            }
+            size_t threaded_size;
+            uint8_t *threaded_bytes = read_whole_file(fildes, &threaded_size);
+            threaded_encode[d].cases++;
+            if (threaded_size != size + 7 || memcmp(threaded_bytes + 4, bytes, size) != 0
+                    || memcmp(threaded_bytes + 4 + size, "end", 3) != 0) {
+                threaded_encode[d].max_diff = 256;
+            }
+            free(threaded_bytes);
+
+            // Written as four quarters, split on a byte of a 1bpp row
+            int split_x = inputs[i].width/16*8, split_y = inputs[i].height/2;
+            if (ftruncate(fildes, 0) == -1 || write_bmp_header_for_regions(fildes, inputs[i].width, inputs[i].height,
+                                                                           expected_bpp) != IMAGE_OK) {
+                error(1, errno, "Couldn't write region header");
+            }
+            int q;
+            for (q = 0; q < 4; q++) {
+                int qx1 = q & 1 ? split_x : 0, qx2 = q & 1 ? inputs[i].width : split_x;
+                int qy1 = q & 2 ? split_y : 0, qy2 = q & 2 ? inputs[i].height : split_y;
+                if (qx1 == qx2 || qy1 == qy2) continue;
+                struct image quarter;
+                if (copy_struct_image_region(&quarter, &expected, qx1, qy1, qx2, qy2) != IMAGE_OK
+                        || struct_image_region_to_bmp(fildes, &quarter, qx1, qy1, inputs[i].width, inputs[i].height,
+                                                      expected_bpp) != IMAGE_OK) {
+                    error(1, errno, "Couldn't encode test image region");
+                }
+                free_struct_image(&quarter);
+            }
+            size_t region_size;
+            uint8_t *region_bytes = read_whole_file(fildes, &region_size);
+            region_encode[d].cases++;
+            if (region_size != size || memcmp(region_bytes, bytes, size) != 0) {
+                region_encode[d].max_diff = 256;
+            }
+            free(region_bytes);
+            free_struct_image(&expected);
+            free(bytes);
+        }
+    }
+    close(fildes);
+
+    report("codec", "auto depth chosen", 0, &chosen);
+    for (d = 0; d < 3; d++) {
+        char variant_name[64];
+        snprintf(variant_name, sizeof(variant_name), "%s file size", names[d]);
+        report("codec", variant_name, 0, &file_size[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s round trip", names[d]);
+        report("codec", variant_name, 0, &round_trip[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s streamed", names[d]);
+        report("codec", variant_name, 0, &streamed[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s threaded encode", names[d]);
+        report("codec", variant_name, 0, &threaded_encode[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s threaded decode", names[d]);
+        report("codec", variant_name, 0, &threaded_decode[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s region decode", names[d]);
+        report("codec", variant_name, 0, &region_decode[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s region encode", names[d]);
+        report("codec", variant_name, 0, &region_encode[d]);
+        snprintf(variant_name, sizeof(variant_name), "%s preview", names[d]);
+        report("codec", variant_name, 0, &preview[d]);
+    }
+}
+
+// Layouts the decoder must read that the encoder never writes
+struct bmp_layout {
+    const char *name;
+    int bpp;
+    int top_down;
+    uint32_t info_header_size;
+    uint32_t compression;
+};
+
+static const struct bmp_layout input_layouts[] = {
+    {"24bpp top down", 24, 1, 40, 0},
+    {"32bpp", 32, 0, 40, 0},
+    {"32bpp top down", 32, 1, 40, 0},
+    {"32bpp bitfields", 32, 0, 40, 3},
+    {"32bpp V5 top down", 32, 1, 124, 3}
+};
+#define N_OF_INPUT_LAYOUTS (int)(sizeof(input_layouts)/sizeof(input_layouts[0]))
+
+// Builds the bytes of a bitmap in the given layout, independently
+// of bmp_struct_image.c. 32bpp pixels get a junk alpha byte
+uint8_t *ref_encode(const struct image *img, const struct bmp_layout *layout, size_t *size) {
+    uint32_t masks_size = layout->compression == 3 && layout->info_header_size == 40 ? 12 : 0;
+    uint32_t offset = 14 + layout->info_header_size + masks_size;
+    int row_width = (int)(floor((layout->bpp*((double)img->width) + 31.0)/32.0)*4.0);
+    *size = offset + (size_t)row_width*img->height;
+
+    uint8_t *bytes = calloc(*size, 1);
+    if (bytes == NULL) {
+        error(1, 0, "Couldn't allocate memory for encoded image");
+    }
+    uint32_t file_size = *size;
+    int32_t height = layout->top_down ? -img->height : img->height;
+    uint16_t planes = 1;
+    uint16_t bpp = layout->bpp;
+    uint32_t masks[3] = {0x00FF0000, 0x0000FF00, 0x000000FF};
+    memcpy(bytes, "BM", 2);
+    memcpy(bytes + 0x2, &file_size, 4);
+    memcpy(bytes + 0xA, &offset, 4);
+    memcpy(bytes + 0xE, &layout->info_header_size, 4);
+    memcpy(bytes + 0x12, &img->width, 4);
+    memcpy(bytes + 0x16, &height, 4);
+    memcpy(bytes + 0x1A, &planes, 2);
+    memcpy(bytes + 0x1C, &bpp, 2);
+    memcpy(bytes + 0x1E, &layout->compression, 4);
+    if (layout->compression == 3) {
+        memcpy(bytes + 0x36, masks, sizeof(masks));
+    }
+
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        int file_row = layout->top_down ? y : img->height - 1 - y;
+        uint8_t *row = bytes + offset + (size_t)file_row*row_width;
+        for (x = 0; x < img->width; x++) {
+            struct pixel pix = sample_pixel(x, y, img);
+            uint8_t *out = row + x*layout->bpp/8;
+            out[0] = pix.Blue;
+            out[1] = pix.Green;
+            out[2] = pix.Red;
+            if (layout->bpp == 32) out[3] = x + y;
+        }
+    }
+    return bytes;
+}
+
+// Decodes every input layout with both readers
+void run_input_layout_check(struct image *inputs, int n_of_inputs) {
+    struct check_result round_trip[N_OF_INPUT_LAYOUTS];
+    struct check_result streamed[N_OF_INPUT_LAYOUTS];
+
+    char path[] = "/tmp/bmpedit-check-XXXXXX";
+    int fildes = mkstemp(path);
+    if (fildes == -1) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary file");
+    }
+    unlink(path);
+
+    int l, i;
+    for (l = 0; l < N_OF_INPUT_LAYOUTS; l++) {
+        struct check_result empty = {0, 0, INFINITY};
+        round_trip[l] = empty;
+        streamed[l] = empty;
+        for (i = 0; i < n_of_inputs; i++) {
+            size_t size;
+            uint8_t *bytes = ref_encode(&inputs[i], &input_layouts[l], &size);
+            if (ftruncate(fildes, 0) == -1 || pwrite(fildes, bytes, size, 0) != (ssize_t)size) {
+                int errsv = errno;
+                error(1, errsv, "Couldn't write temporary file");
+            }
+            free(bytes);
+
+            struct image decoded;
+            if (bmp_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+                error(1, 0, "Couldn't decode %s test image", input_layouts[l].name);
+            }
+            compare_images(&inputs[i], &decoded, &round_trip[l]);
+            free_struct_image(&decoded);
+
+            if (lseek(fildes, 0, SEEK_SET) == -1 || bmp_stream_to_struct_image(fildes, &decoded, NULL) != IMAGE_OK) {
+                error(1, 0, "Couldn't stream decode %s test image", input_layouts[l].name);
+            }
+            compare_images(&inputs[i], &decoded, &streamed[l]);
+            free_struct_image(&decoded);
+        }
+    }
+    close(fildes);
+
+    for (l = 0; l < N_OF_INPUT_LAYOUTS; l++) {
+        char variant_name[64];
+        snprintf(variant_name, sizeof(variant_name), "%s decode", input_layouts[l].name);
+        report("codec", variant_name, 0, &round_trip[l]);
+        snprintf(variant_name, sizeof(variant_name), "%s streamed", input_layouts[l].name);
+        report("codec", variant_name, 0, &streamed[l]);
+    }
+}
+
+// Headers whose sizes don't fit before the pixels, which both readers
+// must refuse rather than seek or skip by a wrapped amount
+void run_bad_header_check(const struct image *img) {
+    // Info header sizes, for a 24bpp file and a 32bpp bitfields one
+    static const uint32_t bad_sizes[][2] = {
+        {0xFFFFFFF5, 0},    // 14 more wraps round to 3
+        {0xFFFFFFFF, 0},
+        {1000, 0},          // runs past the pixel offset
+        {44, 3}             // too short to hold the masks that follow it
+    };
+    struct check_result result = {0, 0, INFINITY};
+    char path[] = "/tmp/bmpedit-check-XXXXXX";
+    int fildes = mkstemp(path);
+    if (fildes == -1) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary file");
+    }
+    unlink(path);
+
+    int i;
+    for (i = 0; i < (int)(sizeof(bad_sizes)/sizeof(bad_sizes[0])); i++) {
+        struct bmp_layout layout = {"bad", bad_sizes[i][1] == 3 ? 32 : 24, 0, 40, bad_sizes[i][1]};
+        size_t size;
+        uint8_t *bytes = ref_encode(img, &layout, &size);
+        memcpy(bytes + 0xE, &bad_sizes[i][0], 4);
+        if (ftruncate(fildes, 0) == -1 || pwrite(fildes, bytes, size, 0) != (ssize_t)size) {
+            int errsv = errno;
+            error(1, errsv, "Couldn't write temporary file");
+        }
+        free(bytes);
+
+        struct image decoded;
+        int status = bmp_to_struct_image(fildes, &decoded, NULL);
+        if (status == IMAGE_OK) free_struct_image(&decoded);
+        if (status != IMAGE_ERR_FORMAT) result.max_diff = 256;
+        if (lseek(fildes, 0, SEEK_SET) == -1) error(1, errno, "Couldn't seek temporary file");
+        status = bmp_stream_to_struct_image(fildes, &decoded, NULL);
+        if (status == IMAGE_OK) free_struct_image(&decoded);
+        if (status != IMAGE_ERR_FORMAT) result.max_diff = 256;
+        result.cases++;
+    }
+    close(fildes);
+    report("codec", "bad header sizes refused", 0, &result);
+}
+
+// Reads img's bitmap back both ways for each target size. new_width
+// and new_height are numerators over 5, 0 keeps the aspect ratio
+static const int resize_targets[][3] = {
+    {1, 0, RESIZE_AUTO}, {0, 2, RESIZE_AUTO}, {2, 1, RESIZE_AREA}, {3, 4, RESIZE_LANCZOS}
+};
+#define N_OF_RESIZE_TARGETS (int)(sizeof(resize_targets)/sizeof(resize_targets[0]))
+
+void check_resize_decode(int fildes, const struct image *img, int streamed, struct check_result *result) {
+    int t;
+    for (t = 0; t < N_OF_RESIZE_TARGETS; t++) {
+        int new_width = resize_targets[t][0] ? scaled_size(img->width, resize_targets[t][0], 5) : 0;
+        int new_height = resize_targets[t][1] ? scaled_size(img->height, resize_targets[t][1], 5) : 0;
+        int method = resize_targets[t][2];
+
+        struct image expected;
+        struct image actual;
+        if (lseek(fildes, 0, SEEK_SET) == -1 || bmp_to_struct_image(fildes, &expected, NULL) != IMAGE_OK
+                || resize_image(new_width, new_height, method, &expected) != IMAGE_OK) {
+            error(1, 0, "Couldn't decode and resize test image");
+        }
+        int status;
+        if (lseek(fildes, 0, SEEK_SET) == -1) {
+            int errsv = errno;
+            error(1, errsv, "Couldn't rewind temporary file");
+        }
+        if (streamed) {
+            // The stream reader is only picked for pipes, so call it through a pipe
+            int pipe_fds[2];
+            size_t size;
+            uint8_t *bytes = read_whole_file(fildes, &size);
+            if (pipe(pipe_fds) == -1) {
+                int errsv = errno;
+                error(1, errsv, "Couldn't create pipe");
+            }
+            if (fork() == 0) {
+                close(pipe_fds[0]);
+                ssize_t written = write(pipe_fds[1], bytes, size);
+                _exit(written == (ssize_t)size ? 0 : 1);
+            }
+            close(pipe_fds[1]);
+            status = bmp_to_struct_image_for_resize(pipe_fds[0], &actual, NULL, &new_width, &new_height, method);
+            close(pipe_fds[0]);
+            wait(NULL);
+            free(bytes);
+        } else {
+            status = bmp_to_struct_image_for_resize(fildes, &actual, NULL, &new_width, &new_height, method);
+        }
+        if (status != IMAGE_OK || resize_reduced_image(new_width, new_height, method, &actual) != IMAGE_OK) {
+            error(1, 0, "Couldn't resize test image while decoding");
+        }
+        compare_images(&expected, &actual, result);
+        free_struct_image(&expected);
+        free_struct_image(&actual);
+    }
+}
+
+// Bottom up files at the depth -d auto picks (so grey images take
+// the palette path) and top down files, through both readers
+void run_resize_decode_check(struct image *inputs, int n_of_inputs) {
+    struct check_result seekable = {0, 0, INFINITY};
+    struct check_result streamed = {0, 0, INFINITY};
+    struct check_result top_down = {0, 0, INFINITY};
+
+    char path[] = "/tmp/bmpedit-check-XXXXXX";
+    int fildes = mkstemp(path);
+    if (fildes == -1) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary file");
+    }
+    unlink(path);
+
+    int i;
+    for (i = 0; i < n_of_inputs; i++) {
+        if (ftruncate(fildes, 0) == -1 || lseek(fildes, 0, SEEK_SET) == -1) {
+            int errsv = errno;
+            error(1, errsv, "Couldn't reset temporary file");
+        }
+        if (struct_image_to_bmp_depth(fildes, &inputs[i], BMP_DEPTH_AUTO) != IMAGE_OK) {
+            error(1, errno, "Couldn't encode test image");
+        }
+        check_resize_decode(fildes, &inputs[i], 0, &seekable);
+        check_resize_decode(fildes, &inputs[i], 1, &streamed);
+
+        size_t size;
+        uint8_t *bytes = ref_encode(&inputs[i], &input_layouts[0], &size);
+        if (ftruncate(fildes, 0) == -1 || pwrite(fildes, bytes, size, 0) != (ssize_t)size) {
+            int errsv = errno;
+            error(1, errsv, "Couldn't write temporary file");
+        }
+        free(bytes);
+        check_resize_decode(fildes, &inputs[i], 0, &top_down);
+    }
+    close(fildes);
+
+    report("codec", "resize while decoding", 0, &seekable);
+    report("codec", "resize while streaming", 0, &streamed);
+    report("codec", "resize top down", 0, &top_down);
+}
+
+// Pyramid checks
+// Every level must be the reference 2x2 reduction of the level above,
+// for 3 and 1 channel images, and tiles must be exact copies
+void run_pyramid_check(struct image *inputs, int n_of_inputs) {
+    struct check_result levels_result = {0, 0, INFINITY};
+    struct check_result grey_result = {0, 0, INFINITY};
+    struct check_result tiles_result = {0, 0, INFINITY};
+
+    int i, grey;
+    for (i = 0; i < n_of_inputs; i++) {
+        for (grey = 0; grey < 2; grey++) {
+            struct image img;
+            struct image expected;
+            copy_image(&img, &inputs[i]);
+            copy_image(&expected, &inputs[i]);
+            if (grey) {
+                greyscale_image(&img);
+                ref_greyscale(&expected);
+            }
+
+            // A 1x1 image has no levels
+            int n_of_levels = pyramid_depth(img.width, img.height);
+            if (n_of_levels > 0) {
+                struct image *levels = malloc(n_of_levels*sizeof(struct image));
+                if (levels == NULL || build_image_pyramid(&img, n_of_levels, levels) != IMAGE_OK) {
+                    error(1, 0, "Couldn't build pyramid");
+                }
+                int level;
+                for (level = 0; level < n_of_levels; level++) {
+                    ref_reduce(2, 2, &expected);
+                    compare_images(&expected, &levels[level], grey ? &grey_result : &levels_result);
+                    free_struct_image(&levels[level]);
+                }
+                free(levels);
+            }
+            free_struct_image(&expected);
+
+            // A tile from the middle, like --tile-size cuts
+            int x1 = img.width/3;
+            int y1 = img.height/4;
+            int x2 = x1 + 1 + img.width/2;
+            int y2 = y1 + 1 + img.height/3;
+            struct image tile;
+            copy_image(&expected, &inputs[i]);
+            if (grey) ref_greyscale(&expected);
+            ref_crop(x1, y1, x2, y2, &expected);
+            if (copy_struct_image_region(&tile, &img, x1, y1, x2, y2) != IMAGE_OK) {
+                error(1, 0, "Couldn't copy tile");
+            }
+            compare_images(&expected, &tile, &tiles_result);
+            free_struct_image(&tile);
+            free_struct_image(&expected);
+            free_struct_image(&img);
+        }
+    }
+
+    report("pyramid", "levels", 0, &levels_result);
+    report("pyramid", "1 channel levels", 0, &grey_result);
+    report("pyramid", "tiles", 0, &tiles_result);
+}
+
+// Histogram checks
+// Counts must be exact whatever the number of threads, including an
+// image big enough that compute_image_histogram() would split it
+
+void ref_histogram(const struct image *img, struct image_histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            struct pixel pix = sample_pixel(x, y, img);
+            histogram->luminance[(int)((pix.Red + pix.Green + pix.Blue)/3.0)]++;
+            histogram->red[pix.Red]++;
+            histogram->green[pix.Green]++;
+            histogram->blue[pix.Blue]++;
+            histogram->n_of_pixels++;
+        }
+    }
+}
+
+void compare_histograms(const struct image_histogram *expected, const struct image_histogram *actual,
+                        struct check_result *result) {
+    result->cases++;
+    if (memcmp(expected, actual, sizeof(*expected)) != 0) {
+        result->max_diff = 256;
+    }
+}
+
+void run_histogram_check(struct image *inputs, int n_of_inputs) {
+    struct check_result rgb = {0, 0, INFINITY};
+    struct check_result grey = {0, 0, INFINITY};
+    struct check_result threads = {0, 0, INFINITY};
+
+    int i;
+    for (i = 0; i < n_of_inputs; i++) {
+        struct image_histogram expected;
+        struct image_histogram actual;
+        struct image img;
+        copy_image(&img, &inputs[i]);
+        ref_histogram(&img, &expected);
+        compute_image_histogram(&img, &actual);
+        compare_histograms(&expected, &actual, &rgb);
+
+        greyscale_image(&img);
+        ref_histogram(&img, &expected);
+        compute_image_histogram(&img, &actual);
+        compare_histograms(&expected, &actual, &grey);
+        free_struct_image(&img);
+    }
+
+    // Sizes that don't split evenly between the threads
+    struct image big;
+    make_random_image(1031, 1019, 0, &big);
+    struct image_histogram expected;
+    ref_histogram(&big, &expected);
+    int n_of_threads;
+    for (n_of_threads = 1; n_of_threads <= 5; n_of_threads++) {
+        struct image_histogram actual;
+        compute_image_histogram_threads(&big, &actual, n_of_threads);
+        compare_histograms(&expected, &actual, &threads);
+    }
+    greyscale_image(&big);
+    ref_histogram(&big, &expected);
+    for (n_of_threads = 1; n_of_threads <= 5; n_of_threads++) {
+        struct image_histogram actual;
+        compute_image_histogram_threads(&big, &actual, n_of_threads);
+        compare_histograms(&expected, &actual, &threads);
+    }
+    free_struct_image(&big);
+
+    report("histogram", "counts", 0, &rgb);
+    report("histogram", "1 channel counts", 0, &grey);
+    report("histogram", "threaded counts", 0, &threads);
+}
+
+// Summed-area table checks
+// Window sums must match direct sums, and the table must
+// come out the same whatever the number of threads
+
+void run_integral_check(struct image *inputs, int n_of_inputs) {
+    struct check_result windows = {0, 0, INFINITY};
+    struct check_result threads = {0, 0, INFINITY};
+
+    int i;
+    for (i = 0; i < n_of_inputs; i++) {
+        struct image *img = &inputs[i];
+        struct integral_image integral;
+        if (build_integral_image(img, 1, &integral) != IMAGE_OK) {
+            error(1, 0, "Couldn't build summed-area table");
+        }
+        int w;
+        for (w = 0; w < 8; w++) {
+            int x1 = check_random() % img->width;
+            int y1 = check_random() % img->height;
+            int x2 = x1 + 1 + check_random() % (img->width - x1);
+            int y2 = y1 + 1 + check_random() % (img->height - y1);
+            uint64_t sum = 0, squares = 0;
+            int x,y;
+            for (y = y1; y < y2; y++) {
+                for (x = x1; x < x2; x++) {
+                    uint8_t green = ref_pixel(x, y, img)->Green;
+                    sum += green;
+                    squares += green*green;
+                }
+            }
+            windows.cases++;
+            if (integral_window_sum(&integral, integral.sums, 1, x1, y1, x2, y2) != sum
+                    || integral_window_sum(&integral, integral.squares, 1, x1, y1, x2, y2) != squares) {
+                windows.max_diff = 256;
+            }
+        }
+        free_integral_image(&integral);
+    }
+
+    struct image big;
+    make_random_image(1031, 1019, 0, &big);
+    struct integral_image expected;
+    if (build_integral_image_threads(&big, 1, &expected, 1) != IMAGE_OK) {
+        error(1, 0, "Couldn't build summed-area table");
+    }
+    size_t table_size = (size_t)(big.width + 1)*(big.height + 1)*big.channels*sizeof(uint64_t);
+    int n_of_threads;
+    for (n_of_threads = 2; n_of_threads <= 5; n_of_threads++) {
+        struct integral_image actual;
+        if (build_integral_image_threads(&big, 1, &actual, n_of_threads) != IMAGE_OK) {
+            error(1, 0, "Couldn't build summed-area table");
+        }
+        threads.cases++;
+        if (memcmp(expected.sums, actual.sums, table_size) != 0 || memcmp(expected.squares, actual.squares, table_size) != 0) {
+            threads.max_diff = 256;
+        }
+        free_integral_image(&actual);
+    }
+    free_integral_image(&expected);
+    free_struct_image(&big);
+
+    report("integral", "window sums", 0, &windows);
+    report("integral", "threaded tables", 0, &threads);
+}
+
+// Allocator checks
+// Every buffer a filter allocates must come from the image's allocator
+// and be given back, apart from the pixel array it leaves behind
+
+struct counting_context {
+    long outstanding;
+    long total;
+};
+
+void *counting_alloc(size_t size, void *context) {
+    struct counting_context *counts = context;
+    counts->outstanding++;
+    counts->total++;
+    return malloc(size);
+}
+
+void counting_free(void *ptr, void *context) {
+    struct counting_context *counts = context;
+    counts->outstanding--;
+    free(ptr);
+}
+
+void run_allocator_check(struct image *inputs, struct image *inputs_2, int n_of_inputs) {
+    struct check_result result = {0, 0, INFINITY};
+    struct counting_context counts = {0, 0};
+    struct image_allocator allocator = {counting_alloc, counting_free, &counts};
+
+    int c, i;
+    for (c = 0; c < N_OF_FILTER_CHECKS; c++) {
+        const struct filter_variant *variant = &filter_checks[c].variants[0];
+        for (i = 0; i < n_of_inputs; i++) {
+            struct image img;
+            if (init_struct_image(&img, inputs[i].width, inputs[i].height, &allocator) != IMAGE_OK) {
+                error(1, 0, "Couldn't allocate memory for test image");
+            }
+            memcpy(img.pixel_array, inputs[i].pixel_array, inputs[i].n_of_pixels*sizeof(struct pixel));
+            variant->apply(&img, &inputs_2[i]);
+            free_struct_image(&img);
+
+            result.cases++;
+            if (counts.outstanding != 0) {
+                result.max_diff = 256;
+                counts.outstanding = 0;
+            }
+        }
+    }
+    report("allocator", "balanced allocations", 0, &result);
+}
+
+// Result cache checks
+// The hash must give the published xxHash64 values however the data
+// is split, a chain that starts like an earlier one must pick up the
+// image it saved and write the same bytes as a run without the cache,
+// and a changed option, second input or kernel file must miss
+
+struct hash_vector {
+    const char *text;
+    uint64_t hash;
+};
+
+static const struct hash_vector hash_vectors[] = {
+    {"", 0xEF46DB3751D8E999ULL},
+    {"a", 0xD24EC4F1A98C6E5BULL},
+    {"abc", 0x44BC2CF5AD770999ULL},
+    {"Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ULL},
+    {"The quick brown fox jumps over the lazy dog", 0x0B242D361FDA71BCULL}
+};
+#define N_OF_HASH_VECTORS (int)(sizeof(hash_vectors)/sizeof(hash_vectors[0]))
+
+void write_check_image(const char *path, struct image *img) {
+    int fildes = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (fildes == -1 || struct_image_to_bmp(fildes, img) != IMAGE_OK || close(fildes) == -1) {
+        error(1, errno, "Couldn't write %s", path);
+    }
+}
+
+void write_check_kernel(const char *path, int centre) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL || fprintf(file, "1 2 1\n2 %d 2\n1 2 1\n", centre) < 0 || fclose(file) != 0) {
+        error(1, errno, "Couldn't write %s", path);
+    }
+}
+
+void compare_files(const char *expected_path, const char *actual_path, struct check_result *result) {
+    int expected_fildes = open(expected_path, O_RDONLY);
+    int actual_fildes = open(actual_path, O_RDONLY);
+    if (expected_fildes == -1 || actual_fildes == -1) {
+        error(1, errno, "Couldn't open chain output");
+    }
+    size_t expected_size, actual_size;
+    uint8_t *expected = read_whole_file(expected_fildes, &expected_size);
+    uint8_t *actual = read_whole_file(actual_fildes, &actual_size);
+    result->cases++;
+    if (expected_size != actual_size || memcmp(expected, actual, expected_size) != 0) {
+        result->max_diff = 256;
+    }
+    free(expected);
+    free(actual);
+    close(expected_fildes);
+    close(actual_fildes);
+}
+
+// Parses a bmpedit command line (NULL terminated) into chain. The
+// arguments are copied into argv as parsing cuts some of them up,
+// free them with free_check_argv()
+int parse_check_chain(char **check_argv, char **argv, struct filter_chain *chain) {
+    int argc;
+    for (argc = 0; check_argv[argc] != NULL; argc++) {
+        argv[argc] = strdup(check_argv[argc]);
+        if (argv[argc] == NULL) error(1, 0, "Couldn't copy arguments");
+    }
+    argv[argc] = NULL;
+
+    char message[256];
+    if (parse_filter_chain(argc, argv, chain, message, sizeof(message)) != IMAGE_OK) {
+        error(1, 0, "Couldn't parse chain: %s", message);
+    }
+    return argc;
+}
+
+void free_check_argv(char **argv, int argc) {
+    int i;
+    for (i = 0; i < argc; i++) free(argv[i]);
+}
+
+// Runs a bmpedit command line through the chain, first looking up the
+// stage the cache has for it and whether it has the whole output
+void run_check_chain(char **check_argv, int *from_stage, int *output_is_cached) {
+    char *argv[32];
+    struct filter_chain chain;
+    char message[256];
+    int argc = parse_check_chain(check_argv, argv, &chain);
+
+    *from_stage = CHAIN_STAGE_INPUT;
+    *output_is_cached = 0;
+    if (chain.cache_dir != NULL) {
+        struct result_cache cache;
+        struct image img;
+        char path[4096];
+        int fildes = open(chain.input_file_name, O_RDONLY);
+        if (fildes == -1 || open_result_cache(&cache, &chain, fildes) != IMAGE_OK
+                || load_cached_stage(&cache, NULL, from_stage, &img) != IMAGE_OK
+                || result_cache_path(&cache, CHAIN_STAGE_OUTPUT, path, sizeof(path)) != IMAGE_OK) {
+            error(1, 0, "Couldn't look up the cache");
+        }
+        close(fildes);
+        if (*from_stage != CHAIN_STAGE_INPUT) free_struct_image(&img);
+        *output_is_cached = access(path, F_OK) == 0;
+    }
+
+    if (run_filter_chain(&chain, -1, NULL, NULL, message, sizeof(message)) != IMAGE_OK) {
+        error(1, 0, "Couldn't run chain: %s", message);
+    }
+    free_check_argv(argv, argc);
+}
+
+void check_cache_lookup(int from_stage, int output_is_cached, int expected_stage, int expected_output,
+                        struct check_result *result) {
+    result->cases++;
+    if (from_stage != expected_stage || output_is_cached != expected_output) {
+        result->max_diff = 256;
+    }
+}
+
+void remove_check_dir(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    char entry_path[4096];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+        if (unlink(entry_path) == -1) remove_check_dir(entry_path);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+void run_result_cache_check() {
+    struct check_result vectors = {0, 0, INFINITY};
+    struct check_result pieces = {0, 0, INFINITY};
+    struct check_result picked_up = {0, 0, INFINITY};
+    struct check_result same_output = {0, 0, INFINITY};
+    struct check_result misses = {0, 0, INFINITY};
+
+    int v;
+    size_t piece_size;
+    for (v = 0; v < N_OF_HASH_VECTORS; v++) {
+        const char *text = hash_vectors[v].text;
+        size_t length = strlen(text);
+        struct content_hash hash;
+        content_hash_init(&hash);
+        content_hash_update(&hash, text, length);
+        vectors.cases++;
+        if (content_hash_final(&hash) != hash_vectors[v].hash) vectors.max_diff = 256;
+
+        // Pieces that straddle the 32 byte stripes
+        for (piece_size = 1; piece_size <= 33; piece_size += 4) {
+            size_t done;
+            content_hash_init(&hash);
+            for (done = 0; done < length; done += piece_size) {
+                content_hash_update(&hash, text + done, length - done < piece_size ? length - done : piece_size);
+            }
+            pieces.cases++;
+            if (content_hash_final(&hash) != hash_vectors[v].hash) pieces.max_diff = 256;
+        }
+    }
+
+    char dir[] = "/tmp/bmpedit-check-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary directory");
+    }
+    char cache_dir[64], input[64], input_2[64], kernel[64];
+    char uncached[64], first[64], second[64], third[64];
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", dir);
+    snprintf(input, sizeof(input), "%s/in.bmp", dir);
+    snprintf(input_2, sizeof(input_2), "%s/in2.bmp", dir);
+    snprintf(kernel, sizeof(kernel), "%s/kernel.txt", dir);
+    snprintf(uncached, sizeof(uncached), "%s/uncached.bmp", dir);
+    snprintf(first, sizeof(first), "%s/first.bmp", dir);
+    snprintf(second, sizeof(second), "%s/second.bmp", dir);
+    snprintf(third, sizeof(third), "%s/third.bmp", dir);
+
+    struct image img;
+    make_random_image(67, 53, 0, &img);
+    write_check_image(input, &img);
+    free_struct_image(&img);
+    make_random_image(67, 53, 3, &img);
+    write_check_image(input_2, &img);
+    free_struct_image(&img);
+    write_check_kernel(kernel, 4);
+
+    int from_stage, output_is_cached;
+
+    // A chain sharing the blur and box mean with an earlier one starts
+    // after the box mean, and the second time is a copy of the output
+    char *uncached_argv[] = {"bmpedit", "-G", "1,1", "-m", "2", "-t", "0.5", "-o", uncached, input, NULL};
+    char *prefix_argv[] = {"bmpedit", "--cache", cache_dir, "-G", "1,1", "-m", "2", "-o", first, input, NULL};
+    char *shared_argv[] = {"bmpedit", "--cache", cache_dir, "-G", "1,1", "-m", "2", "-t", "0.5", "-o", second, input, NULL};
+    char *repeat_argv[] = {"bmpedit", "--cache", cache_dir, "-G", "1,1", "-m", "2", "-t", "0.5", "-o", third, input, NULL};
+    run_check_chain(uncached_argv, &from_stage, &output_is_cached);
+    run_check_chain(prefix_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+    run_check_chain(shared_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_BOX_MEAN, 0, &picked_up);
+    compare_files(uncached, second, &same_output);
+    run_check_chain(repeat_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_BOX_MEAN, 1, &picked_up);
+    compare_files(uncached, third, &same_output);
+
+    // A different blur changes every stage after it
+    char *option_argv[] = {"bmpedit", "--cache", cache_dir, "-G", "1,1.5", "-m", "2", "-t", "0.5", "-o", first, input, NULL};
+    run_check_chain(option_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+
+    // The same file names with new contents
+    char *blend_uncached_argv[] = {"bmpedit", "-b", "0.3", "-m", "1", "-o", uncached, input, input_2, NULL};
+    char *blend_argv[] = {"bmpedit", "--cache", cache_dir, "-b", "0.3", "-m", "1", "-o", first, input, input_2, NULL};
+    run_check_chain(blend_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+    make_random_image(67, 53, 1, &img);
+    write_check_image(input_2, &img);
+    free_struct_image(&img);
+    run_check_chain(blend_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+    run_check_chain(blend_uncached_argv, &from_stage, &output_is_cached);
+    compare_files(uncached, first, &same_output);
+
+    char *kernel_uncached_argv[] = {"bmpedit", "-k", kernel, "-m", "1", "-o", uncached, input, NULL};
+    char *kernel_argv[] = {"bmpedit", "--cache", cache_dir, "-k", kernel, "-m", "1", "-o", first, input, NULL};
+    run_check_chain(kernel_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+    write_check_kernel(kernel, 12);
+    run_check_chain(kernel_argv, &from_stage, &output_is_cached);
+    check_cache_lookup(from_stage, output_is_cached, CHAIN_STAGE_INPUT, 0, &misses);
+    run_check_chain(kernel_uncached_argv, &from_stage, &output_is_cached);
+    compare_files(uncached, first, &same_output);
+
+    remove_check_dir(dir);
+
+    report("result cache", "xxHash64 vectors", 0, &vectors);
+    report("result cache", "hash in pieces", 0, &pieces);
+    report("result cache", "picked up stage", 0, &picked_up);
+    report("result cache", "same as uncached", 0, &same_output);
+    report("result cache", "changed input misses", 0, &misses);
+}
+
+// Memory plan checks
+// A chain run a strip or tile at a time under --max-memory must write
+// the same bytes as the whole image, for filters that need a halo of
+// pixels round each piece. Budgets are lowered from the whole image's
+// estimate until the planner picks strips, then tiles
+
+// Plans chain (NULL terminated) for its input under budget bytes,
+// 0 for no limit. Returns IMAGE_ERR_NO_MEMORY if nothing fits
+int check_plan(char **check_argv, uint64_t budget, struct memory_plan *plan) {
+    char *argv[32];
+    struct filter_chain chain;
+    char message[256];
+    int argc = parse_check_chain(check_argv, argv, &chain);
+    chain.max_memory = budget;
+    int fildes = open(chain.input_file_name, O_RDONLY);
+    if (fildes == -1) error(1, errno, "Couldn't open %s", chain.input_file_name);
+    int status = plan_filter_chain(&chain, fildes, plan, message, sizeof(message));
+    close(fildes);
+    free_check_argv(argv, argc);
+    if (status != IMAGE_OK && status != IMAGE_ERR_NO_MEMORY) error(1, 0, "Couldn't plan chain: %s", message);
+    return status;
+}
+
+// Sets result failing unless got is expected
+void check_preview_value(double got, double expected, struct check_result *result) {
+    if (fabs(got - expected) > 1e-9) result->max_diff = 256;
+}
+
+// Scales chains for previews of a 400x300 image and checks every size
+// against the numbers worked out by hand. Blurs keep their total
+// variance over factor^2, windows and resizes are rounded, and crops
+// are widened to whole preview pixels and kept inside the preview
+void run_preview_scale_check() {
+    struct check_result gaussian = {0, 0, INFINITY};
+    struct check_result windows = {0, 0, INFINITY};
+    struct check_result crop = {0, 0, INFINITY};
+    struct check_result resize = {0, 0, INFINITY};
+    char *argv[32];
+    struct filter_chain chain;
+    int argc;
+
+    // 8 blurs of sd 2 at a quarter size are 1 of variance 8*4/16
+    char *blur_argv[] = {"bmpedit", "-G", "8,2", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(blur_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.gaussian_repeat, 1, &gaussian);
+    check_preview_value(chain.gaussian_standard_deviation, sqrt(2.0), &gaussian);
+    free_check_argv(argv, argc);
+    gaussian.cases++;
+
+    // One blur stays one, 9 variance over 4
+    char *one_blur_argv[] = {"bmpedit", "-G", "1,3", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(one_blur_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 2, 200, 150);
+    check_preview_value(chain.gaussian_repeat, 1, &gaussian);
+    check_preview_value(chain.gaussian_standard_deviation, 1.5, &gaussian);
+    free_check_argv(argv, argc);
+    gaussian.cases++;
+
+    // 18 blurs at a third size are 2, each of variance 18*1/9/2
+    char *many_blur_argv[] = {"bmpedit", "-G", "18,1", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(many_blur_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 3, 133, 100);
+    check_preview_value(chain.gaussian_repeat, 2, &gaussian);
+    check_preview_value(chain.gaussian_standard_deviation, 1.0, &gaussian);
+    free_check_argv(argv, argc);
+    gaussian.cases++;
+
+    char *median_argv[] = {"bmpedit", "-M", "5", "-x", "open,9x4", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(median_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 3, 133, 100);
+    check_preview_value(chain.median_radius, 2, &windows);
+    check_preview_value(chain.morphology_width, 3, &windows);
+    check_preview_value(chain.morphology_height, 1, &windows);
+    free_check_argv(argv, argc);
+    windows.cases++;
+
+    // Windows never go below a pixel
+    char *small_argv[] = {"bmpedit", "-M", "1", "-x", "close,2x1", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(small_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.median_radius, 0, &windows);
+    check_preview_value(chain.morphology_width, 1, &windows);
+    check_preview_value(chain.morphology_height, 1, &windows);
+    free_check_argv(argv, argc);
+    windows.cases++;
+
+    // Rounded outwards to whole preview pixels
+    char *crop_argv[] = {"bmpedit", "-c", "10,21,101,55", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(crop_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.crop_x1, 2, &crop);
+    check_preview_value(chain.crop_y1, 5, &crop);
+    check_preview_value(chain.crop_x2, 26, &crop);
+    check_preview_value(chain.crop_y2, 14, &crop);
+    free_check_argv(argv, argc);
+    crop.cases++;
+
+    // A pixel wide crop in the corner keeps a pixel inside the preview
+    char *corner_argv[] = {"bmpedit", "-c", "399,299,400,300", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(corner_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 3, 133, 100);
+    check_preview_value(chain.crop_x1, 132, &crop);
+    check_preview_value(chain.crop_y1, 99, &crop);
+    check_preview_value(chain.crop_x2, 133, &crop);
+    check_preview_value(chain.crop_y2, 100, &crop);
+    free_check_argv(argv, argc);
+    crop.cases++;
+
+    // Turned on its side, the crop is bounded by the preview's height
+    char *rotated_argv[] = {"bmpedit", "--rotate", "90", "-c", "0,280,300,400", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(rotated_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.crop_x1, 0, &crop);
+    check_preview_value(chain.crop_y1, 70, &crop);
+    check_preview_value(chain.crop_x2, 75, &crop);
+    check_preview_value(chain.crop_y2, 100, &crop);
+    free_check_argv(argv, argc);
+    crop.cases++;
+
+    // A height of 0 keeps the aspect ratio and stays 0
+    char *resize_argv[] = {"bmpedit", "-r", "300x0", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(resize_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.resize_width, 75, &resize);
+    check_preview_value(chain.resize_height, 0, &resize);
+    free_check_argv(argv, argc);
+    resize.cases++;
+
+    char *tiny_argv[] = {"bmpedit", "-r", "3x1", "-o", "out.bmp", "in.bmp", NULL};
+    argc = parse_check_chain(tiny_argv, argv, &chain);
+    scale_filter_chain_for_preview(&chain, 4, 100, 75);
+    check_preview_value(chain.resize_width, 1, &resize);
+    check_preview_value(chain.resize_height, 1, &resize);
+    free_check_argv(argv, argc);
+    resize.cases++;
+
+    report("preview", "gaussian sd and repeat", 0, &gaussian);
+    report("preview", "median and morphology", 0, &windows);
+    report("preview", "crop", 0, &crop);
+    report("preview", "resize", 0, &resize);
+}
+
+void run_memory_plan_check() {
+    struct check_result strips = {0, 0, INFINITY};
+    struct check_result tiles = {0, 0, INFINITY};
+
+    char dir[] = "/tmp/bmpedit-check-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary directory");
+    }
+    char input[64], whole[64], pieces[64];
+    snprintf(input, sizeof(input), "%s/in.bmp", dir);
+    snprintf(whole, sizeof(whole), "%s/whole.bmp", dir);
+    snprintf(pieces, sizeof(pieces), "%s/pieces.bmp", dir);
+    struct image img;
+    make_random_image(613, 157, 3, &img);
+    write_check_image(input, &img);
+    uint64_t image_bytes = (uint64_t)img.width*img.height*3;
+    free_struct_image(&img);
+
+    char *filters[][8] = {
+        {"-G", "2,1.5", NULL},
+        {"-M", "3", NULL},
+        {"-x", "open,5x3", NULL},
+        {"--bilateral", "1,25", NULL},
+        {"-a", "sauvola,6", NULL},
+        {"-G", "1,1", "-M", "2", "-x", "close,3x5", NULL},
+        {"-c", "20,10,600,150", "-m", "4", "-S", NULL}
+    };
+    int n_of_filters = (int)(sizeof(filters)/sizeof(filters[0]));
+    int f;
+    for (f = 0; f < n_of_filters; f++) {
+        char budget_arg[32];
+        char *check_argv[32];
+        int from_stage, output_is_cached;
+        int n = 0, j;
+        check_argv[n++] = "bmpedit";
+        for (j = 0; filters[f][j] != NULL; j++) check_argv[n++] = filters[f][j];
+        check_argv[n++] = "-o";
+        check_argv[n++] = whole;
+        check_argv[n++] = input;
+        check_argv[n] = NULL;
+        run_check_chain(check_argv, &from_stage, &output_is_cached);
+
+        // The same with --max-memory in front, writing the other file
+        char *budget_argv[32];
+        budget_argv[0] = "bmpedit";
+        budget_argv[1] = "--max-memory";
+        budget_argv[2] = budget_arg;
+        for (j = 1; j <= n; j++) budget_argv[j + 2] = check_argv[j];
+        budget_argv[n] = pieces;
+
+        struct memory_plan plan;
+        check_plan(check_argv, 0, &plan);
+        uint64_t step = image_bytes/64;
+        uint64_t budget;
+        int found_strips = 0, found_tiles = 0;
+        for (budget = plan.whole_bytes - step; budget > step && !found_tiles; budget -= step) {
+            if (check_plan(check_argv, budget, &plan) != IMAGE_OK) break;
+            if ((plan.mode == MEMORY_PLAN_STRIPS && !found_strips) || plan.mode == MEMORY_PLAN_TILES) {
+                snprintf(budget_arg, sizeof(budget_arg), "%" PRIu64, budget);
+                run_check_chain(budget_argv, &from_stage, &output_is_cached);
+                compare_files(whole, pieces, plan.mode == MEMORY_PLAN_STRIPS ? &strips : &tiles);
+                found_strips |= plan.mode == MEMORY_PLAN_STRIPS;
+                found_tiles |= plan.mode == MEMORY_PLAN_TILES;
+            }
+        }
+        if (!found_strips) strips.max_diff = 256;
+        if (!found_tiles) tiles.max_diff = 256;
+    }
+
+    remove_check_dir(dir);
+    report("memory plan", "strips same as whole", 0, &strips);
+    report("memory plan", "tiles same as whole", 0, &tiles);
+}
+
+// Batch checks
+// Every file of a batch must come out the same as running the chain on
+// it alone, whatever the number of batch threads
+
+void run_batch_check() {
+    struct check_result result = {0, 0, INFINITY};
+    static const int sizes[][2] = {{1, 1}, {67, 53}, {13, 300}, {301, 211}};
+    int n_of_sizes = (int)(sizeof(sizes)/sizeof(sizes[0]));
+
+    char dir[] = "/tmp/bmpedit-check-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        int errsv = errno;
+        error(1, errsv, "Couldn't create temporary directory");
+    }
+    char batch_dir[64], single[64];
+    char inputs[4][64];
+    snprintf(batch_dir, sizeof(batch_dir), "%s/batch", dir);
+    snprintf(single, sizeof(single), "%s/single.bmp", dir);
+    int i;
+    for (i = 0; i < n_of_sizes; i++) {
+        struct image img;
+        snprintf(inputs[i], sizeof(inputs[i]), "%s/in%d.bmp", dir, i);
+        make_random_image(sizes[i][0], sizes[i][1], i % 4, &img);
+        write_check_image(inputs[i], &img);
+        free_struct_image(&img);
+    }
+
+    char *filters[][8] = {
+        {"-G", "1,1", "-m", "2", "-t", "auto", NULL},
+        {"--bilateral", "2,30", "-a", "sauvola,4", "-x", "open,3x3", NULL},
+        {"-g", "-M", "2", "-S", "-d", "auto", NULL}
+    };
+    int n_of_filters = (int)(sizeof(filters)/sizeof(filters[0]));
+    int f, n_of_threads;
+    for (f = 0; f < n_of_filters; f++) {
+        for (n_of_threads = 1; n_of_threads <= 3; n_of_threads += 2) {
+            char *check_argv[32];
+            char *argv[32];
+            char message[256];
+            struct filter_chain chain;
+            int n = 0, j;
+            check_argv[n++] = "bmpedit";
+            check_argv[n++] = "--batch";
+            check_argv[n++] = batch_dir;
+            for (j = 0; filters[f][j] != NULL; j++) check_argv[n++] = filters[f][j];
+            for (i = 0; i < n_of_sizes; i++) check_argv[n++] = inputs[i];
+            check_argv[n] = NULL;
+            int argc = parse_check_chain(check_argv, argv, &chain);
+            if (run_filter_chain_batch(&chain, n_of_threads, NULL, message, sizeof(message)) != IMAGE_OK) {
+                error(1, 0, "Couldn't run batch: %s", message);
+            }
+            free_check_argv(argv, argc);
+
+            for (i = 0; i < n_of_sizes; i++) {
+                char batch_output[128];
+                n = 0;
+                check_argv[n++] = "bmpedit";
+                for (j = 0; filters[f][j] != NULL; j++) check_argv[n++] = filters[f][j];
+                check_argv[n++] = "-o";
+                check_argv[n++] = single;
+                check_argv[n++] = inputs[i];
+                check_argv[n] = NULL;
+                argc = parse_check_chain(check_argv, argv, &chain);
+                if (run_filter_chain(&chain, -1, NULL, NULL, message, sizeof(message)) != IMAGE_OK) {
+                    error(1, 0, "Couldn't run chain: %s", message);
+                }
+                free_check_argv(argv, argc);
+
+                snprintf(batch_output, sizeof(batch_output), "%s/in%d.bmp", batch_dir, i);
+                compare_files(single, batch_output, &result);
+            }
+        }
+    }
+
+    remove_check_dir(dir);
+    report("batch", "same as single runs", 0, &result);
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        rng_state = strtoul(argv[1], NULL, 0);
+        if (rng_state == 0) rng_state = 1;
+    }
+    printf("bmpedit golden-output check, seed 0x%08" PRIx32 "\n", rng_state);
+
+    int n_of_inputs = (N_OF_FIXED_SIZES + N_OF_RANDOM_SIZES)*4;
+    struct image *inputs = malloc(n_of_inputs*sizeof(struct image));
+    struct image *inputs_2 = malloc(n_of_inputs*sizeof(struct image));
+
+    int i, kind, n = 0;
+    for (i = 0; i < N_OF_FIXED_SIZES + N_OF_RANDOM_SIZES; i++) {
+        int width, height;
+        if (i < N_OF_FIXED_SIZES) {
+            width = fixed_sizes[i][0];
+            height = fixed_sizes[i][1];
+        } else {
+            width = 1 + check_random() % MAX_RANDOM_SIDE;
+            height = 1 + check_random() % MAX_RANDOM_SIDE;
+        }
+        for (kind = 0; kind < 4; kind++, n++) {
+            make_random_image(width, height, kind, &inputs[n]);
+            make_random_image(width, height, 0, &inputs_2[n]);
+        }
+    }
+
+    run_codec_check(inputs, n_of_inputs);
+    run_depth_check(inputs, n_of_inputs);
+    run_input_layout_check(inputs, n_of_inputs);
+    run_bad_header_check(&inputs[0]);
+    run_resize_decode_check(inputs, n_of_inputs);
+    run_pyramid_check(inputs, n_of_inputs);
+    run_histogram_check(inputs, n_of_inputs);
+    run_integral_check(inputs, n_of_inputs);
+    run_allocator_check(inputs, inputs_2, n_of_inputs);
+    run_brightness_sweep_check();
+    run_result_cache_check();
+    run_batch_check();
+    run_memory_plan_check();
+    run_preview_scale_check();
+
+    int c;
+    for (c = 0; c < N_OF_FILTER_CHECKS; c++) {
+        int v;
+        for (v = 0; v < MAX_VARIANTS && filter_checks[c].variants[v].name != NULL; v++) {
+            run_filter_check(&filter_checks[c], &filter_checks[c].variants[v], inputs, inputs_2, n_of_inputs);
+        }
+    }
+
+    for (i = 0; i < n_of_inputs; i++) {
+        free_struct_image(&inputs[i]);
+        free_struct_image(&inputs_2[i]);
+    }
+    free(inputs);
+    free(inputs_2);
+
+    if (failures) {
+        printf("%d check(s) FAILED\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,472 @@
+/* colour_matrix.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Colour matrix filters. Each new channel is a sum of
+ * the old channels times the matrix values plus an
+ * offset, worked out in 16 bit fixed point, with SSE2
+ * where the compiler has it
+ *
+ */
+
+#include "colour_matrix.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define COLOUR_MATRIX_SHIFT 16
+#define COLOUR_MATRIX_ONE (1 << COLOUR_MATRIX_SHIFT)
+
+// Rounding each value to the nearest 1/65536 is out by at most half of
+// that, times 255 for each of the three channels, plus half for the
+// offset. Adding this to every sum keeps it from being under the real
+// one, so sums that should be whole numbers don't come out one less
+#define COLOUR_MATRIX_BIAS 384
+
+// Values the SSE2 sums can take without going past 32 bits, 16 for
+// the matrix values and 4096 for the offsets
+#define COLOUR_MATRIX_SSE2_MAX_VALUE (16*COLOUR_MATRIX_ONE)
+#define COLOUR_MATRIX_SSE2_MAX_OFFSET (4096*COLOUR_MATRIX_ONE)
+
+// The matrix in fixed point with the rows and columns in the order
+// the channels are in memory, blue, green then red, and the bias
+// added to the offsets
+struct fixed_colour_matrix {
+    int32_t values[3][3];
+    int32_t offsets[3];
+};
+
+int32_t fixed_colour_value(double value);
+void fixed_colour_matrix(const struct colour_matrix *matrix, struct fixed_colour_matrix *fixed);
+int fixed_colour_rows_equal(const struct fixed_colour_matrix *fixed);
+int fixed_colour_fits_sse2(const struct fixed_colour_matrix *fixed);
+int fixed_colour_channel(const struct fixed_colour_matrix *fixed, int channel, int blue, int green, int red);
+void colour_matrix_pixels_scalar(const struct fixed_colour_matrix *fixed, uint8_t *bytes, size_t n_of_pixels);
+void colour_matrix_pixels_sse2(const struct fixed_colour_matrix *fixed, uint8_t *bytes, size_t n_of_pixels);
+void colour_matrix_grey_scalar(const struct fixed_colour_matrix *fixed, const uint8_t *bytes, uint8_t *grey,
+                               size_t n_of_pixels);
+void colour_matrix_grey_sse2(const struct fixed_colour_matrix *fixed, const uint8_t *bytes, uint8_t *grey,
+                             size_t n_of_pixels);
+int fixed_colour_is_invert(const struct fixed_colour_matrix *fixed);
+int colour_matrix_apply(const struct colour_matrix *matrix, struct image *img, int use_sse2);
+#ifdef __SSE2__
+void sse2_load_pixel_pairs(const uint8_t *pixels, __m128i pairs[2]);
+__m128i sse2_channel_sums(__m128i pair, __m128i high, __m128i low);
+void sse2_split_values(const int32_t *values, __m128i *high, __m128i *low);
+#endif
+
+void colour_matrix_identity(struct colour_matrix *matrix) {
+    memset(matrix, 0, sizeof(*matrix));
+    matrix->values[0][0] = 1.0;
+    matrix->values[1][1] = 1.0;
+    matrix->values[2][2] = 1.0;
+}
+
+// The pixel average in every channel, like greyscale_image()
+void colour_matrix_greyscale(struct colour_matrix *matrix) {
+    colour_matrix_saturation(0.0, matrix);
+}
+
+// Adds brightness_percentage_change times the sum of the channels
+// to each
+void colour_matrix_brightness(double brightness_percentage_change, struct colour_matrix *matrix) {
+    int c, k;
+    memset(matrix, 0, sizeof(*matrix));
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) {
+            matrix->values[c][k] = brightness_percentage_change + (c == k ? 1.0 : 0.0);
+        }
+    }
+}
+
+void colour_matrix_invert(struct colour_matrix *matrix) {
+    int c;
+    memset(matrix, 0, sizeof(*matrix));
+    for (c = 0; c < 3; c++) {
+        matrix->values[c][c] = -1.0;
+        matrix->values[c][3] = 255.0;
+    }
+}
+
+// The usual sepia tone matrix, brown and a little brighter
+void colour_matrix_sepia(struct colour_matrix *matrix) {
+    static const double sepia[3][4] = {{0.393, 0.769, 0.189, 0.0},
+                                       {0.349, 0.686, 0.168, 0.0},
+                                       {0.272, 0.534, 0.131, 0.0}};
+    memcpy(matrix->values, sepia, sizeof(sepia));
+}
+
+// Moves each channel away from the pixel average by saturation times
+// as much as it was, 0 is greyscale, 1 is no change
+void colour_matrix_saturation(double saturation, struct colour_matrix *matrix) {
+    int c, k;
+    memset(matrix, 0, sizeof(*matrix));
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) {
+            matrix->values[c][k] = (1.0 - saturation)/3.0 + (c == k ? saturation : 0.0);
+        }
+    }
+}
+
+void colour_matrix_white_balance(double red_gain, double green_gain, double blue_gain, struct colour_matrix *matrix) {
+    memset(matrix, 0, sizeof(*matrix));
+    matrix->values[0][0] = red_gain;
+    matrix->values[1][1] = green_gain;
+    matrix->values[2][2] = blue_gain;
+}
+
+// White balance that makes the average red, green and blue the same,
+// assuming the scene is grey on average. Gains are capped at
+// COLOUR_MATRIX_MAX_GAIN so a channel that is nearly empty isn't blown out
+int colour_matrix_grey_world(const struct image *img, struct colour_matrix *matrix) {
+    colour_matrix_identity(matrix);
+    if (img->channels == 1 || img->n_of_pixels == 0) return IMAGE_OK;
+
+    uint64_t sums[3] = {0, 0, 0};
+    size_t pixel_index;
+    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+        sums[0] += img->pixel_array[pixel_index].Red;
+        sums[1] += img->pixel_array[pixel_index].Green;
+        sums[2] += img->pixel_array[pixel_index].Blue;
+    }
+
+    double grey = (double)(sums[0] + sums[1] + sums[2])/3.0;
+    int c;
+    for (c = 0; c < 3; c++) {
+        matrix->values[c][c] = sums[c] == 0 ? 1.0 : fmin(grey/sums[c], COLOUR_MATRIX_MAX_GAIN);
+    }
+    return IMAGE_OK;
+}
+
+// order is three of r, g and b, the old channels to take the new red,
+// green and blue from, so "bgr" swaps red and blue and "ggg" is the
+// green channel in grey. Returns IMAGE_ERR_ARGUMENT for anything else
+int colour_matrix_swap(const char *order, struct colour_matrix *matrix) {
+    static const char channel_names[] = "rgb";
+    if (strlen(order) != 3) return IMAGE_ERR_ARGUMENT;
+
+    memset(matrix, 0, sizeof(*matrix));
+    int c;
+    for (c = 0; c < 3; c++) {
+        const char *name = strchr(channel_names, order[c]);
+        if (name == NULL) return IMAGE_ERR_ARGUMENT;
+        matrix->values[c][name - channel_names] = 1.0;
+    }
+    return IMAGE_OK;
+}
+
+// product is first then second. Nothing is rounded or clamped in
+// between, so running the product can differ from running the two
+// one after the other where first pushed a channel past 0 or 255
+void colour_matrix_multiply(const struct colour_matrix *second, const struct colour_matrix *first,
+                            struct colour_matrix *product) {
+    struct colour_matrix result;
+    int c, k, j;
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 4; k++) {
+            double sum = k == 3 ? second->values[c][3] : 0.0;
+            for (j = 0; j < 3; j++) {
+                sum += second->values[c][j]*first->values[j][k];
+            }
+            result.values[c][k] = sum;
+        }
+    }
+    *product = result;
+}
+
+// Rounds to the nearest 1/65536, kept inside 32 bits
+int32_t fixed_colour_value(double value) {
+    double fixed = floor(value*COLOUR_MATRIX_ONE + 0.5);
+    return (int32_t)fmax(-2147483647.0, fmin(2147483647.0 - COLOUR_MATRIX_BIAS, fixed));
+}
+
+void fixed_colour_matrix(const struct colour_matrix *matrix, struct fixed_colour_matrix *fixed) {
+    int c, k;
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) {
+            fixed->values[2 - c][2 - k] = fixed_colour_value(matrix->values[c][k]);
+        }
+        fixed->offsets[2 - c] = fixed_colour_value(matrix->values[c][3]) + COLOUR_MATRIX_BIAS;
+    }
+}
+
+// True when every new channel is the same sum, so the result is grey
+int fixed_colour_rows_equal(const struct fixed_colour_matrix *fixed) {
+    int c;
+    for (c = 1; c < 3; c++) {
+        if (memcmp(fixed->values[c], fixed->values[0], sizeof(fixed->values[0])) != 0
+                || fixed->offsets[c] != fixed->offsets[0]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int fixed_colour_fits_sse2(const struct fixed_colour_matrix *fixed) {
+    int c, k;
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) {
+            if (abs(fixed->values[c][k]) > COLOUR_MATRIX_SSE2_MAX_VALUE) return 0;
+        }
+        if (abs(fixed->offsets[c]) > COLOUR_MATRIX_SSE2_MAX_OFFSET) return 0;
+    }
+    return 1;
+}
+
+// New value of channel (in memory order) for one pixel, rounded down and
+// clamped to 0-255. 64 bits so any matrix fits
+int fixed_colour_channel(const struct fixed_colour_matrix *fixed, int channel, int blue, int green, int red) {
+    const int32_t *values = fixed->values[channel];
+    int64_t sum = (int64_t)values[0]*blue + (int64_t)values[1]*green + (int64_t)values[2]*red + fixed->offsets[channel];
+    if (sum < 0) return 0;
+    sum >>= COLOUR_MATRIX_SHIFT;
+    return sum > 255 ? 255 : (int)sum;
+}
+
+// n_of_pixels 24bpp pixels in place
+void colour_matrix_pixels_scalar(const struct fixed_colour_matrix *fixed, uint8_t *bytes, size_t n_of_pixels) {
+    size_t pixel_index;
+    for (pixel_index = 0; pixel_index < n_of_pixels; pixel_index++) {
+        uint8_t *pixel = bytes + pixel_index*3;
+        int blue = pixel[0], green = pixel[1], red = pixel[2];
+        pixel[0] = fixed_colour_channel(fixed, 0, blue, green, red);
+        pixel[1] = fixed_colour_channel(fixed, 1, blue, green, red);
+        pixel[2] = fixed_colour_channel(fixed, 2, blue, green, red);
+    }
+}
+
+// Grey values of n_of_pixels 24bpp pixels when every new channel is the same
+void colour_matrix_grey_scalar(const struct fixed_colour_matrix *fixed, const uint8_t *bytes, uint8_t *grey,
+                               size_t n_of_pixels) {
+    size_t pixel_index;
+    for (pixel_index = 0; pixel_index < n_of_pixels; pixel_index++) {
+        const uint8_t *pixel = bytes + pixel_index*3;
+        grey[pixel_index] = fixed_colour_channel(fixed, 0, pixel[0], pixel[1], pixel[2]);
+    }
+}
+
+#ifdef __SSE2__
+// Pixels are spread out to 16 bits as blue, green, red, 0, two to a
+// register, and multiplied with pmaddwd. That only takes 16 bit values,
+// so each matrix value is split into value/256 and value%256 and the two
+// sums put back together. The sums are in 32 bits, fixed_colour_fits_sse2()
+// has to be true. packs and packus do the clamping
+
+// Four pixels from 16 bytes at pixels, the last 4 bytes aren't used
+void sse2_load_pixel_pairs(const uint8_t *pixels, __m128i pairs[2]) {
+    const __m128i three_lanes = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i loaded = _mm_loadu_si128((const __m128i *)pixels);
+    __m128i first = _mm_unpacklo_epi8(loaded, zero);     // b0 g0 r0 b1 g1 r1 b2 g2
+    __m128i second = _mm_unpackhi_epi8(loaded, zero);    // r2 b3 g3 r3 ...
+    second = _mm_or_si128(_mm_srli_si128(first, 12), _mm_slli_si128(second, 4));
+    pairs[0] = _mm_and_si128(_mm_unpacklo_epi64(first, _mm_srli_si128(first, 6)), three_lanes);
+    pairs[1] = _mm_and_si128(_mm_unpacklo_epi64(second, _mm_srli_si128(second, 6)), three_lanes);
+}
+
+// {b*B + g*G, r*R} for both pixels of a pair, for the channel high and low are split from
+__m128i sse2_channel_sums(__m128i pair, __m128i high, __m128i low) {
+    return _mm_add_epi32(_mm_slli_epi32(_mm_madd_epi16(pair, high), 8), _mm_madd_epi16(pair, low));
+}
+
+void sse2_split_values(const int32_t *values, __m128i *high, __m128i *low) {
+    *high = _mm_setr_epi16(values[0] >> 8, values[1] >> 8, values[2] >> 8, 0,
+                           values[0] >> 8, values[1] >> 8, values[2] >> 8, 0);
+    *low = _mm_setr_epi16(values[0] & 255, values[1] & 255, values[2] & 255, 0,
+                          values[0] & 255, values[1] & 255, values[2] & 255, 0);
+}
+
+// The same sums as colour_matrix_pixels_scalar(), four pixels at a time
+void colour_matrix_pixels_sse2(const struct fixed_colour_matrix *fixed, uint8_t *bytes, size_t n_of_pixels) {
+    __m128i high[3], low[3];
+    int c;
+    for (c = 0; c < 3; c++) {
+        sse2_split_values(fixed->values[c], &high[c], &low[c]);
+    }
+    const __m128i offsets = _mm_setr_epi32(fixed->offsets[0], fixed->offsets[1], fixed->offsets[2], 0);
+    const __m128i first_three = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t pixel_index = 0;
+    // Each load is 16 bytes for 12 bytes of pixels
+    for (; pixel_index + 6 <= n_of_pixels; pixel_index += 4) {
+        uint8_t *pixels = bytes + pixel_index*3;
+        __m128i pairs[2];
+        sse2_load_pixel_pairs(pixels, pairs);
+
+        __m128i results[2];
+        int p;
+        for (p = 0; p < 2; p++) {
+            __m128i sums[3];
+            for (c = 0; c < 3; c++) {
+                sums[c] = sse2_channel_sums(pairs[p], high[c], low[c]);
+            }
+            __m128i blue_green = _mm_unpacklo_epi32(sums[0], sums[1]);
+            __m128i red = _mm_unpacklo_epi32(sums[2], zero);
+            __m128i pixel_0 = _mm_add_epi32(_mm_unpacklo_epi64(blue_green, red), _mm_unpackhi_epi64(blue_green, red));
+            blue_green = _mm_unpackhi_epi32(sums[0], sums[1]);
+            red = _mm_unpackhi_epi32(sums[2], zero);
+            __m128i pixel_1 = _mm_add_epi32(_mm_unpacklo_epi64(blue_green, red), _mm_unpackhi_epi64(blue_green, red));
+
+            pixel_0 = _mm_srai_epi32(_mm_add_epi32(pixel_0, offsets), COLOUR_MATRIX_SHIFT);
+            pixel_1 = _mm_srai_epi32(_mm_add_epi32(pixel_1, offsets), COLOUR_MATRIX_SHIFT);
+            // b g r 0 b g r 0 back to b g r b g r 0 0
+            __m128i packed = _mm_packs_epi32(pixel_0, pixel_1);
+            results[p] = _mm_or_si128(_mm_and_si128(packed, first_three), _mm_slli_si128(_mm_srli_si128(packed, 8), 6));
+        }
+
+        __m128i out = _mm_packus_epi16(_mm_or_si128(results[0], _mm_slli_si128(results[1], 12)),
+                                       _mm_srli_si128(results[1], 4));
+        _mm_storel_epi64((__m128i *)pixels, out);
+        uint32_t last_four = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+        memcpy(pixels + 8, &last_four, 4);
+    }
+    colour_matrix_pixels_scalar(fixed, bytes + pixel_index*3, n_of_pixels - pixel_index);
+}
+
+// The same as colour_matrix_grey_scalar(), four pixels at a time
+void colour_matrix_grey_sse2(const struct fixed_colour_matrix *fixed, const uint8_t *bytes, uint8_t *grey,
+                             size_t n_of_pixels) {
+    __m128i high, low;
+    sse2_split_values(fixed->values[0], &high, &low);
+    const __m128i offset = _mm_set1_epi32(fixed->offsets[0]);
+
+    size_t pixel_index = 0;
+    for (; pixel_index + 6 <= n_of_pixels; pixel_index += 4) {
+        __m128i pairs[2];
+        sse2_load_pixel_pairs(bytes + pixel_index*3, pairs);
+        // a0 b0 a1 b1 and a2 b2 a3 b3 to a0 a1 a2 a3 + b0 b1 b2 b3
+        __m128i sums_01 = _mm_shuffle_epi32(sse2_channel_sums(pairs[0], high, low), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i sums_23 = _mm_shuffle_epi32(sse2_channel_sums(pairs[1], high, low), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i sums = _mm_add_epi32(_mm_unpacklo_epi64(sums_01, sums_23), _mm_unpackhi_epi64(sums_01, sums_23));
+        sums = _mm_srai_epi32(_mm_add_epi32(sums, offset), COLOUR_MATRIX_SHIFT);
+        sums = _mm_packs_epi32(sums, sums);
+        uint32_t four = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sums, sums));
+        memcpy(grey + pixel_index, &four, 4);
+    }
+    colour_matrix_grey_scalar(fixed, bytes + pixel_index*3, grey + pixel_index, n_of_pixels - pixel_index);
+}
+#else
+void colour_matrix_pixels_sse2(const struct fixed_colour_matrix *fixed, uint8_t *bytes, size_t n_of_pixels) {
+    colour_matrix_pixels_scalar(fixed, bytes, n_of_pixels);
+}
+
+void colour_matrix_grey_sse2(const struct fixed_colour_matrix *fixed, const uint8_t *bytes, uint8_t *grey,
+                             size_t n_of_pixels) {
+    colour_matrix_grey_scalar(fixed, bytes, grey, n_of_pixels);
+}
+#endif
+
+// True for colour_matrix_invert(), which is done a byte at a time
+int fixed_colour_is_invert(const struct fixed_colour_matrix *fixed) {
+    int c, k;
+    for (c = 0; c < 3; c++) {
+        for (k = 0; k < 3; k++) {
+            if (fixed->values[c][k] != (c == k ? -COLOUR_MATRIX_ONE : 0)) return 0;
+        }
+        if (fixed->offsets[c] != 255*COLOUR_MATRIX_ONE + COLOUR_MATRIX_BIAS) return 0;
+    }
+    return 1;
+}
+
+// Runs the matrix over img. A matrix that gives grey makes a 1 channel
+// image like greyscale_image() does. A 1 channel image is looked up in
+// a table, and becomes 24bpp if the matrix gives colours
+int colour_matrix_apply(const struct colour_matrix *matrix, struct image *img, int use_sse2) {
+    struct fixed_colour_matrix fixed;
+    fixed_colour_matrix(matrix, &fixed);
+    int grey_result = fixed_colour_rows_equal(&fixed);
+    int sse2 = use_sse2 && fixed_colour_fits_sse2(&fixed);
+    size_t pixel_index;
+
+    if (fixed_colour_is_invert(&fixed)) {
+        uint8_t *bytes = img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+        size_t n_of_bytes = img->n_of_pixels*img->channels;
+        for (pixel_index = 0; pixel_index < n_of_bytes; pixel_index++) {
+            bytes[pixel_index] = 255 - bytes[pixel_index];
+        }
+        return IMAGE_OK;
+    }
+
+    if (img->channels == 1) {
+        uint8_t table[3][256];
+        int value, c;
+        for (value = 0; value < 256; value++) {
+            for (c = 0; c < 3; c++) {
+                table[c][value] = fixed_colour_channel(&fixed, c, value, value, value);
+            }
+        }
+        if (grey_result) {
+            for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+                img->grey_array[pixel_index] = table[0][img->grey_array[pixel_index]];
+            }
+            return IMAGE_OK;
+        }
+
+        struct pixel *pixel_array = image_alloc(img->allocator, img->n_of_pixels*sizeof(struct pixel));
+        if (pixel_array == NULL) return IMAGE_ERR_NO_MEMORY;
+        for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+            uint8_t grey_value = img->grey_array[pixel_index];
+            pixel_array[pixel_index].Blue = table[0][grey_value];
+            pixel_array[pixel_index].Green = table[1][grey_value];
+            pixel_array[pixel_index].Red = table[2][grey_value];
+        }
+        image_dealloc(img->allocator, img->grey_array);
+        img->grey_array = NULL;
+        img->pixel_array = pixel_array;
+        img->channels = 3;
+        return IMAGE_OK;
+    }
+
+    if (grey_result) {
+        uint8_t *grey_array = image_alloc(img->allocator, img->n_of_pixels);
+        if (grey_array == NULL) return IMAGE_ERR_NO_MEMORY;
+        if (sse2) {
+            colour_matrix_grey_sse2(&fixed, (uint8_t *)img->pixel_array, grey_array, img->n_of_pixels);
+        } else {
+            colour_matrix_grey_scalar(&fixed, (uint8_t *)img->pixel_array, grey_array, img->n_of_pixels);
+        }
+        image_dealloc(img->allocator, img->pixel_array);
+        img->pixel_array = NULL;
+        img->grey_array = grey_array;
+        img->channels = 1;
+        return IMAGE_OK;
+    }
+
+    if (sse2) {
+        colour_matrix_pixels_sse2(&fixed, (uint8_t *)img->pixel_array, img->n_of_pixels);
+    } else {
+        colour_matrix_pixels_scalar(&fixed, (uint8_t *)img->pixel_array, img->n_of_pixels);
+    }
+    return IMAGE_OK;
+}
+
+int colour_matrix_image(const struct colour_matrix *matrix, struct image *img) {
+    return colour_matrix_apply(matrix, img, 1);
+}
+
+// Never uses SSE2, for checking against
+int colour_matrix_image_scalar(const struct colour_matrix *matrix, struct image *img) {
+    return colour_matrix_apply(matrix, img, 0);
+}
+
+// Parses "red,green,blue" gains, each 0 to COLOUR_MATRIX_MAX_GAIN
+int parse_white_balance_arg(double *red_gain, double *green_gain, double *blue_gain, char *white_balance_arg) {
+    double *gains[3] = {red_gain, green_gain, blue_gain};
+    char *token = strtok(white_balance_arg, ",");
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (token == NULL) return IMAGE_ERR_ARGUMENT;
+        char *end;
+        *gains[i] = strtod(token, &end);
+        if (end == token || *end != '\0' || !(*gains[i] >= 0.0 && *gains[i] <= COLOUR_MATRIX_MAX_GAIN)) {
+            return IMAGE_ERR_ARGUMENT;
+        }
+        token = strtok(NULL, ",");
+    }
+    return token == NULL ? IMAGE_OK : IMAGE_ERR_ARGUMENT;
+}
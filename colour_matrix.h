@@ -0,0 +1,44 @@
+/* colour_matrix.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of colour matrix filters, where each
+ * new channel is a sum of the old channels plus an
+ * offset, and the matrices for the filters that are
+ * written that way
+ *
+ */
+
+#ifndef COLOUR_MATRIX_H
+#define COLOUR_MATRIX_H
+
+#include "image_data_types.h"
+
+// Biggest gain or saturation the command line takes, so products of
+// a few matrices stay well inside the fixed point range
+#define COLOUR_MATRIX_MAX_GAIN 8.0
+
+// values[c] = {red, green, blue, offset} for new channel c, 0 red,
+// 1 green and 2 blue. The offset is in 0-255 units
+struct colour_matrix {
+    double values[3][4];
+};
+
+void colour_matrix_identity(struct colour_matrix *matrix);
+void colour_matrix_greyscale(struct colour_matrix *matrix);
+void colour_matrix_brightness(double brightness_percentage_change, struct colour_matrix *matrix);
+void colour_matrix_invert(struct colour_matrix *matrix);
+void colour_matrix_sepia(struct colour_matrix *matrix);
+void colour_matrix_saturation(double saturation, struct colour_matrix *matrix);
+void colour_matrix_white_balance(double red_gain, double green_gain, double blue_gain, struct colour_matrix *matrix);
+int colour_matrix_grey_world(const struct image *img, struct colour_matrix *matrix);
+int colour_matrix_swap(const char *order, struct colour_matrix *matrix);
+void colour_matrix_multiply(const struct colour_matrix *second, const struct colour_matrix *first,
+                            struct colour_matrix *product);
+
+int colour_matrix_image(const struct colour_matrix *matrix, struct image *img);
+int colour_matrix_image_scalar(const struct colour_matrix *matrix, struct image *img);
+
+int parse_white_balance_arg(double *red_gain, double *green_gain, double *blue_gain, char *white_balance_arg);
+
+#endif
@@ -9,10 +9,29 @@
 
 #include "convolution_kernels.h"
 #include "image_data_helper_functions.h"
-#include <math.h>
+#include "fft.h"
 #include <stdlib.h>
-#include <errno.h>
-#include <error.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <math.h>
+
+// What the direct sum needs to work along a row. rows[j] is the image
+// row j rows from the current one, centre[j*kernel_width + i] the value
+// for the pixel i across and j down
+struct direct_convolution {
+    const uint8_t **rows;
+    const double *centre;
+    int kernel_width;
+    int radius_x;
+    int radius_y;
+    int width;
+    int channels;
+};
+
+void direct_pixel_clamped(const struct direct_convolution *convolution, int x, uint8_t *out_row);
+void direct_interior_grey(const struct direct_convolution *convolution, int x1, int x2, uint8_t *out_row);
+void direct_interior_rgb(const struct direct_convolution *convolution, int x1, int x2, uint8_t *out_row);
 
 // Calculates the gaussian function at distance with given standard_deviation,
 // in this file for gaussian kernel use
@@ -86,28 +105,331 @@ void apply_kernel_to_x_y(int x,int y, double kernel[5][5], struct image *img , s
 
 }
 
-void apply_kernel_to_struct_image(double kernel[5][5], struct image *img) {
-    struct pixel *pix;
-    struct image blurred_image;
-    blurred_image.width = img->width;
-    blurred_image.height = img->height;
-    blurred_image.n_of_pixels = img->n_of_pixels;
-    blurred_image.pixel_array = malloc(blurred_image.n_of_pixels*sizeof(struct pixel));
+// One pixel of the direct sum with every x clamped to the image, for the edges
+void direct_pixel_clamped(const struct direct_convolution *convolution, int x, uint8_t *out_row) {
+    int channels = convolution->channels;
+    double sums[3] = {0.0, 0.0, 0.0};
+    int i, j, c;
+    for (j = -convolution->radius_y; j <= convolution->radius_y; j++) {
+        const uint8_t *row = convolution->rows[j];
+        const double *kernel_row = convolution->centre + (ptrdiff_t)j*convolution->kernel_width;
+        for (i = -convolution->radius_x; i <= convolution->radius_x; i++) {
+            const uint8_t *pixel = row + (size_t)min(max(x + i, 0), convolution->width - 1)*channels;
+            for (c = 0; c < channels; c++) {
+                sums[c] += pixel[c]*kernel_row[i];
+            }
+        }
+    }
+    for (c = 0; c < channels; c++) {
+        out_row[(size_t)x*channels + c] = (int)fmin(255.0, fmax(sums[c], 0.0));
+    }
+}
 
-    if (blurred_image.pixel_array == NULL) {
-        int errsv = errno;
-        error(1, errsv, "Failed to allocate memory for the dummy image pixel array\n");
+// Pixels x1 to x2 of a single channel row, four at a time. Each pixel
+// has its own sum so they don't wait on each other
+void direct_interior_grey(const struct direct_convolution *convolution, int x1, int x2, uint8_t *out_row) {
+    int taps = 2*convolution->radius_x + 1;
+    int x, i, j;
+    for (x = x1; x + 4 <= x2; x += 4) {
+        double sum_0 = 0.0, sum_1 = 0.0, sum_2 = 0.0, sum_3 = 0.0;
+        for (j = -convolution->radius_y; j <= convolution->radius_y; j++) {
+            const uint8_t *pixels = convolution->rows[j] + x - convolution->radius_x;
+            const double *kernel_row = convolution->centre + (ptrdiff_t)j*convolution->kernel_width - convolution->radius_x;
+            for (i = 0; i < taps; i++) {
+                double value = kernel_row[i];
+                sum_0 += pixels[i]*value;
+                sum_1 += pixels[i + 1]*value;
+                sum_2 += pixels[i + 2]*value;
+                sum_3 += pixels[i + 3]*value;
+            }
+        }
+        out_row[x] = (int)fmin(255.0, fmax(sum_0, 0.0));
+        out_row[x + 1] = (int)fmin(255.0, fmax(sum_1, 0.0));
+        out_row[x + 2] = (int)fmin(255.0, fmax(sum_2, 0.0));
+        out_row[x + 3] = (int)fmin(255.0, fmax(sum_3, 0.0));
     }
+    for (; x < x2; x++) {
+        double sum = 0.0;
+        for (j = -convolution->radius_y; j <= convolution->radius_y; j++) {
+            const uint8_t *pixels = convolution->rows[j] + x - convolution->radius_x;
+            const double *kernel_row = convolution->centre + (ptrdiff_t)j*convolution->kernel_width - convolution->radius_x;
+            for (i = 0; i < taps; i++) {
+                sum += pixels[i]*kernel_row[i];
+            }
+        }
+        out_row[x] = (int)fmin(255.0, fmax(sum, 0.0));
+    }
+}
 
-    int x,y;
-    
+// Pixels x1 to x2 of a 24bpp row, the three channels are separate sums
+void direct_interior_rgb(const struct direct_convolution *convolution, int x1, int x2, uint8_t *out_row) {
+    int taps = 2*convolution->radius_x + 1;
+    int x, i, j;
+    for (x = x1; x < x2; x++) {
+        double sum_0 = 0.0, sum_1 = 0.0, sum_2 = 0.0;
+        for (j = -convolution->radius_y; j <= convolution->radius_y; j++) {
+            const uint8_t *pixels = convolution->rows[j] + (size_t)(x - convolution->radius_x)*3;
+            const double *kernel_row = convolution->centre + (ptrdiff_t)j*convolution->kernel_width - convolution->radius_x;
+            for (i = 0; i < taps; i++) {
+                double value = kernel_row[i];
+                sum_0 += pixels[3*i]*value;
+                sum_1 += pixels[3*i + 1]*value;
+                sum_2 += pixels[3*i + 2]*value;
+            }
+        }
+        out_row[(size_t)x*3] = (int)fmin(255.0, fmax(sum_0, 0.0));
+        out_row[(size_t)x*3 + 1] = (int)fmin(255.0, fmax(sum_1, 0.0));
+        out_row[(size_t)x*3 + 2] = (int)fmin(255.0, fmax(sum_2, 0.0));
+    }
+}
+
+// 5x5 kernels like the gaussian blur go through the same engine as
+// bigger ones
+int apply_kernel_to_struct_image(double kernel[5][5], struct image *img) {
+    struct convolution_kernel general_kernel = {5, 5, &kernel[0][0]};
+    return convolve_struct_image(&general_kernel, img);
+}
+
+// Runs a filter made with KERNEL_3X3_ROW() over every row, the rows
+// past the top and bottom are the edge rows
+int apply_kernel_3x3_rows(kernel_3x3_row_fn row_fn, const double *weights, struct image *img) {
+    struct image filtered;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, img->allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    size_t row_size = (size_t)img->width*img->channels;
+    const uint8_t *in = img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    uint8_t *out = img->channels == 1 ? filtered.grey_array : (uint8_t *)filtered.pixel_array;
+    int y;
+    for (y = 0; y < img->height; y++) {
+        const uint8_t *row = in + (size_t)y*row_size;
+        const uint8_t *above = y > 0 ? row - row_size : row;
+        const uint8_t *below = y < img->height - 1 ? row + row_size : row;
+        row_fn(above, row, below, img->width, img->channels, weights, out + (size_t)y*row_size);
+    }
+
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
+}
+
+int check_convolution_kernel(const struct convolution_kernel *kernel) {
+    if (kernel->width < 1 || kernel->height < 1 || kernel->width % 2 == 0 || kernel->height % 2 == 0
+            || kernel->values == NULL) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
+
+// Counts the columns and rows of zeros on both sides of the kernel,
+// which don't change any sum so can be skipped. Many of the 5x5
+// kernels are really 3x3
+void kernel_zero_margins(const struct convolution_kernel *kernel, int *margin_x, int *margin_y) {
+    int x, y;
+    *margin_x = 0;
+    while (*margin_x < kernel->width/2) {
+        int zero = 1;
+        for (y = 0; y < kernel->height && zero; y++) {
+            const double *row = kernel->values + (size_t)y*kernel->width;
+            zero = row[*margin_x] == 0.0 && row[kernel->width - 1 - *margin_x] == 0.0;
+        }
+        if (!zero) break;
+        (*margin_x)++;
+    }
+    *margin_y = 0;
+    while (*margin_y < kernel->height/2) {
+        int zero = 1;
+        const double *top = kernel->values + (size_t)*margin_y*kernel->width;
+        const double *bottom = kernel->values + (size_t)(kernel->height - 1 - *margin_y)*kernel->width;
+        for (x = 0; x < kernel->width && zero; x++) {
+            zero = top[x] == 0.0 && bottom[x] == 0.0;
+        }
+        if (!zero) break;
+        (*margin_y)++;
+    }
+}
+
+// normalise_kernel() for any size of kernel
+void normalise_convolution_kernel(struct convolution_kernel *kernel) {
+    size_t n_of_values = (size_t)kernel->width*kernel->height;
+    double kernel_sum = 0.0;
+    size_t i;
+    for (i = 0; i < n_of_values; i++) {
+        kernel_sum += kernel->values[i];
+    }
+    if (kernel_sum == 0.0) kernel_sum = 1.0;
+    for (i = 0; i < n_of_values; i++) {
+        kernel->values[i] = kernel->values[i]/kernel_sum;
+    }
+}
+
+// Reads a kernel written as rows of numbers, one row per line, separated
+// by spaces or commas. Blank lines and lines starting with # are skipped.
+// Every row must be the same odd length and there must be an odd number
+// of them. values is malloced, free with free_convolution_kernel()
+int read_convolution_kernel(FILE *file, struct convolution_kernel *kernel) {
+    size_t capacity = 64;
+    size_t n_of_values = 0;
+    double *values = malloc(capacity*sizeof(double));
+    if (values == NULL) return IMAGE_ERR_NO_MEMORY;
+
+    int width = 0;
+    int height = 0;
+    char line[65536];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            free(values);
+            return IMAGE_ERR_FORMAT;
+        }
+
+        char *position = line;
+        int row_width = 0;
+        while (1) {
+            while (isspace((unsigned char)*position) || *position == ',') position++;
+            if (*position == '\0' || *position == '#') break;
+
+            char *end;
+            double value = strtod(position, &end);
+            if (end == position || !isfinite(value)) {
+                free(values);
+                return IMAGE_ERR_FORMAT;
+            }
+            position = end;
+
+            if (n_of_values == capacity) {
+                capacity *= 2;
+                double *bigger = realloc(values, capacity*sizeof(double));
+                if (bigger == NULL) {
+                    free(values);
+                    return IMAGE_ERR_NO_MEMORY;
+                }
+                values = bigger;
+            }
+            values[n_of_values++] = value;
+            row_width++;
+        }
+
+        if (row_width == 0) continue;
+        if ((height > 0 && row_width != width) || row_width > CONVOLUTION_MAX_KERNEL_SIZE
+                || height == CONVOLUTION_MAX_KERNEL_SIZE) {
+            free(values);
+            return IMAGE_ERR_FORMAT;
+        }
+        width = row_width;
+        height++;
+    }
+
+    if (ferror(file)) {
+        free(values);
+        return IMAGE_ERR_IO;
+    }
+
+    kernel->width = width;
+    kernel->height = height;
+    kernel->values = values;
+    if (check_convolution_kernel(kernel) != IMAGE_OK) {
+        free_convolution_kernel(kernel);
+        return IMAGE_ERR_FORMAT;
+    }
+    return IMAGE_OK;
+}
+
+void free_convolution_kernel(struct convolution_kernel *kernel) {
+    free(kernel->values);
+    kernel->values = NULL;
+}
+
+// Convolves img with kernel, summing directly or with FFTs, whichever
+// should be quicker for the size of kernel and image. Pixels past the
+// edges are the nearest edge pixel, like get_nearest_pixel()
+int convolve_struct_image(const struct convolution_kernel *kernel, struct image *img) {
+    return convolve_struct_image_threads(kernel, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// convolve_struct_image() with an FFT convolution on n_of_threads threads
+int convolve_struct_image_threads(const struct convolution_kernel *kernel, struct image *img, int n_of_threads) {
+    int status = check_convolution_kernel(kernel);
+    if (status != IMAGE_OK) return status;
+
+    int margin_x, margin_y;
+    kernel_zero_margins(kernel, &margin_x, &margin_y);
+    int kernel_width = kernel->width - 2*margin_x;
+    int kernel_height = kernel->height - 2*margin_y;
+
+    int size_x, size_y;
+    double direct_cost = (double)img->n_of_pixels*img->channels*kernel_width*kernel_height;
+    double fft_cost = fft_convolution_cost(img->width, img->height, img->channels, kernel_width, kernel_height,
+                                           &size_x, &size_y);
+    if (fft_cost < direct_cost) {
+        return convolve_struct_image_fft_threads(kernel, img, n_of_threads);
+    }
+    return convolve_struct_image_direct(kernel, img);
+}
+
+// Sums the kernel times the pixels under it for every pixel. The sums
+// are added up in the same order as apply_kernel_to_x_y() so they come
+// out the same
+int convolve_struct_image_direct(const struct convolution_kernel *kernel, struct image *img) {
+    int status = check_convolution_kernel(kernel);
+    if (status != IMAGE_OK) return status;
+
+    int margin_x, margin_y;
+    kernel_zero_margins(kernel, &margin_x, &margin_y);
+    int radius_x = kernel->width/2 - margin_x;
+    int radius_y = kernel->height/2 - margin_y;
+    // Value for offset (dx,dy) from the pixel is centre[dy*kernel->width + dx]
+    const double *centre = kernel->values + (size_t)(kernel->height/2)*kernel->width + kernel->width/2;
+
+    struct image filtered;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, img->allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    const uint8_t **rows = image_alloc(img->allocator, (2*radius_y + 1)*sizeof(uint8_t *));
+    if (rows == NULL) {
+        free_struct_image(&filtered);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    struct direct_convolution convolution = {rows + radius_y, centre, kernel->width, radius_x, radius_y,
+                                             img->width, img->channels};
+    size_t row_size = (size_t)img->width*img->channels;
+    const uint8_t *in = img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    uint8_t *out = img->channels == 1 ? filtered.grey_array : (uint8_t *)filtered.pixel_array;
+    // Pixels the kernel doesn't go past the sides for
+    int interior_start = min(radius_x, img->width);
+    int interior_end = max(img->width - radius_x, interior_start);
+    int x, y, j;
     for (y = 0; y < img->height; y++) {
-        for (x = 0; x < img->width; x++) {
-            pix = get_pixel_pointer_from_struct_image_x_y(x, y, &blurred_image);
-            apply_kernel_to_x_y(x,y,kernel, img , pix);
+        // Rows past the top and bottom are the edge rows
+        for (j = -radius_y; j <= radius_y; j++) {
+            rows[j + radius_y] = in + (size_t)min(max(y + j, 0), img->height - 1)*row_size;
+        }
+
+        uint8_t *out_row = out + (size_t)y*row_size;
+        for (x = 0; x < interior_start; x++) {
+            direct_pixel_clamped(&convolution, x, out_row);
+        }
+        if (img->channels == 1) {
+            direct_interior_grey(&convolution, interior_start, interior_end, out_row);
+        } else {
+            direct_interior_rgb(&convolution, interior_start, interior_end, out_row);
+        }
+        for (x = interior_end; x < img->width; x++) {
+            direct_pixel_clamped(&convolution, x, out_row);
         }
     }
 
-    free(img->pixel_array);
-    img->pixel_array = blurred_image.pixel_array;
+    image_dealloc(img->allocator, rows);
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
 }
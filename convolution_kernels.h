@@ -17,8 +17,56 @@
 #define M_E  2.71828182845904523536
 #endif
 
+#include <stdio.h>
 #include "image_data_types.h"
 
+// Biggest kernel width or height read_convolution_kernel() takes
+#define CONVOLUTION_MAX_KERNEL_SIZE 4095
+
+// A kernel of any odd width and height, centred on its middle value.
+// values holds height rows of width, values[y*width + x]
+struct convolution_kernel {
+    int width;
+    int height;
+    double *values;
+};
+
+// Writes one output row of a 3x3 filter from the image rows above, on
+// and below it. weights is for filters whose taps aren't constants
+typedef void (*kernel_3x3_row_fn)(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                                  int width, int channels, const double *weights, uint8_t *out_row);
+
+// The 3x3 sum around byte i of the rows, with the pixels to the left
+// and right l and r bytes away. With constant taps the compiler drops
+// the zeros and turns the 1s and 2s into adds and shifts
+#define KERNEL_3X3_SUM(k00, k01, k02, k10, k11, k12, k20, k21, k22, i, l, r) \
+    ((k00)*above[(i) - (l)] + (k01)*above[i] + (k02)*above[(i) + (r)] \
+     + (k10)*row[(i) - (l)] + (k11)*row[i] + (k12)*row[(i) + (r)] \
+     + (k20)*below[(i) - (l)] + (k21)*below[i] + (k22)*below[(i) + (r)])
+
+// Defines name() as a kernel_3x3_row_fn setting each byte to PIXEL(i, l, r).
+// The end pixels stand in for the ones past the sides, and the middle
+// of the row goes byte by byte with the neighbours a constant 1 or 3
+// bytes away so it unrolls and vectorises
+#define KERNEL_3X3_ROW(name, PIXEL) \
+void name(const uint8_t *above, const uint8_t *row, const uint8_t *below, \
+          int width, int channels, const double *weights, uint8_t *out_row) { \
+    int last = (width - 1)*channels; \
+    int i; \
+    (void)weights; \
+    if (width == 1) { \
+        for (i = 0; i < channels; i++) out_row[i] = PIXEL(i, 0, 0); \
+        return; \
+    } \
+    for (i = 0; i < channels; i++) out_row[i] = PIXEL(i, 0, channels); \
+    if (channels == 1) { \
+        for (i = 1; i < last; i++) out_row[i] = PIXEL(i, 1, 1); \
+    } else { \
+        for (i = 3; i < last; i++) out_row[i] = PIXEL(i, 3, 3); \
+    } \
+    for (i = last; i < last + channels; i++) out_row[i] = PIXEL(i, channels, 0); \
+}
+
 double gaussian_function(double distance, double standard_deviation);
 double euclidean_distance(double x1, double y1, double x2, double y2);
 void generate_gaussian_kernel(double matrix[5][5], double standard_deviation);
@@ -26,6 +74,16 @@ void generate_gaussian_kernel(double matrix[5][5], double standard_deviation);
 void normalise_kernel(double kernel[5][5]);
 
 void apply_kernel_to_x_y(int x,int y, double kernel[5][5], struct image *img , struct pixel *pix);
-void apply_kernel_to_struct_image(double kernel[5][5], struct image *img);
+int apply_kernel_to_struct_image(double kernel[5][5], struct image *img);
+int apply_kernel_3x3_rows(kernel_3x3_row_fn row_fn, const double *weights, struct image *img);
+
+int check_convolution_kernel(const struct convolution_kernel *kernel);
+void kernel_zero_margins(const struct convolution_kernel *kernel, int *margin_x, int *margin_y);
+void normalise_convolution_kernel(struct convolution_kernel *kernel);
+int read_convolution_kernel(FILE *file, struct convolution_kernel *kernel);
+void free_convolution_kernel(struct convolution_kernel *kernel);
+int convolve_struct_image(const struct convolution_kernel *kernel, struct image *img);
+int convolve_struct_image_threads(const struct convolution_kernel *kernel, struct image *img, int n_of_threads);
+int convolve_struct_image_direct(const struct convolution_kernel *kernel, struct image *img);
 
 #endif
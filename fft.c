@@ -0,0 +1,413 @@
+/* fft.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Radix 2 fast Fourier transform, and convolution of
+ * big kernels with it. The image is cut into tiles,
+ * each tile is transformed with a border the size of
+ * the kernel around it (overlap-save), multiplied by
+ * the kernel's transform and transformed back. Two
+ * planes go through each transform at once, one as
+ * the real part and one as the imaginary part, which
+ * works because the kernel is real
+ *
+ */
+
+#include "fft.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Time for one transform of n values is about n*log2(n) times this,
+// in units of one multiply add of the direct sum. Measured against
+// convolve_struct_image_direct() for square and one row kernels
+#define FFT_COST_PER_VALUE 2.0
+
+// What the tiles share
+struct fft_convolution {
+    const struct image *img;
+    struct image *filtered;
+    int radius_x;
+    int radius_y;
+    int size_x;             // transform size, a power of 2
+    int size_y;
+    int tile_width;         // output pixels per tile
+    int tile_height;
+    int tiles_across;
+    struct fft_plan row_plan;
+    struct fft_plan column_plan;
+    double *kernel_re;      // transform of the kernel, conjugated and scaled
+    double *kernel_im;
+};
+
+// A run of (tile, channel) planes for one thread
+struct fft_job {
+    const struct fft_convolution *convolution;
+    size_t first_plane;
+    size_t end_plane;
+    double *re;
+    double *im;
+};
+
+int log2_of_power_of_2(int size);
+void fft_2d(const struct fft_convolution *convolution, double *re, double *im, int inverse, int rows_wanted);
+void load_fft_plane(const struct fft_convolution *convolution, size_t plane, double *values);
+void store_fft_plane(const struct fft_convolution *convolution, size_t plane, const double *values);
+void *fft_job_main(void *arg);
+int init_kernel_transform(struct fft_convolution *convolution, const struct convolution_kernel *kernel,
+                          int margin_x, int margin_y, const struct image_allocator *allocator);
+
+int log2_of_power_of_2(int size) {
+    int bits = 0;
+    while ((1 << bits) < size) bits++;
+    return bits;
+}
+
+int fft_plan_init(struct fft_plan *plan, int size, const struct image_allocator *allocator) {
+    int bits = log2_of_power_of_2(size);
+    if (size < 1 || (1 << bits) != size || bits > FFT_MAX_LOG2_SIZE) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    plan->size = size;
+    plan->bit_reverse = image_alloc(allocator, size*sizeof(int));
+    plan->cos_table = image_alloc(allocator, (size/2 + 1)*sizeof(double));
+    plan->sin_table = image_alloc(allocator, (size/2 + 1)*sizeof(double));
+    if (plan->bit_reverse == NULL || plan->cos_table == NULL || plan->sin_table == NULL) {
+        fft_plan_free(plan, allocator);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    int i, bit;
+    for (i = 0; i < size; i++) {
+        int reversed = 0;
+        for (bit = 0; bit < bits; bit++) {
+            if (i & (1 << bit)) reversed |= 1 << (bits - 1 - bit);
+        }
+        plan->bit_reverse[i] = reversed;
+    }
+    for (i = 0; i <= size/2; i++) {
+        plan->cos_table[i] = cos(2.0*M_PI*i/size);
+        plan->sin_table[i] = sin(2.0*M_PI*i/size);
+    }
+    return IMAGE_OK;
+}
+
+void fft_plan_free(struct fft_plan *plan, const struct image_allocator *allocator) {
+    image_dealloc(allocator, plan->bit_reverse);
+    image_dealloc(allocator, plan->cos_table);
+    image_dealloc(allocator, plan->sin_table);
+    plan->bit_reverse = NULL;
+    plan->cos_table = NULL;
+    plan->sin_table = NULL;
+}
+
+// Transforms re + i*im in place. The inverse isn't scaled by 1/size
+void fft(const struct fft_plan *plan, double *re, double *im, int inverse) {
+    int size = plan->size;
+    int i, k, half;
+    for (i = 0; i < size; i++) {
+        int j = plan->bit_reverse[i];
+        if (j > i) {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    double sign = inverse ? 1.0 : -1.0;
+    for (half = 1; half < size; half *= 2) {
+        int step = size/(2*half);
+        for (k = 0; k < half; k++) {
+            double w_re = plan->cos_table[k*step];
+            double w_im = sign*plan->sin_table[k*step];
+            for (i = k; i < size; i += 2*half) {
+                double t_re = re[i + half]*w_re - im[i + half]*w_im;
+                double t_im = re[i + half]*w_im + im[i + half]*w_re;
+                re[i + half] = re[i] - t_re;
+                im[i + half] = im[i] - t_im;
+                re[i] += t_re;
+                im[i] += t_im;
+            }
+        }
+    }
+}
+
+// Transforms every column of a plan->size x row_size array at once. The
+// butterflies work on whole rows, so the inner loops run along memory
+void fft_columns(const struct fft_plan *plan, double *re, double *im, int row_size, int inverse) {
+    int size = plan->size;
+    int i, k, x, half;
+    for (i = 0; i < size; i++) {
+        int j = plan->bit_reverse[i];
+        if (j > i) {
+            double *re_i = re + (size_t)i*row_size, *re_j = re + (size_t)j*row_size;
+            double *im_i = im + (size_t)i*row_size, *im_j = im + (size_t)j*row_size;
+            for (x = 0; x < row_size; x++) {
+                double t = re_i[x]; re_i[x] = re_j[x]; re_j[x] = t;
+                t = im_i[x]; im_i[x] = im_j[x]; im_j[x] = t;
+            }
+        }
+    }
+
+    double sign = inverse ? 1.0 : -1.0;
+    for (half = 1; half < size; half *= 2) {
+        int step = size/(2*half);
+        for (k = 0; k < half; k++) {
+            double w_re = plan->cos_table[k*step];
+            double w_im = sign*plan->sin_table[k*step];
+            for (i = k; i < size; i += 2*half) {
+                double *a_re = re + (size_t)i*row_size, *b_re = re + (size_t)(i + half)*row_size;
+                double *a_im = im + (size_t)i*row_size, *b_im = im + (size_t)(i + half)*row_size;
+                for (x = 0; x < row_size; x++) {
+                    double t_re = b_re[x]*w_re - b_im[x]*w_im;
+                    double t_im = b_re[x]*w_im + b_im[x]*w_re;
+                    b_re[x] = a_re[x] - t_re;
+                    b_im[x] = a_im[x] - t_im;
+                    a_re[x] += t_re;
+                    a_im[x] += t_im;
+                }
+            }
+        }
+    }
+}
+
+// 2D transform of a size_y x size_x array. Going back, only the first
+// rows_wanted rows are transformed along x as the rest are thrown away
+void fft_2d(const struct fft_convolution *convolution, double *re, double *im, int inverse, int rows_wanted) {
+    int size_x = convolution->size_x;
+    int y;
+    if (!inverse) {
+        for (y = 0; y < convolution->size_y; y++) {
+            fft(&convolution->row_plan, re + (size_t)y*size_x, im + (size_t)y*size_x, 0);
+        }
+        fft_columns(&convolution->column_plan, re, im, size_x, 0);
+        return;
+    }
+
+    fft_columns(&convolution->column_plan, re, im, size_x, 1);
+    for (y = 0; y < rows_wanted; y++) {
+        fft(&convolution->row_plan, re + (size_t)y*size_x, im + (size_t)y*size_x, 1);
+    }
+}
+
+// Copies the tile and border for one plane (tile, channel) out of the
+// image. Pixels past the edges are the nearest edge pixel
+void load_fft_plane(const struct fft_convolution *convolution, size_t plane, double *values) {
+    const struct image *img = convolution->img;
+    int channels = img->channels;
+    size_t tile = plane/channels;
+    int channel = plane % channels;
+    int x1 = (tile % convolution->tiles_across)*convolution->tile_width - convolution->radius_x;
+    int y1 = (tile / convolution->tiles_across)*convolution->tile_height - convolution->radius_y;
+    const uint8_t *bytes = channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    size_t row_size = (size_t)img->width*channels;
+
+    int u, v;
+    for (v = 0; v < convolution->size_y; v++) {
+        int y = min(max(y1 + v, 0), img->height - 1);
+        const uint8_t *row = bytes + (size_t)y*row_size + channel;
+        double *out = values + (size_t)v*convolution->size_x;
+        for (u = 0; u < convolution->size_x; u++) {
+            int x = min(max(x1 + u, 0), img->width - 1);
+            out[u] = row[(size_t)x*channels];
+        }
+    }
+}
+
+// Writes the part of a transformed back plane that is inside the image,
+// clamped and truncated the same way as the direct sum
+void store_fft_plane(const struct fft_convolution *convolution, size_t plane, const double *values) {
+    struct image *filtered = convolution->filtered;
+    int channels = filtered->channels;
+    size_t tile = plane/channels;
+    int channel = plane % channels;
+    int x1 = (tile % convolution->tiles_across)*convolution->tile_width;
+    int y1 = (tile / convolution->tiles_across)*convolution->tile_height;
+    int width = min(convolution->tile_width, filtered->width - x1);
+    int height = min(convolution->tile_height, filtered->height - y1);
+    uint8_t *bytes = channels == 1 ? filtered->grey_array : (uint8_t *)filtered->pixel_array;
+    size_t row_size = (size_t)filtered->width*channels;
+
+    int u, v;
+    for (v = 0; v < height; v++) {
+        uint8_t *row = bytes + (size_t)(y1 + v)*row_size + (size_t)x1*channels + channel;
+        const double *in = values + (size_t)v*convolution->size_x;
+        for (u = 0; u < width; u++) {
+            row[(size_t)u*channels] = (int)fmin(255.0, fmax(in[u], 0.0));
+        }
+    }
+}
+
+// Runs the job's planes through the transform two at a time
+void *fft_job_main(void *arg) {
+    struct fft_job *job = arg;
+    const struct fft_convolution *convolution = job->convolution;
+    size_t n_of_values = (size_t)convolution->size_x*convolution->size_y;
+    size_t plane, i;
+
+    for (plane = job->first_plane; plane < job->end_plane; plane += 2) {
+        int paired = plane + 1 < job->end_plane;
+        load_fft_plane(convolution, plane, job->re);
+        if (paired) load_fft_plane(convolution, plane + 1, job->im);
+        else memset(job->im, 0, n_of_values*sizeof(double));
+
+        fft_2d(convolution, job->re, job->im, 0, convolution->size_y);
+        for (i = 0; i < n_of_values; i++) {
+            double a_re = job->re[i], a_im = job->im[i];
+            job->re[i] = a_re*convolution->kernel_re[i] - a_im*convolution->kernel_im[i];
+            job->im[i] = a_re*convolution->kernel_im[i] + a_im*convolution->kernel_re[i];
+        }
+        fft_2d(convolution, job->re, job->im, 1, convolution->tile_height);
+
+        store_fft_plane(convolution, plane, job->re);
+        if (paired) store_fft_plane(convolution, plane + 1, job->im);
+    }
+    return NULL;
+}
+
+// Each output pixel is a sum of the kernel times the pixels from it
+// onwards in the tile, a correlation, so the kernel's transform is
+// conjugated. It is also divided by the size the inverse doesn't
+int init_kernel_transform(struct fft_convolution *convolution, const struct convolution_kernel *kernel,
+                          int margin_x, int margin_y, const struct image_allocator *allocator) {
+    size_t n_of_values = (size_t)convolution->size_x*convolution->size_y;
+    convolution->kernel_re = image_alloc(allocator, n_of_values*sizeof(double));
+    convolution->kernel_im = image_alloc(allocator, n_of_values*sizeof(double));
+    if (convolution->kernel_re == NULL || convolution->kernel_im == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    memset(convolution->kernel_re, 0, n_of_values*sizeof(double));
+    memset(convolution->kernel_im, 0, n_of_values*sizeof(double));
+    double scale = 1.0/n_of_values;
+    int x, y;
+    for (y = 0; y <= 2*convolution->radius_y; y++) {
+        const double *row = kernel->values + (size_t)(y + margin_y)*kernel->width + margin_x;
+        for (x = 0; x <= 2*convolution->radius_x; x++) {
+            convolution->kernel_re[(size_t)y*convolution->size_x + x] = row[x]*scale;
+        }
+    }
+
+    fft_2d(convolution, convolution->kernel_re, convolution->kernel_im, 0, convolution->size_y);
+    size_t i;
+    for (i = 0; i < n_of_values; i++) {
+        convolution->kernel_im[i] = -convolution->kernel_im[i];
+    }
+    return IMAGE_OK;
+}
+
+// Cost of the cheapest transform size for a kernel_width x kernel_height
+// kernel, in multiply adds of the direct sum. Sets the size to use, or
+// returns HUGE_VAL if the kernel is too big for any
+double fft_convolution_cost(int width, int height, int channels, int kernel_width, int kernel_height,
+                            int *size_x, int *size_y) {
+    double best_cost = HUGE_VAL;
+    int bits_x, bits_y;
+    for (bits_x = 1; bits_x <= FFT_MAX_LOG2_SIZE; bits_x++) {
+        int tile_width = (1 << bits_x) - kernel_width + 1;
+        if (tile_width < 1) continue;
+        for (bits_y = 1; bits_y <= FFT_MAX_LOG2_SIZE; bits_y++) {
+            int tile_height = (1 << bits_y) - kernel_height + 1;
+            if (tile_height < 1) continue;
+
+            double n_of_tiles = (double)((width + tile_width - 1)/tile_width)*((height + tile_height - 1)/tile_height);
+            double n_of_transforms = ceil(n_of_tiles*channels/2.0);
+            double n_of_values = (double)(1 << bits_x)*(1 << bits_y);
+            // A forward and an inverse transform, plus loading and multiplying
+            double cost = n_of_transforms*n_of_values*(FFT_COST_PER_VALUE*2*(bits_x + bits_y) + 4);
+            if (cost < best_cost) {
+                best_cost = cost;
+                *size_x = 1 << bits_x;
+                *size_y = 1 << bits_y;
+            }
+
+            // Bigger tiles than the image only cost more
+            if (tile_height >= height) break;
+        }
+        if (tile_width >= width) break;
+    }
+    return best_cost;
+}
+
+int convolve_struct_image_fft(const struct convolution_kernel *kernel, struct image *img) {
+    return convolve_struct_image_fft_threads(kernel, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// Same result as convolve_struct_image_direct() give or take 1 from
+// rounding, on n_of_threads threads, at most WORKER_MAX_THREADS
+int convolve_struct_image_fft_threads(const struct convolution_kernel *kernel, struct image *img, int n_of_threads) {
+    int status = check_convolution_kernel(kernel);
+    if (status != IMAGE_OK) return status;
+    if (n_of_threads < 1) n_of_threads = 1;
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+
+    // Rows and columns of zeros all round the kernel don't change the sum
+    int margin_x, margin_y;
+    kernel_zero_margins(kernel, &margin_x, &margin_y);
+
+    struct fft_convolution convolution;
+    memset(&convolution, 0, sizeof(convolution));
+    convolution.img = img;
+    convolution.radius_x = kernel->width/2 - margin_x;
+    convolution.radius_y = kernel->height/2 - margin_y;
+    if (fft_convolution_cost(img->width, img->height, img->channels, 2*convolution.radius_x + 1, 2*convolution.radius_y + 1,
+                             &convolution.size_x, &convolution.size_y) == HUGE_VAL) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    convolution.tile_width = convolution.size_x - 2*convolution.radius_x;
+    convolution.tile_height = convolution.size_y - 2*convolution.radius_y;
+    convolution.tiles_across = (img->width + convolution.tile_width - 1)/convolution.tile_width;
+    int tiles_down = (img->height + convolution.tile_height - 1)/convolution.tile_height;
+    size_t n_of_planes = (size_t)convolution.tiles_across*tiles_down*img->channels;
+
+    // Each thread takes an even number of planes so they pair up
+    size_t planes_per_job = (n_of_planes + n_of_threads - 1)/n_of_threads;
+    planes_per_job += planes_per_job % 2;
+    n_of_threads = (n_of_planes + planes_per_job - 1)/planes_per_job;
+
+    const struct image_allocator *allocator = img->allocator;
+    struct image filtered;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, allocator);
+    }
+    if (status != IMAGE_OK) return status;
+    convolution.filtered = &filtered;
+
+    struct fft_job jobs[WORKER_MAX_THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    size_t n_of_values = (size_t)convolution.size_x*convolution.size_y;
+    status = fft_plan_init(&convolution.row_plan, convolution.size_x, allocator);
+    if (status == IMAGE_OK) status = fft_plan_init(&convolution.column_plan, convolution.size_y, allocator);
+    if (status == IMAGE_OK) status = init_kernel_transform(&convolution, kernel, margin_x, margin_y, allocator);
+    int t;
+    for (t = 0; t < n_of_threads && status == IMAGE_OK; t++) {
+        jobs[t].convolution = &convolution;
+        jobs[t].first_plane = t*planes_per_job;
+        jobs[t].end_plane = (size_t)(t + 1)*planes_per_job < n_of_planes ? (t + 1)*planes_per_job : n_of_planes;
+        jobs[t].re = image_alloc(allocator, n_of_values*sizeof(double));
+        jobs[t].im = image_alloc(allocator, n_of_values*sizeof(double));
+        if (jobs[t].re == NULL || jobs[t].im == NULL) status = IMAGE_ERR_NO_MEMORY;
+    }
+
+    if (status == IMAGE_OK) run_worker_jobs(jobs, sizeof(jobs[0]), n_of_threads, fft_job_main);
+
+    for (t = 0; t < WORKER_MAX_THREADS; t++) {
+        image_dealloc(allocator, jobs[t].re);
+        image_dealloc(allocator, jobs[t].im);
+    }
+    image_dealloc(allocator, convolution.kernel_re);
+    image_dealloc(allocator, convolution.kernel_im);
+    fft_plan_free(&convolution.row_plan, allocator);
+    fft_plan_free(&convolution.column_plan, allocator);
+
+    if (status != IMAGE_OK) {
+        free_struct_image(&filtered);
+        return status;
+    }
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
+}
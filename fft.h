@@ -0,0 +1,37 @@
+/* fft.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the fast Fourier transform and
+ * the convolution of big kernels that uses it
+ *
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#include "image_data_types.h"
+#include "convolution_kernels.h"
+
+// Transforms are at most 2^FFT_MAX_LOG2_SIZE long in each direction
+#define FFT_MAX_LOG2_SIZE 13
+
+// Bit reversal and twiddle factors for transforms of one power of 2 size
+struct fft_plan {
+    int size;
+    int *bit_reverse;
+    double *cos_table;      // cos(2*pi*k/size) for k < size/2
+    double *sin_table;
+};
+
+int fft_plan_init(struct fft_plan *plan, int size, const struct image_allocator *allocator);
+void fft_plan_free(struct fft_plan *plan, const struct image_allocator *allocator);
+void fft(const struct fft_plan *plan, double *re, double *im, int inverse);
+void fft_columns(const struct fft_plan *plan, double *re, double *im, int row_size, int inverse);
+
+double fft_convolution_cost(int width, int height, int channels, int kernel_width, int kernel_height,
+                            int *size_x, int *size_y);
+int convolve_struct_image_fft(const struct convolution_kernel *kernel, struct image *img);
+int convolve_struct_image_fft_threads(const struct convolution_kernel *kernel, struct image *img, int n_of_threads);
+
+#endif
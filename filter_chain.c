@@ -0,0 +1,1040 @@
+/* filter_chain.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Parsing and running of the filter chain, the
+ * parsed form of a bmpedit command line, shared by
+ * the command line front end and the server
+ *
+ */
+
+#include "filter_chain.h"
+#include "libbmpedit.h"
+#include "result_cache.h"
+#include "memory_plan.h"
+#include "batch.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+
+static const char *short_options = "G:Sgs:eH:B:c:b:iht:o:d:r:m:a:M:k:x:";
+
+static const struct option long_options[] = {
+    {"serve", required_argument, NULL, OPTION_SERVE},
+    {"threads", required_argument, NULL, OPTION_THREADS},
+    {"pyramid", optional_argument, NULL, OPTION_PYRAMID},
+    {"tile-size", required_argument, NULL, OPTION_TILE_SIZE},
+    {"histogram", required_argument, NULL, OPTION_HISTOGRAM},
+    {"white-balance", required_argument, NULL, OPTION_WHITE_BALANCE},
+    {"saturation", required_argument, NULL, OPTION_SATURATION},
+    {"sepia", no_argument, NULL, OPTION_SEPIA},
+    {"swap", required_argument, NULL, OPTION_SWAP},
+    {"rotate", required_argument, NULL, OPTION_ROTATE},
+    {"flip", required_argument, NULL, OPTION_FLIP},
+    {"transpose", no_argument, NULL, OPTION_TRANSPOSE},
+    {"cache", required_argument, NULL, OPTION_CACHE},
+    {"batch", required_argument, NULL, OPTION_BATCH},
+    {"max-memory", required_argument, NULL, OPTION_MAX_MEMORY},
+    {"stats", no_argument, NULL, OPTION_STATS},
+    {"preview", required_argument, NULL, OPTION_PREVIEW},
+    {"bilateral", required_argument, NULL, OPTION_BILATERAL},
+    {NULL, 0, NULL, 0}
+};
+
+int str_is_digit_and_radix_point(char *str);
+int chain_filter_threads(struct filter_chain *chain, struct image *img);
+int convolve_with_kernel_file(char *file_name, struct image *img, int n_of_threads);
+void add_colour_matrix(struct colour_matrix *colour, int *colour_is_set, const struct colour_matrix *next);
+int run_colour_matrix(struct colour_matrix *colour, int *colour_is_set, struct image *img);
+int apply_filter_chain_from(struct filter_chain *chain, int from_stage, struct result_cache *cache, struct image *img,
+                            struct image *img_2, FILE *log, char *message, size_t message_size);
+void save_chain_stage(struct result_cache *cache, int stage, struct image *img, FILE *log);
+int scale_preview_size(int size, int factor);
+int write_bmp_file(char *file_name, struct image *img, int depth);
+int write_histogram_file(char *file_name, struct image *img);
+int write_pyramid_level(struct filter_chain *chain, struct image *img, int level, char *message, size_t message_size);
+int write_pyramid(struct filter_chain *chain, struct image *img, FILE *log, char *message, size_t message_size);
+
+int str_is_digit_and_radix_point(char *str) {
+    int str_len = strlen(str);
+    int i;
+    for (i = 0; i < str_len; i++) {
+        if (isdigit(str[i]) || str[i] == '.') continue;
+        else return 0;
+    }
+
+    return 1;
+}
+
+// Formats an error message for the caller, IO errors get errno's
+// description on the end. Returns status so it can be returned directly
+int chain_error(char *message, size_t message_size, int status, const char *format, ...) {
+    int errsv = errno;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, message_size, format, args);
+    va_end(args);
+
+    if (status == IMAGE_ERR_IO && length >= 0 && (size_t)length < message_size) {
+        snprintf(message + length, message_size - length, ": %s", strerror(errsv));
+    } else if (status != IMAGE_ERR_IO && status != IMAGE_ERR_ARGUMENT && length >= 0 && (size_t)length < message_size) {
+        snprintf(message + length, message_size - length, ": %s", image_status_string(status));
+    }
+    return status;
+}
+
+// True when resize is the only filter to run, so the input can be
+// shrunk while it is read (see bmp_to_struct_image_for_resize())
+int only_resize_is_set(const struct filter_chain *chain) {
+    return chain->resize_is_set && !chain->blend_is_set && chain->orientation == ORIENTATION_NONE && !chain->gaussian_is_set && chain->kernel_file_name == NULL
+        && !chain->box_mean_is_set && !chain->bilateral_is_set && !chain->white_balance_is_set && !chain->brightness_is_set && !chain->saturation_is_set
+        && !chain->sepia_is_set && chain->swap_order == NULL && !chain->greyscale_is_set && !chain->median_is_set
+        && !chain->sobel_is_set && !chain->invert_is_set && !chain->threshold_is_set && !chain->adaptive_is_set
+        && !chain->morphology_is_set && !chain->emboss_is_set && !chain->sharpen_is_set && !chain->crop_is_set
+        && chain->histogram_file_name == NULL;
+}
+
+// Parses a bmpedit command line into chain, checking every value is in range.
+// getopt is used so this isn't reentrant, callers on several threads must lock.
+// Returns IMAGE_OK, or IMAGE_ERR_ARGUMENT with a message
+int parse_filter_chain(int argc, char *argv[], struct filter_chain *chain, char *message, size_t message_size) {
+    memset(chain, 0, sizeof(*chain));
+    chain->output_file_name = "out.bmp";
+    chain->output_depth = BMP_DEPTH_24;
+
+    // Handle command line arguments
+    // Based off of http://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html#Example-of-Getopt
+
+    // Start getopt from scratch every time, the server parses many command lines
+    optind = 0;
+    opterr = 0;
+
+    int option;
+    while ((option = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch(option) {
+            case 'h':
+                chain->help_is_set = 1;
+                break;
+            case 'o':
+                chain->output_file_name = optarg;
+                break;
+            case 'd':
+                if (strcmp(optarg, "auto") == 0) {
+                    chain->output_depth = BMP_DEPTH_AUTO;
+                } else if (strcmp(optarg, "1") == 0 || strcmp(optarg, "8") == 0 || strcmp(optarg, "24") == 0) {
+                    chain->output_depth = atoi(optarg);
+                } else {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Output depth must be auto, 1, 8 or 24");
+                }
+                break;
+            case 't':
+                chain->threshold_is_set = 1;
+                if (strcmp(optarg, "auto") == 0) {
+                    chain->threshold_auto = 1;
+                    break;
+                }
+                chain->threshold_auto = 0;
+                if (!str_is_digit_and_radix_point(optarg)) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "A number or auto is required for the threshold");
+                }
+                chain->threshold_value = atof(optarg);
+                if (chain->threshold_value > 1.0 || chain->threshold_value < 0.0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Threshold must be between 0.0 and 1.0");
+                }
+                break;
+            case 'b':
+                chain->blend_is_set = 1;
+                if (!str_is_digit_and_radix_point(optarg)) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "A number is required for the blend coefficient");
+                }
+                chain->blend_value = atof(optarg);
+                if (chain->blend_value > 1.0 || chain->blend_value < 0.0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Blend value must be between 0.0 and 1.0");
+                }
+                break;
+            case 'e':
+                chain->emboss_is_set = 1;
+                break;
+            case 'g':
+                chain->greyscale_is_set = 1;
+                break;
+            case 'S':
+                chain->sobel_is_set = 1;
+                break;
+            case 's':
+                chain->sharpen_is_set = 1;
+                if (!str_is_digit_and_radix_point(optarg)) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "A number is required for sharpen");
+                }
+                chain->sharpen_value = atof(optarg);
+                if (chain->sharpen_value < 0.0 || chain->sharpen_value > 20.0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Sharpen value must be between 0.0 and 20.0");
+                }
+                break;
+            case 'B':
+                chain->brightness_is_set = 1;
+                if (!str_is_digit_and_radix_point(optarg)) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "A number is required for the brightness");
+                }
+                chain->brightness_value = atof(optarg);
+                if (chain->brightness_value < 0.0 || chain->brightness_value > 2.0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Brightness value must be between 0.0 and 2.0");
+                }
+                break;
+            case 'i':
+                chain->invert_is_set = 1;
+                break;
+            case 'c':
+                chain->crop_is_set = 1;
+                if (parse_crop_arg(&chain->crop_x1, &chain->crop_y1, &chain->crop_x2, &chain->crop_y2, optarg) != IMAGE_OK
+                        || chain->crop_x1 >= chain->crop_x2 || chain->crop_y1 >= chain->crop_y2) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Crop needs sensible values\nTry bmpedit -h for help");
+                }
+                break;
+            case 'r':
+                chain->resize_is_set = 1;
+                if (parse_resize_arg(&chain->resize_width, &chain->resize_height, &chain->resize_method, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Resize needs WxH[,method]\nTry bmpedit -h for help");
+                }
+                break;
+            case 'm':
+                chain->box_mean_is_set = 1;
+                if (!isdigit(optarg[0]) || !str_is_digit_and_radix_point(optarg) || strchr(optarg, '.') != NULL) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Box mean needs a whole number radius");
+                }
+                chain->box_mean_radius = atoi(optarg);
+                break;
+            case 'M':
+                chain->median_is_set = 1;
+                if (!isdigit(optarg[0]) || !str_is_digit_and_radix_point(optarg) || strchr(optarg, '.') != NULL
+                        || atoi(optarg) > MEDIAN_MAX_RADIUS) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Median needs a whole number radius up to %d",
+                                       MEDIAN_MAX_RADIUS);
+                }
+                chain->median_radius = atoi(optarg);
+                break;
+            case 'a':
+                chain->adaptive_is_set = 1;
+                if (parse_adaptive_arg(&chain->adaptive_method, &chain->adaptive_radius, &chain->adaptive_k, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Adaptive threshold needs bradley|sauvola,radius[,k]\nTry bmpedit -h for help");
+                }
+                break;
+            case 'x':
+                chain->morphology_is_set = 1;
+                if (parse_morphology_arg(&chain->morphology_operation, &chain->morphology_width,
+                                         &chain->morphology_height, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Morphology needs erode|dilate|open|close,WxH\nTry bmpedit -h for help");
+                }
+                break;
+            case 'G':
+                chain->gaussian_is_set = 1;
+                if (parse_gaussian_arg(&chain->gaussian_repeat, &chain->gaussian_standard_deviation, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Gaussian blur needs repeat,sd\nTry bmpedit -h for help");
+                }
+                if (chain->gaussian_repeat < 0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Must repeat gaussian blur 1 or more times");
+                }
+                break;
+            case 'k':
+                chain->kernel_file_name = optarg;
+                break;
+            case OPTION_WHITE_BALANCE:
+                chain->white_balance_is_set = 1;
+                if (strcmp(optarg, "auto") == 0) {
+                    chain->white_balance_auto = 1;
+                    break;
+                }
+                chain->white_balance_auto = 0;
+                if (parse_white_balance_arg(&chain->white_balance_red, &chain->white_balance_green,
+                                            &chain->white_balance_blue, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--white-balance needs auto or R,G,B gains between 0.0 and %.1f",
+                                       COLOUR_MATRIX_MAX_GAIN);
+                }
+                break;
+            case OPTION_SATURATION:
+                chain->saturation_is_set = 1;
+                if (!str_is_digit_and_radix_point(optarg) || atof(optarg) > COLOUR_MATRIX_MAX_GAIN) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--saturation needs a number between 0.0 and %.1f",
+                                       COLOUR_MATRIX_MAX_GAIN);
+                }
+                chain->saturation_value = atof(optarg);
+                break;
+            case OPTION_SEPIA:
+                chain->sepia_is_set = 1;
+                break;
+            case OPTION_SWAP: {
+                struct colour_matrix swap;
+                if (colour_matrix_swap(optarg, &swap) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--swap needs three of r, g and b, like bgr");
+                }
+                chain->swap_order = optarg;
+                break;
+            }
+            case OPTION_ROTATE: {
+                int rotation;
+                if (parse_rotate_arg(&rotation, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--rotate needs 90, 180 or 270 degrees clockwise");
+                }
+                chain->orientation = orientation_then(chain->orientation, rotation);
+                break;
+            }
+            case OPTION_FLIP: {
+                int flip;
+                if (parse_flip_arg(&flip, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--flip needs h or v");
+                }
+                chain->orientation = orientation_then(chain->orientation, flip);
+                break;
+            }
+            case OPTION_TRANSPOSE:
+                chain->orientation = orientation_then(chain->orientation, ORIENTATION_TRANSPOSE);
+                break;
+            case OPTION_PYRAMID:
+                chain->pyramid_is_set = 1;
+                if (optarg != NULL) {
+                    chain->pyramid_levels = atoi(optarg);
+                    if (chain->pyramid_levels < 1) {
+                        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--pyramid needs a number of levels");
+                    }
+                }
+                break;
+            case OPTION_TILE_SIZE:
+                chain->tile_size = atoi(optarg);
+                if (chain->tile_size < 1) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--tile-size needs a size in pixels");
+                }
+                break;
+            case OPTION_HISTOGRAM:
+                chain->histogram_file_name = optarg;
+                break;
+            case OPTION_CACHE:
+                chain->cache_dir = optarg;
+                break;
+            case OPTION_BATCH:
+                chain->batch_dir = optarg;
+                break;
+            case OPTION_MAX_MEMORY:
+                if (parse_memory_size_arg(&chain->max_memory, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--max-memory needs a size like 512M or 2G");
+                }
+                break;
+            case OPTION_STATS:
+                chain->stats_is_set = 1;
+                break;
+            case OPTION_BILATERAL:
+                chain->bilateral_is_set = 1;
+                if (parse_bilateral_arg(&chain->bilateral_spatial_sd, &chain->bilateral_range_sd, optarg) != IMAGE_OK) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Bilateral needs spatial,range sds over 0\nTry bmpedit -h for help");
+                }
+                break;
+            case OPTION_PREVIEW:
+                if (!isdigit(optarg[0]) || !str_is_digit_and_radix_point(optarg) || strchr(optarg, '.') != NULL
+                        || atoi(optarg) < 1) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--preview needs a whole number to divide the size by");
+                }
+                chain->preview_factor = atoi(optarg);
+                break;
+            case OPTION_SERVE:
+                chain->serve_socket_path = optarg;
+                break;
+            case OPTION_THREADS:
+                chain->n_of_threads = atoi(optarg);
+                if (chain->n_of_threads < 1) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--threads needs a number of threads");
+                }
+                break;
+            case '?':
+                if (optopt >= OPTION_SERVE) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "%s requires an argument", argv[optind-1]);
+                } else if (optopt != 0 && strchr(short_options, optopt) != NULL) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "-%c requires an argument", optopt);
+                } else if (isprint(optopt)) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Unknown option -%c.", optopt);
+                } else if (optopt == 0) {
+                    return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Unknown option %s", argv[optind-1]);
+                }
+                return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Unknown option character \\x%x", optopt);
+            default:;
+        }
+    }
+
+    // Grab the input file names, the server doesn't need one
+    if (optind < argc) {
+        chain->input_file_name = argv[optind];
+    }
+    if (optind + 1 < argc) {
+        chain->input_2_file_name = argv[optind + 1];
+    }
+    chain->batch_input_file_names = argv + optind;
+    chain->n_of_batch_inputs = argc - optind;
+
+    if (chain->batch_dir != NULL) {
+        if (chain->n_of_batch_inputs == 0) {
+            return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--batch needs input files");
+        }
+        if (chain->blend_is_set || chain->pyramid_is_set || chain->histogram_file_name != NULL || chain->cache_dir != NULL
+                || chain->max_memory != 0 || chain->stats_is_set || chain->preview_factor != 0) {
+            return chain_error(message, message_size, IMAGE_ERR_ARGUMENT,
+                               "--batch can't be used with -b, --pyramid, --histogram, --cache, --max-memory, --stats or --preview");
+        }
+        int i;
+        for (i = 0; i < chain->n_of_batch_inputs; i++) {
+            if (strcmp(chain->batch_input_file_names[i], "-") == 0) {
+                return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--batch inputs have to be files, not stdin");
+            }
+        }
+        int status = check_batch_output_names(chain, message, message_size);
+        if (status != IMAGE_OK) return status;
+    }
+
+    if (chain->tile_size && !chain->pyramid_is_set) {
+        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--tile-size only works with --pyramid");
+    }
+    if (chain->histogram_file_name != NULL && strcmp(chain->histogram_file_name, "-") == 0
+            && strcmp(chain->output_file_name, "-") == 0) {
+        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "The histogram and the output file can't both go to stdout");
+    }
+    if (chain->pyramid_is_set && strcmp(chain->output_file_name, "-") == 0) {
+        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--pyramid needs an output file name to name the levels after");
+    }
+    // A preview isn't the full size result, to save or to plan for
+    if (chain->preview_factor > 1 && (chain->cache_dir != NULL || chain->max_memory != 0)) {
+        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "--preview can't be used with --cache or --max-memory");
+    }
+
+    if (chain->blend_is_set && chain->input_file_name != NULL && chain->input_2_file_name == NULL) {
+        return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Two input files and a blend coefficient are required for\
+ blend.\nTry bmpedit -h for help.");
+    }
+
+    return IMAGE_OK;
+}
+
+// Applies every filter set in chain to img, img_2 is only needed for blend.
+// Progress messages go to log if it isn't NULL
+int apply_filter_chain(struct filter_chain *chain, struct image *img, struct image *img_2, FILE *log,
+                       char *message, size_t message_size) {
+    return apply_filter_chain_from(chain, CHAIN_STAGE_INPUT, NULL, img, img_2, log, message, message_size);
+}
+
+// As apply_filter_chain(), for an image that has had the filters up to
+// from_stage already (see enum chain_stage). With a cache, the image
+// after each expensive filter is saved in it
+int apply_filter_chain_from(struct filter_chain *chain, int from_stage, struct result_cache *cache, struct image *img,
+                            struct image *img_2, FILE *log, char *message, size_t message_size) {
+    int status;
+
+    // Blend
+    if (chain->blend_is_set && from_stage < CHAIN_STAGE_GAUSSIAN) {
+        if (log) fprintf(log, "Blending images...\n");
+
+        // Will it blend?
+        if (blend_two_images(chain->blend_value, img, img_2) != IMAGE_OK) {
+            return chain_error(message, message_size, IMAGE_ERR_DIMENSIONS, "Two input images need same dimensions");
+        }
+    }
+
+    // Rotate and flip
+    if (chain->orientation != ORIENTATION_NONE && from_stage < CHAIN_STAGE_GAUSSIAN) {
+        if (log) fprintf(log, "Turning image...\n");
+        status = orient_image(chain->orientation, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Rotate failed");
+    }
+
+    // Gaussian blur
+    if (chain->gaussian_is_set && from_stage < CHAIN_STAGE_GAUSSIAN) {
+        if (log) fprintf(log, "Applying gaussian blur...\n");
+        status = gaussian_blur(chain->gaussian_repeat, chain->gaussian_standard_deviation, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Gaussian blur failed");
+        save_chain_stage(cache, CHAIN_STAGE_GAUSSIAN, img, log);
+    }
+
+    // Kernel
+    if (chain->kernel_file_name != NULL && from_stage < CHAIN_STAGE_KERNEL) {
+        if (log) fprintf(log, "Applying kernel...\n");
+        status = convolve_with_kernel_file(chain->kernel_file_name, img, chain_filter_threads(chain, img));
+        if (status == IMAGE_ERR_FORMAT) {
+            return chain_error(message, message_size, IMAGE_ERR_ARGUMENT,
+                               "Kernel %s needs an odd number of rows of numbers, all the same odd length", chain->kernel_file_name);
+        }
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error applying kernel %s", chain->kernel_file_name);
+        save_chain_stage(cache, CHAIN_STAGE_KERNEL, img, log);
+    }
+
+    // Box mean
+    if (chain->box_mean_is_set && from_stage < CHAIN_STAGE_BOX_MEAN) {
+        if (log) fprintf(log, "Applying box mean...\n");
+        status = box_mean_image_threads(chain->box_mean_radius, img, chain_filter_threads(chain, img));
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Box mean failed");
+        save_chain_stage(cache, CHAIN_STAGE_BOX_MEAN, img, log);
+    }
+
+    // Bilateral
+    if (chain->bilateral_is_set && from_stage < CHAIN_STAGE_BILATERAL) {
+        if (log) fprintf(log, "Applying bilateral filter...\n");
+        status = bilateral_image_threads(chain->bilateral_spatial_sd, chain->bilateral_range_sd, img,
+                                         chain_filter_threads(chain, img));
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Bilateral filter failed");
+        save_chain_stage(cache, CHAIN_STAGE_BILATERAL, img, log);
+    }
+
+    // White balance through to invert are colour matrices. The ones next
+    // to each other are multiplied together and run over the image once,
+    // so the values are only rounded and clipped at the end
+    struct colour_matrix colour, next;
+    int colour_is_set = 0;
+
+    // White balance
+    if (chain->white_balance_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Balancing the colours...\n");
+        if (chain->white_balance_auto) {
+            status = colour_matrix_grey_world(img, &next);
+            if (status != IMAGE_OK) return chain_error(message, message_size, status, "White balance failed");
+        } else {
+            colour_matrix_white_balance(chain->white_balance_red, chain->white_balance_green, chain->white_balance_blue, &next);
+        }
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Brightness
+    if (chain->brightness_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Changing brightness of image...\n");
+        colour_matrix_brightness(chain->brightness_value-1.0, &next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Saturation
+    if (chain->saturation_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Changing saturation of image...\n");
+        colour_matrix_saturation(chain->saturation_value, &next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Sepia
+    if (chain->sepia_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Applying sepia tone...\n");
+        colour_matrix_sepia(&next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Channel swap
+    if (chain->swap_order != NULL && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Swapping channels to %s...\n", chain->swap_order);
+        colour_matrix_swap(chain->swap_order, &next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Greyscale, a matrix that gives grey makes a 1 channel image
+    if (chain->greyscale_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        if (log) fprintf(log, "Converting the image to greyscale\n");
+        colour_matrix_greyscale(&next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    // Median, after greyscale so it only has one channel to do
+    if (chain->median_is_set && from_stage < CHAIN_STAGE_MEDIAN) {
+        status = run_colour_matrix(&colour, &colour_is_set, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Colour matrix failed");
+        if (log) fprintf(log, "Applying median filter...\n");
+        status = median_image(chain->median_radius, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Median failed");
+        save_chain_stage(cache, CHAIN_STAGE_MEDIAN, img, log);
+    }
+
+    // Sobel
+    if (chain->sobel_is_set && from_stage < CHAIN_STAGE_SOBEL) {
+        status = run_colour_matrix(&colour, &colour_is_set, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Colour matrix failed");
+        if (log) fprintf(log, "Applying sobel edge detection...\n");
+        status = sobel_edge_detect_image(img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Sobel edge detection failed");
+        save_chain_stage(cache, CHAIN_STAGE_SOBEL, img, log);
+    }
+
+    // Invert
+    if (chain->invert_is_set && from_stage < CHAIN_STAGE_ADAPTIVE) {
+        if (log) fprintf(log, "Inverting image...\n");
+        colour_matrix_invert(&next);
+        add_colour_matrix(&colour, &colour_is_set, &next);
+    }
+
+    status = run_colour_matrix(&colour, &colour_is_set, img);
+    if (status != IMAGE_OK) return chain_error(message, message_size, status, "Colour matrix failed");
+
+    // Threshold
+    if (chain->threshold_is_set && from_stage < CHAIN_STAGE_ADAPTIVE) {
+        double threshold_value = chain->threshold_value;
+        if (chain->threshold_auto) {
+            struct image_histogram histogram;
+            status = compute_image_histogram_threads(img, &histogram, chain_filter_threads(chain, img));
+            if (status != IMAGE_OK) return chain_error(message, message_size, status, "Histogram failed");
+            threshold_value = otsu_threshold_value(&histogram);
+            if (log) fprintf(log, "Otsu threshold %.4f (level %d)\n", threshold_value, otsu_level(histogram.luminance));
+        }
+        if (log) fprintf(log, "Running threshold filter...\n");
+        status = threshold_image(threshold_value, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Threshold failed");
+    }
+
+    // Adaptive threshold
+    if (chain->adaptive_is_set && from_stage < CHAIN_STAGE_ADAPTIVE) {
+        if (log) fprintf(log, "Running adaptive threshold filter...\n");
+        status = adaptive_threshold_image_threads(chain->adaptive_method, chain->adaptive_radius, chain->adaptive_k, img,
+                                                  chain_filter_threads(chain, img));
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Adaptive threshold failed");
+        save_chain_stage(cache, CHAIN_STAGE_ADAPTIVE, img, log);
+    }
+
+    // Morphology
+    if (chain->morphology_is_set && from_stage < CHAIN_STAGE_MORPHOLOGY) {
+        if (log) fprintf(log, "Applying morphology filter...\n");
+        status = morphology_image(chain->morphology_operation, chain->morphology_width, chain->morphology_height, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Morphology failed");
+        save_chain_stage(cache, CHAIN_STAGE_MORPHOLOGY, img, log);
+    }
+
+    // Emboss
+    if (chain->emboss_is_set) {
+        if (log) fprintf(log, "Embossing image...\n");
+        status = emboss_image(img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Emboss failed");
+    }
+
+    // Sharpen
+    if (chain->sharpen_is_set) {
+        if (log) fprintf(log, "Sharpening image...\n");
+        // Magic numbers that make sharpen work
+        status = sharpen_image(8.01 + (20-chain->sharpen_value), img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Sharpen failed");
+    }
+
+    // Crop
+    if (chain->crop_is_set) {
+        if (log) fprintf(log, "Cropping image...\n");
+        status = crop_image(chain->crop_x1, chain->crop_y1, chain->crop_x2, chain->crop_y2, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Crop needs sensible dimensions");
+        if (log) fprintf(log, "New image width %dpx\n", img->width);
+        if (log) fprintf(log, "New image height: %dpx\n", img->height);
+    }
+
+    // Resize
+    if (chain->resize_is_set) {
+        if (log) fprintf(log, "Resizing image...\n");
+        status = resize_image(chain->resize_width, chain->resize_height, chain->resize_method, img);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Resize failed");
+        if (log) fprintf(log, "New image width %dpx\n", img->width);
+        if (log) fprintf(log, "New image height: %dpx\n", img->height);
+    }
+
+    return IMAGE_OK;
+}
+
+// Puts next after the colour matrices waiting to run
+void add_colour_matrix(struct colour_matrix *colour, int *colour_is_set, const struct colour_matrix *next) {
+    if (*colour_is_set) {
+        colour_matrix_multiply(next, colour, colour);
+    } else {
+        *colour = *next;
+        *colour_is_set = 1;
+    }
+}
+
+// Keeps the image after stage in the cache, if there is one. The cache
+// only saves time, so failing to write to it isn't an error
+void save_chain_stage(struct result_cache *cache, int stage, struct image *img, FILE *log) {
+    if (cache == NULL) return;
+    if (store_cached_stage(cache, stage, img) != IMAGE_OK && log) {
+        fprintf(log, "Couldn't save the image after the %s in the cache\n", chain_stage_name(stage));
+    }
+}
+
+// Runs the colour matrices waiting to run, if there are any
+int run_colour_matrix(struct colour_matrix *colour, int *colour_is_set, struct image *img) {
+    if (!*colour_is_set) return IMAGE_OK;
+    *colour_is_set = 0;
+    return colour_matrix_image(colour, img);
+}
+
+// Reads the input image (from input_fildes, or the input file name if it is -1),
+// applies the chain and writes the output file. A file name of "-" is stdin
+// or stdout. Everything is freed before returning
+int run_filter_chain(struct filter_chain *chain, int input_fildes, const struct image_allocator *allocator,
+                     FILE *log, char *message, size_t message_size) {
+    int status;
+    int opened_input = 0;
+
+    if (input_fildes == -1) {
+        if (chain->input_file_name == NULL) {
+            return chain_error(message, message_size, IMAGE_ERR_ARGUMENT,
+                               "An input file is required, or you are missing an argument.\nTry bmpedit -h for help");
+        }
+        if (strcmp(chain->input_file_name, "-") == 0) {
+            input_fildes = STDIN_FILENO;
+        } else {
+            input_fildes = open(chain->input_file_name, O_RDONLY);
+            if (input_fildes == -1) {
+                return chain_error(message, message_size, IMAGE_ERR_IO, "Error opening input file");
+            }
+            opened_input = 1;
+        }
+    }
+
+    // With --cache, the same input and chain as an earlier run is a copy
+    // of the file it wrote, and a chain that starts the same way picks up
+    // the image it saved after the last filter they share. The histogram
+    // needs the input decoded whatever happens, so it goes without
+    struct result_cache cache;
+    int use_cache = chain->cache_dir != NULL && chain->histogram_file_name == NULL
+        && open_result_cache(&cache, chain, input_fildes) == IMAGE_OK;
+    if (chain->cache_dir != NULL && !use_cache && log) fprintf(log, "Not using the cache, the input has to be a file and there can't be a --histogram\n");
+    if (use_cache && !chain->pyramid_is_set) {
+        int hit;
+        status = copy_cached_output(&cache, chain->output_file_name, &hit);
+        if (hit) {
+            if (opened_input) close(input_fildes);
+            if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error copying cached output");
+            if (log) fprintf(log, "Copied the output from the cache\n");
+            return IMAGE_OK;
+        }
+    }
+
+    // With --max-memory the chain is planned from the headers, and run a
+    // strip or tile at a time if the whole image won't fit. An input
+    // that can't be planned from, a pipe, is read whole as usual
+    int preview = chain->preview_factor > 1;
+    if ((chain->max_memory != 0 || chain->stats_is_set) && !preview) {
+        struct memory_plan plan;
+        status = plan_filter_chain(chain, input_fildes, &plan, message, message_size);
+        if (status == IMAGE_ERR_NO_MEMORY) {
+            if (opened_input) close(input_fildes);
+            return status;
+        }
+        if (status != IMAGE_OK) {
+            if (log) fprintf(log, "Plan: none, %s\n", message);
+        } else if (chain->stats_is_set && log) {
+            report_memory_plan(log, chain, &plan);
+        }
+        if (status == IMAGE_OK && plan.mode != MEMORY_PLAN_WHOLE) {
+            status = run_filter_chain_in_pieces(chain, &plan, input_fildes, allocator, log, message, message_size);
+            if (opened_input) close(input_fildes);
+            return status;
+        }
+    }
+
+    // Grab bitmap data and put into struct image. A resize on its own
+    // is started while reading, the full size image is never held.
+    // Without a blend the rotate or flip comes first, so its vertical
+    // flip is done by storing the rows upside down as they are read.
+    // A preview only reads the rows it keeps
+    struct image raw_image;
+    int resize_width = chain->resize_width;
+    int resize_height = chain->resize_height;
+    int resize_while_reading = only_resize_is_set(chain) && !preview;
+    struct filter_chain after_reading = *chain;
+    int from_stage = CHAIN_STAGE_INPUT;
+    status = IMAGE_OK;
+    if (use_cache) {
+        status = load_cached_stage(&cache, allocator, &from_stage, &raw_image);
+        if (log && from_stage != CHAIN_STAGE_INPUT) {
+            fprintf(log, "Picked up the image after the %s from the cache\n", chain_stage_name(from_stage));
+        }
+    }
+    if (from_stage != CHAIN_STAGE_INPUT) {
+        resize_while_reading = 0;
+    } else if (preview) {
+        status = bmp_to_struct_image_preview(input_fildes, &raw_image, allocator, chain->preview_factor);
+    } else if (resize_while_reading) {
+        status = bmp_to_struct_image_for_resize(input_fildes, &raw_image, allocator,
+                                                &resize_width, &resize_height, chain->resize_method);
+    } else if ((chain->orientation & ORIENTATION_FLIP_VERTICAL) && !chain->blend_is_set) {
+        status = bmp_to_struct_image_flipped(input_fildes, &raw_image, allocator);
+        after_reading.orientation &= ~ORIENTATION_FLIP_VERTICAL;
+    } else {
+        status = bmp_to_struct_image(input_fildes, &raw_image, allocator);
+    }
+    if (opened_input) close(input_fildes);
+    if (status != IMAGE_OK) {
+        return chain_error(message, message_size, status, "Error reading input file");
+    }
+
+    // Histogram of the input, before any filters
+    if (chain->histogram_file_name != NULL) {
+        status = write_histogram_file(chain->histogram_file_name, &raw_image);
+        if (status != IMAGE_OK) {
+            free_struct_image(&raw_image);
+            return chain_error(message, message_size, status, "Error writing histogram file");
+        }
+    }
+
+    if (preview) {
+        scale_filter_chain_for_preview(&after_reading, chain->preview_factor, raw_image.width, raw_image.height);
+        if (log) fprintf(log, "Previewing at 1/%d size\n", chain->preview_factor);
+    }
+
+    // Print width and height
+    if (log) fprintf(log, "Image width: %dpx\n", raw_image.width);
+    if (log) fprintf(log, "Image height: %dpx\n", raw_image.height);
+    if (log && resize_while_reading) fprintf(log, "(already reduced for the resize)\n");
+
+    struct image image_2;
+    image_2.pixel_array = NULL;
+    image_2.grey_array = NULL;
+    image_2.allocator = allocator;
+    if (chain->blend_is_set && from_stage < CHAIN_STAGE_GAUSSIAN) {
+        if (chain->input_2_file_name == NULL) {
+            free_struct_image(&raw_image);
+            return chain_error(message, message_size, IMAGE_ERR_ARGUMENT, "Two input files and a blend coefficient are required for\
+ blend.\nTry bmpedit -h for help.");
+        }
+        int input_2_fildes = STDIN_FILENO;
+        if (strcmp(chain->input_2_file_name, "-") != 0) {
+            input_2_fildes = open(chain->input_2_file_name, O_RDONLY);
+            if (input_2_fildes == -1) {
+                free_struct_image(&raw_image);
+                return chain_error(message, message_size, IMAGE_ERR_IO, "Error opening second input file");
+            }
+        }
+        if (preview) {
+            status = bmp_to_struct_image_preview(input_2_fildes, &image_2, allocator, chain->preview_factor);
+        } else {
+            status = bmp_to_struct_image(input_2_fildes, &image_2, allocator);
+        }
+        if (input_2_fildes != STDIN_FILENO) close(input_2_fildes);
+        if (status != IMAGE_OK) {
+            free_struct_image(&raw_image);
+            return chain_error(message, message_size, status, "Error reading second input file");
+        }
+    }
+
+    // Apply the filters
+    if (resize_while_reading) {
+        if (log) fprintf(log, "Resizing image...\n");
+        status = resize_reduced_image(resize_width, resize_height, chain->resize_method, &raw_image);
+        if (status != IMAGE_OK) {
+            status = chain_error(message, message_size, status, "Resize failed");
+        } else if (log) {
+            fprintf(log, "New image width %dpx\n", raw_image.width);
+            fprintf(log, "New image height: %dpx\n", raw_image.height);
+        }
+    } else {
+        status = apply_filter_chain_from(&after_reading, from_stage, use_cache ? &cache : NULL, &raw_image, &image_2,
+                                         log, message, message_size);
+    }
+    free_struct_image(&image_2);
+    if (status != IMAGE_OK) {
+        free_struct_image(&raw_image);
+        return status;
+    }
+
+    // Write modified image to output file, "-" is stdout
+    int to_stdout = strcmp(chain->output_file_name, "-") == 0;
+    int output_fildes = to_stdout ? STDOUT_FILENO : open(chain->output_file_name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (output_fildes == -1) {
+        free_struct_image(&raw_image);
+        return chain_error(message, message_size, IMAGE_ERR_IO, "Error opening output file");
+    }
+
+    status = struct_image_to_bmp_depth(output_fildes, &raw_image, chain->output_depth);
+    if (status != IMAGE_OK) {
+        free_struct_image(&raw_image);
+        if (!to_stdout) close(output_fildes);
+        return chain_error(message, message_size, status, "Error writing output file");
+    }
+
+    if (!to_stdout && close(output_fildes) == -1) {
+        free_struct_image(&raw_image);
+        return chain_error(message, message_size, IMAGE_ERR_IO, "Error writing output file");
+    }
+
+    // Kept for the next time the same chain is run on this input
+    if (use_cache) save_chain_stage(&cache, CHAIN_STAGE_OUTPUT, &raw_image, log);
+
+    // Smaller copies of the output, named after it
+    if (chain->pyramid_is_set) {
+        status = write_pyramid(chain, &raw_image, log, message, message_size);
+    }
+    free_struct_image(&raw_image);
+    return status;
+}
+
+// A length in full size pixels as a length in preview pixels, rounded
+int scale_preview_size(int size, int factor) {
+    return (size + factor/2)/factor;
+}
+
+// Scales chain's sizes for a width x height preview read at 1/factor
+// size with bmp_to_struct_image_preview(), so the filters reach as far
+// across the picture as they would at full size. Repeated blurs add
+// their variances, so the gaussian is repeated less often with the
+// same total in preview pixels. Kernel files are run as they are
+void scale_filter_chain_for_preview(struct filter_chain *chain, int factor, int width, int height) {
+    if (chain->gaussian_is_set && chain->gaussian_repeat > 0) {
+        double variance = chain->gaussian_repeat*chain->gaussian_standard_deviation*chain->gaussian_standard_deviation
+            /((double)factor*factor);
+        int repeat = scale_preview_size(chain->gaussian_repeat, factor*factor);
+        if (repeat < 1) repeat = 1;
+        chain->gaussian_repeat = repeat;
+        chain->gaussian_standard_deviation = sqrt(variance/repeat);
+    }
+    chain->box_mean_radius = scale_preview_size(chain->box_mean_radius, factor);
+    chain->bilateral_spatial_sd /= factor;
+    chain->median_radius = scale_preview_size(chain->median_radius, factor);
+    chain->adaptive_radius = scale_preview_size(chain->adaptive_radius, factor);
+    if (chain->adaptive_radius < 1) chain->adaptive_radius = 1;
+    chain->morphology_width = scale_preview_size(chain->morphology_width, factor);
+    chain->morphology_height = scale_preview_size(chain->morphology_height, factor);
+    if (chain->morphology_width < 1) chain->morphology_width = 1;
+    if (chain->morphology_height < 1) chain->morphology_height = 1;
+    if (chain->resize_width > 0) chain->resize_width = max(1, scale_preview_size(chain->resize_width, factor));
+    if (chain->resize_height > 0) chain->resize_height = max(1, scale_preview_size(chain->resize_height, factor));
+
+    // The crop keeps at least a pixel, inside the rotated preview
+    if (chain->crop_is_set) {
+        if (chain->orientation & ORIENTATION_TRANSPOSE) {
+            int swap = width;
+            width = height;
+            height = swap;
+        }
+        chain->crop_x1 = min(chain->crop_x1/factor, width - 1);
+        chain->crop_y1 = min(chain->crop_y1/factor, height - 1);
+        chain->crop_x2 = max(chain->crop_x1 + 1, min((chain->crop_x2 + factor - 1)/factor, width));
+        chain->crop_y2 = max(chain->crop_y1 + 1, min((chain->crop_y2 + factor - 1)/factor, height));
+    }
+}
+
+// Threads for a filter on img, chain->n_of_filter_threads or one per CPU
+int chain_filter_threads(struct filter_chain *chain, struct image *img) {
+    if (chain->n_of_filter_threads > 0) return chain->n_of_filter_threads;
+    return worker_threads_for_pixels(img->n_of_pixels);
+}
+
+// Reads a kernel from file_name, scales it to add up to 1 and convolves img with it
+int convolve_with_kernel_file(char *file_name, struct image *img, int n_of_threads) {
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) return IMAGE_ERR_IO;
+
+    struct convolution_kernel kernel;
+    int status = read_convolution_kernel(file, &kernel);
+    fclose(file);
+    if (status != IMAGE_OK) return status;
+
+    normalise_convolution_kernel(&kernel);
+    status = convolve_struct_image_threads(&kernel, img, n_of_threads);
+    free_convolution_kernel(&kernel);
+    return status;
+}
+
+// Writes img to a new file, returns IMAGE_ERR_IO if it can't be opened
+int write_bmp_file(char *file_name, struct image *img, int depth) {
+    int fildes = open(file_name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (fildes == -1) {
+        return IMAGE_ERR_IO;
+    }
+    int status = struct_image_to_bmp_depth(fildes, img, depth);
+    if (close(fildes) == -1 && status == IMAGE_OK) {
+        status = IMAGE_ERR_IO;
+    }
+    return status;
+}
+
+// Writes img's histogram as CSV, "-" is stdout
+int write_histogram_file(char *file_name, struct image *img) {
+    struct image_histogram histogram;
+    int status = compute_image_histogram(img, &histogram);
+    if (status != IMAGE_OK) return status;
+
+    int to_stdout = strcmp(file_name, "-") == 0;
+    FILE *file = to_stdout ? stdout : fopen(file_name, "w");
+    if (file == NULL) {
+        return IMAGE_ERR_IO;
+    }
+    status = write_histogram_csv(file, &histogram);
+    if (to_stdout) {
+        if (fflush(file) != 0 && status == IMAGE_OK) status = IMAGE_ERR_IO;
+    } else if (fclose(file) != 0 && status == IMAGE_OK) {
+        status = IMAGE_ERR_IO;
+    }
+    return status;
+}
+
+// Level n of "out.bmp" is written to "out-n.bmp", or with --tile-size to
+// "out-n-column-row.bmp" tiles, the ones on the right and bottom smaller
+int write_pyramid_level(struct filter_chain *chain, struct image *img, int level, char *message, size_t message_size) {
+    char file_name[4096];
+    size_t stem_length = strlen(chain->output_file_name);
+    if (stem_length >= 4 && strcmp(chain->output_file_name + stem_length - 4, ".bmp") == 0) {
+        stem_length -= 4;
+    }
+
+    int status;
+    if (chain->tile_size == 0) {
+        snprintf(file_name, sizeof(file_name), "%.*s-%d.bmp", (int)stem_length, chain->output_file_name, level);
+        status = write_bmp_file(file_name, img, chain->output_depth);
+        if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error writing %s", file_name);
+        return IMAGE_OK;
+    }
+
+    int tile_x, tile_y;
+    for (tile_y = 0; tile_y*chain->tile_size < img->height; tile_y++) {
+        for (tile_x = 0; tile_x*chain->tile_size < img->width; tile_x++) {
+            int x1 = tile_x*chain->tile_size;
+            int y1 = tile_y*chain->tile_size;
+            struct image tile;
+            status = copy_struct_image_region(&tile, img, x1, y1, min(x1 + chain->tile_size, img->width),
+                                              min(y1 + chain->tile_size, img->height));
+            if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error making tile");
+
+            snprintf(file_name, sizeof(file_name), "%.*s-%d-%d-%d.bmp", (int)stem_length, chain->output_file_name,
+                     level, tile_x, tile_y);
+            status = write_bmp_file(file_name, &tile, chain->output_depth);
+            free_struct_image(&tile);
+            if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error writing %s", file_name);
+        }
+    }
+    return IMAGE_OK;
+}
+
+// Writes each level of the pyramid, all of them are built
+// in one pass over img. Level 0 is only written when tiled
+int write_pyramid(struct filter_chain *chain, struct image *img, FILE *log, char *message, size_t message_size) {
+    int status;
+    if (chain->tile_size) {
+        if (log) fprintf(log, "Writing pyramid level 0 tiles\n");
+        status = write_pyramid_level(chain, img, 0, message, message_size);
+        if (status != IMAGE_OK) return status;
+    }
+
+    int n_of_levels = pyramid_depth(img->width, img->height);
+    if (chain->pyramid_levels != 0 && chain->pyramid_levels < n_of_levels) {
+        n_of_levels = chain->pyramid_levels;
+    }
+    if (n_of_levels == 0) return IMAGE_OK;
+
+    if (log) fprintf(log, "Building %d pyramid levels...\n", n_of_levels);
+    struct image *levels = image_alloc(img->allocator, n_of_levels*sizeof(struct image));
+    if (levels == NULL) {
+        return chain_error(message, message_size, IMAGE_ERR_NO_MEMORY, "Pyramid failed");
+    }
+    status = build_image_pyramid(img, n_of_levels, levels);
+    if (status != IMAGE_OK) {
+        image_dealloc(img->allocator, levels);
+        return chain_error(message, message_size, status, "Pyramid failed");
+    }
+
+    int level;
+    for (level = 0; level < n_of_levels; level++) {
+        if (status == IMAGE_OK) {
+            if (log) fprintf(log, "Writing pyramid level %d, %dx%dpx\n", level + 1, levels[level].width, levels[level].height);
+            status = write_pyramid_level(chain, &levels[level], level + 1, message, message_size);
+        }
+        free_struct_image(&levels[level]);
+    }
+    image_dealloc(img->allocator, levels);
+    return status;
+}
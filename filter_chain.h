@@ -0,0 +1,183 @@
+/* filter_chain.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the filter chain, the parsed
+ * form of a bmpedit command line, shared by the
+ * command line front end and the server
+ *
+ */
+
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include <stdio.h>
+#include "image_data_types.h"
+
+// Options that only have a long form
+enum long_option {
+    OPTION_SERVE = 256,
+    OPTION_THREADS,
+    OPTION_PYRAMID,
+    OPTION_TILE_SIZE,
+    OPTION_HISTOGRAM,
+    OPTION_WHITE_BALANCE,
+    OPTION_SATURATION,
+    OPTION_SEPIA,
+    OPTION_SWAP,
+    OPTION_ROTATE,
+    OPTION_FLIP,
+    OPTION_TRANSPOSE,
+    OPTION_CACHE,
+    OPTION_BATCH,
+    OPTION_MAX_MEMORY,
+    OPTION_STATS,
+    OPTION_PREVIEW,
+    OPTION_BILATERAL
+};
+
+// Points in apply_filter_chain() after the expensive filters, where
+// no colour matrix is waiting to run, so the image can be saved and
+// picked up again later (see result_cache.h). Each covers the options
+// since the one before
+enum chain_stage {
+    CHAIN_STAGE_INPUT = 0,      // nothing run yet
+    CHAIN_STAGE_GAUSSIAN,       // blend, rotate and flip, gaussian blur
+    CHAIN_STAGE_KERNEL,
+    CHAIN_STAGE_BOX_MEAN,
+    CHAIN_STAGE_BILATERAL,
+    CHAIN_STAGE_MEDIAN,         // white balance through to greyscale, median
+    CHAIN_STAGE_SOBEL,
+    CHAIN_STAGE_ADAPTIVE,       // invert, threshold, adaptive threshold
+    CHAIN_STAGE_MORPHOLOGY,
+    CHAIN_STAGE_OUTPUT          // emboss through to resize, and the output depth
+};
+
+// Every option bmpedit understands. Filters are always
+// applied in the order of the fields below, whatever
+// order they were given in on the command line
+struct filter_chain {
+    int help_is_set;
+
+    char *output_file_name;
+    int output_depth;
+    char *input_file_name;
+    char *input_2_file_name;
+
+    int blend_is_set;
+    double blend_value;
+
+    // Rotations and flips, combined in the order they were
+    // given into one orientation (see orientation.h)
+    int orientation;
+
+    int gaussian_is_set;
+    int gaussian_repeat;
+    double gaussian_standard_deviation;
+
+    char *kernel_file_name;
+
+    int box_mean_is_set;
+    int box_mean_radius;
+
+    int bilateral_is_set;
+    double bilateral_spatial_sd, bilateral_range_sd;
+
+    // White balance through to invert are colour matrices, the
+    // ones next to each other are run as one
+    int white_balance_is_set;
+    int white_balance_auto;
+    double white_balance_red, white_balance_green, white_balance_blue;
+
+    int brightness_is_set;
+    double brightness_value;
+
+    int saturation_is_set;
+    double saturation_value;
+
+    int sepia_is_set;
+
+    char *swap_order;
+
+    int greyscale_is_set;
+
+    int median_is_set;
+    int median_radius;
+
+    int sobel_is_set;
+
+    int invert_is_set;
+
+    int threshold_is_set;
+    int threshold_auto;
+    double threshold_value;
+
+    int adaptive_is_set;
+    int adaptive_method;
+    int adaptive_radius;
+    double adaptive_k;
+
+    int morphology_is_set;
+    int morphology_operation;
+    int morphology_width, morphology_height;
+
+    int emboss_is_set;
+
+    int sharpen_is_set;
+    double sharpen_value;
+
+    int crop_is_set;
+    int crop_x1, crop_y1, crop_x2, crop_y2;
+
+    int resize_is_set;
+    int resize_width, resize_height;
+    int resize_method;
+
+    // Extra outputs. The histogram is of the input,
+    // the pyramid is written after the output file
+    char *histogram_file_name;
+    int pyramid_is_set;
+    int pyramid_levels;
+    int tile_size;
+
+    // Directory of saved results, see result_cache.h
+    char *cache_dir;
+
+    // Bytes to stay under, 0 for no limit, see memory_plan.h.
+    // --stats reports the plan, peak memory use and time taken
+    uint64_t max_memory;
+    int stats_is_set;
+
+    // Run on a 1/preview_factor size copy of the input, with the
+    // filters' sizes scaled to match. 0 for the full size
+    int preview_factor;
+
+    // Batch mode, every input file name is filtered into batch_dir
+    char *batch_dir;
+    char **batch_input_file_names;
+    int n_of_batch_inputs;
+
+    // Server mode
+    char *serve_socket_path;
+
+    // Requests or batch images handled at once, 0 for one per CPU
+    int n_of_threads;
+
+    // Threads each filter splits the image between, 0 for one per CPU
+    // on big images. Batches filter one image per thread
+    int n_of_filter_threads;
+};
+
+int chain_error(char *message, size_t message_size, int status, const char *format, ...);
+
+int parse_filter_chain(int argc, char *argv[], struct filter_chain *chain, char *message, size_t message_size);
+int only_resize_is_set(const struct filter_chain *chain);
+
+int apply_filter_chain(struct filter_chain *chain, struct image *img, struct image *img_2, FILE *log,
+                       char *message, size_t message_size);
+
+void scale_filter_chain_for_preview(struct filter_chain *chain, int factor, int width, int height);
+int run_filter_chain(struct filter_chain *chain, int input_fildes, const struct image_allocator *allocator,
+                     FILE *log, char *message, size_t message_size);
+
+#endif
@@ -11,8 +11,7 @@
 #include "filters.h"
 #include "image_data_helper_functions.h"
 #include "convolution_kernels.h"
-#include <error.h>
-#include <errno.h>
+#include "colour_matrix.h"
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -36,24 +35,29 @@ void threshold_pixel(double threshold_value, struct pixel *ptr_pixel) {
     }
 }
 
-void threshold_image(double threshold_value, struct image *img) {
-    int pixel_index;
+// Single channel threshold, the grey value is the pixel average
+void threshold_grey(double threshold_value, uint8_t *grey) {
+    *grey = ((double)*grey / 255.0 > threshold_value) ? 0xFF : 0x0;
+}
+
+int threshold_image(double threshold_value, struct image *img) {
+    size_t pixel_index;
+    if (img->channels == 1) {
+        for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+            threshold_grey(threshold_value, &img->grey_array[pixel_index]);
+        }
+        return IMAGE_OK;
+    }
     for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
         threshold_pixel(threshold_value, &img->pixel_array[pixel_index]);
     }
+    return IMAGE_OK;
 }
 
-void invert_pixel(struct pixel *ptr_pixel) {
-    ptr_pixel->Red = 255 - ptr_pixel->Red;
-    ptr_pixel->Green = 255 - ptr_pixel->Green;
-    ptr_pixel->Blue = 255 - ptr_pixel->Blue;
-}
-
-void invert_image(struct image *img) {
-    int pixel_index;
-    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
-        invert_pixel(&img->pixel_array[pixel_index]);
-    }
+int invert_image(struct image *img) {
+    struct colour_matrix matrix;
+    colour_matrix_invert(&matrix);
+    return colour_matrix_image(&matrix, img);
 }
 
 // Blends two pixels together, the result is stored in pixel 1
@@ -69,247 +73,208 @@ void blend_two_pixels(double blend_coefficient, struct pixel *pixel_1, struct pi
 // Blends two images together with the blend_two_pixels function,
 // stores the result in img_1
 // Images must be the same dimensions and size
-// Returns 0 on success, -1 on failure
+// Returns IMAGE_OK on success, IMAGE_ERR_DIMENSIONS if they aren't
 int blend_two_images(double blend_coefficient, struct image *img_1, struct image *img_2) {
     // Check images can be blended
     if (img_1->width != img_2->width || img_1->height != img_2->height) {
-        return -1;
+        return IMAGE_ERR_DIMENSIONS;
     } else if (img_1->n_of_pixels != img_2->n_of_pixels) {
-        return -1;
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    // Only blend single channel if both are greyscale
+    int status = IMAGE_OK;
+    if (img_1->channels != img_2->channels) {
+        status = expand_grey_to_rgb(img_1);
+        if (status == IMAGE_OK) status = expand_grey_to_rgb(img_2);
+        if (status != IMAGE_OK) return status;
+    }
+
+    size_t pixel_index;
+    if (img_1->channels == 1) {
+        for (pixel_index = 0; pixel_index < img_1->n_of_pixels; pixel_index++) {
+            img_1->grey_array[pixel_index] = (int)((1.0-blend_coefficient)*img_1->grey_array[pixel_index]
+                                                   + blend_coefficient*img_2->grey_array[pixel_index]);
+        }
+        return IMAGE_OK;
     }
 
-    int pixel_index;
     for (pixel_index = 0; pixel_index < img_1->n_of_pixels; pixel_index++) {
         blend_two_pixels(blend_coefficient, &img_1->pixel_array[pixel_index], &img_2->pixel_array[pixel_index]);
     }
-    return 0;
+    return IMAGE_OK;
 }
 
 
 // Crops an image to contain all pixels between (x1,y1) inclusive and (x2,y2) exclusive
-void crop_image (int x1, int y1, int x2, int y2, struct image *img) {
+int crop_image (int x1, int y1, int x2, int y2, struct image *img) {
     int new_width = x2 - x1;
     int new_height = y2 - y1;
 
-    if (new_width <= 0 || new_height <= 0 || new_width > img->width || new_height > img->height) {
-        error(1, 0, "Crop needs sensible dimensions");
+    if (x1 < 0 || y1 < 0 || new_width <= 0 || new_height <= 0 || x2 > img->width || y2 > img->height) {
+        return IMAGE_ERR_DIMENSIONS;
     }
 
     struct image new_img;
-    new_img.width = new_width;
-    new_img.height = new_height;
-    new_img.n_of_pixels = new_width*new_height;
-    new_img.pixel_array_byte_size = new_img.n_of_pixels*3;
-    new_img.pixel_array = malloc(new_img.n_of_pixels*sizeof(struct pixel));
-
-    if (new_img.pixel_array == NULL) {
-        error(1, 0, "Couldn't allocate memory for new pixel array");
-    }
-
-    int x,y;
-    struct pixel *pix_ptr;
-    for (y = y1; y < y2; y++) {
-        for (x = x1; x < x2; x++) {
-            pix_ptr = get_pixel_pointer_from_struct_image_x_y(x, y, img);
-            set_pixel_in_struct_image_x_y(x-x1, y-y1, &new_img, pix_ptr);
-        }
-    }
-    
-    // Free the old array
-    free(img->pixel_array);       
-
-    // Point the old pointer at the new array
-    img->pixel_array = new_img.pixel_array;
-
-    // Set the new width/height/byte size
-    img->width = new_img.width;
-    img->height = new_img.height;
-    img->n_of_pixels = new_img.n_of_pixels;
-    img->pixel_array_byte_size = new_img.pixel_array_byte_size;
+    int status = copy_struct_image_region(&new_img, img, x1, y1, x2, y2);
+    if (status != IMAGE_OK) return status;
 
+    // Free the old array and use the new one
+    free_struct_image(img);
+    *img = new_img;
+    return IMAGE_OK;
 }
 
-void parse_crop_arg(int *x1, int *y1, int *x2, int *y2,char *crop_arg) {
+// Parses "x1,y1,x2,y2", returns IMAGE_ERR_ARGUMENT if a value is missing
+int parse_crop_arg(int *x1, int *y1, int *x2, int *y2,char *crop_arg) {
     // Get values out of string with strtok
-    *x1 = atoi(strtok(crop_arg, ","));
-    *y1 = atoi(strtok(NULL, ","));
-    *x2 = atoi(strtok(NULL, ","));
-    *y2 = atoi(strtok(NULL, ","));
-}
-
-void set_brightness_pixel(double brightness_percentage_change, struct pixel *pix) {
-    int old_red = pix->Red;
-    int old_green = pix->Green;
-    int old_blue = pix->Blue;
-
-    // Necessary because pixel colours are uint8_t
-    int new_red = pix->Red;
-    int new_green = pix->Green;
-    int new_blue = pix->Blue;
-
-    double brightness = (old_red + old_green + old_blue)/3.0;
-    double new_brightness = brightness_percentage_change*brightness + brightness;
-
-    new_red = (int)(3*new_brightness - old_green - old_blue);
-    new_green = (int)(3*new_brightness - old_red - old_blue);
-    new_blue = (int)(3*new_brightness - old_red- old_green);
-
-    if (new_red > 255) {
-        pix->Red = 255;
-    } else if (new_red < 0) {
-        pix->Red = 0;
-    } else {
-        pix->Red = new_red;
-    }
-
-    if (new_green> 255) {
-        pix->Green = 255;
-    } else if (new_green < 0) {
-        pix->Green = 0;
-    } else {
-        pix->Green = new_green;
-    }
-
-    if (new_blue> 255) {
-        pix->Blue = 255;
-    } else if (new_blue < 0) {
-        pix->Blue = 0;
-    } else {
-        pix->Blue = new_blue;
+    int *values[4] = {x1, y1, x2, y2};
+    char *token = strtok(crop_arg, ",");
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (token == NULL) return IMAGE_ERR_ARGUMENT;
+        *values[i] = atoi(token);
+        token = strtok(NULL, ",");
     }
+    return IMAGE_OK;
 }
 
-void brightness_image(double brightness_percentage_change, struct image *img) {
-    int pixel_index;
-    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
-        set_brightness_pixel(brightness_percentage_change, &img->pixel_array[pixel_index]);
-    }
+// Adds brightness_percentage_change times the sum of the channels to
+// each channel, with a colour matrix
+int brightness_image(double brightness_percentage_change, struct image *img) {
+    struct colour_matrix matrix;
+    colour_matrix_brightness(brightness_percentage_change, &matrix);
+    return colour_matrix_image(&matrix, img);
 }
 
+// Converts the image to a 1 channel image, so everything
+// after this only has a third of the data to work on
+int greyscale_image(struct image *img) {
+    if (img->channels == 1) return IMAGE_OK;
 
-void greyscale_pixel(struct pixel *pix) {
-    double grey_value = (int) ((pix->Red + pix->Green + pix->Blue)/3.0);
-    pix->Red = grey_value;
-    pix->Green = grey_value;
-    pix->Blue = grey_value;
+    struct colour_matrix matrix;
+    colour_matrix_greyscale(&matrix);
+    return colour_matrix_image(&matrix, img);
 }
 
-void greyscale_image(struct image *img) {
-    int pixel_index;
-// Blends two images together with the blend_two_pixels function,
-// stores the result in img_1
-// Images must be the same dimensions and size
-// Returns 0 on success, -1 on failure
-int blend_two_images(double blend_coefficient, struct image *img_1, struct image *img_2) {
-    // Check images can be blended
-    if (img_1->width != img_2->width || img_1->height != img_2->height) {
-        return -1;
-    } else if (img_1->n_of_pixels != img_2->n_of_pixels) {
-        return -1;
-    }
+// Clamps a 3x3 sum to a byte, (int)fmin(255, fmax(sum, 0)) without
+// the calls
+int clamp_kernel_sum(int sum) {
+    return sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+}
 
-    int pixel_index;
-    for (pixel_index = 0; pixel_index < img_1->n_of_pixels; pixel_index++) {
-        blend_two_pixels(blend_coefficient, &img_1->pixel_array[pixel_index], &img_2->pixel_array[pixel_index]);
-    }
-    return 0;
+int clamp_kernel_sum_double(double sum) {
+    sum = sum > 0.0 ? sum : 0.0;
+    sum = sum < 255.0 ? sum : 255.0;
+    return (int)sum;
 }
-    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
-        greyscale_pixel(&img->pixel_array[pixel_index]);
-    }
+
+// Both sobel directions clamped then added, like add_two_images()
+int sobel_sum(int horizontal, int vertical) {
+    int sum = clamp_kernel_sum(horizontal) + clamp_kernel_sum(vertical);
+    return sum > 255 ? 255 : sum;
 }
 
+// The built in 3x3 filters, each with its taps written into the sum.
+// Emboss adds up to 1 and the sobel matrices to 0, so normalising
+// them wouldn't change anything and they stay in ints
+#define EMBOSS_PIXEL(i, l, r) clamp_kernel_sum(KERNEL_3X3_SUM(-2, -1, 0, \
+                                                              -1, 1, 1, \
+                                                              0, 1, 2, i, l, r))
+// The sharpen middle value isn't a whole number so the taps are
+// doubles. Every pixel value times each tap is looked up, weights[p]
+// for the edges and weights[256 + p] for the middle, and added in the
+// same order as apply_kernel_to_x_y() so the result is the same
+#define SHARPEN_PIXEL(i, l, r) clamp_kernel_sum_double( \
+    weights[above[(i) - (l)]] + weights[above[i]] + weights[above[(i) + (r)]] \
+    + weights[row[(i) - (l)]] + weights[256 + row[i]] + weights[row[(i) + (r)]] \
+    + weights[below[(i) - (l)]] + weights[below[i]] + weights[below[(i) + (r)]])
+#define SOBEL_PIXEL(i, l, r) sobel_sum(KERNEL_3X3_SUM(1, 0, -1, \
+                                                      2, 0, -2, \
+                                                      1, 0, -1, i, l, r), \
+                                       KERNEL_3X3_SUM(1, 2, 1, \
+                                                      0, 0, 0, \
+                                                      -1, -2, -1, i, l, r))
+
+KERNEL_3X3_ROW(emboss_row, EMBOSS_PIXEL)
+KERNEL_3X3_ROW(sharpen_row, SHARPEN_PIXEL)
+KERNEL_3X3_ROW(sobel_row, SOBEL_PIXEL)
+
 // Emboss image
 // Creates an embossed effect,
 // conv matrix from
 // http://docs.gimp.org/en/plug-in-convmatrix.html
-void emboss_image (struct image *img) {
-    double conv_matrix[5][5] = {{0.0, 0.0, 0.0, 0.0, 0.0},
-                          {0.0, -2.0, -1.0, 0.0, 0.0},
-                          {0.0, -1.0, 1.0, 1.0, 0.0},
-                          {0.0, 0.0, 1.0, 2.0, 0.0},
-                          {0.0, 0.0, 0.0, 0.0, 0.0}};
-    normalise_kernel(conv_matrix);
-    apply_kernel_to_struct_image(conv_matrix, img);
+//  -2 -1  0
+//  -1  1  1
+//   0  1  2
+int emboss_image (struct image *img) {
+    return apply_kernel_3x3_rows(emboss_row, NULL, img);
 }
 
 // Sharpen image
 // based off of various sharpen conv matrices that I have seen
 // around, varies the middle value for difference in effect
 // Here is one example: http://www.nist.gov/lispix/imlab/filter/sharpen.html
-void sharpen_image(double sharpen_value, struct image *img) {
-    double conv_matrix[5][5] = {{0.0,  0.0,  0.0,  0.0, 0.0},
-                                {0.0, -1.0, -1.0, -1.0, 0.0},
-                                {0.0, -1.0,  0.0, -1.0, 0.0},
-                                {0.0, -1.0, -1.0, -1.0, 0.0},
-                                {0.0,  0.0,  0.0,  0.0, 0.0}};
-    conv_matrix[2][2] = sharpen_value;
-    normalise_kernel(conv_matrix);
-    apply_kernel_to_struct_image(conv_matrix, img);
-}      
+//  -1 -1 -1
+//  -1  v -1
+//  -1 -1 -1
+// divided by v - 8 so it keeps the brightness
+int sharpen_image(double sharpen_value, struct image *img) {
+    double kernel_sum = sharpen_value - 8.0;
+    if (kernel_sum == 0.0) kernel_sum = 1.0;
+    double edge = -1.0/kernel_sum;
+    double middle = sharpen_value/kernel_sum;
+    double weights[512];
+    int value;
+    for (value = 0; value < 256; value++) {
+        weights[value] = value*edge;
+        weights[256 + value] = value*middle;
+    }
+    return apply_kernel_3x3_rows(sharpen_row, weights, img);
+}
 
 // Sobel edge detector
 // Detects horizontal and vertical edges
 // Matrices are from
 // http://homepages.inf.ed.ac.uk/rbf/HIPR2/sobel.htm
-// Expensive implementation to take advantage of conv matrix functions
-void sobel_edge_detect_image(struct image *img) {
-    // Duplicate the original image then add the two images together
-    struct image dup_image;
-    dup_image.width = img->width;
-    dup_image.height = img->height;
-    dup_image.n_of_pixels = img->n_of_pixels;
-    dup_image.pixel_array = malloc(dup_image.n_of_pixels*sizeof(struct pixel));
-
-    if (dup_image.pixel_array == NULL) {
-        int errsv = errno;
-        error(1, errsv, "Failed to allocate memory for the duplicate image");
-    }
-
-    memcpy(dup_image.pixel_array, img->pixel_array, dup_image.n_of_pixels*sizeof(struct pixel));
-
-    double conv_matrix[5][5] = {{0.0,  0.0,  0.0,  0.0, 0.0},
-                                {0.0, 1.0, 0.0, -1.0, 0.0},
-                                {0.0, 2.0,  0.0, -2.0, 0.0},
-                                {0.0, 1.0, 0.0, -1.0, 0.0},
-                                {0.0,  0.0,  0.0,  0.0, 0.0}};
-    normalise_kernel(conv_matrix);
-    apply_kernel_to_struct_image(conv_matrix, img);
-
-    
-    double conv_2_matrix[5][5] = {{0.0,  0.0,  0.0,  0.0, 0.0},
-                                  {0.0, 1.0, 2.0, 1.0, 0.0},
-                                  {0.0, 0.0,  0.0, 0.0, 0.0},
-                                  {0.0, -1.0, -2.0, -1.0, 0.0},
-                                  {0.0,  0.0,  0.0,  0.0, 0.0}};
-    normalise_kernel(conv_2_matrix);
-    apply_kernel_to_struct_image(conv_2_matrix, &dup_image);
-
-    add_two_images(img, &dup_image);
-    free(dup_image.pixel_array);
-}  
+//   1  0 -1      1  2  1
+//   2  0 -2      0  0  0
+//   1  0 -1     -1 -2 -1
+// Each is clamped to 0-255 and the two are added, in one pass
+int sobel_edge_detect_image(struct image *img) {
+    return apply_kernel_3x3_rows(sobel_row, NULL, img);
+}
 
 
 // Gaussian blur
-// Generates a gaussian convolution matrix
-// then applies it to the image
-// This implementation is slower than necessary
-// the application of the convolution matrix
-// could be split up and applied horizontally
-// and vertically, but I want to use the conv
-// matrix functions
-void gaussian_blur(int repeat, double standard_deviation, struct image *img) {
+// Generates a 5x5 gaussian convolution matrix
+// and runs it over the image repeat times with
+// convolve_struct_image(), the engine -k uses
+int gaussian_blur(int repeat, double standard_deviation, struct image *img) {
+    if (standard_deviation <= 0.0) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
     double conv_matrix[5][5];
     generate_gaussian_kernel(conv_matrix, standard_deviation);
 
     int i;
     for (i = 0; i < repeat; i++) {
-        apply_kernel_to_struct_image(conv_matrix, img);
+        int status = apply_kernel_to_struct_image(conv_matrix, img);
+        if (status != IMAGE_OK) return status;
     }
+    return IMAGE_OK;
 }
 
-void parse_gaussian_arg(int *repeat, double *standard_deviation, char *gaussian_arg) {
+// Parses "repeat,sd", returns IMAGE_ERR_ARGUMENT if a value is missing
+int parse_gaussian_arg(int *repeat, double *standard_deviation, char *gaussian_arg) {
     // Get values out of string with strtok
-    *repeat = atoi(strtok(gaussian_arg, ","));
-    *standard_deviation = atof(strtok(NULL, ","));
+    char *repeat_str = strtok(gaussian_arg, ",");
+    char *standard_deviation_str = strtok(NULL, ",");
+    if (repeat_str == NULL || standard_deviation_str == NULL) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    *repeat = atoi(repeat_str);
+    *standard_deviation = atof(standard_deviation_str);
+    return IMAGE_OK;
 }
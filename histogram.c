@@ -0,0 +1,228 @@
+/* histogram.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Luminance and per channel histograms in one pass,
+ * split across threads, and Otsu's method for
+ * picking a threshold from them
+ *
+ */
+
+#include "histogram.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Pixels counted into the 32 bit sub-histograms before
+// they are added to the totals, so they can't overflow
+#define HISTOGRAM_BLOCK_PIXELS (1 << 24)
+
+// A range of pixels and the totals for it, one per thread
+struct histogram_job {
+    struct image *img;
+    size_t start;
+    size_t end;
+    struct image_histogram histogram;
+};
+
+void init_sum_to_luminance();
+void count_rgb_block(const struct pixel *pixels, size_t n_of_pixels, struct image_histogram *histogram);
+void count_grey_block(const uint8_t *grey, size_t n_of_pixels, struct image_histogram *histogram);
+void *histogram_job_main(void *arg);
+
+// Sum of the channels to luminance, (int)(sum/3.0) without the divide
+static uint8_t sum_to_luminance[3*255 + 1];
+static pthread_once_t sum_to_luminance_once = PTHREAD_ONCE_INIT;
+
+void init_sum_to_luminance() {
+    int sum;
+    for (sum = 0; sum <= 3*255; sum++) {
+        sum_to_luminance[sum] = sum/3;
+    }
+}
+
+// Consecutive pixels go to different copies of each histogram so
+// runs of equal values don't wait on the previous increment's store
+void count_rgb_block(const struct pixel *pixels, size_t n_of_pixels, struct image_histogram *histogram) {
+    uint32_t lum[4][256], red[4][256], green[4][256], blue[4][256];
+    memset(lum, 0, sizeof(lum));
+    memset(red, 0, sizeof(red));
+    memset(green, 0, sizeof(green));
+    memset(blue, 0, sizeof(blue));
+
+    size_t i;
+    int k;
+    for (i = 0; i + 4 <= n_of_pixels; i += 4) {
+        for (k = 0; k < 4; k++) {
+            const struct pixel *pix = &pixels[i + k];
+            red[k][pix->Red]++;
+            green[k][pix->Green]++;
+            blue[k][pix->Blue]++;
+            lum[k][sum_to_luminance[pix->Red + pix->Green + pix->Blue]]++;
+        }
+    }
+    for (; i < n_of_pixels; i++) {
+        const struct pixel *pix = &pixels[i];
+        red[0][pix->Red]++;
+        green[0][pix->Green]++;
+        blue[0][pix->Blue]++;
+        lum[0][sum_to_luminance[pix->Red + pix->Green + pix->Blue]]++;
+    }
+
+    int level;
+    for (level = 0; level < 256; level++) {
+        for (k = 0; k < 4; k++) {
+            histogram->luminance[level] += lum[k][level];
+            histogram->red[level] += red[k][level];
+            histogram->green[level] += green[k][level];
+            histogram->blue[level] += blue[k][level];
+        }
+    }
+}
+
+void count_grey_block(const uint8_t *grey, size_t n_of_pixels, struct image_histogram *histogram) {
+    uint32_t lum[4][256];
+    memset(lum, 0, sizeof(lum));
+
+    size_t i;
+    int k;
+    for (i = 0; i + 4 <= n_of_pixels; i += 4) {
+        lum[0][grey[i]]++;
+        lum[1][grey[i + 1]]++;
+        lum[2][grey[i + 2]]++;
+        lum[3][grey[i + 3]]++;
+    }
+    for (; i < n_of_pixels; i++) {
+        lum[0][grey[i]]++;
+    }
+
+    int level;
+    for (level = 0; level < 256; level++) {
+        for (k = 0; k < 4; k++) {
+            histogram->luminance[level] += lum[k][level];
+        }
+    }
+}
+
+void *histogram_job_main(void *arg) {
+    struct histogram_job *job = arg;
+    size_t start;
+    for (start = job->start; start < job->end; start += HISTOGRAM_BLOCK_PIXELS) {
+        size_t n = job->end - start;
+        if (n > HISTOGRAM_BLOCK_PIXELS) n = HISTOGRAM_BLOCK_PIXELS;
+        if (job->img->channels == 1) {
+            count_grey_block(job->img->grey_array + start, n, &job->histogram);
+        } else {
+            count_rgb_block(job->img->pixel_array + start, n, &job->histogram);
+        }
+    }
+    return NULL;
+}
+
+// Counts every pixel of img. Big images are split between one thread per
+// CPU, each with its own histogram, and the histograms added at the end
+int compute_image_histogram(struct image *img, struct image_histogram *histogram) {
+    return compute_image_histogram_threads(img, histogram, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// compute_image_histogram() on n_of_threads threads, at most WORKER_MAX_THREADS
+int compute_image_histogram_threads(struct image *img, struct image_histogram *histogram, int n_of_threads) {
+    pthread_once(&sum_to_luminance_once, init_sum_to_luminance);
+
+    if (n_of_threads < 1) n_of_threads = 1;
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+
+    struct histogram_job *jobs = image_alloc(img->allocator, n_of_threads*sizeof(struct histogram_job));
+    if (jobs == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    int t;
+    for (t = 0; t < n_of_threads; t++) {
+        memset(&jobs[t].histogram, 0, sizeof(struct image_histogram));
+        jobs[t].img = img;
+        jobs[t].start = img->n_of_pixels/n_of_threads*t;
+        jobs[t].end = t == n_of_threads - 1 ? img->n_of_pixels : img->n_of_pixels/n_of_threads*(t + 1);
+    }
+    run_worker_jobs(jobs, sizeof(jobs[0]), n_of_threads, histogram_job_main);
+
+    memset(histogram, 0, sizeof(*histogram));
+    int level;
+    for (t = 0; t < n_of_threads; t++) {
+        for (level = 0; level < 256; level++) {
+            histogram->luminance[level] += jobs[t].histogram.luminance[level];
+            histogram->red[level] += jobs[t].histogram.red[level];
+            histogram->green[level] += jobs[t].histogram.green[level];
+            histogram->blue[level] += jobs[t].histogram.blue[level];
+        }
+    }
+    image_dealloc(img->allocator, jobs);
+
+    // A grey pixel is the same in every channel
+    if (img->channels == 1) {
+        memcpy(histogram->red, histogram->luminance, sizeof(histogram->luminance));
+        memcpy(histogram->green, histogram->luminance, sizeof(histogram->luminance));
+        memcpy(histogram->blue, histogram->luminance, sizeof(histogram->luminance));
+    }
+    histogram->n_of_pixels = img->n_of_pixels;
+    return IMAGE_OK;
+}
+
+// Otsu's method: the level k that splits counts into 0..k and k+1..255
+// with the largest variance between the two classes' means. Ties go to
+// the lowest level, an image with one value gives that value
+int otsu_level(const uint64_t *counts) {
+    double total = 0.0;
+    double total_sum = 0.0;
+    int level;
+    for (level = 0; level < 256; level++) {
+        total += counts[level];
+        total_sum += (double)level*counts[level];
+    }
+
+    int best_level = 0;
+    double best_variance = -1.0;
+    double below = 0.0;
+    double below_sum = 0.0;
+    for (level = 0; level < 255; level++) {
+        below += counts[level];
+        below_sum += (double)level*counts[level];
+        double above = total - below;
+        if (below == 0.0 || above == 0.0) continue;
+
+        double mean_difference = below_sum/below - (total_sum - below_sum)/above;
+        double variance = below*above*mean_difference*mean_difference;
+        if (variance > best_variance) {
+            best_variance = variance;
+            best_level = level;
+        }
+    }
+
+    // One value only, nothing to split
+    if (best_variance < 0.0) {
+        for (level = 0; level < 256 && counts[level] == 0; level++);
+        return level < 256 ? level : 0;
+    }
+    return best_level;
+}
+
+// The -t value that makes threshold_image() turn luminance levels up to
+// otsu_level() black and the rest white. An RGB pixel's average is a whole
+// number of thirds, so anything between k + 2/3 and k + 1 splits after k
+double otsu_threshold_value(const struct image_histogram *histogram) {
+    return (otsu_level(histogram->luminance) + 5.0/6.0)/255.0;
+}
+
+// One line per level, "level,luminance,red,green,blue"
+int write_histogram_csv(FILE *file, const struct image_histogram *histogram) {
+    if (fprintf(file, "level,luminance,red,green,blue\n") < 0) return IMAGE_ERR_IO;
+    int level;
+    for (level = 0; level < 256; level++) {
+        if (fprintf(file, "%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", level, histogram->luminance[level],
+                    histogram->red[level], histogram->green[level], histogram->blue[level]) < 0) {
+            return IMAGE_ERR_IO;
+        }
+    }
+    return IMAGE_OK;
+}
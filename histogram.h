@@ -0,0 +1,32 @@
+/* histogram.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the histogram functions and
+ * the threshold choices made from histograms
+ *
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include "image_data_types.h"
+
+// Luminance is the grey value greyscale_image() would give, the
+// pixel average. A 1 channel image has the same counts in all four
+struct image_histogram {
+    uint64_t luminance[256];
+    uint64_t red[256];
+    uint64_t green[256];
+    uint64_t blue[256];
+    uint64_t n_of_pixels;
+};
+
+int compute_image_histogram(struct image *img, struct image_histogram *histogram);
+int compute_image_histogram_threads(struct image *img, struct image_histogram *histogram, int n_of_threads);
+int otsu_level(const uint64_t *counts);
+double otsu_threshold_value(const struct image_histogram *histogram);
+int write_histogram_csv(FILE *file, const struct image_histogram *histogram);
+
+#endif
@@ -8,27 +8,223 @@
  */
 
 #include "image_data_helper_functions.h"
-#include "error.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Below this many pixels starting threads costs more than it saves
+#define WORKER_THREAD_MIN_PIXELS (1 << 20)
 
 int min(int x, int y) { return x < y ? x : y; }
 int max(int x, int y) { return x > y ? x : y; }
 
-// Returns a pointer to the pixel at the given coordinates in the pixel array of img
+const char *image_status_string(int status) {
+    switch (status) {
+        case IMAGE_OK:             return "Success";
+        case IMAGE_ERR_IO:         return "Input/output error";
+        case IMAGE_ERR_NO_MEMORY:  return "Couldn't allocate memory";
+        case IMAGE_ERR_FORMAT:     return "Not a supported bitmap";
+        case IMAGE_ERR_ARGUMENT:   return "Invalid argument";
+        case IMAGE_ERR_DIMENSIONS: return "Image dimensions are out of range or don't match";
+        default:                   return "Unknown error";
+    }
+}
+
+// Threads to split a pass over n_of_pixels between, one per CPU for big images
+int worker_threads_for_pixels(size_t n_of_pixels) {
+    if (n_of_pixels < WORKER_THREAD_MIN_PIXELS) return 1;
+    long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return n_of_cpus > 0 ? n_of_cpus : 1;
+}
+
+// Runs job_main on each of the n_of_jobs jobs of job_size bytes, at most
+// WORKER_MAX_THREADS. Job 0 runs here and the rest on threads, or here
+// if a thread won't start
+void run_worker_jobs(void *jobs, size_t job_size, int n_of_jobs, void *(*job_main)(void *)) {
+    pthread_t threads[WORKER_MAX_THREADS];
+    char *job_bytes = jobs;
+    int started = 0;
+    int t;
+    for (t = 1; t < n_of_jobs; t++) {
+        if (pthread_create(&threads[t], NULL, job_main, job_bytes + t*job_size) != 0) break;
+        started = t;
+    }
+    job_main(job_bytes);
+    for (t = started + 1; t < n_of_jobs; t++) {
+        job_main(job_bytes + t*job_size);
+    }
+    for (t = 1; t <= started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Allocates through the caller's allocator, or malloc if there isn't one
+void *image_alloc(const struct image_allocator *allocator, size_t size) {
+    if (allocator == NULL) return malloc(size);
+    return allocator->alloc(size, allocator->context);
+}
+
+void image_dealloc(const struct image_allocator *allocator, void *ptr) {
+    if (ptr == NULL) return;
+    if (allocator == NULL) free(ptr);
+    else allocator->free(ptr, allocator->context);
+}
+
+// Sets up img as a width x height image with an uninitialised pixel array
+int init_struct_image(struct image *img, int width, int height, const struct image_allocator *allocator) {
+    if (width <= 0 || height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    // Size of the pixel data in a 24bpp bitmap, rows are padded to 4 bytes
+    // http://en.wikipedia.org/wiki/BMP_file_format
+    uint64_t row_width = ((uint64_t)24*width + 31)/32*4;
+
+    // Sizes are 64 bit, but size_t may not be
+    if ((uint64_t)width*height > SIZE_MAX/sizeof(struct pixel)) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->n_of_pixels = (size_t)width*height;
+    img->pixel_array_byte_size = row_width*height;
+    img->channels = 3;
+    img->grey_array = NULL;
+    img->allocator = allocator;
+    img->pixel_array = image_alloc(allocator, img->n_of_pixels*sizeof(struct pixel));
+
+    if (img->pixel_array == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    return IMAGE_OK;
+}
+
+// Sets up img as a 1 channel width x height image with an uninitialised grey array
+int init_grey_struct_image(struct image *img, int width, int height, const struct image_allocator *allocator) {
+    if (width <= 0 || height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    // Still 24bpp once it is written out
+    uint64_t row_width = ((uint64_t)24*width + 31)/32*4;
+
+    // Sizes are 64 bit, but size_t may not be
+    if ((uint64_t)width*height > SIZE_MAX/sizeof(struct pixel)) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    img->width = width;
+    img->height = height;
+    img->n_of_pixels = (size_t)width*height;
+    img->pixel_array_byte_size = row_width*height;
+    img->channels = 1;
+    img->pixel_array = NULL;
+    img->allocator = allocator;
+    img->grey_array = image_alloc(allocator, img->n_of_pixels);
+
+    if (img->grey_array == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    return IMAGE_OK;
+}
+
+// Makes dst a copy of src using the same allocator
+int copy_struct_image(struct image *dst, const struct image *src) {
+    int status;
+    if (src->channels == 1) {
+        status = init_grey_struct_image(dst, src->width, src->height, src->allocator);
+        if (status != IMAGE_OK) return status;
+        memcpy(dst->grey_array, src->grey_array, src->n_of_pixels);
+        return IMAGE_OK;
+    }
+
+    status = init_struct_image(dst, src->width, src->height, src->allocator);
+    if (status != IMAGE_OK) return status;
+    memcpy(dst->pixel_array, src->pixel_array, src->n_of_pixels*sizeof(struct pixel));
+    return IMAGE_OK;
+}
+
+// Copies the pixels between (x1,y1) inclusive and (x2,y2) exclusive
+// of src into a new image, a row at a time
+int copy_struct_image_region(struct image *dst, const struct image *src, int x1, int y1, int x2, int y2) {
+    if (x1 < 0 || y1 < 0 || x1 >= x2 || y1 >= y2 || x2 > src->width || y2 > src->height) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    int status;
+    if (src->channels == 1) {
+        status = init_grey_struct_image(dst, x2 - x1, y2 - y1, src->allocator);
+    } else {
+        status = init_struct_image(dst, x2 - x1, y2 - y1, src->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    size_t bytes_per_pixel = src->channels == 1 ? 1 : sizeof(struct pixel);
+    const uint8_t *src_bytes = src->channels == 1 ? src->grey_array : (uint8_t *)src->pixel_array;
+    uint8_t *dst_bytes = dst->channels == 1 ? dst->grey_array : (uint8_t *)dst->pixel_array;
+    size_t row_size = (size_t)dst->width*bytes_per_pixel;
+    int y;
+    for (y = y1; y < y2; y++) {
+        memcpy(dst_bytes + (size_t)(y - y1)*row_size, src_bytes + ((size_t)y*src->width + x1)*bytes_per_pixel, row_size);
+    }
+    return IMAGE_OK;
+}
+
+void free_struct_image(struct image *img) {
+    image_dealloc(img->allocator, img->pixel_array);
+    image_dealloc(img->allocator, img->grey_array);
+    img->pixel_array = NULL;
+    img->grey_array = NULL;
+}
+
+// Turns a 1 channel image back into 24bpp, for code
+// that doesn't have a single channel path
+int expand_grey_to_rgb(struct image *img) {
+    if (img->channels != 1) return IMAGE_OK;
+
+    struct pixel *pixel_array = image_alloc(img->allocator, img->n_of_pixels*sizeof(struct pixel));
+    if (pixel_array == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    size_t pixel_index;
+    for (pixel_index = 0; pixel_index < img->n_of_pixels; pixel_index++) {
+        uint8_t grey_value = img->grey_array[pixel_index];
+        pixel_array[pixel_index].Red = grey_value;
+        pixel_array[pixel_index].Green = grey_value;
+        pixel_array[pixel_index].Blue = grey_value;
+    }
+
+    image_dealloc(img->allocator, img->grey_array);
+    img->grey_array = NULL;
+    img->pixel_array = pixel_array;
+    img->channels = 3;
+    return IMAGE_OK;
+}
+
+// Returns a pointer to the pixel at the given coordinates in the pixel array of img,
+// or NULL if the coordinates are not inside the image
 struct pixel  *get_pixel_pointer_from_struct_image_x_y(int x, int y, struct image *img) {
-    int pixel_index = img->width*y + (img->width - 1 - x);
-    if (pixel_index >= img->n_of_pixels || pixel_index < 0) {
-        error(1, 0, "Error in get_pixel_from_struct_image_x_y, coordinates not inside image");
+    if (x < 0 || y < 0 || x >= img->width || y >= img->height) {
+        return NULL;
     }
-    return &img->pixel_array[pixel_index];
+    return &img->pixel_array[(size_t)img->width*y + x];
 }
 
 // Sets a pixel in img to have the same values as pix
-void set_pixel_in_struct_image_x_y(int x, int y, struct image *img, struct pixel *pix) {
+int set_pixel_in_struct_image_x_y(int x, int y, struct image *img, struct pixel *pix) {
     struct pixel *pixel_to_change = get_pixel_pointer_from_struct_image_x_y(x, y, img);
+    if (pixel_to_change == NULL) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
     pixel_to_change->Red = pix->Red;
     pixel_to_change->Blue = pix->Blue;
     pixel_to_change->Green = pix->Green;
+    return IMAGE_OK;
 }
 
 void print_pixel(struct pixel *ptr_pixel) {
@@ -46,6 +242,14 @@ struct pixel *get_nearest_pixel(int x, int y, struct image *img) {
     return get_pixel_pointer_from_struct_image_x_y(x, y, img);
 }
 
+// Single channel version of get_pixel_pointer_from_struct_image_x_y()
+uint8_t *get_grey_pointer_from_struct_image_x_y(int x, int y, struct image *img) {
+    if (x < 0 || y < 0 || x >= img->width || y >= img->height) {
+        return NULL;
+    }
+    return &img->grey_array[(size_t)img->width*y + x];
+}
+
 // Adds two pixels together
 // either adds the values together or finds
 // their maximums
@@ -60,16 +264,31 @@ void add_two_pixels(struct pixel *pix1, struct pixel *pix2) {
 }
 
 // Adds two images together, stores in first image
-void add_two_images(struct image *img_1, struct image *img_2) {
+int add_two_images(struct image *img_1, struct image *img_2) {
     // Check same dimensions
     if (img_1->width != img_2->width || img_1->height != img_2->height) {
-        error(1, 0, "add_two_images requires two images with the same dimensions");
+        return IMAGE_ERR_DIMENSIONS;
     } else if (img_1->n_of_pixels != img_2->n_of_pixels) {
-        error(1, 0, "add_two_images requires two images with the same number of pixels");
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    int status = IMAGE_OK;
+    if (img_1->channels != img_2->channels) {
+        status = expand_grey_to_rgb(img_1);
+        if (status == IMAGE_OK) status = expand_grey_to_rgb(img_2);
+        if (status != IMAGE_OK) return status;
+    }
+
+    size_t pixel_index;
+    if (img_1->channels == 1) {
+        for (pixel_index = 0; pixel_index < img_1->n_of_pixels; pixel_index++) {
+            img_1->grey_array[pixel_index] = min(img_1->grey_array[pixel_index] + img_2->grey_array[pixel_index], 255);
+        }
+        return IMAGE_OK;
     }
 
-    int pixel_index;
     for (pixel_index = 0; pixel_index < img_1->n_of_pixels; pixel_index++) {
         add_two_pixels(&img_1->pixel_array[pixel_index], &img_2->pixel_array[pixel_index]);
     }
+    return IMAGE_OK;
 }
@@ -13,18 +13,39 @@
 
 #include "image_data_types.h"
 
+// Most threads one pass over an image is split between
+#define WORKER_MAX_THREADS 16
+
 int min(int x, int y);
+int max(int x, int y);
+
+const char *image_status_string(int status);
+
+int worker_threads_for_pixels(size_t n_of_pixels);
+void run_worker_jobs(void *jobs, size_t job_size, int n_of_jobs, void *(*job_main)(void *));
+
+void *image_alloc(const struct image_allocator *allocator, size_t size);
+void image_dealloc(const struct image_allocator *allocator, void *ptr);
+
+int init_struct_image(struct image *img, int width, int height, const struct image_allocator *allocator);
+int init_grey_struct_image(struct image *img, int width, int height, const struct image_allocator *allocator);
+int copy_struct_image(struct image *dst, const struct image *src);
+int copy_struct_image_region(struct image *dst, const struct image *src, int x1, int y1, int x2, int y2);
+void free_struct_image(struct image *img);
+int expand_grey_to_rgb(struct image *img);
 
 struct pixel *get_pixel_pointer_from_struct_image_x_y(int x, int y, struct image *img);
 
-void set_pixel_in_struct_image_x_y(int x, int y, struct image *img, struct pixel *pix);
+int set_pixel_in_struct_image_x_y(int x, int y, struct image *img, struct pixel *pix);
 
 void print_pixel(struct pixel *ptr_pixel);
 
 struct pixel *get_nearest_pixel(int x, int y, struct image *img);
 
+uint8_t *get_grey_pointer_from_struct_image_x_y(int x, int y, struct image *img);
+
 void add_two_pixels(struct pixel *pix1, struct pixel *pix2);
 
-void add_two_images(struct image *img_1, struct image *img_2);
+int add_two_images(struct image *img_1, struct image *img_2);
 
 #endif
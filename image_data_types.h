@@ -11,21 +11,51 @@
 #define IMG_DATA_TYPES_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
+// Status codes returned by library functions,
+// IMAGE_OK is 0 and every error is negative
+enum image_status {
+    IMAGE_OK = 0,
+    IMAGE_ERR_IO = -1,          // errno holds the cause
+    IMAGE_ERR_NO_MEMORY = -2,
+    IMAGE_ERR_FORMAT = -3,      // not a supported bitmap
+    IMAGE_ERR_ARGUMENT = -4,
+    IMAGE_ERR_DIMENSIONS = -5   // mismatched or out of range dimensions
+};
+
+// Allocator for pixel arrays and scratch buffers,
+// a NULL allocator means malloc and free
+struct image_allocator {
+    void *(*alloc)(size_t size, void *context);
+    void (*free)(void *ptr, void *context);
+    void *context;
+};
+
+// Same byte order as a pixel in a 24bpp bitmap row
 struct pixel {
-    uint8_t Red;
-    uint8_t Green;
     uint8_t Blue;
+    uint8_t Green;
+    uint8_t Red;
 };
 
 // Generic image structure
-// 24bpp
+// 24bpp when channels is 3, the pixels are in pixel_array.
+// Greyscale images have 1 channel, one byte per pixel in
+// grey_array (same order as pixel_array) and no pixel_array.
+// Rows run top to bottom and each row left to right, so a
+// row of pixel_array is laid out exactly like a 24bpp bitmap
+// row without its padding
 
 struct image {
     int width;
     int height;
-    int n_of_pixels;
-    uint32_t pixel_array_byte_size;
+    size_t n_of_pixels;
+    // Padded size of the pixel data at 24bpp, can be over 4GiB
+    uint64_t pixel_array_byte_size;
+    int channels;
     struct pixel *pixel_array;
+    uint8_t *grey_array;
+    const struct image_allocator *allocator;
 };
 #endif
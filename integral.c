@@ -0,0 +1,323 @@
+/* integral.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Summed-area tables, built in parallel by bands of
+ * rows, and the box mean and adaptive threshold
+ * filters built on them. Any window sum is four
+ * lookups, so cost doesn't grow with the window
+ *
+ */
+
+#include "integral.h"
+#include "image_data_helper_functions.h"
+#include "filters.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Default k for each adaptive_method
+#define BRADLEY_DEFAULT_K 0.15
+#define SAUVOLA_DEFAULT_K 0.34
+
+// The rows [start, end) of the image one thread sums
+struct integral_job {
+    struct image *img;
+    struct integral_image *integral;
+    int start;
+    int end;
+    const uint64_t *offset_sums;
+    const uint64_t *offset_squares;
+};
+
+size_t integral_index(const struct integral_image *integral, int x, int y);
+void *integral_band_main(void *arg);
+void *integral_offset_main(void *arg);
+
+size_t integral_index(const struct integral_image *integral, int x, int y) {
+    return ((size_t)y*(integral->width + 1) + x)*integral->channels;
+}
+
+// Sums a band as if the rows above it were all 0
+void *integral_band_main(void *arg) {
+    struct integral_job *job = arg;
+    struct integral_image *integral = job->integral;
+    int channels = integral->channels;
+    int width = integral->width;
+    const uint8_t *bytes = job->img->channels == 1 ? job->img->grey_array : (uint8_t *)job->img->pixel_array;
+    size_t row_size = (size_t)(width + 1)*channels;
+    const uint64_t *zeros = integral->sums;     // row 0 is already all 0
+
+    int y, c;
+    for (y = job->start; y < job->end; y++) {
+        const uint8_t *in_row = bytes + (size_t)y*width*channels;
+        uint64_t *sums = integral->sums + integral_index(integral, 0, y + 1);
+        uint64_t *squares = integral->squares ? integral->squares + integral_index(integral, 0, y + 1) : NULL;
+        int first_row = y == job->start;
+
+        // The row above, or a row of 0s at the top of the band
+        const uint64_t *above_sums = first_row ? zeros : sums - row_size;
+        const uint64_t *above_squares = first_row || squares == NULL ? zeros : squares - row_size;
+
+        uint64_t row_sums[3] = {0, 0, 0};
+        uint64_t row_squares[3] = {0, 0, 0};
+        for (c = 0; c < channels; c++) {
+            sums[c] = 0;
+            if (squares) squares[c] = 0;
+        }
+        size_t i;
+        for (i = 0; i < (size_t)width*channels; i += channels) {
+            for (c = 0; c < channels; c++) {
+                row_sums[c] += in_row[i + c];
+                sums[channels + i + c] = row_sums[c] + above_sums[channels + i + c];
+            }
+        }
+        if (squares) {
+            for (i = 0; i < (size_t)width*channels; i += channels) {
+                for (c = 0; c < channels; c++) {
+                    uint64_t value = in_row[i + c];
+                    row_squares[c] += value*value;
+                    squares[channels + i + c] = row_squares[c] + above_squares[channels + i + c];
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Adds the finished row above the band to every row but its last,
+// which has already been done so the next band could start
+void *integral_offset_main(void *arg) {
+    struct integral_job *job = arg;
+    struct integral_image *integral = job->integral;
+    size_t row_size = (size_t)(integral->width + 1)*integral->channels;
+
+    int y;
+    size_t i;
+    for (y = job->start; y < job->end - 1; y++) {
+        uint64_t *sums = integral->sums + integral_index(integral, 0, y + 1);
+        for (i = 0; i < row_size; i++) sums[i] += job->offset_sums[i];
+        if (integral->squares) {
+            uint64_t *squares = integral->squares + integral_index(integral, 0, y + 1);
+            for (i = 0; i < row_size; i++) squares[i] += job->offset_squares[i];
+        }
+    }
+    return NULL;
+}
+
+int build_integral_image(struct image *img, int with_squares, struct integral_image *integral) {
+    return build_integral_image_threads(img, with_squares, integral, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// Each thread sums its own band of rows starting from 0. Then the last
+// row of each band is corrected in order, and every band adds the
+// corrected row above it to the rest of its rows at the same time
+int build_integral_image_threads(struct image *img, int with_squares, struct integral_image *integral, int n_of_threads) {
+    if (n_of_threads < 1) n_of_threads = 1;
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+    if (n_of_threads > img->height) n_of_threads = img->height;
+
+    integral->width = img->width;
+    integral->height = img->height;
+    integral->channels = img->channels;
+    integral->allocator = img->allocator;
+    size_t table_size = (size_t)(img->width + 1)*(img->height + 1)*img->channels*sizeof(uint64_t);
+    integral->sums = image_alloc(img->allocator, table_size);
+    integral->squares = with_squares ? image_alloc(img->allocator, table_size) : NULL;
+    struct integral_job *jobs = image_alloc(img->allocator, n_of_threads*sizeof(struct integral_job));
+    if (integral->sums == NULL || (with_squares && integral->squares == NULL) || jobs == NULL) {
+        image_dealloc(img->allocator, jobs);
+        free_integral_image(integral);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    // Row 0 is all 0
+    size_t row_size = (size_t)(img->width + 1)*img->channels;
+    memset(integral->sums, 0, row_size*sizeof(uint64_t));
+    if (with_squares) memset(integral->squares, 0, row_size*sizeof(uint64_t));
+
+    int t;
+    for (t = 0; t < n_of_threads; t++) {
+        jobs[t].img = img;
+        jobs[t].integral = integral;
+        jobs[t].start = (int)((int64_t)img->height*t/n_of_threads);
+        jobs[t].end = (int)((int64_t)img->height*(t + 1)/n_of_threads);
+    }
+    run_worker_jobs(jobs, sizeof(jobs[0]), n_of_threads, integral_band_main);
+    if (n_of_threads == 1) {
+        image_dealloc(img->allocator, jobs);
+        return IMAGE_OK;
+    }
+
+    size_t i;
+    for (t = 1; t < n_of_threads; t++) {
+        jobs[t].offset_sums = integral->sums + integral_index(integral, 0, jobs[t].start);
+        jobs[t].offset_squares = with_squares ? integral->squares + integral_index(integral, 0, jobs[t].start) : NULL;
+        uint64_t *last_sums = integral->sums + integral_index(integral, 0, jobs[t].end);
+        for (i = 0; i < row_size; i++) last_sums[i] += jobs[t].offset_sums[i];
+        if (with_squares) {
+            uint64_t *last_squares = integral->squares + integral_index(integral, 0, jobs[t].end);
+            for (i = 0; i < row_size; i++) last_squares[i] += jobs[t].offset_squares[i];
+        }
+    }
+    run_worker_jobs(jobs + 1, sizeof(jobs[0]), n_of_threads - 1, integral_offset_main);
+
+    image_dealloc(img->allocator, jobs);
+    return IMAGE_OK;
+}
+
+void free_integral_image(struct integral_image *integral) {
+    image_dealloc(integral->allocator, integral->sums);
+    image_dealloc(integral->allocator, integral->squares);
+    integral->sums = NULL;
+    integral->squares = NULL;
+}
+
+// Sum of channel over the pixels from (x1,y1) inclusive to (x2,y2)
+// exclusive, table is the integral's sums or squares
+uint64_t integral_window_sum(const struct integral_image *integral, const uint64_t *table, int channel,
+                             int x1, int y1, int x2, int y2) {
+    return table[integral_index(integral, x2, y2) + channel] - table[integral_index(integral, x1, y2) + channel]
+         - table[integral_index(integral, x2, y1) + channel] + table[integral_index(integral, x1, y1) + channel];
+}
+
+// Replaces each pixel with the mean of the (2*radius + 1) square around it.
+// Windows are cut off at the edges of the image and average fewer pixels
+int box_mean_image(int radius, struct image *img) {
+    return box_mean_image_threads(radius, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// box_mean_image() building the summed-area table on n_of_threads threads
+int box_mean_image_threads(int radius, struct image *img, int n_of_threads) {
+    if (radius < 0) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    struct integral_image integral;
+    int status = build_integral_image_threads(img, 0, &integral, n_of_threads);
+    if (status != IMAGE_OK) return status;
+
+    // Window sums fit in 32 bits unless the window is huge, which
+    // makes the divide a lot cheaper
+    int channels = img->channels;
+    uint64_t window_size = (uint64_t)(2*radius + 1)*(2*radius + 1);
+    int small_window = window_size <= UINT32_MAX/255;
+    uint8_t *bytes = img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    int x, y, c;
+    for (y = 0; y < img->height; y++) {
+        int y1 = y - radius < 0 ? 0 : y - radius;
+        int y2 = y + radius + 1 > img->height ? img->height : y + radius + 1;
+        const uint64_t *top = integral.sums + integral_index(&integral, 0, y1);
+        const uint64_t *bottom = integral.sums + integral_index(&integral, 0, y2);
+        uint8_t *row = bytes + (size_t)y*img->width*channels;
+        for (x = 0; x < img->width; x++) {
+            int x1 = x - radius < 0 ? 0 : x - radius;
+            int x2 = x + radius + 1 > img->width ? img->width : x + radius + 1;
+            size_t left = (size_t)x1*channels;
+            size_t right = (size_t)x2*channels;
+            uint64_t n = (uint64_t)(x2 - x1)*(y2 - y1);
+            for (c = 0; c < channels; c++) {
+                uint64_t sum = bottom[right + c] - bottom[left + c] - top[right + c] + top[left + c];
+                if (small_window) {
+                    row[x*channels + c] = ((uint32_t)sum + (uint32_t)n/2)/(uint32_t)n;
+                } else {
+                    row[x*channels + c] = (sum + n/2)/n;
+                }
+            }
+        }
+    }
+
+    free_integral_image(&integral);
+    return IMAGE_OK;
+}
+
+// Thresholds each pixel's luminance against its (2*radius + 1) square
+// window, see adaptive_method. A k of 0 or less uses the method's
+// default. Pixels come out black or white, with the image's channels
+int adaptive_threshold_image(int method, int radius, double k, struct image *img) {
+    return adaptive_threshold_image_threads(method, radius, k, img, worker_threads_for_pixels(img->n_of_pixels));
+}
+
+// adaptive_threshold_image() building the summed-area table on n_of_threads threads
+int adaptive_threshold_image_threads(int method, int radius, double k, struct image *img, int n_of_threads) {
+    if (radius < 0 || (method != ADAPTIVE_BRADLEY && method != ADAPTIVE_SAUVOLA)) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    if (k <= 0.0) {
+        k = method == ADAPTIVE_SAUVOLA ? SAUVOLA_DEFAULT_K : BRADLEY_DEFAULT_K;
+    }
+
+    // Luminance, as greyscale_image() works it out
+    struct image luminance;
+    int status = copy_struct_image(&luminance, img);
+    if (status == IMAGE_OK) status = greyscale_image(&luminance);
+    if (status != IMAGE_OK) {
+        free_struct_image(&luminance);
+        return status;
+    }
+
+    struct integral_image integral;
+    status = build_integral_image_threads(&luminance, method == ADAPTIVE_SAUVOLA, &integral, n_of_threads);
+    if (status != IMAGE_OK) {
+        free_struct_image(&luminance);
+        return status;
+    }
+
+    int x, y;
+    for (y = 0; y < img->height; y++) {
+        int y1 = y - radius < 0 ? 0 : y - radius;
+        int y2 = y + radius + 1 > img->height ? img->height : y + radius + 1;
+        const uint64_t *top = integral.sums + integral_index(&integral, 0, y1);
+        const uint64_t *bottom = integral.sums + integral_index(&integral, 0, y2);
+        const uint64_t *top_squares = integral.squares ? integral.squares + integral_index(&integral, 0, y1) : NULL;
+        const uint64_t *bottom_squares = integral.squares ? integral.squares + integral_index(&integral, 0, y2) : NULL;
+        for (x = 0; x < img->width; x++) {
+            int x1 = x - radius < 0 ? 0 : x - radius;
+            int x2 = x + radius + 1 > img->width ? img->width : x + radius + 1;
+            double n = (double)(x2 - x1)*(y2 - y1);
+            double mean = (bottom[x2] - bottom[x1] - top[x2] + top[x1])/n;
+            double threshold;
+            if (method == ADAPTIVE_SAUVOLA) {
+                uint64_t squares = bottom_squares[x2] - bottom_squares[x1] - top_squares[x2] + top_squares[x1];
+                double variance = squares/n - mean*mean;
+                double deviation = variance > 0.0 ? sqrt(variance) : 0.0;
+                threshold = mean*(1.0 + k*(deviation/128.0 - 1.0));
+            } else {
+                threshold = mean*(1.0 - k);
+            }
+
+            size_t pixel_index = (size_t)y*img->width + x;
+            uint8_t value = luminance.grey_array[pixel_index] <= threshold ? 0x0 : 0xFF;
+            if (img->channels == 1) {
+                img->grey_array[pixel_index] = value;
+            } else {
+                struct pixel *pix = &img->pixel_array[pixel_index];
+                pix->Red = pix->Green = pix->Blue = value;
+            }
+        }
+    }
+
+    free_integral_image(&integral);
+    free_struct_image(&luminance);
+    return IMAGE_OK;
+}
+
+// Parses "method,radius[,k]", method is bradley or sauvola
+int parse_adaptive_arg(int *method, int *radius, double *k, char *adaptive_arg) {
+    char method_name[16];
+    *k = 0.0;
+    int n = sscanf(adaptive_arg, "%15[a-z],%d,%lf", method_name, radius, k);
+    if (n < 2 || *radius < 0 || *k < 0.0 || *k > 1.0) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    if (strcmp(method_name, "bradley") == 0) {
+        *method = ADAPTIVE_BRADLEY;
+    } else if (strcmp(method_name, "sauvola") == 0) {
+        *method = ADAPTIVE_SAUVOLA;
+    } else {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
@@ -0,0 +1,44 @@
+/* integral.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of summed-area tables and the
+ * filters built on them
+ *
+ */
+
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include "image_data_types.h"
+
+// sums[((size_t)y*(width + 1) + x)*channels + c] is the sum of channel c
+// over every pixel above and left of (x,y), so row and column 0 are 0.
+// squares is the same for the squared values, NULL unless asked for
+struct integral_image {
+    int width;
+    int height;
+    int channels;
+    uint64_t *sums;
+    uint64_t *squares;
+    const struct image_allocator *allocator;
+};
+
+enum adaptive_method {
+    ADAPTIVE_BRADLEY = 0,   // black below (1-k) times the local mean
+    ADAPTIVE_SAUVOLA        // black below mean*(1 + k*(sd/128 - 1))
+};
+
+int build_integral_image(struct image *img, int with_squares, struct integral_image *integral);
+int build_integral_image_threads(struct image *img, int with_squares, struct integral_image *integral, int n_of_threads);
+void free_integral_image(struct integral_image *integral);
+uint64_t integral_window_sum(const struct integral_image *integral, const uint64_t *table, int channel,
+                             int x1, int y1, int x2, int y2);
+
+int box_mean_image(int radius, struct image *img);
+int box_mean_image_threads(int radius, struct image *img, int n_of_threads);
+int adaptive_threshold_image(int method, int radius, double k, struct image *img);
+int adaptive_threshold_image_threads(int method, int radius, double k, struct image *img, int n_of_threads);
+int parse_adaptive_arg(int *method, int *radius, double *k, char *adaptive_arg);
+
+#endif
@@ -0,0 +1,35 @@
+/* libbmpedit.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Public header for libbmpedit, the bitmap codec
+ * and filters without the command line front end.
+ *
+ * Nothing in the library exits the process, functions
+ * return IMAGE_OK or a negative image_status (see
+ * image_data_types.h and image_status_string()).
+ * Memory for pixel arrays and scratch buffers comes
+ * from the image_allocator passed to the decoder or
+ * init_struct_image(), or malloc if that is NULL
+ *
+ */
+
+#ifndef LIBBMPEDIT_H
+#define LIBBMPEDIT_H
+
+#include "image_data_types.h"
+#include "image_data_helper_functions.h"
+#include "bmp_struct_image.h"
+#include "convolution_kernels.h"
+#include "filters.h"
+#include "resize.h"
+#include "histogram.h"
+#include "integral.h"
+#include "median.h"
+#include "fft.h"
+#include "morphology.h"
+#include "colour_matrix.h"
+#include "orientation.h"
+#include "bilateral.h"
+
+#endif
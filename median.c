@@ -0,0 +1,201 @@
+/* median.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Median filter in constant time per pixel, after
+ * Perreault and Hebert, "Median Filtering in Constant
+ * Time". Each column keeps a histogram of its part of
+ * the window and the window's histogram slides along
+ * the row by adding one column and taking one away.
+ * Histograms are split into 16 coarse bins of 16 fine
+ * ones, only the coarse bins are kept up to date on
+ * every step and a fine bin is caught up when the
+ * median lands in it
+ *
+ */
+
+#include "median.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define COARSE_BINS 16
+#define FINE_BINS 256
+
+// Histograms for one channel of one row of windows
+struct median_state {
+    int width;
+    int radius;
+    uint16_t *column_coarse;    // width x COARSE_BINS
+    uint16_t *column_fine;      // width x FINE_BINS
+    uint32_t kernel_coarse[COARSE_BINS];
+    uint32_t kernel_fine[FINE_BINS];
+    int fine_updated_at[COARSE_BINS];  // x the fine bins were last right for
+};
+
+int clamp_index(int i, int size);
+void column_add(struct median_state *state, int x, uint8_t value, int amount);
+void kernel_add_column(struct median_state *state, int column, int sign);
+void update_fine_bin(struct median_state *state, int coarse, int x);
+uint8_t kernel_median(struct median_state *state, int x, uint32_t rank);
+void median_channel(struct median_state *state, const uint8_t *in, uint8_t *out, int height, int channels, int channel);
+
+// Edges are replicated like get_nearest_pixel()
+int clamp_index(int i, int size) {
+    if (i < 0) return 0;
+    if (i >= size) return size - 1;
+    return i;
+}
+
+void column_add(struct median_state *state, int x, uint8_t value, int amount) {
+    state->column_coarse[(size_t)x*COARSE_BINS + (value >> 4)] += amount;
+    state->column_fine[(size_t)x*FINE_BINS + value] += amount;
+}
+
+// Adds (sign 1) or takes away (sign -1) a column's coarse counts
+void kernel_add_column(struct median_state *state, int column, int sign) {
+    const uint16_t *coarse = &state->column_coarse[(size_t)clamp_index(column, state->width)*COARSE_BINS];
+    int i;
+    for (i = 0; i < COARSE_BINS; i++) {
+        state->kernel_coarse[i] += sign*coarse[i];
+    }
+}
+
+// Brings the fine bins under one coarse bin up to the window at x. Steps
+// along from where they were last right, or sums the window from scratch
+// if that's less work
+void update_fine_bin(struct median_state *state, int coarse, int x) {
+    int radius = state->radius;
+    uint32_t *fine = &state->kernel_fine[coarse*16];
+    int last = state->fine_updated_at[coarse];
+    int i, column;
+
+    if (last < 0 || 2*(x - last) > 2*radius + 1) {
+        memset(fine, 0, 16*sizeof(uint32_t));
+        for (column = x - radius; column <= x + radius; column++) {
+            const uint16_t *counts = &state->column_fine[(size_t)clamp_index(column, state->width)*FINE_BINS + coarse*16];
+            for (i = 0; i < 16; i++) fine[i] += counts[i];
+        }
+    } else {
+        for (column = last + 1; column <= x; column++) {
+            const uint16_t *added = &state->column_fine[(size_t)clamp_index(column + radius, state->width)*FINE_BINS + coarse*16];
+            const uint16_t *removed = &state->column_fine[(size_t)clamp_index(column - radius - 1, state->width)*FINE_BINS + coarse*16];
+            for (i = 0; i < 16; i++) fine[i] += added[i] - removed[i];
+        }
+    }
+    state->fine_updated_at[coarse] = x;
+}
+
+// The value rank values up from the bottom of the window at x
+uint8_t kernel_median(struct median_state *state, int x, uint32_t rank) {
+    int coarse = 0;
+    uint32_t below = 0;
+    while (below + state->kernel_coarse[coarse] <= rank) {
+        below += state->kernel_coarse[coarse];
+        coarse++;
+    }
+
+    update_fine_bin(state, coarse, x);
+    int value = coarse*16;
+    while (below + state->kernel_fine[value] <= rank) {
+        below += state->kernel_fine[value];
+        value++;
+    }
+    return value;
+}
+
+// Median of one channel of in, written to the same channel of out
+void median_channel(struct median_state *state, const uint8_t *in, uint8_t *out, int height, int channels, int channel) {
+    int width = state->width;
+    int radius = state->radius;
+    size_t row_size = (size_t)width*channels;
+    uint32_t rank = ((uint32_t)(2*radius + 1)*(2*radius + 1))/2;
+    int x, y, i;
+
+    // Columns start out holding the window around row 0
+    memset(state->column_coarse, 0, (size_t)width*COARSE_BINS*sizeof(uint16_t));
+    memset(state->column_fine, 0, (size_t)width*FINE_BINS*sizeof(uint16_t));
+    for (i = -radius; i <= radius; i++) {
+        const uint8_t *row = in + (size_t)clamp_index(i, height)*row_size + channel;
+        for (x = 0; x < width; x++) {
+            column_add(state, x, row[x*channels], 1);
+        }
+    }
+
+    for (y = 0; y < height; y++) {
+        // Slide the columns down a row
+        if (y > 0) {
+            const uint8_t *removed = in + (size_t)clamp_index(y - radius - 1, height)*row_size + channel;
+            const uint8_t *added = in + (size_t)clamp_index(y + radius, height)*row_size + channel;
+            for (x = 0; x < width; x++) {
+                column_add(state, x, removed[x*channels], -1);
+                column_add(state, x, added[x*channels], 1);
+            }
+        }
+
+        memset(state->kernel_coarse, 0, sizeof(state->kernel_coarse));
+        for (i = 0; i < COARSE_BINS; i++) state->fine_updated_at[i] = -1;
+        for (i = -radius; i <= radius; i++) {
+            kernel_add_column(state, i, 1);
+        }
+
+        uint8_t *out_row = out + (size_t)y*row_size + channel;
+        for (x = 0; x < width; x++) {
+            if (x > 0) {
+                kernel_add_column(state, x + radius, 1);
+                kernel_add_column(state, x - radius - 1, -1);
+            }
+            out_row[x*channels] = kernel_median(state, x, rank);
+        }
+    }
+}
+
+// Replaces each pixel with the median of the (2*radius + 1) square around
+// it, each channel on its own. Cost per pixel doesn't depend on radius
+int median_image(int radius, struct image *img) {
+    if (radius < 0 || radius > MEDIAN_MAX_RADIUS) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    if (radius == 0) {
+        return IMAGE_OK;
+    }
+
+    struct image filtered;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&filtered, img->width, img->height, img->allocator);
+    } else {
+        status = init_struct_image(&filtered, img->width, img->height, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    struct median_state *state = image_alloc(img->allocator, sizeof(struct median_state));
+    uint16_t *column_coarse = image_alloc(img->allocator, (size_t)img->width*COARSE_BINS*sizeof(uint16_t));
+    uint16_t *column_fine = image_alloc(img->allocator, (size_t)img->width*FINE_BINS*sizeof(uint16_t));
+    if (state == NULL || column_coarse == NULL || column_fine == NULL) {
+        image_dealloc(img->allocator, state);
+        image_dealloc(img->allocator, column_coarse);
+        image_dealloc(img->allocator, column_fine);
+        free_struct_image(&filtered);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    state->width = img->width;
+    state->radius = radius;
+    state->column_coarse = column_coarse;
+    state->column_fine = column_fine;
+
+    int channels = img->channels;
+    const uint8_t *in = channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    uint8_t *out = channels == 1 ? filtered.grey_array : (uint8_t *)filtered.pixel_array;
+    int c;
+    for (c = 0; c < channels; c++) {
+        median_channel(state, in, out, img->height, channels, c);
+    }
+
+    image_dealloc(img->allocator, state);
+    image_dealloc(img->allocator, column_coarse);
+    image_dealloc(img->allocator, column_fine);
+    free_struct_image(img);
+    *img = filtered;
+    return IMAGE_OK;
+}
@@ -0,0 +1,19 @@
+/* median.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the median filter
+ *
+ */
+
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include "image_data_types.h"
+
+// Biggest radius median_image() takes, column counts are 16 bit
+#define MEDIAN_MAX_RADIUS 32000
+
+int median_image(int radius, struct image *img);
+
+#endif
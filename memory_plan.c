@@ -0,0 +1,572 @@
+/* memory_plan.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * bmpedit --max-memory SIZE reads the input's header and
+ * adds up what each filter in the chain allocates, to
+ * estimate the most memory the run will use at once. If
+ * the whole image won't fit, the image is cut into full
+ * width strips, or if even a strip is too big into tiles,
+ * and the chain is run on one piece at a time.
+ *
+ * Each piece is read with a halo of the pixels the filters
+ * reach for round it, so the middle comes out exactly as
+ * it would from the whole image, and only the middle is
+ * written. Strips go bottom up, the order rows are stored
+ * in, so they can be written to a pipe. Tiles are written
+ * into place with pwrite
+ *
+ */
+
+#include "memory_plan.h"
+#include "libbmpedit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Everything besides images and scratch buffers: the program,
+// libc, thread stacks and the buffer pool's spare blocks
+#define MEMORY_PLAN_BASE_BYTES (8 << 20)
+
+// Per thread block buffer for reading and writing, IO_BLOCK_SIZE
+// in bmp_struct_image.c
+#define MEMORY_PLAN_IO_BLOCK_BYTES (1 << 20)
+
+// Fewer rows than this and the halos are most of the work,
+// so tiles are tried instead
+#define MEMORY_PLAN_MIN_STRIP_ROWS 16
+
+// Tiles start on a whole byte of a 1bpp output row
+#define MEMORY_PLAN_TILE_STEP 8
+
+uint64_t max_u64(uint64_t a, uint64_t b);
+uint64_t convolution_memory(int width, int height, int channels, int kernel_width, int kernel_height);
+uint64_t integral_memory(int width, int height, int channels, int with_squares);
+uint64_t resize_while_reading_memory(const struct filter_chain *chain, const struct memory_plan *plan);
+const char *option_needing_whole_image(const struct filter_chain *chain);
+void chain_reach(const struct filter_chain *chain, const struct memory_plan *plan, int *reach_x, int *reach_y);
+int piece_output_depth(const struct filter_chain *chain, const struct memory_plan *plan);
+uint64_t piece_memory(const struct filter_chain *chain, const struct memory_plan *plan, int tiles, int size);
+int largest_piece(const struct filter_chain *chain, const struct memory_plan *plan, int tiles);
+int output_can_seek(const struct filter_chain *chain);
+int count_pieces(const struct memory_plan *plan);
+int run_piece(struct filter_chain *piece_chain, const struct memory_plan *plan, int input_fildes, int input_2_fildes,
+              int output_fildes, int x1, int y1, int x2, int y2, const struct image_allocator *allocator,
+              char *message, size_t message_size);
+
+uint64_t max_u64(uint64_t a, uint64_t b) { return a > b ? a : b; }
+
+// Parses a number of bytes, with K, M or G for KiB, MiB or GiB
+int parse_memory_size_arg(uint64_t *bytes, const char *memory_arg) {
+    char *end;
+    double size = strtod(memory_arg, &end);
+    double unit = 1.0;
+    switch (*end) {
+        case 'k': case 'K': unit = 1 << 10; end++; break;
+        case 'm': case 'M': unit = 1 << 20; end++; break;
+        case 'g': case 'G': unit = 1 << 30; end++; break;
+        default:;
+    }
+    if (end == memory_arg || *end != '\0' || !(size*unit >= 1.0) || size*unit > 1e18) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    *bytes = size*unit;
+    return IMAGE_OK;
+}
+
+// The filtered copy convolve_struct_image() makes, and the
+// transform buffers if it picks FFTs for this size
+uint64_t convolution_memory(int width, int height, int channels, int kernel_width, int kernel_height) {
+    uint64_t pixels = (uint64_t)width*height;
+    double direct_cost = (double)pixels*channels*kernel_width*kernel_height;
+    int size_x, size_y;
+    double fft_cost = fft_convolution_cost(width, height, channels, kernel_width, kernel_height, &size_x, &size_y);
+    if (fft_cost >= direct_cost) {
+        return pixels*channels;
+    }
+    int n_of_threads = worker_threads_for_pixels(pixels);
+    if (n_of_threads > WORKER_MAX_THREADS) n_of_threads = WORKER_MAX_THREADS;
+    // Real and imaginary parts for the kernel and for each thread
+    return pixels*channels + (uint64_t)(2 + 2*n_of_threads)*size_x*size_y*sizeof(double);
+}
+
+uint64_t integral_memory(int width, int height, int channels, int with_squares) {
+    return (uint64_t)(width + 1)*(height + 1)*channels*sizeof(uint64_t)*(with_squares ? 2 : 1);
+}
+
+// Rough peak memory use of running chain on a width x height image
+// with plan's channels, from what each filter allocates while the
+// image, and the second image for a blend, are held. A piece leaves
+// out the crop, the resize and the extra outputs, which need the
+// whole image
+uint64_t estimate_chain_memory(const struct filter_chain *chain, const struct memory_plan *plan,
+                               int width, int height, int is_piece) {
+    uint64_t pixels = (uint64_t)width*height;
+    uint64_t io = (uint64_t)worker_threads_for_pixels(pixels)*MEMORY_PLAN_IO_BLOCK_BYTES;
+    int channels = plan->channels;
+    uint64_t image = pixels*channels;
+    uint64_t other = 0;
+    uint64_t peak = image + io;
+
+    // The second image is kept until the chain is done. A grey
+    // and a colour image are both made colour
+    if (chain->blend_is_set) {
+        if (plan->channels_2 != channels) channels = 3;
+        image = pixels*channels;
+        other = image;
+        peak = max_u64(peak, 2*image + io);
+    }
+
+    // Transposing copies, flips are in place
+    if (chain->orientation & ORIENTATION_TRANSPOSE) {
+        peak = max_u64(peak, other + 2*image);
+        int swap = width;
+        width = height;
+        height = swap;
+    }
+    if (chain->gaussian_is_set) {
+        peak = max_u64(peak, other + image + convolution_memory(width, height, channels, 5, 5));
+    }
+    if (chain->kernel_file_name != NULL) {
+        peak = max_u64(peak, other + image + convolution_memory(width, height, channels,
+                                                                plan->kernel_width, plan->kernel_height));
+    }
+    if (chain->box_mean_is_set) {
+        peak = max_u64(peak, other + image + integral_memory(width, height, channels, 0));
+    }
+    // A brightness plane, and for the grid each thread's band of it
+    if (chain->bilateral_is_set) {
+        uint64_t bilateral = other + 2*image + pixels;
+        if (chain->bilateral_spatial_sd > BILATERAL_EXACT_MAX_SD) {
+            bilateral += (uint64_t)worker_threads_for_pixels(pixels)*bilateral_grid_thread_bytes(width, height, channels,
+                chain->bilateral_spatial_sd, chain->bilateral_range_sd);
+        }
+        peak = max_u64(peak, bilateral);
+    }
+
+    // The colour matrices make a new array when the channels change
+    int colour_is_set = chain->white_balance_is_set || chain->saturation_is_set || chain->sepia_is_set
+        || chain->swap_order != NULL;
+    if (chain->greyscale_is_set && channels == 3) {
+        peak = max_u64(peak, other + image + pixels);
+        channels = 1;
+    } else if (!chain->greyscale_is_set && colour_is_set && channels == 1) {
+        peak = max_u64(peak, other + image + 3*pixels);
+        channels = 3;
+    }
+    image = pixels*channels;
+
+    if (chain->median_is_set) {
+        peak = max_u64(peak, other + 2*image + (uint64_t)width*(16 + 256)*sizeof(uint16_t));
+    }
+    if (chain->sobel_is_set || chain->emboss_is_set || chain->sharpen_is_set) {
+        peak = max_u64(peak, other + 2*image);
+    }
+    // A copy made grey, then an integral image of that
+    if (chain->adaptive_is_set) {
+        uint64_t adaptive = max_u64(image + pixels, pixels + integral_memory(width, height, 1,
+                                                                               chain->adaptive_method == ADAPTIVE_SAUVOLA));
+        peak = max_u64(peak, other + image + adaptive);
+    }
+    // A bit per pixel when the image is black and white
+    if (chain->morphology_is_set) {
+        peak = max_u64(peak, other + image + ((uint64_t)width + 63)/64*8*height + MEMORY_PLAN_IO_BLOCK_BYTES);
+    }
+    if (is_piece) {
+        return peak + MEMORY_PLAN_BASE_BYTES;
+    }
+
+    if (chain->crop_is_set) {
+        uint64_t cropped = (uint64_t)(plan->x2 - plan->x1)*(plan->y2 - plan->y1)*channels;
+        peak = max_u64(peak, other + image + cropped);
+        width = plan->x2 - plan->x1;
+        height = plan->y2 - plan->y1;
+        pixels = (uint64_t)width*height;
+        image = cropped;
+    }
+    // The new image, and the whole number reduction it starts with
+    if (chain->resize_is_set) {
+        int new_width = chain->resize_width;
+        int new_height = chain->resize_height;
+        resolve_resize_dimensions(width, height, &new_width, &new_height);
+        uint64_t resized = (uint64_t)new_width*new_height*channels;
+        peak = max_u64(peak, other + image + 2*resized);
+        image = resized;
+    }
+    // Every level together is a third of the image
+    if (chain->pyramid_is_set) {
+        peak = max_u64(peak, other + image + image/3 + io);
+    }
+    peak = max_u64(peak, other + image + io);
+    return peak + MEMORY_PLAN_BASE_BYTES;
+}
+
+// A resize on its own is started while the input is read (see
+// bmp_to_struct_image_for_resize()), so only the whole number reduction
+// of the image is held, with a row and its sums. Then the resize makes
+// a copy resized across, and the new image from that
+uint64_t resize_while_reading_memory(const struct filter_chain *chain, const struct memory_plan *plan) {
+    int new_width = chain->resize_width;
+    int new_height = chain->resize_height;
+    resolve_resize_dimensions(plan->width, plan->height, &new_width, &new_height);
+    int factor_x = reduce_factor_for_resize(plan->width, new_width, chain->resize_method);
+    int factor_y = reduce_factor_for_resize(plan->height, new_height, chain->resize_method);
+    uint64_t reduced_width = (plan->width + factor_x - 1)/factor_x;
+    uint64_t reduced_height = (plan->height + factor_y - 1)/factor_y;
+    int channels = plan->channels;
+
+    uint64_t reduced = reduced_width*reduced_height*channels;
+    uint64_t rows = (uint64_t)plan->width*channels + reduced_width*channels*sizeof(uint64_t);
+    uint64_t across = (uint64_t)new_width*reduced_height*channels;
+    uint64_t resized = (uint64_t)new_width*new_height*channels;
+    uint64_t io = (uint64_t)worker_threads_for_pixels((uint64_t)plan->width*plan->height)*MEMORY_PLAN_IO_BLOCK_BYTES;
+    uint64_t peak = max_u64(reduced + rows + io, max_u64(reduced + across, across + resized));
+    if (chain->pyramid_is_set) {
+        peak = max_u64(peak, resized + resized/3 + io);
+    }
+    peak = max_u64(peak, resized + io);
+    return peak + MEMORY_PLAN_BASE_BYTES;
+}
+
+// Options that look at the whole image, or change its shape, so
+// can't be run on pieces of it
+const char *option_needing_whole_image(const struct filter_chain *chain) {
+    if (chain->orientation & ORIENTATION_TRANSPOSE) return "--rotate 90 or 270, or --transpose";
+    if (chain->white_balance_is_set && chain->white_balance_auto) return "--white-balance auto";
+    if (chain->threshold_is_set && chain->threshold_auto) return "-t auto";
+    if (chain->resize_is_set) return "-r";
+    // The grid's cells are laid out from the image's corner
+    if (chain->bilateral_is_set && chain->bilateral_spatial_sd > BILATERAL_EXACT_MAX_SD) {
+        return "--bilateral with a spatial sd over 1";
+    }
+    if (chain->histogram_file_name != NULL) return "--histogram";
+    if (chain->pyramid_is_set) return "--pyramid";
+    if (chain->cache_dir != NULL) return "--cache";
+    if (chain->blend_is_set && (chain->input_2_file_name == NULL || strcmp(chain->input_2_file_name, "-") == 0)) {
+        return "-b with the second input on stdin";
+    }
+    return NULL;
+}
+
+// How far from each output pixel the chain reads, added up over
+// the filters, as each one reads what the last one wrote
+void chain_reach(const struct filter_chain *chain, const struct memory_plan *plan, int *reach_x, int *reach_y) {
+    int x = 0;
+    int y = 0;
+    if (chain->gaussian_is_set) {
+        x += 2*chain->gaussian_repeat;
+        y += 2*chain->gaussian_repeat;
+    }
+    if (chain->kernel_file_name != NULL) {
+        x += plan->kernel_width/2;
+        y += plan->kernel_height/2;
+    }
+    if (chain->box_mean_is_set) {
+        x += chain->box_mean_radius;
+        y += chain->box_mean_radius;
+    }
+    if (chain->bilateral_is_set) {
+        x += 2;
+        y += 2;
+    }
+    if (chain->median_is_set) {
+        x += chain->median_radius;
+        y += chain->median_radius;
+    }
+    if (chain->adaptive_is_set) {
+        x += chain->adaptive_radius;
+        y += chain->adaptive_radius;
+    }
+    // Opening and closing are two passes
+    if (chain->morphology_is_set) {
+        int passes = chain->morphology_operation == MORPHOLOGY_OPEN || chain->morphology_operation == MORPHOLOGY_CLOSE ? 2 : 1;
+        x += passes*(chain->morphology_width/2);
+        y += passes*(chain->morphology_height/2);
+    }
+    int n_of_3x3 = chain->sobel_is_set + chain->emboss_is_set + chain->sharpen_is_set;
+    *reach_x = x + n_of_3x3;
+    *reach_y = y + n_of_3x3;
+}
+
+// BMP_DEPTH_AUTO looks at every pixel before writing any, which pieces
+// can't do. Instead they get the smallest depth the chain always gives
+// exactly: 1bpp after a threshold, 8bpp for grey, otherwise 24bpp
+int piece_output_depth(const struct filter_chain *chain, const struct memory_plan *plan) {
+    if (chain->output_depth != BMP_DEPTH_AUTO) return chain->output_depth;
+    if ((chain->threshold_is_set || chain->adaptive_is_set) && !chain->emboss_is_set && !chain->sharpen_is_set) {
+        return BMP_DEPTH_1;
+    }
+    int colour_is_set = chain->white_balance_is_set || chain->saturation_is_set || chain->sepia_is_set
+        || chain->swap_order != NULL;
+    int grey_input = plan->channels == 1 && (!chain->blend_is_set || plan->channels_2 == 1);
+    if (chain->greyscale_is_set || (grey_input && !colour_is_set)) {
+        return BMP_DEPTH_8;
+    }
+    return BMP_DEPTH_24;
+}
+
+// Estimated peak for one piece, a strip of size rows or a size x size
+// tile, and the copy of its middle that is written
+uint64_t piece_memory(const struct filter_chain *chain, const struct memory_plan *plan, int tiles, int size) {
+    int piece_width = tiles ? min(size, plan->x2 - plan->x1) : plan->x2 - plan->x1;
+    int piece_height = min(size, plan->y2 - plan->y1);
+    int read_width = min(piece_width + 2*plan->reach_x, plan->width);
+    int read_height = min(piece_height + 2*plan->reach_y, plan->height);
+    return estimate_chain_memory(chain, plan, read_width, read_height, 1) + (uint64_t)piece_width*piece_height*3;
+}
+
+// Most rows in a strip, or the biggest square tile, that fits in
+// --max-memory, 0 if none does. Tiles are a multiple of 8 across
+int largest_piece(const struct filter_chain *chain, const struct memory_plan *plan, int tiles) {
+    int step = tiles ? MEMORY_PLAN_TILE_STEP : 1;
+    int limit = tiles ? max(plan->x2 - plan->x1, plan->y2 - plan->y1) : plan->y2 - plan->y1;
+    int low = 0;
+    int high = (limit + step - 1)/step;
+    while (low < high) {
+        int middle = low + (high - low + 1)/2;
+        if (piece_memory(chain, plan, tiles, middle*step) <= chain->max_memory) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low*step;
+}
+
+// Tiles are written out of order, which needs an output that can seek
+int output_can_seek(const struct filter_chain *chain) {
+    if (strcmp(chain->output_file_name, "-") != 0) return 1;
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    return flags != -1 && !(flags & O_APPEND) && lseek(STDOUT_FILENO, 0, SEEK_CUR) != -1;
+}
+
+// Reads the input's header, and the kernel's size, and picks how to run
+// chain. Returns IMAGE_ERR_NO_MEMORY with a message if nothing fits in
+// --max-memory, or another error if the input can't be planned from,
+// a pipe, in which case it is best read whole as usual
+int plan_filter_chain(const struct filter_chain *chain, int input_fildes, struct memory_plan *plan,
+                      char *message, size_t message_size) {
+    memset(plan, 0, sizeof(*plan));
+    plan->mode = MEMORY_PLAN_WHOLE;
+    plan->output_depth = chain->output_depth;
+    int status = get_layout_from_bmp(&plan->width, &plan->height, &plan->channels, input_fildes);
+    if (status != IMAGE_OK) return chain_error(message, message_size, status, "Couldn't read the input's header");
+
+    // Guesses where the second input can't be read, the blend will say why
+    plan->channels_2 = 3;
+    plan->whole_option = option_needing_whole_image(chain);
+    if (chain->blend_is_set && plan->whole_option == NULL) {
+        int input_2_fildes = open(chain->input_2_file_name, O_RDONLY);
+        int width_2 = 0, height_2 = 0;
+        if (input_2_fildes == -1
+                || get_layout_from_bmp(&width_2, &height_2, &plan->channels_2, input_2_fildes) != IMAGE_OK
+                || width_2 != plan->width || height_2 != plan->height) {
+            plan->whole_option = "-b with a second input that doesn't match";
+        }
+        if (input_2_fildes != -1) close(input_2_fildes);
+    }
+    if (chain->kernel_file_name != NULL) {
+        FILE *file = fopen(chain->kernel_file_name, "r");
+        struct convolution_kernel kernel;
+        if (file == NULL || read_convolution_kernel(file, &kernel) != IMAGE_OK) {
+            if (file != NULL) fclose(file);
+            return chain_error(message, message_size, IMAGE_ERR_FORMAT, "Couldn't read kernel %s", chain->kernel_file_name);
+        }
+        fclose(file);
+        plan->kernel_width = kernel.width;
+        plan->kernel_height = kernel.height;
+        free_convolution_kernel(&kernel);
+    }
+
+    // The written part, in the filtered image. The crop is checked again when it runs
+    int filtered_width = chain->orientation & ORIENTATION_TRANSPOSE ? plan->height : plan->width;
+    int filtered_height = chain->orientation & ORIENTATION_TRANSPOSE ? plan->width : plan->height;
+    plan->x2 = filtered_width;
+    plan->y2 = filtered_height;
+    if (chain->crop_is_set) {
+        if (chain->crop_x1 < 0 || chain->crop_y1 < 0 || chain->crop_x2 <= chain->crop_x1 || chain->crop_y2 <= chain->crop_y1
+                || chain->crop_x2 > filtered_width || chain->crop_y2 > filtered_height) {
+            return chain_error(message, message_size, IMAGE_ERR_DIMENSIONS, "Crop is outside the image");
+        }
+        plan->x1 = chain->crop_x1;
+        plan->y1 = chain->crop_y1;
+        plan->x2 = chain->crop_x2;
+        plan->y2 = chain->crop_y2;
+    }
+
+    if (only_resize_is_set(chain)) {
+        plan->whole_bytes = resize_while_reading_memory(chain, plan);
+    } else {
+        plan->whole_bytes = estimate_chain_memory(chain, plan, plan->width, plan->height, 0);
+    }
+    plan->piece_bytes = plan->whole_bytes;
+    if (chain->max_memory == 0 || plan->whole_bytes <= chain->max_memory) {
+        return IMAGE_OK;
+    }
+    if (plan->whole_option != NULL) {
+        snprintf(message, message_size, "The whole image needs about %.1f MiB, more than --max-memory, and %s can't be run in pieces",
+                 plan->whole_bytes/1048576.0, plan->whole_option);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    // Strips unless they'd be so thin the halos are most of the work
+    chain_reach(chain, plan, &plan->reach_x, &plan->reach_y);
+    plan->output_depth = piece_output_depth(chain, plan);
+    int strip_rows = largest_piece(chain, plan, 0);
+    int enough_rows = min(plan->y2 - plan->y1, max(MEMORY_PLAN_MIN_STRIP_ROWS, 2*plan->reach_y));
+    int tile_size = output_can_seek(chain) ? largest_piece(chain, plan, 1) : 0;
+    if (strip_rows >= enough_rows || (strip_rows > 0 && tile_size == 0)) {
+        plan->mode = MEMORY_PLAN_STRIPS;
+        plan->piece_width = plan->x2 - plan->x1;
+        plan->piece_height = strip_rows;
+        plan->piece_bytes = piece_memory(chain, plan, 0, strip_rows);
+    } else if (tile_size > 0) {
+        plan->mode = MEMORY_PLAN_TILES;
+        plan->piece_width = min(tile_size, plan->x2 - plan->x1);
+        plan->piece_height = min(tile_size, plan->y2 - plan->y1);
+        plan->piece_bytes = piece_memory(chain, plan, 1, tile_size);
+    } else {
+        snprintf(message, message_size, "Even one row of the image needs more than --max-memory, about %.1f MiB",
+                 piece_memory(chain, plan, 0, 1)/1048576.0);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    return IMAGE_OK;
+}
+
+int count_pieces(const struct memory_plan *plan) {
+    int across = (plan->x2 - plan->x1 + plan->piece_width - 1)/plan->piece_width;
+    int down = (plan->y2 - plan->y1 + plan->piece_height - 1)/plan->piece_height;
+    return across*down;
+}
+
+// --stats, what was picked and why
+void report_memory_plan(FILE *log, const struct filter_chain *chain, const struct memory_plan *plan) {
+    if (plan->mode == MEMORY_PLAN_WHOLE) {
+        fprintf(log, "Plan: the whole image at once, about %.1f MiB", plan->whole_bytes/1048576.0);
+    } else if (plan->mode == MEMORY_PLAN_STRIPS) {
+        fprintf(log, "Plan: %d strips of up to %d rows with %d more rows each side, about %.1f MiB (%.1f MiB whole)",
+                count_pieces(plan), plan->piece_height, plan->reach_y, plan->piece_bytes/1048576.0,
+                plan->whole_bytes/1048576.0);
+    } else {
+        fprintf(log, "Plan: %d tiles of up to %dx%d with %d,%d more pixels each side, about %.1f MiB (%.1f MiB whole)",
+                count_pieces(plan), plan->piece_width, plan->piece_height, plan->reach_x, plan->reach_y,
+                plan->piece_bytes/1048576.0, plan->whole_bytes/1048576.0);
+    }
+    if (chain->max_memory != 0) {
+        fprintf(log, " of %.1f MiB allowed", chain->max_memory/1048576.0);
+    }
+    fprintf(log, "\n");
+    if (plan->mode != MEMORY_PLAN_WHOLE && chain->output_depth == BMP_DEPTH_AUTO) {
+        fprintf(log, "Plan: writing %dbpp, pieces can't be checked for a smaller depth first\n", plan->output_depth);
+    }
+}
+
+// Filters the part of the image from (x1,y1) to (x2,y2) and writes it.
+// Rotations aren't run on pieces, so the flips are undone by reading
+// the mirror image of the piece and letting the chain flip it back
+int run_piece(struct filter_chain *piece_chain, const struct memory_plan *plan, int input_fildes, int input_2_fildes,
+              int output_fildes, int x1, int y1, int x2, int y2, const struct image_allocator *allocator,
+              char *message, size_t message_size) {
+    int read_x1 = max(0, x1 - plan->reach_x);
+    int read_y1 = max(0, y1 - plan->reach_y);
+    int read_x2 = min(plan->width, x2 + plan->reach_x);
+    int read_y2 = min(plan->height, y2 + plan->reach_y);
+    int file_x1 = piece_chain->orientation & ORIENTATION_FLIP_HORIZONTAL ? plan->width - read_x2 : read_x1;
+    int file_x2 = piece_chain->orientation & ORIENTATION_FLIP_HORIZONTAL ? plan->width - read_x1 : read_x2;
+    int file_y1 = piece_chain->orientation & ORIENTATION_FLIP_VERTICAL ? plan->height - read_y2 : read_y1;
+    int file_y2 = piece_chain->orientation & ORIENTATION_FLIP_VERTICAL ? plan->height - read_y1 : read_y2;
+
+    struct image piece, piece_2;
+    piece_2.pixel_array = NULL;
+    piece_2.grey_array = NULL;
+    int status = bmp_region_to_struct_image(input_fildes, file_x1, file_y1, file_x2, file_y2, &piece, allocator);
+    if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error reading input file");
+    if (input_2_fildes != -1) {
+        status = bmp_region_to_struct_image(input_2_fildes, file_x1, file_y1, file_x2, file_y2, &piece_2, allocator);
+        if (status != IMAGE_OK) {
+            free_struct_image(&piece);
+            return chain_error(message, message_size, status, "Error reading second input file");
+        }
+    }
+
+    status = apply_filter_chain(piece_chain, &piece, &piece_2, NULL, message, message_size);
+    free_struct_image(&piece_2);
+    if (status != IMAGE_OK) {
+        free_struct_image(&piece);
+        return status;
+    }
+
+    struct image middle;
+    status = copy_struct_image_region(&middle, &piece, x1 - read_x1, y1 - read_y1, x2 - read_x1, y2 - read_y1);
+    free_struct_image(&piece);
+    if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error cutting out the piece");
+
+    if (plan->mode == MEMORY_PLAN_STRIPS) {
+        status = write_pixel_array_to_bmp(output_fildes, &middle, plan->output_depth);
+    } else {
+        status = struct_image_region_to_bmp(output_fildes, &middle, x1 - plan->x1, y1 - plan->y1,
+                                            plan->x2 - plan->x1, plan->y2 - plan->y1, plan->output_depth);
+    }
+    free_struct_image(&middle);
+    if (status != IMAGE_OK) return chain_error(message, message_size, status, "Error writing output file");
+    return IMAGE_OK;
+}
+
+// Runs chain a strip or tile at a time as plan says, reading from
+// input_fildes and writing the output file
+int run_filter_chain_in_pieces(struct filter_chain *chain, const struct memory_plan *plan, int input_fildes,
+                               const struct image_allocator *allocator, FILE *log, char *message, size_t message_size) {
+    // The pieces are cut from where the crop would be
+    struct filter_chain piece_chain = *chain;
+    piece_chain.crop_is_set = 0;
+
+    int input_2_fildes = -1;
+    if (chain->blend_is_set) {
+        input_2_fildes = open(chain->input_2_file_name, O_RDONLY);
+        if (input_2_fildes == -1) return chain_error(message, message_size, IMAGE_ERR_IO, "Error opening second input file");
+    }
+    int to_stdout = strcmp(chain->output_file_name, "-") == 0;
+    int output_fildes = to_stdout ? STDOUT_FILENO : open(chain->output_file_name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (output_fildes == -1) {
+        if (input_2_fildes != -1) close(input_2_fildes);
+        return chain_error(message, message_size, IMAGE_ERR_IO, "Error opening output file");
+    }
+
+    if (log) fprintf(log, "Image width: %dpx\n", plan->width);
+    if (log) fprintf(log, "Image height: %dpx\n", plan->height);
+    if (log) fprintf(log, "Filtering %d %s to stay under --max-memory...\n", count_pieces(plan),
+                     plan->mode == MEMORY_PLAN_STRIPS ? "strips" : "tiles");
+
+    int output_width = plan->x2 - plan->x1;
+    int output_height = plan->y2 - plan->y1;
+    int status;
+    if (plan->mode == MEMORY_PLAN_STRIPS) {
+        struct image size_only;
+        memset(&size_only, 0, sizeof(size_only));
+        size_only.width = output_width;
+        size_only.height = output_height;
+        status = write_bmp_header_to_file(output_fildes, &size_only, plan->output_depth);
+    } else {
+        status = write_bmp_header_for_regions(output_fildes, output_width, output_height, plan->output_depth);
+    }
+    if (status != IMAGE_OK) status = chain_error(message, message_size, status, "Error writing output file");
+
+    // Strips from the bottom up, in the order the file stores them
+    int y2, x1;
+    for (y2 = plan->y2; y2 > plan->y1 && status == IMAGE_OK; y2 -= plan->piece_height) {
+        int y1 = max(plan->y1, y2 - plan->piece_height);
+        for (x1 = plan->x1; x1 < plan->x2 && status == IMAGE_OK; x1 += plan->piece_width) {
+            int x2 = min(plan->x2, x1 + plan->piece_width);
+            status = run_piece(&piece_chain, plan, input_fildes, input_2_fildes, output_fildes, x1, y1, x2, y2,
+                               allocator, message, message_size);
+        }
+    }
+
+    if (input_2_fildes != -1) close(input_2_fildes);
+    if (!to_stdout && close(output_fildes) == -1 && status == IMAGE_OK) {
+        status = chain_error(message, message_size, IMAGE_ERR_IO, "Error writing output file");
+    }
+    return status;
+}
@@ -0,0 +1,54 @@
+/* memory_plan.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of bmpedit --max-memory, which works out
+ * how much memory a filter chain needs and runs it a
+ * strip or tile at a time if the whole image won't fit
+ *
+ */
+
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+
+#include "filter_chain.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// How run_filter_chain() works through the image
+enum memory_plan_mode {
+    MEMORY_PLAN_WHOLE = 0,      // decoded whole, the usual way
+    MEMORY_PLAN_STRIPS,         // full width strips, written in order
+    MEMORY_PLAN_TILES           // tiles, each written into place
+};
+
+// Pieces are read with reach_x and reach_y more pixels round them, cut
+// off at the image's edges, so every filter sees the pixels it would
+// with the whole image. Only the middle, up to piece_width x
+// piece_height, is kept. x1 to x2 and y1 to y2 is the part of the
+// filtered image that is written, all of it without a crop
+struct memory_plan {
+    int mode;
+    int width, height, channels;
+    int channels_2;
+    int kernel_width, kernel_height;
+    int reach_x, reach_y;
+    int x1, y1, x2, y2;
+    int piece_width, piece_height;
+    int output_depth;
+    uint64_t whole_bytes;
+    uint64_t piece_bytes;
+    // Option that needs the whole image at once, NULL if there isn't one
+    const char *whole_option;
+};
+
+int parse_memory_size_arg(uint64_t *bytes, const char *memory_arg);
+uint64_t estimate_chain_memory(const struct filter_chain *chain, const struct memory_plan *plan,
+                               int width, int height, int is_piece);
+int plan_filter_chain(const struct filter_chain *chain, int input_fildes, struct memory_plan *plan,
+                      char *message, size_t message_size);
+void report_memory_plan(FILE *log, const struct filter_chain *chain, const struct memory_plan *plan);
+int run_filter_chain_in_pieces(struct filter_chain *chain, const struct memory_plan *plan, int input_fildes,
+                               const struct image_allocator *allocator, FILE *log, char *message, size_t message_size);
+
+#endif
@@ -0,0 +1,420 @@
+/* morphology.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Erode, dilate, open and close with rectangular
+ * structuring elements. A rectangle is a row then a
+ * column, and each is done with van Herk/Gil-Werman:
+ * the line is cut into blocks the size of the
+ * element, each block gets running minimums from
+ * both ends, and any window is the minimum from the
+ * right of one block and from the left of the next.
+ * That is three comparisons per pixel whatever the
+ * size. Black and white images, like threshold_image()
+ * makes, are packed 64 pixels to a word first
+ *
+ * Dilation is erosion with every value flipped (255 - v)
+ * as it is read and written back, and pixels past the
+ * edges never change the result
+ *
+ */
+
+#include "morphology.h"
+#include "image_data_helper_functions.h"
+#include "bmp_struct_image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Scratch for the column pass, it works on strips of columns narrow
+// enough that three blocks of rows stay in cache
+#define MORPHOLOGY_STRIP_BYTES (1 << 18)
+
+int clamp_window(int *lo, int size, int length);
+int erode_flipped(int width, int height, int anchor_x, int anchor_y, int binary, uint8_t flip, struct image *img);
+void erode_line(uint8_t *line, int length, int channels, int lo, int size, uint8_t flip,
+                uint8_t *forward, uint8_t *backward);
+void erode_columns(uint8_t *bytes, int height, size_t row_size, size_t x1, size_t x2, int lo, int size,
+                   uint8_t flip, uint8_t *blocks, const uint8_t *ones);
+void erode_word_columns(uint64_t *words, int height, size_t row_size, size_t x1, size_t x2, int lo, int size,
+                        uint64_t *blocks);
+void and_shifted_bits(uint64_t *bits, size_t n_of_words, int shift);
+int erode_bytes(int size_x, int lo_x, int size_y, int lo_y, uint8_t flip, struct image *img);
+int erode_binary(int size_x, int lo_x, int size_y, int lo_y, uint8_t flip, struct image *img);
+
+// Windows run from lo to lo + size - 1 around each pixel. Past the ends
+// of the line there is nothing to find, so the window is cut down to
+// the line's length either side. Returns the new size
+int clamp_window(int *lo, int size, int length) {
+    int hi = *lo + size - 1;
+    if (*lo < -(length - 1)) *lo = -(length - 1);
+    if (hi > length - 1) hi = length - 1;
+    return hi - *lo + 1;
+}
+
+// Darkest of pixel x + lo to x + lo + size - 1 for every pixel of a row,
+// each channel on its own, in place, with the values XORed with flip
+// going in and coming out. forward and backward hold
+// (length + size - 1)*channels values. min() isn't inlined from another
+// file, so the loops here compare directly to be vectorised
+void erode_line(uint8_t *line, int length, int channels, int lo, int size, uint8_t flip,
+                uint8_t *forward, uint8_t *backward) {
+    size_t padded_size = (size_t)(length + size - 1)*channels;
+    size_t block_size = (size_t)size*channels;
+    size_t line_size = (size_t)length*channels;
+    size_t i, block;
+
+    // The row shifted by lo, white past the ends
+    size_t before = (size_t)(-lo)*channels;
+    memset(backward, 255, before);
+    for (i = 0; i < line_size; i++) backward[before + i] = line[i] ^ flip;
+    memset(backward + before + line_size, 255, padded_size - before - line_size);
+
+    for (block = 0; block < padded_size; block += block_size) {
+        size_t end = block + block_size < padded_size ? block + block_size : padded_size;
+        memcpy(forward + block, backward + block, channels);
+        for (i = block + channels; i < end; i++) {
+            forward[i] = forward[i - channels] < backward[i] ? forward[i - channels] : backward[i];
+        }
+        for (i = end - channels; i-- > block;) {
+            backward[i] = backward[i + channels] < backward[i] ? backward[i + channels] : backward[i];
+        }
+    }
+
+    const uint8_t *from_left = forward + block_size - channels;
+    for (i = 0; i < line_size; i++) {
+        line[i] = (backward[i] < from_left[i] ? backward[i] : from_left[i]) ^ flip;
+    }
+}
+
+// erode_line() down the columns x1 to x2 of every row at once. The rows
+// of each block are finished before the rows they replace are written.
+// blocks holds 3*size rows of x2 - x1, ones is a row of 255 ^ flip
+void erode_columns(uint8_t *bytes, int height, size_t row_size, size_t x1, size_t x2, int lo, int size,
+                   uint8_t flip, uint8_t *blocks, const uint8_t *ones) {
+    size_t strip = x2 - x1;
+    uint8_t *backward = blocks;
+    uint8_t *next_forward = blocks + (size_t)size*strip;
+    uint8_t *next_backward = blocks + (size_t)2*size*strip;
+    int block, k;
+    size_t x;
+
+    for (block = 0; block*size < height + size; block++) {
+        // Running minimums of the next block of the shifted columns
+        uint8_t *backward_row = block == 0 ? backward : next_backward;
+        for (k = 0; k < size; k++) {
+            int y = block*size + k + lo;
+            const uint8_t *row = y >= 0 && y < height ? bytes + (size_t)y*row_size + x1 : ones;
+            uint8_t *out = next_forward + (size_t)k*strip;
+            uint8_t *backward_out = backward_row + (size_t)k*strip;
+            for (x = 0; x < strip; x++) backward_out[x] = row[x] ^ flip;
+            if (k == 0) {
+                memcpy(out, backward_out, strip);
+            } else {
+                for (x = 0; x < strip; x++) out[x] = out[x - strip] < backward_out[x] ? out[x - strip] : backward_out[x];
+            }
+        }
+        for (k = size - 2; k >= 0; k--) {
+            uint8_t *out = backward_row + (size_t)k*strip;
+            for (x = 0; x < strip; x++) out[x] = out[x + strip] < out[x] ? out[x + strip] : out[x];
+        }
+        if (block == 0) continue;
+
+        // Rows of the block before, which needed this one
+        int y;
+        for (y = (block - 1)*size; y < min(block*size, height); y++) {
+            k = y - (block - 1)*size;
+            uint8_t *out = bytes + (size_t)y*row_size + x1;
+            if (k == 0) {
+                for (x = 0; x < strip; x++) out[x] = backward[x] ^ flip;
+                continue;
+            }
+            const uint8_t *from_right = backward + (size_t)k*strip;
+            const uint8_t *from_left = next_forward + (size_t)(k - 1)*strip;
+            for (x = 0; x < strip; x++) out[x] = (from_right[x] < from_left[x] ? from_right[x] : from_left[x]) ^ flip;
+        }
+
+        uint8_t *swap = backward;
+        backward = next_backward;
+        next_backward = swap;
+    }
+}
+
+// Erodes bytes: each channel along the rows, then the columns
+int erode_bytes(int size_x, int lo_x, int size_y, int lo_y, uint8_t flip, struct image *img) {
+    int channels = img->channels;
+    uint8_t *bytes = channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    size_t row_size = (size_t)img->width*channels;
+    size_t strip = MORPHOLOGY_STRIP_BYTES/(3*(size_t)size_y);
+    if (strip < 64) strip = 64;
+    if (strip > row_size) strip = row_size;
+
+    uint8_t *forward = image_alloc(img->allocator, ((size_t)img->width + size_x)*channels);
+    uint8_t *backward = image_alloc(img->allocator, ((size_t)img->width + size_x)*channels);
+    uint8_t *blocks = image_alloc(img->allocator, (size_t)3*size_y*strip);
+    uint8_t *ones = image_alloc(img->allocator, strip);
+    if (forward == NULL || backward == NULL || blocks == NULL || ones == NULL) {
+        image_dealloc(img->allocator, forward);
+        image_dealloc(img->allocator, backward);
+        image_dealloc(img->allocator, blocks);
+        image_dealloc(img->allocator, ones);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    memset(ones, 255 ^ flip, strip);
+
+    int y;
+    if (size_x > 1) {
+        for (y = 0; y < img->height; y++) {
+            erode_line(bytes + (size_t)y*row_size, img->width, channels, lo_x, size_x, flip, forward, backward);
+        }
+    }
+    if (size_y > 1) {
+        size_t x1;
+        for (x1 = 0; x1 < row_size; x1 += strip) {
+            size_t x2 = x1 + strip < row_size ? x1 + strip : row_size;
+            erode_columns(bytes, img->height, row_size, x1, x2, lo_y, size_y, flip, blocks, ones);
+        }
+    }
+
+    image_dealloc(img->allocator, forward);
+    image_dealloc(img->allocator, backward);
+    image_dealloc(img->allocator, blocks);
+    image_dealloc(img->allocator, ones);
+    return IMAGE_OK;
+}
+
+// bits[x] &= bits[x + shift] along a row of words. Reads are never behind
+// the write, so it works in place. There must be a word of 1s past the end
+void and_shifted_bits(uint64_t *bits, size_t n_of_words, int shift) {
+    size_t word_shift = shift/64;
+    int bit_shift = shift % 64;
+    size_t j;
+    for (j = 0; j < n_of_words; j++) {
+        uint64_t shifted = bits[j + word_shift] >> bit_shift;
+        if (bit_shift != 0) shifted |= bits[j + word_shift + 1] << (64 - bit_shift);
+        bits[j] &= shifted;
+    }
+}
+
+// erode_columns() for rows of words, where the minimum is AND
+void erode_word_columns(uint64_t *words, int height, size_t row_size, size_t x1, size_t x2, int lo, int size,
+                        uint64_t *blocks) {
+    size_t strip = x2 - x1;
+    uint64_t *backward = blocks;
+    uint64_t *next_forward = blocks + (size_t)size*strip;
+    uint64_t *next_backward = blocks + (size_t)2*size*strip;
+    int block, k;
+    size_t x;
+
+    for (block = 0; block*size < height + size; block++) {
+        uint64_t *backward_row = block == 0 ? backward : next_backward;
+        for (k = 0; k < size; k++) {
+            int y = block*size + k + lo;
+            uint64_t *forward_out = next_forward + (size_t)k*strip;
+            uint64_t *backward_out = backward_row + (size_t)k*strip;
+            if (y < 0 || y >= height) {
+                for (x = 0; x < strip; x++) backward_out[x] = ~(uint64_t)0;
+            } else {
+                memcpy(backward_out, words + (size_t)y*row_size + x1, strip*sizeof(uint64_t));
+            }
+            if (k == 0) {
+                memcpy(forward_out, backward_out, strip*sizeof(uint64_t));
+            } else {
+                for (x = 0; x < strip; x++) forward_out[x] = forward_out[x - strip] & backward_out[x];
+            }
+        }
+        for (k = size - 2; k >= 0; k--) {
+            uint64_t *out = backward_row + (size_t)k*strip;
+            for (x = 0; x < strip; x++) out[x] &= out[x + strip];
+        }
+        if (block == 0) continue;
+
+        int y;
+        for (y = (block - 1)*size; y < min(block*size, height); y++) {
+            k = y - (block - 1)*size;
+            uint64_t *out = words + (size_t)y*row_size + x1;
+            if (k == 0) {
+                memcpy(out, backward, strip*sizeof(uint64_t));
+                continue;
+            }
+            const uint64_t *from_right = backward + (size_t)k*strip;
+            const uint64_t *from_left = next_forward + (size_t)(k - 1)*strip;
+            for (x = 0; x < strip; x++) out[x] = from_right[x] & from_left[x];
+        }
+
+        uint64_t *swap = backward;
+        backward = next_backward;
+        next_backward = swap;
+    }
+}
+
+// Erodes a black and white image as bits, white is 1, or black when flip
+// is set. Along the rows the window is built up by doubling, (x, x+1),
+// (x..x+3), (x..x+7), ..., so a row of 64 pixels takes log2(size) ANDs
+int erode_binary(int size_x, int lo_x, int size_y, int lo_y, uint8_t flip, struct image *img) {
+    int width = img->width;
+    int height = img->height;
+    int channels = img->channels;
+    uint64_t flip_bit = flip != 0;
+    size_t words_per_row = ((size_t)width + 63)/64;
+    // The padded row, with room for the words the shifts read past its end
+    size_t padded_words = ((size_t)width + size_x - 1 + 63)/64 + size_x/64 + 2;
+    size_t strip = MORPHOLOGY_STRIP_BYTES/(3*(size_t)size_y*sizeof(uint64_t));
+    if (strip < 8) strip = 8;
+    if (strip > words_per_row) strip = words_per_row;
+
+    uint64_t *words = image_alloc(img->allocator, words_per_row*height*sizeof(uint64_t));
+    uint64_t *padded = image_alloc(img->allocator, padded_words*sizeof(uint64_t));
+    uint64_t *blocks = image_alloc(img->allocator, (size_t)3*size_y*strip*sizeof(uint64_t));
+    if (words == NULL || padded == NULL || blocks == NULL) {
+        image_dealloc(img->allocator, words);
+        image_dealloc(img->allocator, padded);
+        image_dealloc(img->allocator, blocks);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    // Pack every row shifted by lo_x, 1s past the ends, and AND the window
+    // along it. What's left in the first width bits is the eroded row
+    const uint8_t *bytes = channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    size_t row_size = (size_t)width*channels;
+    int x, y;
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = bytes + (size_t)y*row_size;
+        memset(padded, 0xff, padded_words*sizeof(uint64_t));
+        for (x = 0; x < width; x += 64) {
+            int n = min(64, width - x);
+            uint64_t word = n < 64 ? ~(uint64_t)0 << n : 0;
+            int k;
+            for (k = 0; k < n; k++) {
+                word |= ((uint64_t)(row[(size_t)(x + k)*channels] != 0) ^ flip_bit) << k;
+            }
+            size_t q = x - lo_x;
+            int shift = q % 64;
+            padded[q/64] &= shift ? (word << shift) | (~(uint64_t)0 >> (64 - shift)) : word;
+            if (shift) padded[q/64 + 1] &= (word >> (64 - shift)) | (~(uint64_t)0 << shift);
+        }
+
+        int span = 1;
+        while (2*span <= size_x) {
+            and_shifted_bits(padded, padded_words - span/64 - 2, span);
+            span *= 2;
+        }
+        if (span < size_x) {
+            and_shifted_bits(padded, words_per_row, size_x - span);
+        }
+        memcpy(words + (size_t)y*words_per_row, padded, words_per_row*sizeof(uint64_t));
+    }
+
+    if (size_y > 1) {
+        size_t x1;
+        for (x1 = 0; x1 < words_per_row; x1 += strip) {
+            size_t x2 = x1 + strip < words_per_row ? x1 + strip : words_per_row;
+            erode_word_columns(words, height, words_per_row, x1, x2, lo_y, size_y, blocks);
+        }
+    }
+
+    uint8_t *out = channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    int c;
+    for (y = 0; y < height; y++) {
+        const uint64_t *row = words + (size_t)y*words_per_row;
+        uint8_t *out_row = out + (size_t)y*row_size;
+        if (channels == 1) {
+            for (x = 0; x < width; x++) {
+                out_row[x] = -(uint8_t)(((row[x/64] >> (x % 64)) & 1) ^ flip_bit);
+            }
+            continue;
+        }
+        for (x = 0; x < width; x++) {
+            uint8_t value = -(uint8_t)(((row[x/64] >> (x % 64)) & 1) ^ flip_bit);
+            for (c = 0; c < channels; c++) out_row[(size_t)x*channels + c] = value;
+        }
+    }
+
+    image_dealloc(img->allocator, words);
+    image_dealloc(img->allocator, padded);
+    image_dealloc(img->allocator, blocks);
+    return IMAGE_OK;
+}
+
+// erode_struct_image() for an image known to be black and white or not,
+// each value XORed with flip going in and coming out
+int erode_flipped(int width, int height, int anchor_x, int anchor_y, int binary, uint8_t flip, struct image *img) {
+    if (width < 1 || height < 1 || anchor_x < 0 || anchor_x >= width || anchor_y < 0 || anchor_y >= height) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    int lo_x = -anchor_x;
+    int lo_y = -anchor_y;
+    int size_x = clamp_window(&lo_x, width, img->width);
+    int size_y = clamp_window(&lo_y, height, img->height);
+    if (size_x == 1 && size_y == 1) {
+        return IMAGE_OK;
+    }
+
+    if (binary) {
+        return erode_binary(size_x, lo_x, size_y, lo_y, flip, img);
+    }
+    return erode_bytes(size_x, lo_x, size_y, lo_y, flip, img);
+}
+
+// Replaces each pixel with the darkest under a width x height rectangle,
+// with the pixel at (anchor_x, anchor_y) in it. Channels are separate
+int erode_struct_image(int width, int height, int anchor_x, int anchor_y, struct image *img) {
+    return erode_flipped(width, height, anchor_x, anchor_y, bmp_depth_for_image(img) == BMP_DEPTH_1, 0, img);
+}
+
+// Applies operation with a width x height rectangle centred on each pixel,
+// or just up and left of centre for even sizes. Dilating takes the
+// lightest pixel, eroding the flipped values with the rectangle turned
+// round. Neither makes a black and white image grey, so that is looked
+// at once
+int morphology_image(int operation, int width, int height, struct image *img) {
+    int anchor_x = width/2;
+    int anchor_y = height/2;
+    int binary = bmp_depth_for_image(img) == BMP_DEPTH_1;
+    int status;
+    switch (operation) {
+        case MORPHOLOGY_ERODE:
+            return erode_flipped(width, height, anchor_x, anchor_y, binary, 0, img);
+        case MORPHOLOGY_DILATE:
+            return erode_flipped(width, height, width - 1 - anchor_x, height - 1 - anchor_y, binary, 255, img);
+        case MORPHOLOGY_OPEN:
+            status = erode_flipped(width, height, anchor_x, anchor_y, binary, 0, img);
+            if (status != IMAGE_OK) return status;
+            return erode_flipped(width, height, width - 1 - anchor_x, height - 1 - anchor_y, binary, 255, img);
+        case MORPHOLOGY_CLOSE:
+            status = erode_flipped(width, height, width - 1 - anchor_x, height - 1 - anchor_y, binary, 255, img);
+            if (status != IMAGE_OK) return status;
+            return erode_flipped(width, height, anchor_x, anchor_y, binary, 0, img);
+        default:
+            return IMAGE_ERR_ARGUMENT;
+    }
+}
+
+// Parses OPERATION,WxH or OPERATION,N for an N x N square
+int parse_morphology_arg(int *operation, int *width, int *height, char *morphology_arg) {
+    char operation_name[16];
+    char separator;
+    int n = sscanf(morphology_arg, "%15[a-z],%d%c%d", operation_name, width, &separator, height);
+    if (n == 2) {
+        *height = *width;
+    } else if (n != 4 || separator != 'x') {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    if (*width < 1 || *height < 1) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    if (strcmp(operation_name, "erode") == 0) {
+        *operation = MORPHOLOGY_ERODE;
+    } else if (strcmp(operation_name, "dilate") == 0) {
+        *operation = MORPHOLOGY_DILATE;
+    } else if (strcmp(operation_name, "open") == 0) {
+        *operation = MORPHOLOGY_OPEN;
+    } else if (strcmp(operation_name, "close") == 0) {
+        *operation = MORPHOLOGY_CLOSE;
+    } else {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
@@ -0,0 +1,26 @@
+/* morphology.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of erode, dilate, open and close
+ * with rectangular structuring elements
+ *
+ */
+
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include "image_data_types.h"
+
+enum morphology_operation {
+    MORPHOLOGY_ERODE = 0,   // darkest pixel under the element
+    MORPHOLOGY_DILATE,      // lightest pixel under the element
+    MORPHOLOGY_OPEN,        // erode then dilate, takes away small light spots
+    MORPHOLOGY_CLOSE        // dilate then erode, fills in small dark spots
+};
+
+int erode_struct_image(int width, int height, int anchor_x, int anchor_y, struct image *img);
+int morphology_image(int operation, int width, int height, struct image *img);
+int parse_morphology_arg(int *operation, int *width, int *height, char *morphology_arg);
+
+#endif
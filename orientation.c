@@ -0,0 +1,380 @@
+/* orientation.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Rotations by quarter turns, flips and transposes.
+ * Every one is a vertical flip, a horizontal flip and
+ * a transpose, each done or not (see orientation.h).
+ * Flips without a transpose swap pixels in place a row
+ * at a time. A transpose copies into a new image a
+ * tile at a time, so the columns being read and the
+ * rows being written both stay in cache, and any flips
+ * go into which end of the rows and columns it starts
+ * from, so they cost nothing. Grey tiles are turned 8x8
+ * bytes at a time with SSE2 unpacks
+ *
+ * Reading a bitmap upside down costs nothing either,
+ * see bmp_to_struct_image_flipped()
+ *
+ */
+
+#include "orientation.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Side of the square tiles a transpose works through, in pixels, so
+// the rows of a tile being read and written sit in L1 together. RGB
+// pixels are copied one at a time and like short rows best, grey
+// tiles are moved 8 rows at a time and like long ones. Measured on a
+// 4000x3000 image
+#define ORIENTATION_TILE_RGB 16
+#define ORIENTATION_TILE_GREY 128
+
+void swap_bytes(uint8_t *a, uint8_t *b, size_t length);
+void reverse_bytes(uint8_t *bytes, size_t length);
+void reverse_pixels(struct pixel *pixels, size_t length);
+void transpose_tile_grey(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride,
+                         int width, int height);
+void transpose_tile_rgb(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride,
+                        int width, int height);
+int transpose_image_tiles(int orientation, int tile, struct image *img);
+#ifdef __SSE2__
+void transpose_block_8x8_sse2(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride);
+#endif
+
+// Swaps two equal length runs of bytes that don't overlap
+void swap_bytes(uint8_t *a, uint8_t *b, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        uint8_t t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
+
+// Reverses bytes in place. With SSE2, 16 bytes from each end are
+// reversed in registers and swapped until the middle is reached
+void reverse_bytes(uint8_t *bytes, size_t length) {
+    size_t i = 0;
+    size_t j = length;
+#ifdef __SSE2__
+    while (j - i >= 32) {
+        __m128i left = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i right = _mm_loadu_si128((const __m128i *)(bytes + j - 16));
+
+        // Reverse the words in each half, swap the halves, then
+        // swap the bytes in each word
+        left = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(left, 0x1B), 0x1B), 0x4E);
+        right = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(right, 0x1B), 0x1B), 0x4E);
+        left = _mm_or_si128(_mm_slli_epi16(left, 8), _mm_srli_epi16(left, 8));
+        right = _mm_or_si128(_mm_slli_epi16(right, 8), _mm_srli_epi16(right, 8));
+
+        _mm_storeu_si128((__m128i *)(bytes + i), right);
+        _mm_storeu_si128((__m128i *)(bytes + j - 16), left);
+        i += 16;
+        j -= 16;
+    }
+#endif
+    while (j - i >= 2) {
+        j--;
+        uint8_t t = bytes[i];
+        bytes[i] = bytes[j];
+        bytes[j] = t;
+        i++;
+    }
+}
+
+void reverse_pixels(struct pixel *pixels, size_t length) {
+    size_t i = 0;
+    size_t j = length;
+    while (j - i >= 2) {
+        j--;
+        struct pixel t = pixels[i];
+        pixels[i] = pixels[j];
+        pixels[j] = t;
+        i++;
+    }
+}
+
+// Top row becomes the bottom row, in place
+int flip_image_vertical(struct image *img) {
+    size_t row_size = (size_t)img->width*img->channels;
+    uint8_t *bytes = img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+    int y;
+    for (y = 0; y < img->height/2; y++) {
+        swap_bytes(bytes + (size_t)y*row_size, bytes + (size_t)(img->height - 1 - y)*row_size, row_size);
+    }
+    return IMAGE_OK;
+}
+
+// Left column becomes the right column, in place
+int flip_image_horizontal(struct image *img) {
+    int y;
+    for (y = 0; y < img->height; y++) {
+        if (img->channels == 1) {
+            reverse_bytes(img->grey_array + (size_t)y*img->width, img->width);
+        } else {
+            reverse_pixels(img->pixel_array + (size_t)y*img->width, img->width);
+        }
+    }
+    return IMAGE_OK;
+}
+
+// Both flips at once is the whole pixel array backwards, in place
+int rotate_image_180(struct image *img) {
+    if (img->channels == 1) {
+        reverse_bytes(img->grey_array, img->n_of_pixels);
+    } else {
+        reverse_pixels(img->pixel_array, img->n_of_pixels);
+    }
+    return IMAGE_OK;
+}
+
+#ifdef __SSE2__
+// Transposes an 8x8 block of bytes. Interleaving bytes, then pairs,
+// then fours of rows leaves each register holding two columns
+void transpose_block_8x8_sse2(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride) {
+    __m128i r0 = _mm_loadl_epi64((const __m128i *)(src));
+    __m128i r1 = _mm_loadl_epi64((const __m128i *)(src + src_stride));
+    __m128i r2 = _mm_loadl_epi64((const __m128i *)(src + 2*src_stride));
+    __m128i r3 = _mm_loadl_epi64((const __m128i *)(src + 3*src_stride));
+    __m128i r4 = _mm_loadl_epi64((const __m128i *)(src + 4*src_stride));
+    __m128i r5 = _mm_loadl_epi64((const __m128i *)(src + 5*src_stride));
+    __m128i r6 = _mm_loadl_epi64((const __m128i *)(src + 6*src_stride));
+    __m128i r7 = _mm_loadl_epi64((const __m128i *)(src + 7*src_stride));
+
+    __m128i a0 = _mm_unpacklo_epi8(r0, r1);
+    __m128i a1 = _mm_unpacklo_epi8(r2, r3);
+    __m128i a2 = _mm_unpacklo_epi8(r4, r5);
+    __m128i a3 = _mm_unpacklo_epi8(r6, r7);
+
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+
+    __m128i c0 = _mm_unpacklo_epi32(b0, b2);
+    __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+    __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+    __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+
+    _mm_storel_epi64((__m128i *)(dst), c0);
+    _mm_storel_epi64((__m128i *)(dst + dst_stride), _mm_srli_si128(c0, 8));
+    _mm_storel_epi64((__m128i *)(dst + 2*dst_stride), c1);
+    _mm_storel_epi64((__m128i *)(dst + 3*dst_stride), _mm_srli_si128(c1, 8));
+    _mm_storel_epi64((__m128i *)(dst + 4*dst_stride), c2);
+    _mm_storel_epi64((__m128i *)(dst + 5*dst_stride), _mm_srli_si128(c2, 8));
+    _mm_storel_epi64((__m128i *)(dst + 6*dst_stride), c3);
+    _mm_storel_epi64((__m128i *)(dst + 7*dst_stride), _mm_srli_si128(c3, 8));
+}
+#endif
+
+// Column x of the width x height tile at src becomes row x at dst.
+// Strides are in bytes and may be negative
+void transpose_tile_grey(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride,
+                         int width, int height) {
+    int x = 0;
+    int y;
+#ifdef __SSE2__
+    for (; x + 8 <= width; x += 8) {
+        for (y = 0; y + 8 <= height; y += 8) {
+            transpose_block_8x8_sse2(src + y*src_stride + x, src_stride, dst + x*dst_stride + y, dst_stride);
+        }
+        int block_x;
+        for (block_x = x; block_x < x + 8; block_x++) {
+            for (y = height & ~7; y < height; y++) {
+                dst[block_x*dst_stride + y] = src[y*src_stride + block_x];
+            }
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        for (y = 0; y < height; y++) {
+            dst[x*dst_stride + y] = src[y*src_stride + x];
+        }
+    }
+}
+
+// As transpose_tile_grey() for 3 byte pixels. Pixels don't fit SSE2
+// lanes, but the copies within a tile never leave L1
+void transpose_tile_rgb(const uint8_t *src, ptrdiff_t src_stride, uint8_t *dst, ptrdiff_t dst_stride,
+                        int width, int height) {
+    int x,y;
+    for (y = 0; y < height; y++) {
+        const struct pixel *in = (const struct pixel *)(src + y*src_stride);
+        uint8_t *out = dst + 3*y;
+        for (x = 0; x < width; x++) {
+            *(struct pixel *)(out + x*dst_stride) = in[x];
+        }
+    }
+}
+
+// Transposes img into a new image, tile x tile pixels at a time. A
+// vertical flip reads the source rows from the bottom up, and a
+// horizontal flip writes the destination rows from the bottom up
+int transpose_image_tiles(int orientation, int tile, struct image *img) {
+    struct image turned;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&turned, img->height, img->width, img->allocator);
+    } else {
+        status = init_struct_image(&turned, img->height, img->width, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    int channels = img->channels;
+    ptrdiff_t src_stride = (ptrdiff_t)img->width*channels;
+    ptrdiff_t dst_stride = (ptrdiff_t)turned.width*channels;
+    const uint8_t *src = channels == 1 ? img->grey_array : (const uint8_t *)img->pixel_array;
+    uint8_t *dst = channels == 1 ? turned.grey_array : (uint8_t *)turned.pixel_array;
+    if (orientation & ORIENTATION_FLIP_VERTICAL) {
+        src += (img->height - 1)*src_stride;
+        src_stride = -src_stride;
+    }
+    if (orientation & ORIENTATION_FLIP_HORIZONTAL) {
+        dst += (turned.height - 1)*dst_stride;
+        dst_stride = -dst_stride;
+    }
+
+    int tile_x, tile_y;
+    for (tile_y = 0; tile_y < img->height; tile_y += tile) {
+        int tile_height = img->height - tile_y < tile ? img->height - tile_y : tile;
+        for (tile_x = 0; tile_x < img->width; tile_x += tile) {
+            int tile_width = img->width - tile_x < tile ? img->width - tile_x : tile;
+            const uint8_t *tile_src = src + tile_y*src_stride + (ptrdiff_t)tile_x*channels;
+            uint8_t *tile_dst = dst + tile_x*dst_stride + (ptrdiff_t)tile_y*channels;
+            if (channels == 1) {
+                transpose_tile_grey(tile_src, src_stride, tile_dst, dst_stride, tile_width, tile_height);
+            } else {
+                transpose_tile_rgb(tile_src, src_stride, tile_dst, dst_stride, tile_width, tile_height);
+            }
+        }
+    }
+
+    free_struct_image(img);
+    *img = turned;
+    return IMAGE_OK;
+}
+
+// Rows become columns, after the flips in orientation. The transpose
+// bit itself is assumed
+int transpose_image(int orientation, struct image *img) {
+    return transpose_image_tiles(orientation, img->channels == 1 ? ORIENTATION_TILE_GREY : ORIENTATION_TILE_RGB, img);
+}
+
+// A whole row as one tile, for checking the tiled version against
+int transpose_image_scalar(int orientation, struct image *img) {
+    struct image turned;
+    int status;
+    if (img->channels == 1) {
+        status = init_grey_struct_image(&turned, img->height, img->width, img->allocator);
+    } else {
+        status = init_struct_image(&turned, img->height, img->width, img->allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    int x,y;
+    for (y = 0; y < img->height; y++) {
+        int from_y = orientation & ORIENTATION_FLIP_VERTICAL ? img->height - 1 - y : y;
+        for (x = 0; x < img->width; x++) {
+            int to_y = orientation & ORIENTATION_FLIP_HORIZONTAL ? img->width - 1 - x : x;
+            size_t from = (size_t)from_y*img->width + x;
+            size_t to = (size_t)to_y*turned.width + y;
+            if (img->channels == 1) {
+                turned.grey_array[to] = img->grey_array[from];
+            } else {
+                turned.pixel_array[to] = img->pixel_array[from];
+            }
+        }
+    }
+
+    free_struct_image(img);
+    *img = turned;
+    return IMAGE_OK;
+}
+
+// Applies any of the eight orientations
+int orient_image(int orientation, struct image *img) {
+    if (orientation & ORIENTATION_TRANSPOSE) {
+        return transpose_image(orientation, img);
+    }
+    switch (orientation) {
+        case ORIENTATION_ROTATE_180:
+            return rotate_image_180(img);
+        case ORIENTATION_FLIP_VERTICAL:
+            return flip_image_vertical(img);
+        case ORIENTATION_FLIP_HORIZONTAL:
+            return flip_image_horizontal(img);
+        default:
+            return IMAGE_OK;
+    }
+}
+
+// The orientation that is first then second. Each is the 2x2 matrix
+// that moves pixel coordinates measured from the centre, and the
+// product is turned back into flips and a transpose
+int orientation_then(int first, int second) {
+    int matrices[2][2][2];
+    int orientations[2] = {first, second};
+    int i;
+    for (i = 0; i < 2; i++) {
+        int sx = orientations[i] & ORIENTATION_FLIP_HORIZONTAL ? -1 : 1;
+        int sy = orientations[i] & ORIENTATION_FLIP_VERTICAL ? -1 : 1;
+        int transpose = orientations[i] & ORIENTATION_TRANSPOSE;
+        matrices[i][0][0] = transpose ? 0 : sx;
+        matrices[i][0][1] = transpose ? sy : 0;
+        matrices[i][1][0] = transpose ? sx : 0;
+        matrices[i][1][1] = transpose ? 0 : sy;
+    }
+
+    int product[2][2];
+    int r, c;
+    for (r = 0; r < 2; r++) {
+        for (c = 0; c < 2; c++) {
+            product[r][c] = matrices[1][r][0]*matrices[0][0][c] + matrices[1][r][1]*matrices[0][1][c];
+        }
+    }
+
+    // A transpose swaps the rows of the flips' diagonal matrix
+    int orientation = 0;
+    if (product[0][0] == 0) {
+        orientation |= ORIENTATION_TRANSPOSE;
+        if (product[1][0] < 0) orientation |= ORIENTATION_FLIP_HORIZONTAL;
+        if (product[0][1] < 0) orientation |= ORIENTATION_FLIP_VERTICAL;
+    } else {
+        if (product[0][0] < 0) orientation |= ORIENTATION_FLIP_HORIZONTAL;
+        if (product[1][1] < 0) orientation |= ORIENTATION_FLIP_VERTICAL;
+    }
+    return orientation;
+}
+
+// Clockwise quarter turns, 90, 180 or 270
+int parse_rotate_arg(int *orientation, char *rotate_arg) {
+    if (strcmp(rotate_arg, "90") == 0) {
+        *orientation = ORIENTATION_ROTATE_90;
+    } else if (strcmp(rotate_arg, "180") == 0) {
+        *orientation = ORIENTATION_ROTATE_180;
+    } else if (strcmp(rotate_arg, "270") == 0) {
+        *orientation = ORIENTATION_ROTATE_270;
+    } else {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
+
+// h mirrors left to right, v top to bottom
+int parse_flip_arg(int *orientation, char *flip_arg) {
+    if (strcmp(flip_arg, "h") == 0) {
+        *orientation = ORIENTATION_FLIP_HORIZONTAL;
+    } else if (strcmp(flip_arg, "v") == 0) {
+        *orientation = ORIENTATION_FLIP_VERTICAL;
+    } else {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
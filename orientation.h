@@ -0,0 +1,45 @@
+/* orientation.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of rotations by quarter turns, flips
+ * and transposes, the eight ways a page can be put
+ * back on the scanner
+ *
+ */
+
+#ifndef ORIENTATION_H
+#define ORIENTATION_H
+
+#include "image_data_types.h"
+
+// An orientation is a vertical flip, then a horizontal flip, then a
+// transpose (rows become columns), each either done or not. The eight
+// combinations are every rotation and mirror image of the image
+#define ORIENTATION_FLIP_VERTICAL 1
+#define ORIENTATION_FLIP_HORIZONTAL 2
+#define ORIENTATION_TRANSPOSE 4
+
+enum orientation {
+    ORIENTATION_NONE = 0,
+    ORIENTATION_MIRROR_VERTICAL = ORIENTATION_FLIP_VERTICAL,
+    ORIENTATION_MIRROR_HORIZONTAL = ORIENTATION_FLIP_HORIZONTAL,
+    ORIENTATION_ROTATE_180 = ORIENTATION_FLIP_VERTICAL | ORIENTATION_FLIP_HORIZONTAL,
+    ORIENTATION_MIRROR_DIAGONAL = ORIENTATION_TRANSPOSE,
+    ORIENTATION_ROTATE_90 = ORIENTATION_FLIP_VERTICAL | ORIENTATION_TRANSPOSE,     // clockwise
+    ORIENTATION_ROTATE_270 = ORIENTATION_FLIP_HORIZONTAL | ORIENTATION_TRANSPOSE,  // clockwise
+    ORIENTATION_MIRROR_ANTIDIAGONAL = ORIENTATION_FLIP_VERTICAL | ORIENTATION_FLIP_HORIZONTAL | ORIENTATION_TRANSPOSE
+};
+
+int flip_image_vertical(struct image *img);
+int flip_image_horizontal(struct image *img);
+int rotate_image_180(struct image *img);
+int transpose_image(int orientation, struct image *img);
+int transpose_image_scalar(int orientation, struct image *img);
+int orient_image(int orientation, struct image *img);
+int orientation_then(int first, int second);
+
+int parse_rotate_arg(int *orientation, char *rotate_arg);
+int parse_flip_arg(int *orientation, char *flip_arg);
+
+#endif
@@ -0,0 +1,518 @@
+/* resize.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Resize filters and image pyramids. Whole number
+ * reductions are exact box averages, everything else
+ * goes through a separable resampler (area, bilinear
+ * or lanczos) with fixed point weights
+ *
+ */
+
+#include "resize.h"
+#include "image_data_helper_functions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Resampler weights are fixed point with this many fractional bits
+#define RESAMPLE_PRECISION_BITS 22
+
+// For each output pixel, the first input pixel it uses and
+// a weight for each of the count input pixels from there
+struct resample_weights {
+    int *starts;
+    int *counts;
+    int32_t *weights;
+    int max_count;
+};
+
+uint8_t *image_bytes(struct image *img);
+int init_image_like(struct image *img, int width, int height, const struct image *like);
+double bilinear_filter(double x);
+double lanczos_filter(double x);
+int compute_resample_weights(int in_size, int out_size, int method, struct resample_weights *resample,
+                             const struct image_allocator *allocator);
+void free_resample_weights(struct resample_weights *resample, const struct image_allocator *allocator);
+uint8_t clamp_fixed_point(int64_t sum);
+
+// Pixel data as bytes, channels to a pixel
+uint8_t *image_bytes(struct image *img) {
+    return img->channels == 1 ? img->grey_array : (uint8_t *)img->pixel_array;
+}
+
+// New image with the same number of channels and allocator as like
+int init_image_like(struct image *img, int width, int height, const struct image *like) {
+    if (like->channels == 1) {
+        return init_grey_struct_image(img, width, height, like->allocator);
+    }
+    return init_struct_image(img, width, height, like->allocator);
+}
+
+int row_reducer_init(struct row_reducer *reducer, int width, int height, int channels,
+                     int factor_x, int factor_y, struct image *output, const struct image_allocator *allocator) {
+    if (factor_x < 1 || factor_y < 1) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    reducer->width = width;
+    reducer->height = height;
+    reducer->channels = channels;
+    reducer->factor_x = factor_x;
+    reducer->factor_y = factor_y;
+    reducer->output = output;
+    reducer->rows_in_sums = 0;
+
+    int output_width = (width + factor_x - 1)/factor_x;
+    int output_height = (height + factor_y - 1)/factor_y;
+    int status;
+    if (channels == 1) {
+        status = init_grey_struct_image(output, output_width, output_height, allocator);
+    } else {
+        status = init_struct_image(output, output_width, output_height, allocator);
+    }
+    if (status != IMAGE_OK) return status;
+
+    size_t sums_size = (size_t)output_width*channels*sizeof(uint64_t);
+    reducer->sums = image_alloc(allocator, sums_size);
+    if (reducer->sums == NULL) {
+        free_struct_image(output);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+    memset(reducer->sums, 0, sums_size);
+    return IMAGE_OK;
+}
+
+// Adds row y (counting from the top) of the full size image. The rows
+// of each block must arrive one after another, but blocks can come
+// in any order, so bottom up bitmaps can be fed straight in.
+// Returns the output row y finished, or -1 if its block isn't full yet
+int row_reducer_add_row(struct row_reducer *reducer, const uint8_t *row, int y) {
+    int channels = reducer->channels;
+    int factor_x = reducer->factor_x;
+    int output_width = reducer->output->width;
+    uint64_t *sums = reducer->sums;
+
+    // Bytes are read in order, a pixel's channels at a time
+    int output_x, i, c;
+    for (output_x = 0; output_x < output_width; output_x++) {
+        int x_end = (output_x + 1)*factor_x;
+        if (x_end > reducer->width) x_end = reducer->width;
+        const uint8_t *block = row + (size_t)output_x*factor_x*channels;
+        int n_of_bytes = (x_end - output_x*factor_x)*channels;
+        uint64_t *block_sums = &sums[output_x*channels];
+        if (channels == 3) {
+            uint32_t blue = 0, green = 0, red = 0;
+            for (i = 0; i < n_of_bytes; i += 3) {
+                blue += block[i];
+                green += block[i + 1];
+                red += block[i + 2];
+            }
+            block_sums[0] += blue;
+            block_sums[1] += green;
+            block_sums[2] += red;
+        } else {
+            uint32_t sum = 0;
+            for (i = 0; i < n_of_bytes; i++) {
+                sum += block[i];
+            }
+            block_sums[0] += sum;
+        }
+    }
+
+    // Write out the block once all of its rows are in
+    int block = y/reducer->factor_y;
+    int rows_in_block = reducer->height - block*reducer->factor_y;
+    if (rows_in_block > reducer->factor_y) rows_in_block = reducer->factor_y;
+    reducer->rows_in_sums++;
+    if (reducer->rows_in_sums < rows_in_block) return -1;
+
+    // Full blocks of a power of two pixels (all of a pyramid's) shift
+    // instead of dividing
+    uint64_t full_n = (uint64_t)factor_x*rows_in_block;
+    int shift = 0;
+    while (((uint64_t)1 << shift) < full_n) shift++;
+    if (((uint64_t)1 << shift) != full_n) shift = -1;
+
+    uint8_t *output_row = image_bytes(reducer->output) + (size_t)block*output_width*channels;
+    for (output_x = 0; output_x < output_width; output_x++) {
+        int columns = reducer->width - output_x*factor_x;
+        uint64_t *block_sums = &sums[output_x*channels];
+        uint8_t *output = &output_row[output_x*channels];
+        if (columns >= factor_x && shift >= 0) {
+            for (c = 0; c < channels; c++) {
+                output[c] = (block_sums[c] + full_n/2) >> shift;
+                block_sums[c] = 0;
+            }
+            continue;
+        }
+        if (columns > factor_x) columns = factor_x;
+        uint64_t n = (uint64_t)columns*rows_in_block;
+        for (c = 0; c < channels; c++) {
+            output[c] = (block_sums[c] + n/2)/n;
+            block_sums[c] = 0;
+        }
+    }
+    reducer->rows_in_sums = 0;
+    return block;
+}
+
+// Frees the sums, the output image is the caller's
+void row_reducer_free(struct row_reducer *reducer, const struct image_allocator *allocator) {
+    image_dealloc(allocator, reducer->sums);
+    reducer->sums = NULL;
+}
+
+// A new dimension of 0 keeps the aspect ratio from the other one
+void resolve_resize_dimensions(int width, int height, int *new_width, int *new_height) {
+    if (*new_width == 0 && *new_height > 0) {
+        *new_width = (int)fmax(1.0, floor((double)width*(*new_height)/height + 0.5));
+    } else if (*new_height == 0 && *new_width > 0) {
+        *new_height = (int)fmax(1.0, floor((double)height*(*new_width)/width + 0.5));
+    }
+}
+
+// Whole number factor resize_image() reduces size by before resampling.
+// Exact multiples are reduced all the way by area averaging. Otherwise
+// RESIZE_AUTO box averages down to between 2x and 4x the new size
+// and leaves the rest to lanczos, which costs little in quality and
+// saves lanczos reading every source pixel many times
+int reduce_factor_for_resize(int size, int new_size, int method) {
+    if (new_size <= 0 || new_size >= size) return 1;
+    if (size % new_size == 0 && (method == RESIZE_AUTO || method == RESIZE_AREA)) {
+        return size/new_size;
+    }
+    if (method == RESIZE_AUTO && size/new_size/2 > 1) {
+        return size/new_size/2;
+    }
+    return 1;
+}
+
+// Box averages factor_x x factor_y blocks of pixels
+int reduce_image(int factor_x, int factor_y, struct image *img) {
+    if (factor_x < 1 || factor_y < 1) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    if (factor_x == 1 && factor_y == 1) {
+        return IMAGE_OK;
+    }
+
+    struct image reduced;
+    struct row_reducer reducer;
+    int status = row_reducer_init(&reducer, img->width, img->height, img->channels,
+                                  factor_x, factor_y, &reduced, img->allocator);
+    if (status != IMAGE_OK) return status;
+
+    uint8_t *bytes = image_bytes(img);
+    size_t row_size = (size_t)img->width*img->channels;
+    int y;
+    for (y = 0; y < img->height; y++) {
+        row_reducer_add_row(&reducer, bytes + y*row_size, y);
+    }
+    row_reducer_free(&reducer, img->allocator);
+
+    free_struct_image(img);
+    *img = reduced;
+    return IMAGE_OK;
+}
+
+double bilinear_filter(double x) {
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+double lanczos_filter(double x) {
+    if (x == 0.0) return 1.0;
+    if (x <= -3.0 || x >= 3.0) return 0.0;
+    return 3.0*sin(M_PI*x)*sin(M_PI*x/3.0)/(M_PI*M_PI*x*x);
+}
+
+// Works out the weights for resampling in_size pixels to out_size.
+// Area weights are how much of each input pixel the output pixel covers.
+// Bilinear and lanczos are stretched when shrinking so every input
+// pixel still counts. Weights near the edges are renormalised
+int compute_resample_weights(int in_size, int out_size, int method, struct resample_weights *resample,
+                             const struct image_allocator *allocator) {
+    double scale = (double)in_size/out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double support;
+    if (method == RESIZE_AREA) {
+        support = scale/2.0 + 0.5;
+    } else if (method == RESIZE_BILINEAR) {
+        support = filter_scale;
+    } else {
+        support = 3.0*filter_scale;
+    }
+
+    resample->max_count = (int)ceil(support*2.0) + 2;
+    resample->starts = image_alloc(allocator, out_size*sizeof(int));
+    resample->counts = image_alloc(allocator, out_size*sizeof(int));
+    resample->weights = image_alloc(allocator, (size_t)out_size*resample->max_count*sizeof(int32_t));
+    double *weights = image_alloc(allocator, resample->max_count*sizeof(double));
+    if (resample->starts == NULL || resample->counts == NULL || resample->weights == NULL || weights == NULL) {
+        image_dealloc(allocator, weights);
+        free_resample_weights(resample, allocator);
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    int i, j;
+    for (i = 0; i < out_size; i++) {
+        double centre = (i + 0.5)*scale;
+        int start = (int)floor(centre - support);
+        int end = (int)ceil(centre + support);
+        if (start < 0) start = 0;
+        if (end > in_size) end = in_size;
+        if (end - start > resample->max_count) end = start + resample->max_count;
+
+        double total = 0.0;
+        for (j = start; j < end; j++) {
+            double weight;
+            if (method == RESIZE_AREA) {
+                double low = fmax(i*scale, j);
+                double high = fmin((i + 1)*scale, j + 1);
+                weight = high > low ? high - low : 0.0;
+            } else if (method == RESIZE_BILINEAR) {
+                weight = bilinear_filter((j + 0.5 - centre)/filter_scale);
+            } else {
+                weight = lanczos_filter((j + 0.5 - centre)/filter_scale);
+            }
+            weights[j - start] = weight;
+            total += weight;
+        }
+
+        resample->starts[i] = start;
+        resample->counts[i] = end - start;
+        int32_t *fixed_weights = &resample->weights[(size_t)i*resample->max_count];
+        for (j = 0; j < end - start; j++) {
+            double weight = total != 0.0 ? weights[j]/total : 0.0;
+            fixed_weights[j] = (int32_t)floor(weight*(1 << RESAMPLE_PRECISION_BITS) + 0.5);
+        }
+    }
+
+    image_dealloc(allocator, weights);
+    return IMAGE_OK;
+}
+
+void free_resample_weights(struct resample_weights *resample, const struct image_allocator *allocator) {
+    image_dealloc(allocator, resample->starts);
+    image_dealloc(allocator, resample->counts);
+    image_dealloc(allocator, resample->weights);
+    resample->starts = NULL;
+    resample->counts = NULL;
+    resample->weights = NULL;
+}
+
+uint8_t clamp_fixed_point(int64_t sum) {
+    sum = (sum + (1 << (RESAMPLE_PRECISION_BITS - 1))) >> RESAMPLE_PRECISION_BITS;
+    if (sum < 0) return 0;
+    if (sum > 255) return 255;
+    return sum;
+}
+
+// Number of 2x2 reductions it takes to get down to 1x1
+int pyramid_depth(int width, int height) {
+    int depth = 0;
+    while (width > 1 || height > 1) {
+        width = (width + 1)/2;
+        height = (height + 1)/2;
+        depth++;
+    }
+    return depth;
+}
+
+// Fills levels with n_of_levels successive 2x2 box reductions of img,
+// levels[0] is half size. Each row of a level is passed on to the next
+// level as soon as it is finished, so all of them are made in one pass
+// over img while the rows they come from are still in cache
+int build_image_pyramid(struct image *img, int n_of_levels, struct image *levels) {
+    if (n_of_levels < 1 || n_of_levels > pyramid_depth(img->width, img->height)) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    struct row_reducer *reducers = image_alloc(img->allocator, n_of_levels*sizeof(struct row_reducer));
+    if (reducers == NULL) {
+        return IMAGE_ERR_NO_MEMORY;
+    }
+
+    int channels = img->channels;
+    int width = img->width;
+    int height = img->height;
+    int level;
+    int status = IMAGE_OK;
+    for (level = 0; level < n_of_levels; level++) {
+        status = row_reducer_init(&reducers[level], width, height, channels, 2, 2, &levels[level], img->allocator);
+        if (status != IMAGE_OK) break;
+        width = levels[level].width;
+        height = levels[level].height;
+    }
+    if (status != IMAGE_OK) {
+        while (level-- > 0) {
+            row_reducer_free(&reducers[level], img->allocator);
+            free_struct_image(&levels[level]);
+        }
+        image_dealloc(img->allocator, reducers);
+        return status;
+    }
+
+    uint8_t *bytes = image_bytes(img);
+    int y;
+    for (y = 0; y < img->height; y++) {
+        const uint8_t *row = bytes + (size_t)y*img->width*channels;
+        int row_y = y;
+        for (level = 0; level < n_of_levels; level++) {
+            row_y = row_reducer_add_row(&reducers[level], row, row_y);
+            if (row_y < 0) break;
+            row = image_bytes(&levels[level]) + (size_t)row_y*levels[level].width*channels;
+        }
+    }
+
+    for (level = 0; level < n_of_levels; level++) {
+        row_reducer_free(&reducers[level], img->allocator);
+    }
+    image_dealloc(img->allocator, reducers);
+    return IMAGE_OK;
+}
+
+// Resamples img to new_width x new_height with RESIZE_AREA, RESIZE_BILINEAR
+// or RESIZE_LANCZOS, horizontally then vertically
+int resample_image(int new_width, int new_height, int method, struct image *img) {
+    if (new_width <= 0 || new_height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+    if (method != RESIZE_AREA && method != RESIZE_BILINEAR && method != RESIZE_LANCZOS) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    int channels = img->channels;
+    int status;
+    int x, y, c, k;
+
+    // Horizontal pass, each row on its own
+    if (new_width != img->width) {
+        struct resample_weights resample;
+        status = compute_resample_weights(img->width, new_width, method, &resample, img->allocator);
+        if (status != IMAGE_OK) return status;
+
+        struct image resampled;
+        status = init_image_like(&resampled, new_width, img->height, img);
+        if (status != IMAGE_OK) {
+            free_resample_weights(&resample, img->allocator);
+            return status;
+        }
+
+        uint8_t *in_bytes = image_bytes(img);
+        uint8_t *out_bytes = image_bytes(&resampled);
+        for (y = 0; y < img->height; y++) {
+            const uint8_t *in_row = in_bytes + (size_t)y*img->width*channels;
+            uint8_t *out_row = out_bytes + (size_t)y*new_width*channels;
+            for (x = 0; x < new_width; x++) {
+                const uint8_t *in_pixels = in_row + (size_t)resample.starts[x]*channels;
+                const int32_t *weights = &resample.weights[(size_t)x*resample.max_count];
+                for (c = 0; c < channels; c++) {
+                    int64_t sum = 0;
+                    for (k = 0; k < resample.counts[x]; k++) {
+                        sum += (int64_t)weights[k]*in_pixels[k*channels + c];
+                    }
+                    out_row[x*channels + c] = clamp_fixed_point(sum);
+                }
+            }
+        }
+
+        free_resample_weights(&resample, img->allocator);
+        free_struct_image(img);
+        *img = resampled;
+    }
+
+    // Vertical pass, a row of sums at a time so rows are read in order
+    if (new_height != img->height) {
+        struct resample_weights resample;
+        status = compute_resample_weights(img->height, new_height, method, &resample, img->allocator);
+        if (status != IMAGE_OK) return status;
+
+        size_t row_size = (size_t)img->width*channels;
+        struct image resampled;
+        status = init_image_like(&resampled, img->width, new_height, img);
+        int64_t *sums = image_alloc(img->allocator, row_size*sizeof(int64_t));
+        if (status != IMAGE_OK || sums == NULL) {
+            if (status == IMAGE_OK) free_struct_image(&resampled);
+            image_dealloc(img->allocator, sums);
+            free_resample_weights(&resample, img->allocator);
+            return status != IMAGE_OK ? status : IMAGE_ERR_NO_MEMORY;
+        }
+
+        uint8_t *in_bytes = image_bytes(img);
+        uint8_t *out_bytes = image_bytes(&resampled);
+        size_t i;
+        for (y = 0; y < new_height; y++) {
+            const int32_t *weights = &resample.weights[(size_t)y*resample.max_count];
+            memset(sums, 0, row_size*sizeof(int64_t));
+            for (k = 0; k < resample.counts[y]; k++) {
+                const uint8_t *in_row = in_bytes + (size_t)(resample.starts[y] + k)*row_size;
+                for (i = 0; i < row_size; i++) {
+                    sums[i] += (int64_t)weights[k]*in_row[i];
+                }
+            }
+            uint8_t *out_row = out_bytes + (size_t)y*row_size;
+            for (i = 0; i < row_size; i++) {
+                out_row[i] = clamp_fixed_point(sums[i]);
+            }
+        }
+
+        image_dealloc(img->allocator, sums);
+        free_resample_weights(&resample, img->allocator);
+        free_struct_image(img);
+        *img = resampled;
+    }
+    return IMAGE_OK;
+}
+
+// Resizes img to new_width x new_height, either may be 0 to keep the
+// aspect ratio. Whole number reductions are done first with
+// reduce_image() (see reduce_factor_for_resize()), then the rest
+// with resample_image(), lanczos for RESIZE_AUTO
+int resize_image(int new_width, int new_height, int method, struct image *img) {
+    resolve_resize_dimensions(img->width, img->height, &new_width, &new_height);
+    if (new_width <= 0 || new_height <= 0) {
+        return IMAGE_ERR_DIMENSIONS;
+    }
+
+    int status = reduce_image(reduce_factor_for_resize(img->width, new_width, method),
+                              reduce_factor_for_resize(img->height, new_height, method), img);
+    if (status != IMAGE_OK) return status;
+
+    return resize_reduced_image(new_width, new_height, method, img);
+}
+
+// Second half of resize_image(), for an image that has already had
+// its whole number reduction (e.g. by bmp_to_struct_image_for_resize()).
+// new_width and new_height must already be resolved
+int resize_reduced_image(int new_width, int new_height, int method, struct image *img) {
+    if (img->width == new_width && img->height == new_height) {
+        return IMAGE_OK;
+    }
+    return resample_image(new_width, new_height, method == RESIZE_AUTO ? RESIZE_LANCZOS : method, img);
+}
+
+// Parses "WIDTHxHEIGHT" with an optional ",method" on the end,
+// returns IMAGE_ERR_ARGUMENT if it doesn't make sense
+int parse_resize_arg(int *width, int *height, int *method, char *resize_arg) {
+    char method_name[16] = "auto";
+    int n = sscanf(resize_arg, "%dx%d,%15s", width, height, method_name);
+    if (n < 2 || *width < 0 || *height < 0 || (*width == 0 && *height == 0)) {
+        return IMAGE_ERR_ARGUMENT;
+    }
+
+    if (strcmp(method_name, "auto") == 0) {
+        *method = RESIZE_AUTO;
+    } else if (strcmp(method_name, "area") == 0) {
+        *method = RESIZE_AREA;
+    } else if (strcmp(method_name, "bilinear") == 0) {
+        *method = RESIZE_BILINEAR;
+    } else if (strcmp(method_name, "lanczos") == 0) {
+        *method = RESIZE_LANCZOS;
+    } else {
+        return IMAGE_ERR_ARGUMENT;
+    }
+    return IMAGE_OK;
+}
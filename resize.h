@@ -0,0 +1,53 @@
+/* resize.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declarations of the resize filters, image
+ * pyramids and the row reducer the decoder uses
+ * to shrink images as they are read
+ *
+ */
+
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include "image_data_types.h"
+
+enum resize_method {
+    RESIZE_AUTO = 0,    // exact area average, then lanczos for what's left
+    RESIZE_AREA,
+    RESIZE_BILINEAR,
+    RESIZE_LANCZOS
+};
+
+// Box averages factor_x x factor_y blocks of rows and columns as the rows
+// arrive, in any order, into a ceil(width/factor_x) x ceil(height/factor_y)
+// image. Blocks on the right and bottom edges may be smaller
+struct row_reducer {
+    int width;
+    int height;
+    int channels;
+    int factor_x;
+    int factor_y;
+    struct image *output;
+    uint64_t *sums;
+    int rows_in_sums;
+};
+
+int row_reducer_init(struct row_reducer *reducer, int width, int height, int channels,
+                     int factor_x, int factor_y, struct image *output, const struct image_allocator *allocator);
+int row_reducer_add_row(struct row_reducer *reducer, const uint8_t *row, int y);
+void row_reducer_free(struct row_reducer *reducer, const struct image_allocator *allocator);
+
+void resolve_resize_dimensions(int width, int height, int *new_width, int *new_height);
+int reduce_factor_for_resize(int size, int new_size, int method);
+
+int reduce_image(int factor_x, int factor_y, struct image *img);
+int resample_image(int new_width, int new_height, int method, struct image *img);
+int resize_image(int new_width, int new_height, int method, struct image *img);
+int resize_reduced_image(int new_width, int new_height, int method, struct image *img);
+int pyramid_depth(int width, int height);
+int build_image_pyramid(struct image *img, int n_of_levels, struct image *levels);
+int parse_resize_arg(int *width, int *height, int *method, char *resize_arg);
+
+#endif
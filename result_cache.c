@@ -0,0 +1,455 @@
+/* result_cache.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * bmpedit --cache DIR keeps the results of filter chains
+ * in DIR, named after a hash of the input file and a
+ * hash of the chain written out in a fixed order. The
+ * output file is kept, so the same request again is a
+ * file copy (a reflink where the file system can) with
+ * no decode at all. So is the image after each of the
+ * expensive filters, so a chain that starts the same
+ * way as an earlier one only runs the filters after
+ * the part they share
+ *
+ * Files are written under a temporary name and renamed,
+ * so several bmpedits, or server threads, can share a
+ * directory. Nothing is ever removed, clear it out with
+ * find or a cron job
+ *
+ */
+
+#define _GNU_SOURCE
+#include "result_cache.h"
+#include "libbmpedit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+// Bump when a filter's output changes, so old results aren't used
+#define RESULT_CACHE_VERSION 1
+
+#define HASH_BLOCK_SIZE (1 << 20)
+#define CHAIN_TEXT_SIZE 2048
+
+// xxHash64 primes
+#define HASH_P1 11400714785074694791ULL
+#define HASH_P2 14029467366897019727ULL
+#define HASH_P3 1609587929392839161ULL
+#define HASH_P4 9650029242287828579ULL
+#define HASH_P5 2870177450012600261ULL
+
+static const char *chain_stage_names[] = {
+    "input", "gaussian blur", "kernel", "box mean", "bilateral", "median", "sobel", "adaptive threshold", "morphology", "output"
+};
+
+uint64_t rotate_left(uint64_t x, int bits);
+uint64_t hash_round(uint64_t lane, const uint8_t *bytes);
+uint64_t read_le64(const uint8_t *bytes);
+void append_text(char *text, size_t text_size, size_t *length, const char *format, ...);
+int describe_chain_stage(const struct result_cache *cache, int stage, char *text, size_t text_size);
+int hash_named_file(const char *file_name, uint64_t *hash);
+int copy_file_contents(int in_fildes, int out_fildes);
+
+uint64_t rotate_left(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+uint64_t read_le64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    int i;
+    for (i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+    return value;
+}
+
+uint64_t hash_round(uint64_t lane, const uint8_t *bytes) {
+    lane += read_le64(bytes)*HASH_P2;
+    return rotate_left(lane, 31)*HASH_P1;
+}
+
+void content_hash_init(struct content_hash *hash) {
+    hash->lanes[0] = HASH_P1 + HASH_P2;
+    hash->lanes[1] = HASH_P2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = -HASH_P1;
+    hash->total = 0;
+    hash->tail_size = 0;
+}
+
+// Four lanes take 8 bytes each a round, so the multiplies overlap.
+// Leftovers wait in tail for the next piece
+void content_hash_update(struct content_hash *hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    hash->total += size;
+
+    if (hash->tail_size > 0) {
+        size_t fill = 32 - hash->tail_size < size ? 32 - hash->tail_size : size;
+        memcpy(hash->tail + hash->tail_size, bytes, fill);
+        hash->tail_size += fill;
+        bytes += fill;
+        size -= fill;
+        if (hash->tail_size < 32) return;
+        int lane;
+        for (lane = 0; lane < 4; lane++) hash->lanes[lane] = hash_round(hash->lanes[lane], hash->tail + 8*lane);
+        hash->tail_size = 0;
+    }
+
+    uint64_t v1 = hash->lanes[0], v2 = hash->lanes[1], v3 = hash->lanes[2], v4 = hash->lanes[3];
+    while (size >= 32) {
+        v1 = hash_round(v1, bytes);
+        v2 = hash_round(v2, bytes + 8);
+        v3 = hash_round(v3, bytes + 16);
+        v4 = hash_round(v4, bytes + 24);
+        bytes += 32;
+        size -= 32;
+    }
+    hash->lanes[0] = v1;
+    hash->lanes[1] = v2;
+    hash->lanes[2] = v3;
+    hash->lanes[3] = v4;
+
+    memcpy(hash->tail, bytes, size);
+    hash->tail_size = size;
+}
+
+uint64_t content_hash_final(struct content_hash *hash) {
+    uint64_t h;
+    if (hash->total >= 32) {
+        h = rotate_left(hash->lanes[0], 1) + rotate_left(hash->lanes[1], 7)
+            + rotate_left(hash->lanes[2], 12) + rotate_left(hash->lanes[3], 18);
+        int lane;
+        for (lane = 0; lane < 4; lane++) {
+            h ^= rotate_left(hash->lanes[lane]*HASH_P2, 31)*HASH_P1;
+            h = h*HASH_P1 + HASH_P4;
+        }
+    } else {
+        h = HASH_P5;
+    }
+    h += hash->total;
+
+    const uint8_t *bytes = hash->tail;
+    size_t size = hash->tail_size;
+    while (size >= 8) {
+        h ^= hash_round(0, bytes);
+        h = rotate_left(h, 27)*HASH_P1 + HASH_P4;
+        bytes += 8;
+        size -= 8;
+    }
+    if (size >= 4) {
+        uint64_t word = (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 | (uint64_t)bytes[2] << 16 | (uint64_t)bytes[3] << 24;
+        h ^= word*HASH_P1;
+        h = rotate_left(h, 23)*HASH_P2 + HASH_P3;
+        bytes += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        h ^= *bytes*HASH_P5;
+        h = rotate_left(h, 11)*HASH_P1;
+        bytes++;
+        size--;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hashes a whole file with pread, so it has to be seekable. The
+// file offset is left alone for the decoder
+int hash_file(int fildes, uint64_t *hash) {
+    uint8_t *block = malloc(HASH_BLOCK_SIZE);
+    if (block == NULL) return IMAGE_ERR_NO_MEMORY;
+
+    struct content_hash state;
+    content_hash_init(&state);
+    off_t offset = 0;
+    int status = IMAGE_OK;
+    for (;;) {
+        ssize_t n = pread(fildes, block, HASH_BLOCK_SIZE, offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            status = IMAGE_ERR_IO;
+            break;
+        }
+        if (n == 0) break;
+        content_hash_update(&state, block, n);
+        offset += n;
+    }
+    free(block);
+    *hash = content_hash_final(&state);
+    return status;
+}
+
+int hash_named_file(const char *file_name, uint64_t *hash) {
+    int fildes = open(file_name, O_RDONLY);
+    if (fildes == -1) return IMAGE_ERR_IO;
+    int status = hash_file(fildes, hash);
+    close(fildes);
+    return status;
+}
+
+void append_text(char *text, size_t text_size, size_t *length, const char *format, ...) {
+    if (*length >= text_size) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + *length, text_size - *length, format, args);
+    va_end(args);
+    if (n > 0) *length += n;
+}
+
+// Writes out every option that changes the image up to the end of
+// stage, in the order apply_filter_chain() runs them. File names
+// aren't part of it, the files' hashes are. Keep in step with
+// apply_filter_chain()
+int describe_chain_stage(const struct result_cache *cache, int stage, char *text, size_t text_size) {
+    const struct filter_chain *chain = cache->chain;
+    size_t length = 0;
+    append_text(text, text_size, &length, "bmpedit cache %d\n", RESULT_CACHE_VERSION);
+
+    if (stage >= CHAIN_STAGE_GAUSSIAN) {
+        if (chain->blend_is_set) {
+            append_text(text, text_size, &length, "blend %.17g %016" PRIx64 "\n", chain->blend_value, cache->input_2_hash);
+        }
+        if (chain->orientation) append_text(text, text_size, &length, "orientation %d\n", chain->orientation);
+        if (chain->gaussian_is_set) {
+            append_text(text, text_size, &length, "gaussian %d %.17g\n", chain->gaussian_repeat, chain->gaussian_standard_deviation);
+        }
+    }
+    if (stage >= CHAIN_STAGE_KERNEL && chain->kernel_file_name != NULL) {
+        append_text(text, text_size, &length, "kernel %016" PRIx64 "\n", cache->kernel_hash);
+    }
+    if (stage >= CHAIN_STAGE_BOX_MEAN && chain->box_mean_is_set) {
+        append_text(text, text_size, &length, "box mean %d\n", chain->box_mean_radius);
+    }
+    if (stage >= CHAIN_STAGE_BILATERAL && chain->bilateral_is_set) {
+        append_text(text, text_size, &length, "bilateral %.17g %.17g\n", chain->bilateral_spatial_sd, chain->bilateral_range_sd);
+    }
+    if (stage >= CHAIN_STAGE_MEDIAN) {
+        if (chain->white_balance_is_set && chain->white_balance_auto) {
+            append_text(text, text_size, &length, "white balance auto\n");
+        } else if (chain->white_balance_is_set) {
+            append_text(text, text_size, &length, "white balance %.17g %.17g %.17g\n", chain->white_balance_red,
+                        chain->white_balance_green, chain->white_balance_blue);
+        }
+        if (chain->brightness_is_set) append_text(text, text_size, &length, "brightness %.17g\n", chain->brightness_value);
+        if (chain->saturation_is_set) append_text(text, text_size, &length, "saturation %.17g\n", chain->saturation_value);
+        if (chain->sepia_is_set) append_text(text, text_size, &length, "sepia\n");
+        if (chain->swap_order != NULL) append_text(text, text_size, &length, "swap %s\n", chain->swap_order);
+        if (chain->greyscale_is_set) append_text(text, text_size, &length, "greyscale\n");
+        if (chain->median_is_set) append_text(text, text_size, &length, "median %d\n", chain->median_radius);
+    }
+    if (stage >= CHAIN_STAGE_SOBEL && chain->sobel_is_set) {
+        append_text(text, text_size, &length, "sobel\n");
+    }
+    if (stage >= CHAIN_STAGE_ADAPTIVE) {
+        if (chain->invert_is_set) append_text(text, text_size, &length, "invert\n");
+        if (chain->threshold_is_set && chain->threshold_auto) {
+            append_text(text, text_size, &length, "threshold auto\n");
+        } else if (chain->threshold_is_set) {
+            append_text(text, text_size, &length, "threshold %.17g\n", chain->threshold_value);
+        }
+        if (chain->adaptive_is_set) {
+            append_text(text, text_size, &length, "adaptive %d %d %.17g\n", chain->adaptive_method, chain->adaptive_radius,
+                        chain->adaptive_k);
+        }
+    }
+    if (stage >= CHAIN_STAGE_MORPHOLOGY && chain->morphology_is_set) {
+        append_text(text, text_size, &length, "morphology %d %dx%d\n", chain->morphology_operation,
+                    chain->morphology_width, chain->morphology_height);
+    }
+    if (stage >= CHAIN_STAGE_OUTPUT) {
+        if (chain->emboss_is_set) append_text(text, text_size, &length, "emboss\n");
+        if (chain->sharpen_is_set) append_text(text, text_size, &length, "sharpen %.17g\n", chain->sharpen_value);
+        if (chain->crop_is_set) {
+            append_text(text, text_size, &length, "crop %d,%d,%d,%d\n", chain->crop_x1, chain->crop_y1,
+                        chain->crop_x2, chain->crop_y2);
+        }
+        if (chain->resize_is_set) {
+            append_text(text, text_size, &length, "resize %dx%d %d\n", chain->resize_width, chain->resize_height,
+                        chain->resize_method);
+        }
+        append_text(text, text_size, &length, "depth %d\n", chain->output_depth);
+    }
+
+    return length < text_size ? IMAGE_OK : IMAGE_ERR_ARGUMENT;
+}
+
+// Hashes the input file, and the second input and kernel files if the
+// chain uses them. The input has to be seekable, a pipe can't be hashed
+// without reading it
+int open_result_cache(struct result_cache *cache, const struct filter_chain *chain, int input_fildes) {
+    cache->chain = chain;
+    cache->dir = chain->cache_dir;
+    cache->input_2_hash = 0;
+    cache->kernel_hash = 0;
+
+    if (mkdir(cache->dir, 0775) == -1 && errno != EEXIST) return IMAGE_ERR_IO;
+
+    int status = hash_file(input_fildes, &cache->input_hash);
+    if (status != IMAGE_OK) return status;
+    if (chain->blend_is_set) {
+        if (chain->input_2_file_name == NULL || strcmp(chain->input_2_file_name, "-") == 0) return IMAGE_ERR_ARGUMENT;
+        status = hash_named_file(chain->input_2_file_name, &cache->input_2_hash);
+        if (status != IMAGE_OK) return status;
+    }
+    if (chain->kernel_file_name != NULL) {
+        status = hash_named_file(chain->kernel_file_name, &cache->kernel_hash);
+        if (status != IMAGE_OK) return status;
+    }
+    return IMAGE_OK;
+}
+
+// DIR/<input hash>-<chain hash>.bmp for the image after stage
+int result_cache_path(const struct result_cache *cache, int stage, char *path, size_t path_size) {
+    char text[CHAIN_TEXT_SIZE];
+    int status = describe_chain_stage(cache, stage, text, sizeof(text));
+    if (status != IMAGE_OK) return status;
+
+    struct content_hash hash;
+    content_hash_init(&hash);
+    content_hash_update(&hash, text, strlen(text));
+    int length = snprintf(path, path_size, "%s/%016" PRIx64 "-%016" PRIx64 ".bmp", cache->dir, cache->input_hash,
+                          content_hash_final(&hash));
+    return length >= 0 && (size_t)length < path_size ? IMAGE_OK : IMAGE_ERR_ARGUMENT;
+}
+
+// Copies a whole file, sharing the blocks when the file system can
+// (btrfs, XFS), then with copy_file_range(), then through a buffer
+int copy_file_contents(int in_fildes, int out_fildes) {
+#ifdef FICLONE
+    if (ioctl(out_fildes, FICLONE, in_fildes) == 0) return IMAGE_OK;
+#endif
+
+    int copied_any = 0;
+    for (;;) {
+        ssize_t n = copy_file_range(in_fildes, NULL, out_fildes, NULL, 1 << 30, 0);
+        if (n > 0) {
+            copied_any = 1;
+            continue;
+        }
+        if (n == 0) return IMAGE_OK;
+        if (errno == EINTR) continue;
+        if (copied_any) return IMAGE_ERR_IO;
+        break;
+    }
+
+    // Pipes, and kernels or file systems without copy_file_range()
+    uint8_t *block = malloc(HASH_BLOCK_SIZE);
+    if (block == NULL) return IMAGE_ERR_NO_MEMORY;
+    int status = IMAGE_OK;
+    for (;;) {
+        ssize_t n = read(in_fildes, block, HASH_BLOCK_SIZE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            status = IMAGE_ERR_IO;
+            break;
+        }
+        if (n == 0) break;
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = write(out_fildes, block + written, n - written);
+            if (w == -1 && errno == EINTR) continue;
+            if (w == -1) {
+                status = IMAGE_ERR_IO;
+                break;
+            }
+            written += w;
+        }
+        if (status != IMAGE_OK) break;
+    }
+    free(block);
+    return status;
+}
+
+// Copies the cached output for the chain to output_file_name, "-" is
+// stdout. hit is 0, and nothing is touched, if there isn't one
+int copy_cached_output(const struct result_cache *cache, const char *output_file_name, int *hit) {
+    char path[4096];
+    *hit = 0;
+    if (result_cache_path(cache, CHAIN_STAGE_OUTPUT, path, sizeof(path)) != IMAGE_OK) return IMAGE_OK;
+    int cached_fildes = open(path, O_RDONLY);
+    if (cached_fildes == -1) return IMAGE_OK;
+    *hit = 1;
+
+    int to_stdout = strcmp(output_file_name, "-") == 0;
+    int output_fildes = to_stdout ? STDOUT_FILENO : open(output_file_name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (output_fildes == -1) {
+        close(cached_fildes);
+        return IMAGE_ERR_IO;
+    }
+    int status = copy_file_contents(cached_fildes, output_fildes);
+    close(cached_fildes);
+    if (!to_stdout && close(output_fildes) == -1 && status == IMAGE_OK) {
+        status = IMAGE_ERR_IO;
+    }
+    return status;
+}
+
+// Finds the latest stage before the output with a cached image and
+// decodes it into img. stage is left at CHAIN_STAGE_INPUT if there
+// isn't one. A stage with none of its options set has the same path
+// as the one before, which is the one that made the image
+int load_cached_stage(const struct result_cache *cache, const struct image_allocator *allocator,
+                      int *stage, struct image *img) {
+    char path[4096];
+    char earlier_path[4096];
+    int try_stage;
+    *stage = CHAIN_STAGE_INPUT;
+    for (try_stage = CHAIN_STAGE_OUTPUT - 1; try_stage > CHAIN_STAGE_INPUT; try_stage--) {
+        if (result_cache_path(cache, try_stage, path, sizeof(path)) != IMAGE_OK) continue;
+        if (result_cache_path(cache, try_stage - 1, earlier_path, sizeof(earlier_path)) == IMAGE_OK
+                && strcmp(path, earlier_path) == 0) {
+            continue;
+        }
+        int fildes = open(path, O_RDONLY);
+        if (fildes == -1) continue;
+        int status = bmp_to_struct_image(fildes, img, allocator);
+        close(fildes);
+        if (status == IMAGE_OK) {
+            *stage = try_stage;
+            return IMAGE_OK;
+        }
+    }
+    return IMAGE_OK;
+}
+
+// Saves img as the result of stage. The output is kept at the depth
+// it was written at, images part way through at 24 bits, or 8 if they
+// are grey so they come back with one channel
+int store_cached_stage(const struct result_cache *cache, int stage, struct image *img) {
+    char path[4096];
+    char temp_path[4096];
+    int status = result_cache_path(cache, stage, path, sizeof(path));
+    if (status != IMAGE_OK) return status;
+    int length = snprintf(temp_path, sizeof(temp_path), "%s/.tmp-XXXXXX", cache->dir);
+    if (length < 0 || (size_t)length >= sizeof(temp_path)) return IMAGE_ERR_ARGUMENT;
+
+    int fildes = mkstemp(temp_path);
+    if (fildes == -1) return IMAGE_ERR_IO;
+    fchmod(fildes, 0664);
+    int depth = cache->chain->output_depth;
+    if (stage != CHAIN_STAGE_OUTPUT) {
+        depth = img->channels == 1 ? BMP_DEPTH_8 : BMP_DEPTH_24;
+    }
+    status = struct_image_to_bmp_depth(fildes, img, depth);
+    if (close(fildes) == -1 && status == IMAGE_OK) status = IMAGE_ERR_IO;
+    if (status == IMAGE_OK && rename(temp_path, path) == -1) status = IMAGE_ERR_IO;
+    if (status != IMAGE_OK) unlink(temp_path);
+    return status;
+}
+
+const char *chain_stage_name(int stage) {
+    if (stage < 0 || stage > CHAIN_STAGE_OUTPUT) return "unknown stage";
+    return chain_stage_names[stage];
+}
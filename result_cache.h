@@ -0,0 +1,48 @@
+/* result_cache.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of the on disk cache of filter chain
+ * results, bmpedit --cache DIR
+ *
+ */
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "filter_chain.h"
+#include <stdint.h>
+
+// 64 bit hash of any number of bytes given in pieces, the
+// same as xxHash64 with a seed of 0
+struct content_hash {
+    uint64_t lanes[4];
+    uint64_t total;
+    uint8_t tail[32];
+    size_t tail_size;
+};
+
+// Everything a key is made of besides the chain itself. Files
+// are hashed whole, so a changed input is a different key
+struct result_cache {
+    const struct filter_chain *chain;
+    const char *dir;
+    uint64_t input_hash;
+    uint64_t input_2_hash;
+    uint64_t kernel_hash;
+};
+
+void content_hash_init(struct content_hash *hash);
+void content_hash_update(struct content_hash *hash, const void *data, size_t size);
+uint64_t content_hash_final(struct content_hash *hash);
+int hash_file(int fildes, uint64_t *hash);
+
+int open_result_cache(struct result_cache *cache, const struct filter_chain *chain, int input_fildes);
+int result_cache_path(const struct result_cache *cache, int stage, char *path, size_t path_size);
+int copy_cached_output(const struct result_cache *cache, const char *output_file_name, int *hit);
+int load_cached_stage(const struct result_cache *cache, const struct image_allocator *allocator,
+                      int *stage, struct image *img);
+int store_cached_stage(const struct result_cache *cache, int stage, struct image *img);
+const char *chain_stage_name(int stage);
+
+#endif
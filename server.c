@@ -0,0 +1,493 @@
+/* server.c
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * bmpedit --serve, a long running worker that takes
+ * filter chains over a UNIX domain socket so callers
+ * don't pay for process startup on every image
+ *
+ * Protocol: one request per line, each line is a bmpedit
+ * command line without the program name, for example
+ *     -g -S -o /srv/out/thumb.bmp /srv/in/photo.bmp
+ * Arguments are separated by spaces or tabs. An input file
+ * name of "-" means the file descriptor sent along with the
+ * request (SCM_RIGHTS). Each request gets one reply line,
+ * "OK" or "ERR message". A connection can carry any
+ * number of requests
+ *
+ * The main thread polls the listening socket and every open
+ * connection, and queues a connection for the workers when
+ * it has something to read. A worker handles the requests
+ * that have arrived and hands the connection back, so idle
+ * connections don't hold up a worker
+ *
+ */
+
+#define _GNU_SOURCE
+#include "server.h"
+#include "filter_chain.h"
+#include "buffer_pool.h"
+#include "libbmpedit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REQUEST_MAX_LENGTH 8192
+#define REQUEST_MAX_ARGS 128
+#define MESSAGE_MAX_LENGTH 512
+
+// Freed pixel arrays each worker keeps around for the next request
+#define WORKER_POOL_BYTES (256*1024*1024)
+
+// Each worker's requests split their filters between
+// n_of_filter_threads, the CPUs shared out between the workers
+struct server_worker {
+    pthread_t thread;
+    struct buffer_pool pool;
+    int n_of_filter_threads;
+};
+
+// An open connection and what has been read of its next request.
+// passed_fildes came with the line starting at passed_line in buf
+struct server_connection {
+    int fildes;
+    char buf[REQUEST_MAX_LENGTH];
+    size_t used;
+    int passed_fildes;
+    size_t passed_line;
+    struct server_connection *next;
+};
+
+// getopt has global state, so requests are parsed one at a time
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Connections with something to read, waiting for a worker, and ones
+// the workers have finished with, waiting to be polled again. Writing
+// to wake_fildes tells the polling thread about the second. Workers
+// return once stopping is set
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connection_ready = PTHREAD_COND_INITIALIZER;
+static struct server_connection *ready_connections;
+static struct server_connection *returned_connections;
+static int wake_fildes[2];
+static int stopping;
+
+static const char *bound_socket_path;
+
+void handle_shutdown_signal(int signal_number);
+int send_reply(int client_fildes, const char *reply);
+void handle_request(struct server_worker *worker, int client_fildes, char *line, int passed_fildes);
+int handle_connection(struct server_worker *worker, struct server_connection *connection);
+void close_connection(struct server_connection *connection);
+void *server_worker_main(void *arg);
+void close_connection_list(struct server_connection *connection);
+void stop_workers(struct server_worker *workers, int n_of_workers);
+int poll_connections(int listen_fildes);
+
+void handle_shutdown_signal(int signal_number) {
+    if (bound_socket_path) unlink(bound_socket_path);
+    _exit(0);
+}
+
+int send_reply(int client_fildes, const char *reply) {
+    size_t done = 0;
+    size_t length = strlen(reply);
+    while (done < length) {
+        ssize_t n = send(client_fildes, reply + done, length - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// passed_fildes is the file descriptor sent with this request, -1 if
+// there wasn't one. The caller closes it
+void handle_request(struct server_worker *worker, int client_fildes, char *line, int passed_fildes) {
+    char *argv[REQUEST_MAX_ARGS + 1];
+    int argc = 0;
+    char message[MESSAGE_MAX_LENGTH];
+    char reply[MESSAGE_MAX_LENGTH + 32];
+    struct filter_chain chain;
+
+    argv[argc++] = "bmpedit";
+    char *token = strtok_r(line, " \t\r", &line);
+    while (token != NULL && argc < REQUEST_MAX_ARGS) {
+        argv[argc++] = token;
+        token = strtok_r(NULL, " \t\r", &line);
+    }
+    argv[argc] = NULL;
+
+    // Blank lines are ignored
+    if (argc == 1) return;
+
+    pthread_mutex_lock(&parse_lock);
+    int status = parse_filter_chain(argc, argv, &chain, message, sizeof(message));
+    pthread_mutex_unlock(&parse_lock);
+    chain.n_of_filter_threads = worker->n_of_filter_threads;
+
+    int input_fildes = -1;
+    if (status == IMAGE_OK) {
+        if (chain.serve_socket_path != NULL || chain.batch_dir != NULL || chain.help_is_set) {
+            status = IMAGE_ERR_ARGUMENT;
+            snprintf(message, sizeof(message), "--serve, --batch and -h can't be used in a request");
+        } else if (strcmp(chain.output_file_name, "-") == 0
+                || (chain.input_2_file_name != NULL && strcmp(chain.input_2_file_name, "-") == 0)
+                || (chain.histogram_file_name != NULL && strcmp(chain.histogram_file_name, "-") == 0)) {
+            status = IMAGE_ERR_ARGUMENT;
+            snprintf(message, sizeof(message), "Requests can't use stdin or stdout");
+        } else if (chain.input_file_name != NULL && strcmp(chain.input_file_name, "-") == 0) {
+            if (passed_fildes == -1) {
+                status = IMAGE_ERR_ARGUMENT;
+                snprintf(message, sizeof(message), "Input \"-\" needs a file descriptor sent with the request");
+            }
+            input_fildes = passed_fildes;
+        }
+    }
+
+    if (status == IMAGE_OK) {
+        status = run_filter_chain(&chain, input_fildes, &worker->pool.allocator, NULL, message, sizeof(message));
+    }
+
+    if (status == IMAGE_OK) {
+        snprintf(reply, sizeof(reply), "OK\n");
+    } else {
+        // Keep the reply to one line
+        char *c;
+        for (c = message; *c; c++) {
+            if (*c == '\n') *c = ' ';
+        }
+        snprintf(reply, sizeof(reply), "ERR %s\n", message);
+    }
+    send_reply(client_fildes, reply);
+}
+
+// Reads what the client has sent and handles every complete request.
+// A file descriptor belongs to the request it was sent with, and is
+// closed after that request whether it was used or not. Returns -1
+// once the connection should be closed
+int handle_connection(struct server_worker *worker, struct server_connection *connection) {
+    char *buf = connection->buf;
+
+    // Receive more of the request, along with any file descriptor
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {buf + connection->used, sizeof(connection->buf) - connection->used - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t n;
+    do {
+        n = recvmsg(connection->fildes, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+
+    // Data sent with a file descriptor ends a read, so the descriptor
+    // goes with the line holding the last byte read
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            if (connection->passed_fildes != -1) close(connection->passed_fildes);
+            memcpy(&connection->passed_fildes, CMSG_DATA(cmsg), sizeof(int));
+            size_t line = connection->used + n - 1;
+            while (line > 0 && buf[line - 1] != '\n') line--;
+            connection->passed_line = line;
+        }
+    }
+
+    connection->used += n;
+    buf[connection->used] = '\0';
+
+    // Handle every complete line
+    char *line_start = buf;
+    char *newline;
+    while ((newline = strchr(line_start, '\n')) != NULL) {
+        *newline = '\0';
+        int passed_fildes = -1;
+        if (connection->passed_fildes != -1 && (size_t)(line_start - buf) == connection->passed_line) {
+            passed_fildes = connection->passed_fildes;
+            connection->passed_fildes = -1;
+        }
+        handle_request(worker, connection->fildes, line_start, passed_fildes);
+        if (passed_fildes != -1) close(passed_fildes);
+        line_start = newline + 1;
+    }
+
+    size_t handled = line_start - buf;
+    connection->used -= handled;
+    memmove(buf, line_start, connection->used);
+    if (connection->passed_fildes != -1) connection->passed_line -= handled;
+
+    if (connection->used == sizeof(connection->buf) - 1) {
+        send_reply(connection->fildes, "ERR Request too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+void close_connection(struct server_connection *connection) {
+    if (connection->passed_fildes != -1) close(connection->passed_fildes);
+    close(connection->fildes);
+    free(connection);
+}
+
+// Takes connections with something to read off the queue, and hands
+// each back to the polling thread once its requests are done
+void *server_worker_main(void *arg) {
+    struct server_worker *worker = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&connections_lock);
+        while (ready_connections == NULL && !stopping) {
+            pthread_cond_wait(&connection_ready, &connections_lock);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&connections_lock);
+            return NULL;
+        }
+        struct server_connection *connection = ready_connections;
+        ready_connections = connection->next;
+        pthread_mutex_unlock(&connections_lock);
+
+        if (handle_connection(worker, connection) != 0) {
+            close_connection(connection);
+            continue;
+        }
+
+        pthread_mutex_lock(&connections_lock);
+        connection->next = returned_connections;
+        returned_connections = connection;
+        pthread_mutex_unlock(&connections_lock);
+        char wake = 0;
+        while (write(wake_fildes[1], &wake, 1) == -1 && errno == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+void close_connection_list(struct server_connection *connection) {
+    while (connection != NULL) {
+        struct server_connection *next = connection->next;
+        close_connection(connection);
+        connection = next;
+    }
+}
+
+// Tells the first n_of_workers workers to stop, waits for them to
+// finish the requests they are on, and closes the connections they
+// leave queued
+void stop_workers(struct server_worker *workers, int n_of_workers) {
+    pthread_mutex_lock(&connections_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&connection_ready);
+    pthread_mutex_unlock(&connections_lock);
+
+    int i;
+    for (i = 0; i < n_of_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        buffer_pool_destroy(&workers[i].pool);
+    }
+    close_connection_list(ready_connections);
+    close_connection_list(returned_connections);
+    ready_connections = NULL;
+    returned_connections = NULL;
+}
+
+// Waits for new connections and for requests on open ones, queueing
+// the connections that have something to read for the workers. Only
+// returns on failure
+int poll_connections(int listen_fildes) {
+    struct server_connection *idle = NULL;
+    size_t n_of_idle = 0;
+    struct pollfd *polled = NULL;
+    size_t polled_size = 0;
+
+    for (;;) {
+        // Connections back from the workers are polled again
+        pthread_mutex_lock(&connections_lock);
+        while (returned_connections != NULL) {
+            struct server_connection *connection = returned_connections;
+            returned_connections = connection->next;
+            connection->next = idle;
+            idle = connection;
+            n_of_idle++;
+        }
+        pthread_mutex_unlock(&connections_lock);
+
+        if (polled_size < n_of_idle + 2) {
+            polled_size = 2*(n_of_idle + 2);
+            struct pollfd *bigger = realloc(polled, polled_size*sizeof(struct pollfd));
+            if (bigger == NULL) {
+                free(polled);
+                close_connection_list(idle);
+                return IMAGE_ERR_NO_MEMORY;
+            }
+            polled = bigger;
+        }
+        polled[0].fd = listen_fildes;
+        polled[0].events = POLLIN;
+        polled[1].fd = wake_fildes[0];
+        polled[1].events = POLLIN;
+        size_t i = 2;
+        struct server_connection *connection;
+        for (connection = idle; connection != NULL; connection = connection->next) {
+            polled[i].fd = connection->fildes;
+            polled[i].events = POLLIN;
+            i++;
+        }
+
+        if (poll(polled, n_of_idle + 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("bmpedit: poll");
+            free(polled);
+            close_connection_list(idle);
+            return IMAGE_ERR_IO;
+        }
+
+        if (polled[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_fildes[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        // Queue every connection with something to read, or that hung up
+        struct server_connection **link = &idle;
+        i = 2;
+        int queued = 0;
+        while (*link != NULL) {
+            connection = *link;
+            if (polled[i++].revents != 0) {
+                *link = connection->next;
+                n_of_idle--;
+                pthread_mutex_lock(&connections_lock);
+                connection->next = ready_connections;
+                ready_connections = connection;
+                pthread_mutex_unlock(&connections_lock);
+                queued = 1;
+            } else {
+                link = &connection->next;
+            }
+        }
+        if (queued) pthread_cond_broadcast(&connection_ready);
+
+        if (polled[0].revents & POLLIN) {
+            int client_fildes = accept4(listen_fildes, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fildes == -1) {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+                // Out of file descriptors, wait for other requests to finish
+                if (errno == EMFILE || errno == ENFILE) {
+                    usleep(10000);
+                    continue;
+                }
+                perror("bmpedit: accept");
+                free(polled);
+                close_connection_list(idle);
+                return IMAGE_ERR_IO;
+            }
+            connection = malloc(sizeof(struct server_connection));
+            if (connection == NULL) {
+                close(client_fildes);
+                continue;
+            }
+            connection->fildes = client_fildes;
+            connection->used = 0;
+            connection->passed_fildes = -1;
+            connection->passed_line = 0;
+            connection->next = idle;
+            idle = connection;
+            n_of_idle++;
+        }
+    }
+}
+
+// Listens on socket_path and serves requests on n_of_threads workers.
+// Only returns on failure
+int serve_filter_chains(const char *socket_path, int n_of_threads) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return IMAGE_ERR_ARGUMENT;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fildes = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fildes == -1) return IMAGE_ERR_IO;
+
+    // Replace a socket left behind by a previous server
+    unlink(socket_path);
+    if (bind(listen_fildes, (struct sockaddr *)&address, sizeof(address)) == -1
+            || listen(listen_fildes, SOMAXCONN) == -1) {
+        int errsv = errno;
+        close(listen_fildes);
+        errno = errsv;
+        return IMAGE_ERR_IO;
+    }
+
+    bound_socket_path = socket_path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_shutdown_signal);
+    signal(SIGTERM, handle_shutdown_signal);
+
+    long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_of_cpus < 1) n_of_cpus = 1;
+    if (n_of_threads < 1) n_of_threads = n_of_cpus;
+    // Each request's filters get a share of the CPUs
+    int n_of_filter_threads = n_of_cpus > n_of_threads ? n_of_cpus/n_of_threads : 1;
+
+    if (pipe2(wake_fildes, O_CLOEXEC | O_NONBLOCK) == -1) {
+        close(listen_fildes);
+        unlink(socket_path);
+        return IMAGE_ERR_IO;
+    }
+
+    stopping = 0;
+    struct server_worker *workers = malloc(n_of_threads*sizeof(struct server_worker));
+    int status = workers == NULL ? IMAGE_ERR_NO_MEMORY : IMAGE_OK;
+    int n_of_workers = 0;
+    while (status == IMAGE_OK && n_of_workers < n_of_threads) {
+        struct server_worker *worker = &workers[n_of_workers];
+        buffer_pool_init(&worker->pool, WORKER_POOL_BYTES);
+        worker->n_of_filter_threads = n_of_filter_threads;
+        if (pthread_create(&worker->thread, NULL, server_worker_main, worker) != 0) {
+            buffer_pool_destroy(&worker->pool);
+            status = IMAGE_ERR_NO_MEMORY;
+        } else {
+            n_of_workers++;
+        }
+    }
+
+    if (status == IMAGE_OK) {
+        fprintf(stderr, "bmpedit: serving on %s with %d threads\n", socket_path, n_of_threads);
+        status = poll_connections(listen_fildes);
+    }
+
+    // Only failures get here. The workers are stopped before the pipe
+    // they write to is closed
+    stop_workers(workers, n_of_workers);
+    free(workers);
+    close(wake_fildes[0]);
+    close(wake_fildes[1]);
+    close(listen_fildes);
+    unlink(socket_path);
+    bound_socket_path = NULL;
+    return status;
+}
@@ -0,0 +1,14 @@
+/* server.h
+ * Nicholas Donaldson
+ * u5350448
+ *
+ * Declaration of bmpedit's server mode
+ *
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+int serve_filter_chains(const char *socket_path, int n_of_threads);
+
+#endif